@@ -32,9 +32,278 @@
 
 #include "ble_fat.h"
 #include <string.h>
+#include "nordic_common.h"
+#include "app_util_platform.h"
+#include "crc16.h"
+#include "fat_store.h"
+#include "fat_metrics.h"
+#include "fat_trace.h"
 #include "SEGGER_RTT.h"
 
 
+/**@brief Function for returning a link to its idle state.
+ *
+ * @param[in] p_link      Link to reset.
+ * @param[in] conn_handle Connection now owning the link, BLE_CONN_HANDLE_INVALID to free it.
+ */
+static void link_reset(ble_fat_link_t * p_link, uint16_t conn_handle)
+{
+    p_link->conn_handle = conn_handle;
+    memset(&p_link->page, 0, sizeof(p_link->page));
+    p_link->att_mtu     = GATT_MTU_SIZE_DEFAULT;
+    p_link->chunk_len   = FAT_CHAR_MAX_LEN;
+    p_link->read_pos    = 0;
+    p_link->streaming   = false;
+    p_link->stream_pos  = 0;
+    p_link->transfer    = BLE_FAT_TRANSFER_IDLE;
+    p_link->phy         = BLE_FAT_PHY_1M;
+    p_link->transfer_phys = 0;
+    p_link->chunks      = 0;
+    p_link->options     = 0;
+    p_link->inflating   = false;
+    p_link->rendering   = false;
+    p_link->resume_pos  = 0;
+    p_link->header_due  = false;
+}
+
+/**@brief Function for choosing how the link's page is delivered and restarting any transfer.
+ *
+ * @details A compressed page is sent as stored to clients that set FAT_CTRL_OPT_DEFLATE, and
+ *          inflated on the fly for everyone else.  A template is always rendered.
+ *
+ * @param[in] p_link      Link to set up, its page and options must already be set.
+ */
+static void link_view_set(ble_fat_link_t * p_link)
+{
+    p_link->read_pos   = 0;
+    p_link->streaming  = false;
+    p_link->stream_pos = 0;
+    p_link->resume_pos = 0;
+    p_link->header_due = (p_link->options & FAT_CTRL_OPT_HEADER) != 0;
+    p_link->inflating  = (p_link->page.encoding == FAT_ENCODING_DEFLATE) &&
+                         !(p_link->options & FAT_CTRL_OPT_DEFLATE);
+    p_link->rendering  = (p_link->page.encoding == FAT_ENCODING_TEMPLATE);
+
+    if (p_link->inflating) {
+        fat_inflate_init(&p_link->inflater, p_link->page.p_data, p_link->page.len);
+    }
+}
+
+/**@brief Function for recording how far a link's transfer has got.
+ *
+ * @details Called by the stream path here and by the application's read handler, so the
+ *          application hears about every change in one place, whichever way the page goes out.
+ *
+ * @param[in] p_fat     Fatbeacon URL Service structure.
+ * @param[in] p_link    Link whose transfer moved on.
+ * @param[in] transfer  New state.
+ */
+void ble_fat_transfer_set(ble_fat_t * p_fat, ble_fat_link_t * p_link, ble_fat_transfer_t transfer)
+{
+    if (p_link->transfer == transfer) {
+        return;
+    }
+    p_link->transfer = transfer;
+    if (transfer == BLE_FAT_TRANSFER_ACTIVE) {
+        p_link->transfer_phys = p_link->phy;
+    }
+
+    if (p_fat->transfer_evt_handler != NULL) {
+        p_fat->transfer_evt_handler(p_fat, p_link);
+    }
+    if ((transfer == BLE_FAT_TRANSFER_DONE) || (transfer == BLE_FAT_TRANSFER_ABANDONED)) {
+        p_link->chunks = 0;                     // The handler has seen them, count the next transfer afresh.
+    }
+}
+
+/**@brief Function for continuing a transfer a client lost to a disconnect.
+ *
+ * @details Nothing about a transfer survives the disconnect; the client brings it back.  It
+ *          keeps the content hash it was served under and the CRC-16 of everything it has, as
+ *          it came over the air, and FAT_CTRL_OP_RESUME hands both over with the offset.  The
+ *          hash ties the offset to the same content; a page uploaded since, or a template,
+ *          whose values change with every connection, is read from the start.  The CRC catches
+ *          a copy that doesn't match up to the offset, which is read from the start too.
+ *
+ *          Checking it runs through the page up to the offset, from the SoftDevice interrupt:
+ *          a few milliseconds for a large page, once per resume.  It leaves the inflater at the
+ *          offset, so the next chunk costs nothing extra.  Cursor reads and the stream then
+ *          carry on from the offset; offset mode clients read from wherever they like anyway,
+ *          and only learn that what they have is good.  The client reads the control
+ *          characteristic to see where the transfer resumed, 0 if it was refused.
+ *
+ * @param[in] p_link    Link to resume, with the client's options already set.
+ * @param[in] hash      Content hash the client's copy was served under.
+ * @param[in] offset    Bytes the client has.
+ * @param[in] crc       CRC-16 of them, as crc16_compute() starting from 0xFFFF.
+ */
+static void link_resume(ble_fat_link_t * p_link, uint32_t hash, uint16_t offset, uint16_t crc)
+{
+    uint16_t        chunks = p_link->chunks;
+    uint16_t        check  = 0xFFFF;
+    uint16_t        pos    = 0;
+    uint16_t        len;
+    uint8_t const * p_data;
+
+    link_view_set(p_link);
+    if ((hash == FAT_HASH_NONE) || (hash != p_link->page.hash) || (offset > ble_fat_link_len(p_link))) {
+        return;
+    }
+    while (pos < offset)
+    {
+        len = ble_fat_link_read(p_link, pos, MIN(sizeof(p_link->buf), offset - pos), &p_data);
+        if (len == 0) {
+            break;
+        }
+        check = crc16_compute(p_data, len, &check);
+        pos  += len;
+    }
+    p_link->chunks = chunks;                    // Not sent, so not counted.
+    if ((pos != offset) || (check != crc)) {
+        return;
+    }
+
+    p_link->read_pos   = offset;
+    p_link->stream_pos = offset;
+    p_link->resume_pos = offset;
+    p_link->header_due = false;                 // The client has it from the lost connection.
+}
+
+/**@brief Function for reading the values a link's template shows.
+ *
+ * @details Only values the template has a placeholder for are asked for.
+ *
+ * @param[in]  p_fat     Fatbeacon URL Service structure.
+ * @param[in]  p_link    Link whose template it is, its page must be set.
+ * @param[out] p_values  The values.
+ */
+static void link_values_read(ble_fat_t * p_fat, ble_fat_link_t * p_link, fat_tmpl_values_t * p_values)
+{
+    uint32_t vars = fat_tmpl_vars_get(p_link->page.p_data);
+
+    memset(p_values, 0, sizeof(*p_values));
+    for (uint8_t var = 0; var < FAT_TMPL_VAR_COUNT; var++)
+    {
+        if ((p_fat->value_handler != NULL) && (vars & (1UL << var))) {
+            p_values->len[var] = MIN(p_fat->value_handler(p_fat, p_link, (fat_tmpl_var_t) var, p_values->text[var]),
+                                     FAT_TMPL_VALUE_MAX);
+        }
+    }
+}
+
+/**@brief Function for reading a link's template values again, before it reads any of its page.
+ *
+ * @details For values that were out of date at connect and have been brought up to date since,
+ *          from the main loop.  A link that has started on its page keeps the values it has,
+ *          so the page can't tear.
+ *
+ * @param[in] p_fat        Fatbeacon URL Service structure.
+ * @param[in] conn_handle  Link to read them for.
+ *
+ * @return NRF_SUCCESS if the values were replaced, NRF_ERROR_NOT_FOUND if there is no such
+ *         link, NRF_ERROR_INVALID_STATE if its page isn't a template or it has started reading.
+ */
+uint32_t ble_fat_link_values_refresh(ble_fat_t * p_fat, uint16_t conn_handle)
+{
+    ble_fat_link_t *  p_link = ble_fat_link_get(p_fat, conn_handle);
+    fat_tmpl_values_t values;
+    uint32_t          err_code = NRF_ERROR_INVALID_STATE;
+
+    if (p_link == NULL) {
+        return NRF_ERROR_NOT_FOUND;
+    }
+    if (!p_link->rendering) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    link_values_read(p_fat, p_link, &values);
+
+    // Reads are answered from the SoftDevice interrupt, the link may have moved on meanwhile.
+    CRITICAL_REGION_ENTER();
+    if ((p_link->conn_handle == conn_handle) && (p_link->transfer == BLE_FAT_TRANSFER_IDLE) &&
+        (p_link->chunks == 0) && !p_link->streaming) {
+        p_link->values = values;
+        err_code       = NRF_SUCCESS;
+    }
+    CRITICAL_REGION_EXIT();
+    return err_code;
+}
+
+uint16_t ble_fat_link_len(ble_fat_link_t const * p_link)
+{
+    return (p_link->inflating || p_link->rendering) ? p_link->page.content_len : p_link->page.len;
+}
+
+/**@brief Function for getting the FAT_ENCODING_* a link's page reaches the client in. */
+static uint8_t link_encoding(ble_fat_link_t const * p_link)
+{
+    return (p_link->inflating || p_link->rendering) ? FAT_ENCODING_IDENTITY : p_link->page.encoding;
+}
+
+/**@brief Function for reading the first chunk of the page for a client that set FAT_CTRL_OPT_HEADER.
+ *
+ * @details The chunk is the stream header followed by as much of the page from its start as
+ *          fits in len, put together in the link's buffer.  It is up to the caller to clear
+ *          header_due once the chunk is sent.
+ *
+ * @param[in]  p_link   Link the chunk is for.
+ * @param[in]  len      Chunk size, at least FAT_HEADER_LEN.
+ * @param[out] pp_data  Set to the chunk, FAT_HEADER_LEN longer than the return value.
+ *
+ * @return Bytes of the page in the chunk.
+ */
+uint16_t ble_fat_link_header_read(ble_fat_link_t * p_link, uint16_t len, uint8_t const ** pp_data)
+{
+    uint8_t const * p_data;
+    uint16_t        page_len = ble_fat_link_read(p_link, 0, len - FAT_HEADER_LEN, &p_data);
+
+    if (page_len > 0) {
+        memmove(&p_link->buf[FAT_HEADER_LEN], p_data, page_len);    // p_data may be the buffer itself.
+    }
+    (void) uint32_encode(ble_fat_link_len(p_link), &p_link->buf[0]);
+    p_link->buf[4] = FAT_CONTENT_TYPE_HTML;
+    p_link->buf[5] = link_encoding(p_link);
+    (void) uint16_encode(p_link->page.version, &p_link->buf[6]);
+
+    *pp_data = p_link->buf;
+    return page_len;
+}
+
+uint16_t ble_fat_link_read(ble_fat_link_t * p_link, uint16_t offset, uint16_t len, uint8_t const ** pp_data)
+{
+    uint16_t total = ble_fat_link_len(p_link);
+
+    if (offset >= total) {
+        *pp_data = NULL;
+        return 0;
+    }
+    len = MIN(len, total - offset);
+    p_link->chunks++;
+
+    if (p_link->rendering) {
+        *pp_data = p_link->buf;
+        return fat_tmpl_read(p_link->page.p_data, &p_link->values, offset, p_link->buf, MIN(len, sizeof(p_link->buf)));
+    }
+    if (!p_link->inflating) {
+        *pp_data = p_link->page.p_data + offset;    // Straight from flash, no copy.
+        return len;
+    }
+
+    *pp_data = p_link->buf;
+    return fat_inflate_read(&p_link->inflater, offset, p_link->buf, MIN(len, sizeof(p_link->buf)));
+}
+
+ble_fat_link_t * ble_fat_link_get(ble_fat_t * p_fat, uint16_t conn_handle)
+{
+    for (uint32_t i = 0; i < BLE_FAT_MAX_LINKS; i++)
+    {
+        if (p_fat->links[i].conn_handle == conn_handle)
+        {
+            return &p_fat->links[i];
+        }
+    }
+    return NULL;
+}
+
 /**@brief Function for handling the @ref BLE_GAP_EVT_CONNECTED event from the S132 SoftDevice.
  *
  * @param[in] p_fat     Fatbeacon URL Service structure.
@@ -42,20 +311,282 @@
  */
 static void on_connect(ble_fat_t * p_fat, ble_evt_t * p_ble_evt)
 {
-    p_fat->conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+    uint16_t         conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+    ble_fat_link_t * p_link      = ble_fat_link_get(p_fat, BLE_CONN_HANDLE_INVALID);
+
+    if (p_link == NULL) {
+        SEGGER_RTT_printf(0, "No free Fatbeacon link for handle %d\n", conn_handle);
+        return;
+    }
+    link_reset(p_link, conn_handle);
+    p_link->page = p_fat->page;
+    link_view_set(p_link);
+    if (p_link->rendering) {
+        link_values_read(p_fat, p_link, &p_link->values);
+    }
+
+#if defined(NRF_SD_BLE_API_VERSION) && (NRF_SD_BLE_API_VERSION >= 4)
+    // Ask for LL packets large enough to carry a full FAT_ATT_MTU_MAX PDU in one go.
+    ble_gap_data_length_params_t dl_params;
+
+    memset(&dl_params, 0, sizeof(dl_params));
+    dl_params.max_tx_octets  = FAT_ATT_MTU_MAX + 4;
+    dl_params.max_rx_octets  = FAT_ATT_MTU_MAX + 4;
+    dl_params.max_tx_time_us = BLE_GAP_DATA_LENGTH_AUTO;
+    dl_params.max_rx_time_us = BLE_GAP_DATA_LENGTH_AUTO;
+
+    uint32_t err_code = sd_ble_gap_data_length_update(conn_handle, &dl_params, NULL);
+    if (err_code != NRF_SUCCESS) {
+        SEGGER_RTT_printf(0, "Data length update Error %d\n", err_code);
+    }
+#endif
+
+#if defined(NRF_SD_BLE_API_VERSION) && (NRF_SD_BLE_API_VERSION >= 5)
+    // Ask for LE 2M both ways.  A central without it completes the procedure on 1M, see
+    // on_phy_update(), so the link carries on as it would have.
+    ble_gap_phys_t phys;
+
+    phys.tx_phys = BLE_GAP_PHY_2MBPS;
+    phys.rx_phys = BLE_GAP_PHY_2MBPS;
+    err_code = sd_ble_gap_phy_update(conn_handle, &phys);
+    if (err_code != NRF_SUCCESS) {
+        SEGGER_RTT_printf(0, "PHY update Error %d\n", err_code);
+    }
+#endif
+}
+
+#if defined(NRF_SD_BLE_API_VERSION) && (NRF_SD_BLE_API_VERSION >= 5)
+/**@brief Function for handling the @ref BLE_GAP_EVT_PHY_UPDATE event from the SoftDevice.
+ *
+ * @details Ends a PHY update procedure started by either side.  When it fails, or the central only
+ *          has LE 1M, the link stays on the PHY it had.
+ *
+ * @param[in] p_fat     Fatbeacon URL Service structure.
+ * @param[in] p_ble_evt Pointer to the event received from BLE stack.
+ */
+static void on_phy_update(ble_fat_t * p_fat, ble_evt_t * p_ble_evt)
+{
+    ble_gap_evt_phy_update_t const * p_update = &p_ble_evt->evt.gap_evt.params.phy_update;
+    ble_fat_link_t *                 p_link   = ble_fat_link_get(p_fat, p_ble_evt->evt.gap_evt.conn_handle);
+
+    if (p_link == NULL) {
+        return;
+    }
+    if (p_update->status != BLE_HCI_STATUS_CODE_SUCCESS) {
+        SEGGER_RTT_printf(0, "PHY update status %d, staying on %dM\n", p_update->status, p_link->phy);
+        return;
+    }
+    p_link->phy = (p_update->tx_phy == BLE_GAP_PHY_2MBPS) ? BLE_FAT_PHY_2M : BLE_FAT_PHY_1M;
+    if (p_link->transfer == BLE_FAT_TRANSFER_ACTIVE) {
+        p_link->transfer_phys |= p_link->phy;
+    }
 }
+#endif
 
 /**@brief Function for handling the @ref BLE_GAP_EVT_DISCONNECTED event from the S132 SoftDevice.
  *
  * @param[in] p_fat     Fatbeacon URL Service structure.
  * @param[in] p_ble_evt Pointer to the event received from BLE stack.
  */
-static void on_disconnect(ble_fat_t * p_fat) //, ble_evt_t * p_ble_evt)
+static void on_disconnect(ble_fat_t * p_fat, ble_evt_t * p_ble_evt)
 {
-    //UNUSED_PARAMETER(p_ble_evt);
-    p_fat->conn_handle = BLE_CONN_HANDLE_INVALID;
+    ble_fat_link_t * p_link = ble_fat_link_get(p_fat, p_ble_evt->evt.gap_evt.conn_handle);
+
+    if (p_link != NULL) {
+        if (p_link->transfer == BLE_FAT_TRANSFER_ACTIVE) {
+            ble_fat_transfer_set(p_fat, p_link, BLE_FAT_TRANSFER_ABANDONED);
+        }
+        link_reset(p_link, BLE_CONN_HANDLE_INVALID);
+    }
 }
 
+/**@brief Function for pushing as much of the page as the SoftDevice will take.
+ *
+ * @details Queues notifications until the SoftDevice runs out of TX buffers, so every connection
+ *          event carries as many packets as the link allows.  It is called again on each
+ *          @ref BLE_EVT_TX_COMPLETE to top the queue back up.  Once the page is sent an empty
+ *          notification marks the end, just like the empty reply in read mode, unless the client
+ *          asked for the stream header and counts the bytes itself.
+ *
+ * @param[in] p_fat     Fatbeacon URL Service structure.
+ * @param[in] p_link    Link being streamed to.
+ */
+static void stream_fill(ble_fat_t * p_fat, ble_fat_link_t * p_link)
+{
+    uint32_t               err_code;
+    ble_gatts_hvx_params_t hvx_params;
+    uint8_t const *        p_data;
+    uint16_t               len;
+    uint16_t               page_len;
+
+    while (p_link->streaming)
+    {
+        if (p_link->header_due) {
+            page_len = ble_fat_link_header_read(p_link, p_link->chunk_len, &p_data);
+            len      = FAT_HEADER_LEN + page_len;
+        } else {
+            page_len = ble_fat_link_read(p_link, p_link->stream_pos, p_link->chunk_len, &p_data);
+            len      = page_len;
+        }
+
+        memset(&hvx_params, 0, sizeof(hvx_params));
+        hvx_params.handle = p_fat->fat_url_handles.value_handle;
+        hvx_params.type   = BLE_GATT_HVX_NOTIFICATION;
+        hvx_params.offset = 0;
+        hvx_params.p_len  = &len;
+        hvx_params.p_data = p_data;
+
+        err_code = sd_ble_gatts_hvx(p_link->conn_handle, &hvx_params);
+        if (err_code == BLE_ERROR_NO_TX_PACKETS) {
+            break;                              // Queue is full, resume on TX complete.
+        }
+        if (err_code != NRF_SUCCESS) {
+            FAT_TRACE(FAT_TRACE_EVT_ERROR, p_link->conn_handle, err_code);
+            SEGGER_RTT_printf(0, "Fatbeacon notify Error %d\n", err_code);
+            p_link->streaming = false;
+            break;
+        }
+        FAT_TRACE(FAT_TRACE_EVT_NOTIFY, p_link->conn_handle, len);
+
+        p_link->header_due  = false;
+        p_link->stream_pos += page_len;
+        if ((len == 0) ||
+            ((p_link->options & FAT_CTRL_OPT_HEADER) && (p_link->stream_pos >= ble_fat_link_len(p_link))))
+        {
+            p_link->streaming = false;          // Terminator is queued, or the last byte for a client that needs none.
+            ble_fat_transfer_set(p_fat, p_link, BLE_FAT_TRANSFER_DONE);
+        }
+    }
+}
+
+/**@brief Function for handling the @ref BLE_GATTS_EVT_WRITE event from the S132 SoftDevice.
+ *
+ * @details Enabling notifications on the fatbeacon characteristic starts a streamed transfer of
+ *          the page from the beginning, or from where a resume put it, disabling them stops it.  Writes to the upload
+ *          characteristic go to the application's upload handler.
+ *
+ * @param[in] p_fat     Fatbeacon URL Service structure.
+ * @param[in] p_ble_evt Pointer to the event received from BLE stack.
+ */
+static void on_write(ble_fat_t * p_fat, ble_evt_t * p_ble_evt)
+{
+    ble_gatts_evt_write_t * p_evt_write = &p_ble_evt->evt.gatts_evt.params.write;
+    ble_fat_link_t *        p_link      = ble_fat_link_get(p_fat, p_ble_evt->evt.gatts_evt.conn_handle);
+
+    if (p_link == NULL) {
+        return;
+    }
+
+    if ((p_evt_write->handle == p_fat->fat_url_handles.cccd_handle) &&
+        (p_evt_write->len == BLE_CCCD_VALUE_LEN))
+    {
+        if (ble_srv_is_notification_enabled(p_evt_write->data))
+        {
+            p_link->streaming  = true;
+            p_link->stream_pos = p_link->resume_pos;
+            p_link->header_due = (p_link->options & FAT_CTRL_OPT_HEADER) && (p_link->resume_pos == 0);
+            ble_fat_transfer_set(p_fat, p_link, BLE_FAT_TRANSFER_ACTIVE);
+            stream_fill(p_fat, p_link);
+        }
+        else
+        {
+            p_link->streaming = false;
+        }
+    }
+    else if ((p_evt_write->handle == p_fat->upload_handles.value_handle) &&
+             (p_fat->upload_evt_handler != NULL))
+    {
+        p_fat->upload_evt_handler(p_fat, p_link, p_evt_write->data, p_evt_write->len);
+    }
+    else if ((p_evt_write->handle == p_fat->control_handles.value_handle) &&
+             (p_evt_write->len == 2) && (p_evt_write->data[0] == FAT_CTRL_OP_OPTIONS))
+    {
+        p_link->options = p_evt_write->data[1];
+        link_view_set(p_link);
+    }
+    else if ((p_evt_write->handle == p_fat->control_handles.value_handle) &&
+             (p_evt_write->len == FAT_CTRL_RESUME_LEN) && (p_evt_write->data[0] == FAT_CTRL_OP_RESUME))
+    {
+        link_resume(p_link, uint32_decode(&p_evt_write->data[1]), uint16_decode(&p_evt_write->data[5]),
+                    uint16_decode(&p_evt_write->data[7]));
+        FAT_TRACE(FAT_TRACE_EVT_RESUME, p_link->conn_handle, p_link->resume_pos);
+    }
+}
+
+/**@brief Function for handling the @ref BLE_EVT_TX_COMPLETE event from the S132 SoftDevice.
+ *
+ * @param[in] p_fat     Fatbeacon URL Service structure.
+ * @param[in] p_ble_evt Pointer to the event received from BLE stack.
+ */
+static void on_tx_complete(ble_fat_t * p_fat, ble_evt_t * p_ble_evt)
+{
+    ble_fat_link_t * p_link = ble_fat_link_get(p_fat, p_ble_evt->evt.common_evt.conn_handle);
+
+    if (p_link != NULL) {
+        FAT_TRACE(FAT_TRACE_EVT_TX_COMPLETE, p_link->conn_handle, p_ble_evt->evt.common_evt.params.tx_complete.count);
+        stream_fill(p_fat, p_link);
+    }
+}
+
+/**@brief Function for handling the @ref BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST event from the S132 SoftDevice.
+ *
+ * @details Offers FAT_ATT_MTU_MAX and grows the link's chunk size to whatever the client accepts.  
+ *          Clients that never send the request stay on the default 20 byte chunks.
+ *
+ * @param[in] p_fat     Fatbeacon URL Service structure.
+ * @param[in] p_ble_evt Pointer to the event received from BLE stack.
+ */
+static void on_exchange_mtu_request(ble_fat_t * p_fat, ble_evt_t * p_ble_evt)
+{
+    uint32_t         err_code;
+    uint16_t         conn_handle   = p_ble_evt->evt.gatts_evt.conn_handle;
+    uint16_t         client_rx_mtu = p_ble_evt->evt.gatts_evt.params.exchange_mtu_request.client_rx_mtu;
+    ble_fat_link_t * p_link        = ble_fat_link_get(p_fat, conn_handle);
+
+    err_code = sd_ble_gatts_exchange_mtu_reply(conn_handle, FAT_ATT_MTU_MAX);
+    if (err_code != NRF_SUCCESS) {
+        SEGGER_RTT_printf(0, "MTU Reply Error %d\n", err_code);
+        return;
+    }
+
+    if (p_link != NULL) {
+        p_link->att_mtu   = MAX(GATT_MTU_SIZE_DEFAULT, MIN(client_rx_mtu, FAT_ATT_MTU_MAX));
+        p_link->chunk_len = p_link->att_mtu - 3;
+    }
+}
+
+
+/**@brief Function for answering a read of the control characteristic.
+ *
+ * @details Tells the client how this connection will be served, so it knows whether to inflate
+ *          what it reads.
+ *
+ * @param[in] p_link    Link being read from.
+ */
+static void control_read_reply(ble_fat_link_t * p_link)
+{
+    uint32_t                              err_code;
+    uint8_t                               info[FAT_CTRL_INFO_LEN];
+    ble_gatts_rw_authorize_reply_params_t reply;
+
+    info[0] = link_encoding(p_link);
+    (void) uint16_encode(ble_fat_link_len(p_link), &info[1]);
+    (void) uint16_encode(p_link->page.version, &info[3]);
+    (void) uint32_encode(p_link->page.hash, &info[5]);
+    (void) uint16_encode(p_link->resume_pos, &info[9]);
+
+    memset(&reply, 0, sizeof(reply));
+    reply.type                     = BLE_GATTS_AUTHORIZE_TYPE_READ;
+    reply.params.read.gatt_status  = BLE_GATT_STATUS_SUCCESS;
+    reply.params.read.update       = 1;
+    reply.params.read.len          = sizeof(info);
+    reply.params.read.p_data       = info;
+
+    err_code = sd_ble_gatts_rw_authorize_reply(p_link->conn_handle, &reply);
+    if (err_code != NRF_SUCCESS) {
+        SEGGER_RTT_printf(0, "Control Reply Error %d\n", err_code);
+    }
+}
 
 /**@brief Function for handling the @ref BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST: BLE_GATTS_AUTHORIZE_TYPE_READ event from the S132 SoftDevice.
  *
@@ -65,8 +596,19 @@ static void on_disconnect(ble_fat_t * p_fat) //, ble_evt_t * p_ble_evt)
 static void on_read(ble_fat_t * p_fat, ble_evt_t * p_ble_evt)
 {
     ble_gatts_evt_read_t * p_evt_read = &p_ble_evt->evt.gatts_evt.params.authorize_request.request.read;
+    ble_fat_link_t *       p_link     = ble_fat_link_get(p_fat, p_ble_evt->evt.gatts_evt.conn_handle);
+
+    if (p_link == NULL) {
+        return;
+    }
+
+    if (p_evt_read->handle == p_fat->control_handles.value_handle) {
+        control_read_reply(p_link);
+        return;
+    }
 
-    p_fat->read_evt_handler(p_fat, p_evt_read->handle);
+    FAT_TRACE(FAT_TRACE_EVT_READ, p_link->conn_handle, p_evt_read->offset);
+    p_fat->read_evt_handler(p_fat, p_link, p_evt_read->handle, p_evt_read->offset);
    
 }
 
@@ -85,8 +627,42 @@ void ble_fat_on_ble_evt(ble_fat_t * p_fat, ble_evt_t * p_ble_evt)
             break;
 
         case BLE_GAP_EVT_DISCONNECTED:
-            on_disconnect(p_fat); //, p_ble_evt);
+            on_disconnect(p_fat, p_ble_evt);
+            break;
+
+        case BLE_GATTS_EVT_WRITE:
+            on_write(p_fat, p_ble_evt);
+            break;
+
+        case BLE_EVT_TX_COMPLETE:
+            on_tx_complete(p_fat, p_ble_evt);
+            break;
+
+        case BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST:
+            on_exchange_mtu_request(p_fat, p_ble_evt);
+            break;
+
+#if defined(NRF_SD_BLE_API_VERSION) && (NRF_SD_BLE_API_VERSION >= 4)
+        case BLE_GAP_EVT_DATA_LENGTH_UPDATE_REQUEST:
+            // Let the SoftDevice pick the largest values both sides support.
+            (void) sd_ble_gap_data_length_update(p_ble_evt->evt.gap_evt.conn_handle, NULL, NULL);
+            break;
+#endif
+
+#if defined(NRF_SD_BLE_API_VERSION) && (NRF_SD_BLE_API_VERSION >= 5)
+        case BLE_GAP_EVT_PHY_UPDATE_REQUEST:
+        {
+            // Central asked first, take 2M if it offers it.
+            ble_gap_phys_t phys = { BLE_GAP_PHY_AUTO, BLE_GAP_PHY_AUTO };
+
+            (void) sd_ble_gap_phy_update(p_ble_evt->evt.gap_evt.conn_handle, &phys);
             break;
+        }
+
+        case BLE_GAP_EVT_PHY_UPDATE:
+            on_phy_update(p_fat, p_ble_evt);
+            break;
+#endif
 
         case BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST:
             if (p_ble_evt->evt.gatts_evt.params.authorize_request.type == BLE_GATTS_AUTHORIZE_TYPE_READ)
@@ -118,14 +694,22 @@ static uint32_t fat_url_char_add(ble_fat_t * p_fat, const ble_fat_init_t * p_fat
     ble_gatts_attr_t    attr_char_value;
     ble_uuid_t          ble_uuid;
     ble_gatts_attr_md_t attr_md;
+    ble_gatts_attr_md_t cccd_md;
+
+    memset(&cccd_md, 0, sizeof(cccd_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+    cccd_md.vloc = BLE_GATTS_VLOC_STACK;
 
     memset(&char_md, 0, sizeof(char_md));
 
     char_md.char_props.read          = 1;
+    char_md.char_props.notify        = 1;   // Optional push mode, see stream_fill()
     char_md.p_char_user_desc         = NULL;
     char_md.p_char_pf                = NULL;
     char_md.p_user_desc_md           = NULL;
-    char_md.p_cccd_md                = NULL; 
+    char_md.p_cccd_md                = &cccd_md; 
     char_md.p_sccd_md                = NULL;
 
     ble_uuid.type = p_fat->char_uuid_type;
@@ -147,8 +731,8 @@ static uint32_t fat_url_char_add(ble_fat_t * p_fat, const ble_fat_init_t * p_fat
     attr_char_value.p_attr_md = &attr_md;
     attr_char_value.init_len  = 1;
     attr_char_value.init_offs = 0;
-    attr_char_value.p_value   = p_fat->val_data;    // Not Used in this implementation.
-    attr_char_value.max_len   = 20;
+    attr_char_value.p_value   = (uint8_t *) p_fat->page.p_data;    // Not Used in this implementation.
+    attr_char_value.max_len   = FAT_ATT_MTU_MAX - 1;    // A full Read Blob response.
 
     return sd_ble_gatts_characteristic_add(p_fat->service_handle,
                                            &char_md,
@@ -157,17 +741,316 @@ static uint32_t fat_url_char_add(ble_fat_t * p_fat, const ble_fat_init_t * p_fat
 }
 
 
+/**@brief Function for adding the upload characteristic.
+ *
+ * @details Clients write new page content here (see FAT_UPLOAD_OP_*) and enable notifications
+ *          to receive the status replies.
+ *
+ * @param[in] p_fat       Fatbeacon URL Service structure.
+ *
+ * @return NRF_SUCCESS on success, otherwise an error code.
+ */
+static uint32_t fat_upload_char_add(ble_fat_t * p_fat)
+{
+    ble_gatts_char_md_t char_md;
+    ble_gatts_attr_t    attr_char_value;
+    ble_uuid_t          ble_uuid;
+    ble_gatts_attr_md_t attr_md;
+    ble_gatts_attr_md_t cccd_md;
+
+    memset(&cccd_md, 0, sizeof(cccd_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+    cccd_md.vloc = BLE_GATTS_VLOC_STACK;
+
+    memset(&char_md, 0, sizeof(char_md));
+
+    char_md.char_props.write         = 1;
+    char_md.char_props.write_wo_resp = 1;   // DATA bursts, several per connection event
+    char_md.char_props.notify        = 1;   // Status replies
+    char_md.p_cccd_md                = &cccd_md;
+
+    ble_uuid.type = p_fat->char_uuid_type;
+    ble_uuid.uuid = BLE_UUID_FAT_UPLOAD_CHAR;
+
+    memset(&attr_md, 0, sizeof(attr_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+
+    attr_md.vloc    = BLE_GATTS_VLOC_STACK;
+    attr_md.rd_auth = 0;
+    attr_md.wr_auth = 0;
+    attr_md.vlen    = 1;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+
+    attr_char_value.p_uuid    = &ble_uuid;
+    attr_char_value.p_attr_md = &attr_md;
+    attr_char_value.init_len  = 0;
+    attr_char_value.max_len   = FAT_ATT_MTU_MAX - 3;    // A full Write Command.
+
+    return sd_ble_gatts_characteristic_add(p_fat->service_handle,
+                                           &char_md,
+                                           &attr_char_value,
+                                           &p_fat->upload_handles);
+}
+
+
+/**@brief Function for adding the control characteristic.
+ *
+ * @details Clients that can inflate deflate themselves say so here (see FAT_CTRL_OP_OPTIONS),
+ *          and read it back to learn the encoding and length of what they will be sent.
+ *
+ * @param[in] p_fat       Fatbeacon URL Service structure.
+ *
+ * @return NRF_SUCCESS on success, otherwise an error code.
+ */
+static uint32_t fat_control_char_add(ble_fat_t * p_fat)
+{
+    ble_gatts_char_md_t char_md;
+    ble_gatts_attr_t    attr_char_value;
+    ble_uuid_t          ble_uuid;
+    ble_gatts_attr_md_t attr_md;
+
+    memset(&char_md, 0, sizeof(char_md));
+
+    char_md.char_props.read          = 1;
+    char_md.char_props.write         = 1;
+
+    ble_uuid.type = p_fat->char_uuid_type;
+    ble_uuid.uuid = BLE_UUID_FAT_CONTROL_CHAR;
+
+    memset(&attr_md, 0, sizeof(attr_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+
+    attr_md.vloc    = BLE_GATTS_VLOC_STACK;
+    attr_md.rd_auth = 1;        // Answered per connection, see control_read_reply()
+    attr_md.wr_auth = 0;
+    attr_md.vlen    = 1;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+
+    attr_char_value.p_uuid    = &ble_uuid;
+    attr_char_value.p_attr_md = &attr_md;
+    attr_char_value.init_len  = 0;
+    attr_char_value.max_len   = MAX(FAT_CTRL_INFO_LEN, FAT_CTRL_RESUME_LEN);
+
+    return sd_ble_gatts_characteristic_add(p_fat->service_handle,
+                                           &char_md,
+                                           &attr_char_value,
+                                           &p_fat->control_handles);
+}
+
+
+/**@brief Function for adding the metrics characteristic.
+ *
+ * @details The value lives in the SoftDevice and is updated with ble_fat_metrics_set(), so
+ *          clients read it, long reads included, without involving the application.
+ *
+ * @param[in] p_fat       Fatbeacon URL Service structure.
+ *
+ * @return NRF_SUCCESS on success, otherwise an error code.
+ */
+static uint32_t fat_metrics_char_add(ble_fat_t * p_fat)
+{
+    ble_gatts_char_md_t char_md;
+    ble_gatts_attr_t    attr_char_value;
+    ble_uuid_t          ble_uuid;
+    ble_gatts_attr_md_t attr_md;
+
+    memset(&char_md, 0, sizeof(char_md));
+
+    char_md.char_props.read          = 1;
+
+    ble_uuid.type = p_fat->char_uuid_type;
+    ble_uuid.uuid = BLE_UUID_FAT_METRICS_CHAR;
+
+    memset(&attr_md, 0, sizeof(attr_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.write_perm);
+
+    attr_md.vloc    = BLE_GATTS_VLOC_STACK;
+    attr_md.rd_auth = 0;
+    attr_md.wr_auth = 0;
+    attr_md.vlen    = 1;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+
+    attr_char_value.p_uuid    = &ble_uuid;
+    attr_char_value.p_attr_md = &attr_md;
+    attr_char_value.init_len  = 0;
+    attr_char_value.max_len   = FAT_METRICS_VALUE_LEN;
+
+    return sd_ble_gatts_characteristic_add(p_fat->service_handle,
+                                           &char_md,
+                                           &attr_char_value,
+                                           &p_fat->metrics_handles);
+}
+
+
+/**@brief Function for updating the value clients read from the metrics characteristic.
+ *
+ * @param[in] p_fat     Fatbeacon URL Service structure.
+ * @param[in] p_data    Value, encoded by fat_metrics_encode().
+ * @param[in] len       Length of the value.
+ */
+uint32_t ble_fat_metrics_set(ble_fat_t * p_fat, uint8_t const * p_data, uint16_t len)
+{
+    ble_gatts_value_t value;
+
+    memset(&value, 0, sizeof(value));
+    value.len     = len;
+    value.offset  = 0;
+    value.p_value = (uint8_t *) p_data;
+
+    return sd_ble_gatts_value_set(BLE_CONN_HANDLE_INVALID, p_fat->metrics_handles.value_handle, &value);
+}
+
+
+uint32_t ble_fat_upload_status_send(ble_fat_t * p_fat, uint16_t conn_handle, uint8_t opcode, uint8_t status, uint32_t offset)
+{
+    uint8_t                data[FAT_UPLOAD_STATUS_LEN];
+    uint16_t               len = sizeof(data);
+    ble_gatts_hvx_params_t hvx_params;
+
+    data[0] = opcode;
+    data[1] = status;
+    (void) uint32_encode(offset, &data[2]);
+
+    memset(&hvx_params, 0, sizeof(hvx_params));
+    hvx_params.handle = p_fat->upload_handles.value_handle;
+    hvx_params.type   = BLE_GATT_HVX_NOTIFICATION;
+    hvx_params.p_len  = &len;
+    hvx_params.p_data = data;
+
+    return sd_ble_gatts_hvx(conn_handle, &hvx_params);
+}
+
+
+/**@brief Function for hashing a page for clients that cache it, see FAT_HASH_NONE.
+ *
+ * @details 32-bit FNV-1a, a few cycles a byte, so even a full 64 kB page is hashed in a few
+ *          milliseconds whenever the page changes.
+ */
+static uint32_t page_hash(uint8_t const * p_data, uint16_t len, uint8_t encoding)
+{
+    uint32_t hash = 2166136261u;
+
+    if (encoding == FAT_ENCODING_TEMPLATE) {
+        return FAT_HASH_NONE;
+    }
+    for (uint32_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ p_data[i]) * 16777619u;
+    }
+    return (hash != FAT_HASH_NONE) ? hash : 1;
+}
+
+
+/**@brief Function for telling whether a page in a flash area is still being served.
+ *
+ * @details Links keep the page they connected with, so after a commit they go on reading the
+ *          old one until they disconnect.  Its flash must not be erased before then.
+ *
+ * @param[in] p_fat     Fatbeacon URL Service structure.
+ * @param[in] p_start   Start of the area.
+ * @param[in] len       Length of the area in bytes.
+ *
+ * @return True if the page being served, or that of any connected link, lies in the area.
+ */
+bool ble_fat_page_in_use(ble_fat_t const * p_fat, uint8_t const * p_start, uint32_t len)
+{
+    uint8_t const * p_data = p_fat->page.p_data;
+
+    if ((p_data >= p_start) && (p_data < p_start + len)) {
+        return true;
+    }
+    for (uint32_t i = 0; i < BLE_FAT_MAX_LINKS; i++)
+    {
+        p_data = p_fat->links[i].page.p_data;
+        if ((p_fat->links[i].conn_handle != BLE_CONN_HANDLE_INVALID) &&
+            (p_data >= p_start) && (p_data < p_start + len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t ble_fat_page_set(ble_fat_t * p_fat, uint8_t const * p_data, uint16_t len, uint16_t version, uint8_t encoding)
+{
+    uint32_t       content_len = len;
+    ble_fat_page_t page;
+
+    if (encoding == FAT_ENCODING_DEFLATE)
+    {
+        // Inflate it once up front, so a stream that won't decode is never served.  This puts
+        // a whole inflater on the stack, but only for the duration of the call.
+        fat_inflate_t inflater;
+
+        fat_inflate_init(&inflater, p_data, len);
+        content_len = fat_inflate_length(&inflater);
+        if ((content_len == 0) || (content_len > UINT16_MAX)) {
+            return NRF_ERROR_INVALID_DATA;
+        }
+    }
+    else if (encoding == FAT_ENCODING_TEMPLATE)
+    {
+        // Checked once here, so reads can trust the offset map.
+        uint16_t out_len;
+
+        if (fat_tmpl_check(p_data, len, &out_len) != NRF_SUCCESS) {
+            return NRF_ERROR_INVALID_DATA;
+        }
+        content_len = out_len;
+    }
+    else if (encoding != FAT_ENCODING_IDENTITY)
+    {
+        return NRF_ERROR_INVALID_DATA;
+    }
+
+    page             = p_fat->page;
+    page.p_data      = p_data;
+    page.len         = len;
+    page.version     = version;
+    page.encoding    = encoding;
+    page.content_len = content_len;
+    page.hash        = page_hash(p_data, len, encoding);
+
+    // Called from the main loop, while on_connect() copies the page from the SoftDevice interrupt.
+    CRITICAL_REGION_ENTER();
+    p_fat->page = page;
+    CRITICAL_REGION_EXIT();
+
+    return NRF_SUCCESS;
+}
+
+
 uint32_t ble_fat_init(ble_fat_t * p_fat, const ble_fat_init_t * p_fat_init)
 {
     uint32_t      err_code = 0;
+    uint32_t      page_err_code;
     ble_uuid_t    ble_uuid;
     ble_uuid128_t fat_base_uuid = FAT_SERVICE_BASE_UUID;
     ble_uuid128_t fat_char_base_uuid = FAT_CHARACTERISTIC_BASE_UUID;
 
     // Initialize the service structure.
-    p_fat->conn_handle                        = BLE_CONN_HANDLE_INVALID;
+    for (uint32_t i = 0; i < BLE_FAT_MAX_LINKS; i++)
+    {
+        link_reset(&p_fat->links[i], BLE_CONN_HANDLE_INVALID);
+    }
     p_fat->read_evt_handler                   = p_fat_init->read_evt_handler;
-    p_fat->val_data                           = p_fat_init->val_data;
+    p_fat->read_mode                          = p_fat_init->read_mode;
+    p_fat->upload_evt_handler                 = p_fat_init->upload_evt_handler;
+    p_fat->transfer_evt_handler               = p_fat_init->transfer_evt_handler;
+    p_fat->value_handler                      = p_fat_init->value_handler;
+
+    page_err_code = ble_fat_page_set(p_fat, p_fat_init->p_page_data, p_fat_init->page_len,
+                                     p_fat_init->page_version, p_fat_init->page_encoding);
 
     // Add a custom base service UUID.
     err_code = sd_ble_uuid_vs_add(&fat_base_uuid, &p_fat->uuid_type);
@@ -197,5 +1080,21 @@ uint32_t ble_fat_init(ble_fat_t * p_fat, const ble_fat_init_t * p_fat_init)
         SEGGER_RTT_printf(0, "Fatbeacon char add Error %d\n", err_code);
     }
 
-    return NRF_SUCCESS;
+    err_code = fat_upload_char_add(p_fat);
+    if (err_code != NRF_SUCCESS) {
+        SEGGER_RTT_printf(0, "Upload char add Error %d\n", err_code);
+    }
+
+    err_code = fat_control_char_add(p_fat);
+    if (err_code != NRF_SUCCESS) {
+        SEGGER_RTT_printf(0, "Control char add Error %d\n", err_code);
+    }
+
+    err_code = fat_metrics_char_add(p_fat);
+    if (err_code != NRF_SUCCESS) {
+        SEGGER_RTT_printf(0, "Metrics char add Error %d\n", err_code);
+    }
+
+    // The service is up either way, the caller can still set a page it can serve.
+    return page_err_code;
 }
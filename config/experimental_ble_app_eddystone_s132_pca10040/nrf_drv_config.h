@@ -204,7 +204,11 @@
 #define PWM_COUNT   (PWM0_ENABLED + PWM1_ENABLED + PWM2_ENABLED)
 
 /* SPI */
+#if defined(FAT_SENSOR_ENABLED) && FAT_SENSOR_ENABLED
+#define SPI0_ENABLED 1                                  /* RuuviTag sensors, pins in ruuvitag.h. */
+#else
 #define SPI0_ENABLED 0
+#endif
 
 #if (SPI0_ENABLED == 1)
 #define SPI0_USE_EASY_DMA 0
@@ -385,7 +389,7 @@
 
 
 /* SAADC */
-#define SAADC_ENABLED 0
+#define SAADC_ENABLED 1
 
 #if (SAADC_ENABLED == 1)
 #define SAADC_CONFIG_RESOLUTION      NRF_SAADC_RESOLUTION_10BIT
@@ -0,0 +1,287 @@
+/*****************************************************************************
+*
+* fat_adv.c
+*
+* This schedules the advertising.  The connectable fatbeacon frame is
+* interleaved with non-connectable Eddystone UID and TLM frames, and while
+* every link is taken only the non-connectable ones go out.  After boot, a button
+* press or a disconnect the frames go out at a fast interval, backing off
+* to a slow one when nobody has connected for a while.
+*
+* Copyright (c) 2016 Matt Roche
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+********************************************************************************/
+
+
+
+#include "fat_adv.h"
+#include <string.h>
+#include "nordic_common.h"
+#include "app_util.h"
+#include "app_timer.h"
+#include "fat_tlm.h"
+#include "fatbeacon.h"
+#include "SEGGER_RTT.h"
+
+#define TIMER_PRESCALER     0                                     /**< Same as APP_TIMER_PRESCALER in main.c. */
+#define ADV_CHANNELS        3                                     /**< Every advertising event sends a PDU on each advertising channel. */
+
+APP_TIMER_DEF(m_slot_timer);                                      /**< Ends the frame being advertised. */
+
+/**@brief Advertising and scan response data of a frame, encoded once by fat_adv_frame_encode(). */
+typedef struct
+{
+    uint8_t                         adv[BLE_GAP_ADV_MAX_SIZE];
+    uint8_t                         adv_len;
+    uint8_t                         sr[BLE_GAP_ADV_MAX_SIZE];
+    uint8_t                         sr_len;                       /**< 0 when the frame has no scan response. */
+} adv_frame_data_t;
+
+static const uint8_t        m_frame_events[FAT_ADV_FRAME_COUNT] = { FAT_ADV_FAT_EVENTS, FAT_ADV_UID_EVENTS, FAT_ADV_TLM_EVENTS };
+static const uint8_t        m_frame_types[FAT_ADV_FRAME_COUNT]  =
+{
+    BLE_GAP_ADV_TYPE_ADV_IND, BLE_GAP_ADV_TYPE_ADV_NONCONN_IND, BLE_GAP_ADV_TYPE_ADV_SCAN_IND
+};
+
+static adv_frame_data_t     m_frames[FAT_ADV_FRAME_COUNT];
+static uint8_t *            mp_tlm;                               /**< Eddystone-TLM data in m_frames, NULL until that frame is encoded. */
+static uint8_t *            mp_tlm_stats;                         /**< Fatbeacon counters in its scan response. */
+static bool                 m_started;                            /**< fat_adv_start() called. */
+static bool                 m_advertising;                        /**< The SoftDevice is advertising m_frame. */
+static bool                 m_connectable = true;                 /**< A link is free, the fatbeacon frame may go out. */
+static fat_adv_frame_t      m_frame;                              /**< Frame of the current slot. */
+static uint16_t             m_interval_ms;                        /**< Interval m_frame is advertised at. */
+static uint32_t             m_slot_ms;                            /**< Length of the current slot. */
+static uint32_t             m_slot_events;                        /**< Advertising events in the current slot. */
+static uint32_t             m_fast_left_ms;                       /**< Fast advertising left, counted down slot by slot. */
+
+/**@brief Function for starting a slot: advertises a frame for its share of the rotation.
+ *
+ * @details The SoftDevice has a single advertiser, so a frame change means stopping it, loading
+ *          the other frame's pre-encoded data and starting it again.  A slot that keeps the same frame and interval
+ *          leaves the advertiser running and only rearms the timer.
+ *
+ * @param[in] frame     Frame to advertise.
+ */
+static void slot_begin(fat_adv_frame_t frame)
+{
+    uint32_t             err_code;
+    uint32_t             events;
+    uint16_t             interval_ms = (m_fast_left_ms > 0) ? FAT_ADV_FAST_INTERVAL_MS : FAT_ADV_SLOW_INTERVAL_MS;
+    ble_gap_adv_params_t adv_params;
+
+    events = m_frame_events[frame];
+    if (!m_connectable && (frame == FAT_ADV_FRAME_FAT)) {
+        frame  = FAT_ADV_FRAME_UID;                               // Takes the fatbeacon frame's turn as well.
+        events = FAT_ADV_FAT_EVENTS + FAT_ADV_UID_EVENTS;
+    }
+
+    if (!m_advertising || (frame != m_frame) || (interval_ms != m_interval_ms)) {
+        if (m_advertising) {
+            (void) sd_ble_gap_adv_stop();
+            m_advertising = false;
+        }
+
+        if ((frame == FAT_ADV_FRAME_TLM) && (mp_tlm != NULL)) {
+            fat_tlm_encode(mp_tlm, mp_tlm_stats);                 // Fresh readings, in place.
+        }
+        err_code = sd_ble_gap_adv_data_set(m_frames[frame].adv, m_frames[frame].adv_len,
+                                           (m_frames[frame].sr_len > 0) ? m_frames[frame].sr : NULL,
+                                           m_frames[frame].sr_len);
+        if (err_code != NRF_SUCCESS) {
+            SEGGER_RTT_printf(0, "Adv data Error %d\n", err_code);
+        }
+
+        memset(&adv_params, 0, sizeof(adv_params));
+        adv_params.type     = m_frame_types[frame];
+        adv_params.fp       = BLE_GAP_ADV_FP_ANY;
+        adv_params.interval = MSEC_TO_UNITS(interval_ms, UNIT_0_625_MS);
+        adv_params.timeout  = 0;                                  // The slot timer decides when to stop.
+
+        err_code = sd_ble_gap_adv_start(&adv_params);
+        if (err_code == NRF_SUCCESS) {
+            m_advertising = true;
+        } else {
+            SEGGER_RTT_printf(0, "Adv start Error %d\n", err_code);
+        }
+    }
+    m_frame       = frame;
+    m_interval_ms = interval_ms;
+    m_slot_events = events;
+    m_slot_ms     = events * interval_ms;
+
+    (void) app_timer_stop(m_slot_timer);
+    err_code = app_timer_start(m_slot_timer, APP_TIMER_TICKS(m_slot_ms, TIMER_PRESCALER), NULL);
+    if (err_code != NRF_SUCCESS) {
+        SEGGER_RTT_printf(0, "Adv timer Error %d\n", err_code);
+    }
+}
+
+/**@brief Function for moving on to the next frame once a slot is over. */
+static void slot_timeout_handler(void * p_context)
+{
+    UNUSED_PARAMETER(p_context);
+
+    if (m_advertising) {
+        fat_tlm_adv_pdus_add(m_slot_events * ADV_CHANNELS);
+    }
+    m_fast_left_ms = (m_fast_left_ms > m_slot_ms) ? (m_fast_left_ms - m_slot_ms) : 0;
+    slot_begin((fat_adv_frame_t) ((m_frame + 1) % FAT_ADV_FRAME_COUNT));
+}
+
+uint32_t fat_adv_init(void)
+{
+    return app_timer_create(&m_slot_timer, APP_TIMER_MODE_SINGLE_SHOT, slot_timeout_handler);
+}
+
+/**@brief Function for finding an AD structure in encoded advertising data.
+ *
+ * @param[in] p_data    Encoded advertising or scan response data.
+ * @param[in] len       Length of p_data.
+ * @param[in] ad_type   AD type to look for.
+ * @param[in] id        16-bit UUID or company ID the structure starts with.
+ * @param[in] data_len  Bytes that must follow the ID.
+ *
+ * @return The data after the ID, NULL if there is no such structure.
+ */
+static uint8_t * ad_field_find(uint8_t * p_data, uint8_t len, uint8_t ad_type, uint16_t id, uint8_t data_len)
+{
+    for (uint8_t pos = 0; (pos + 1 < len) && (p_data[pos] > 0); pos += p_data[pos] + 1)
+    {
+        if ((p_data[pos + 1] == ad_type) && (p_data[pos] >= 3 + data_len) && (pos + 1 + p_data[pos] <= len) &&
+            (uint16_decode(&p_data[pos + 2]) == id)) {
+            return &p_data[pos + 4];
+        }
+    }
+    return NULL;
+}
+
+/**@brief Function for encoding the advertising data of a frame.
+ *
+ * @details Done once, before fat_adv_start(), for every frame.  A frame change then only hands the
+ *          stored bytes to the SoftDevice instead of encoding the same data again each time.
+ *          Encode the frame again if its data changes, it is loaded the next time the frame starts.
+ *          The TLM frame is the exception, its readings are written into the encoded data each
+ *          time it comes round, so it must carry FAT_TLM_DATA_LEN bytes of Eddystone service data
+ *          and a scan response with FAT_TLM_STATS_LEN bytes of manufacturer data.
+ *
+ * @param[in] frame     Frame the data is for.
+ * @param[in] p_advdata Advertising data.
+ * @param[in] p_srdata  Scan response data, NULL for none.
+ *
+ * @return NRF_SUCCESS, or the error of adv_data_encode() if the data does not fit.
+ */
+uint32_t fat_adv_frame_encode(fat_adv_frame_t frame, ble_advdata_t const * p_advdata, ble_advdata_t const * p_srdata)
+{
+    uint32_t           err_code;
+    uint16_t           len;
+    adv_frame_data_t * p_frame = &m_frames[frame];
+
+    len = sizeof(p_frame->adv);
+    err_code = adv_data_encode(p_advdata, p_frame->adv, &len);
+    if (err_code != NRF_SUCCESS) {
+        return err_code;
+    }
+    p_frame->adv_len = (uint8_t) len;
+
+    len = 0;
+    if (p_srdata != NULL) {
+        len = sizeof(p_frame->sr);
+        err_code = adv_data_encode(p_srdata, p_frame->sr, &len);
+        if (err_code != NRF_SUCCESS) {
+            return err_code;
+        }
+    }
+    p_frame->sr_len = (uint8_t) len;
+
+    if (frame == FAT_ADV_FRAME_TLM) {
+        mp_tlm       = ad_field_find(p_frame->adv, p_frame->adv_len, BLE_GAP_AD_TYPE_SERVICE_DATA,
+                                     APP_EDDYSTONE_UUID, FAT_TLM_DATA_LEN);
+        mp_tlm_stats = ad_field_find(p_frame->sr, p_frame->sr_len, BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA,
+                                     FAT_TLM_STATS_COMPANY_ID, FAT_TLM_STATS_LEN);
+        if ((mp_tlm == NULL) || (mp_tlm_stats == NULL)) {
+            mp_tlm = NULL;
+            return NRF_ERROR_INVALID_PARAM;
+        }
+    }
+    return NRF_SUCCESS;
+}
+
+/**@brief Function for starting to advertise, fast, with the fatbeacon frame first. */
+void fat_adv_start(void)
+{
+    m_started = true;
+    fat_adv_fast();
+}
+
+/**@brief Function for going back to the fast interval, e.g. when someone presses the button. */
+void fat_adv_fast(void)
+{
+    m_fast_left_ms = FAT_ADV_FAST_TIMEOUT_MS;
+    if (m_started) {
+        slot_begin(FAT_ADV_FRAME_FAT);
+    }
+}
+
+/**@brief Function for telling the scheduler whether a link is free for another client.
+ *
+ * @details Call it after every connection.  A connection stops the advertiser, so this also
+ *          starts it again, with the fatbeacon frame if there is room for another client.
+ */
+void fat_adv_connectable_set(bool connectable)
+{
+    m_connectable = connectable;
+    if (m_started && (!m_advertising || (connectable && (m_frame != FAT_ADV_FRAME_FAT)) ||
+                      (!connectable && (m_frame == FAT_ADV_FRAME_FAT)))) {
+        slot_begin(FAT_ADV_FRAME_FAT);
+    }
+}
+
+void fat_adv_on_ble_evt(ble_evt_t * p_ble_evt)
+{
+    switch (p_ble_evt->header.evt_id)
+    {
+        case BLE_GAP_EVT_CONNECTED:
+            // Only the connectable frame can be connected to, and the SoftDevice stops it when it is.
+            m_advertising = false;
+            break;
+
+        case BLE_GAP_EVT_DISCONNECTED:
+            // A link is free again, and someone is probably about to connect to it.
+            m_connectable = true;
+            fat_adv_fast();
+            break;
+
+        case BLE_GAP_EVT_TIMEOUT:
+            if (p_ble_evt->evt.gap_evt.params.timeout.src == BLE_GAP_TIMEOUT_SRC_ADVERTISING) {
+                m_advertising = false;
+                slot_begin(m_frame);
+            }
+            break;
+
+        default:
+            // No implementation needed.
+            break;
+    }
+}
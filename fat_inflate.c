@@ -0,0 +1,432 @@
+/*****************************************************************************
+*
+* fat_inflate.c
+*
+* This is a small streaming inflater for pages stored as raw deflate.
+* It works from the compressed data in place and keeps only a 1 kB
+* window of output, so pages can be served decompressed chunk by chunk
+* to clients that can't inflate them themselves.
+*
+* Copyright (c) 2016 Matt Roche
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+********************************************************************************/
+
+
+#include "fat_inflate.h"
+#include <string.h>
+
+#define WINDOW_MASK         (FAT_INFLATE_WINDOW_SIZE - 1)
+
+enum
+{
+    STATE_HEADER,                                                 /**< Next thing in the stream is a block header. */
+    STATE_STORED,                                                 /**< Inside a stored block. */
+    STATE_CODES,                                                  /**< Inside a Huffman coded block. */
+    STATE_DONE,                                                   /**< Final block finished. */
+    STATE_ERROR,                                                  /**< Corrupt stream, or one packed with a larger window. */
+};
+
+static const uint16_t m_len_base[29]  = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                          35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t  m_len_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                          3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t m_dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                          257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                          8193, 12289, 16385, 24577 };
+static const uint8_t  m_dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                           7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t  m_clen_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+
+/**@brief Takes the next n bits (n <= 16) from the stream, LSB first.
+ *
+ * @details Running out of input puts the decoder in STATE_ERROR and returns zeros, so callers
+ *          only need to check the state once they have a whole symbol.
+ */
+static uint32_t bits_get(fat_inflate_t * p_inf, uint8_t n)
+{
+    uint32_t val;
+
+    while (p_inf->bit_cnt < n)
+    {
+        if (p_inf->src_pos >= p_inf->src_len) {
+            p_inf->state = STATE_ERROR;
+            return 0;
+        }
+        p_inf->bit_buf |= (uint32_t) p_inf->p_src[p_inf->src_pos++] << p_inf->bit_cnt;
+        p_inf->bit_cnt += 8;
+    }
+
+    val = p_inf->bit_buf & ((1UL << n) - 1);
+    p_inf->bit_buf >>= n;
+    p_inf->bit_cnt  -= n;
+    return val;
+}
+
+/**@brief Builds a canonical Huffman code from a list of code lengths.
+ *
+ * @return false if the lengths over-subscribe the code.
+ */
+static bool tree_build(uint16_t * p_counts, uint16_t * p_symbols, uint8_t const * p_lengths, uint16_t num)
+{
+    uint16_t offs[16];
+    int32_t  available = 1;
+    uint16_t sum       = 0;
+
+    memset(p_counts, 0, 16 * sizeof(uint16_t));
+    for (uint16_t i = 0; i < num; i++)
+    {
+        p_counts[p_lengths[i]]++;
+    }
+    p_counts[0] = 0;
+
+    for (uint8_t i = 1; i < 16; i++)
+    {
+        available *= 2;
+        if (p_counts[i] > available) {
+            return false;
+        }
+        available -= p_counts[i];
+    }
+
+    for (uint8_t i = 0; i < 16; i++)
+    {
+        offs[i] = sum;
+        sum    += p_counts[i];
+    }
+
+    for (uint16_t i = 0; i < num; i++)
+    {
+        if (p_lengths[i] != 0) {
+            p_symbols[offs[p_lengths[i]]++] = i;
+        }
+    }
+    return true;
+}
+
+/**@brief Decodes one symbol, reading the code a bit at a time.
+ *
+ * @return The symbol, or -1 for a code that isn't in the tree.
+ */
+static int32_t symbol_decode(fat_inflate_t * p_inf, uint16_t const * p_counts, uint16_t const * p_symbols)
+{
+    int32_t cur = 0;
+    int32_t sum = 0;
+
+    for (uint8_t len = 1; len < 16; len++)
+    {
+        cur  = 2 * cur + bits_get(p_inf, 1);
+        sum += p_counts[len];
+        cur -= p_counts[len];
+        if (cur < 0) {
+            return p_symbols[sum + cur];
+        }
+    }
+    return -1;
+}
+
+static bool fixed_trees_build(fat_inflate_t * p_inf)
+{
+    uint8_t lengths[FAT_INFLATE_LIT_SYMBOLS];
+
+    memset(&lengths[0],   8, 144);
+    memset(&lengths[144], 9, 112);
+    memset(&lengths[256], 7, 24);
+    memset(&lengths[280], 8, 8);
+    if (!tree_build(p_inf->lit_counts, p_inf->lit_symbols, lengths, FAT_INFLATE_LIT_SYMBOLS)) {
+        return false;
+    }
+
+    memset(lengths, 5, 30);
+    return tree_build(p_inf->dist_counts, p_inf->dist_symbols, lengths, 30);
+}
+
+/**@brief Reads the code length tables at the start of a dynamic block and builds its trees.
+ */
+static bool dynamic_trees_build(fat_inflate_t * p_inf)
+{
+    uint8_t  lengths[FAT_INFLATE_LIT_SYMBOLS + FAT_INFLATE_DIST_SYMBOLS];
+    uint16_t clen_counts[16];
+    uint16_t clen_symbols[19];
+    uint16_t hlit  = bits_get(p_inf, 5) + 257;
+    uint16_t hdist = bits_get(p_inf, 5) + 1;
+    uint8_t  hclen = bits_get(p_inf, 4) + 4;
+    uint16_t n     = 0;
+
+    if ((hlit > 286) || (hdist > 30)) {
+        return false;
+    }
+
+    memset(lengths, 0, 19);
+    for (uint8_t i = 0; i < hclen; i++)
+    {
+        lengths[m_clen_order[i]] = bits_get(p_inf, 3);
+    }
+    if (!tree_build(clen_counts, clen_symbols, lengths, 19)) {
+        return false;
+    }
+
+    while (n < hlit + hdist)
+    {
+        int32_t  sym = symbol_decode(p_inf, clen_counts, clen_symbols);
+        uint8_t  fill;
+        uint16_t repeat;
+
+        if ((sym < 0) || (p_inf->state == STATE_ERROR)) {
+            return false;
+        }
+
+        if (sym < 16) {
+            lengths[n++] = sym;
+            continue;
+        }
+
+        if (sym == 16) {
+            if (n == 0) {
+                return false;
+            }
+            fill   = lengths[n - 1];
+            repeat = 3 + bits_get(p_inf, 2);
+        } else if (sym == 17) {
+            fill   = 0;
+            repeat = 3 + bits_get(p_inf, 3);
+        } else {
+            fill   = 0;
+            repeat = 11 + bits_get(p_inf, 7);
+        }
+
+        if (n + repeat > hlit + hdist) {
+            return false;
+        }
+        memset(&lengths[n], fill, repeat);
+        n += repeat;
+    }
+
+    if (lengths[256] == 0) {
+        return false;               // No end of block code.
+    }
+
+    return tree_build(p_inf->lit_counts, p_inf->lit_symbols, lengths, hlit) &&
+           tree_build(p_inf->dist_counts, p_inf->dist_symbols, &lengths[hlit], hdist) &&
+           (p_inf->state != STATE_ERROR);
+}
+
+static void block_header_read(fat_inflate_t * p_inf)
+{
+    uint16_t len;
+    uint16_t nlen;
+
+    p_inf->final = bits_get(p_inf, 1);
+
+    switch (bits_get(p_inf, 2))
+    {
+        case 0:
+            // Stored blocks start on a byte boundary.
+            p_inf->bit_buf >>= (p_inf->bit_cnt & 7);
+            p_inf->bit_cnt  -= (p_inf->bit_cnt & 7);
+            len  = bits_get(p_inf, 16);
+            nlen = bits_get(p_inf, 16);
+            if ((uint16_t) (len ^ nlen) != 0xFFFF) {
+                p_inf->state = STATE_ERROR;
+                return;
+            }
+            p_inf->stored_left = len;
+            p_inf->state       = STATE_STORED;
+            break;
+
+        case 1:
+            p_inf->state = fixed_trees_build(p_inf) ? STATE_CODES : STATE_ERROR;
+            break;
+
+        case 2:
+            p_inf->state = dynamic_trees_build(p_inf) ? STATE_CODES : STATE_ERROR;
+            break;
+
+        default:
+            p_inf->state = STATE_ERROR;
+            break;
+    }
+}
+
+static uint8_t byte_put(fat_inflate_t * p_inf, uint8_t byte)
+{
+    p_inf->window[p_inf->out_pos & WINDOW_MASK] = byte;
+    p_inf->out_pos++;
+    return byte;
+}
+
+/**@brief Produces the next byte of output.
+ *
+ * @return The byte, or -1 at the end of the stream or on an error.
+ */
+static int32_t byte_next(fat_inflate_t * p_inf)
+{
+    for (;;)
+    {
+        if (p_inf->match_len > 0) {
+            p_inf->match_len--;
+            return byte_put(p_inf, p_inf->window[(p_inf->out_pos - p_inf->match_dist) & WINDOW_MASK]);
+        }
+
+        switch (p_inf->state)
+        {
+            case STATE_HEADER:
+                block_header_read(p_inf);
+                break;
+
+            case STATE_STORED:
+            {
+                uint8_t byte;
+
+                if (p_inf->stored_left == 0) {
+                    p_inf->state = p_inf->final ? STATE_DONE : STATE_HEADER;
+                    break;
+                }
+                byte = bits_get(p_inf, 8);
+                if (p_inf->state == STATE_ERROR) {
+                    return -1;
+                }
+                p_inf->stored_left--;
+                return byte_put(p_inf, byte);
+            }
+
+            case STATE_CODES:
+            {
+                int32_t sym = symbol_decode(p_inf, p_inf->lit_counts, p_inf->lit_symbols);
+                int32_t dist_sym;
+
+                if ((sym < 0) || (p_inf->state == STATE_ERROR)) {
+                    p_inf->state = STATE_ERROR;
+                    return -1;
+                }
+                if (sym < 256) {
+                    return byte_put(p_inf, sym);
+                }
+                if (sym == 256) {
+                    p_inf->state = p_inf->final ? STATE_DONE : STATE_HEADER;
+                    break;
+                }
+
+                sym -= 257;
+                if (sym >= 29) {
+                    p_inf->state = STATE_ERROR;
+                    return -1;
+                }
+                p_inf->match_len = m_len_base[sym] + bits_get(p_inf, m_len_extra[sym]);
+
+                dist_sym = symbol_decode(p_inf, p_inf->dist_counts, p_inf->dist_symbols);
+                if ((dist_sym < 0) || (dist_sym >= 30)) {
+                    p_inf->state = STATE_ERROR;
+                    return -1;
+                }
+                p_inf->match_dist = m_dist_base[dist_sym] + bits_get(p_inf, m_dist_extra[dist_sym]);
+
+                // Reaching back further than the window means the page was packed with a bigger one.
+                if ((p_inf->state == STATE_ERROR) ||
+                    (p_inf->match_dist > p_inf->out_pos) ||
+                    (p_inf->match_dist > FAT_INFLATE_WINDOW_SIZE)) {
+                    p_inf->match_len = 0;
+                    p_inf->state     = STATE_ERROR;
+                    return -1;
+                }
+                break;
+            }
+
+            default:
+                return -1;
+        }
+    }
+}
+
+void fat_inflate_init(fat_inflate_t * p_inf, uint8_t const * p_src, uint32_t src_len)
+{
+    p_inf->p_src       = p_src;
+    p_inf->src_len     = src_len;
+    p_inf->src_pos     = 0;
+    p_inf->bit_buf     = 0;
+    p_inf->bit_cnt     = 0;
+    p_inf->state       = STATE_HEADER;
+    p_inf->final       = false;
+    p_inf->stored_left = 0;
+    p_inf->match_len   = 0;
+    p_inf->match_dist  = 0;
+    p_inf->out_pos     = 0;
+}
+
+/**@brief Copies inflated bytes [offset, offset + len) to p_dest.
+ *
+ * @details Reads that carry on where the last one stopped, or go back by no more than the window,
+ *          cost only the bytes they return.  Going back further starts over from the beginning
+ *          of the stream, skipping forward decodes and drops the bytes in between.
+ *
+ * @return Number of bytes copied, less than len at the end of the page or on a corrupt stream.
+ */
+uint32_t fat_inflate_read(fat_inflate_t * p_inf, uint32_t offset, uint8_t * p_dest, uint32_t len)
+{
+    uint32_t done = 0;
+
+    if (offset + FAT_INFLATE_WINDOW_SIZE < p_inf->out_pos) {
+        fat_inflate_init(p_inf, p_inf->p_src, p_inf->src_len);
+    }
+
+    // Bytes still in the window.
+    while ((done < len) && (offset + done < p_inf->out_pos))
+    {
+        p_dest[done] = p_inf->window[(offset + done) & WINDOW_MASK];
+        done++;
+    }
+
+    while (done < len)
+    {
+        int32_t byte = byte_next(p_inf);
+
+        if (byte < 0) {
+            break;
+        }
+        if (p_inf->out_pos > offset) {
+            p_dest[done++] = byte;
+        }
+    }
+    return done;
+}
+
+/**@brief Inflates the whole stream to find its length and check that it decodes.
+ *
+ * @details Leaves p_inf rewound to the start of the stream.
+ *
+ * @return Inflated length in bytes, 0 if the stream is corrupt.
+ */
+uint32_t fat_inflate_length(fat_inflate_t * p_inf)
+{
+    uint32_t len;
+
+    fat_inflate_init(p_inf, p_inf->p_src, p_inf->src_len);
+    while (byte_next(p_inf) >= 0)
+    {
+    }
+    len = (p_inf->state == STATE_DONE) ? p_inf->out_pos : 0;
+
+    fat_inflate_init(p_inf, p_inf->p_src, p_inf->src_len);
+    return len;
+}
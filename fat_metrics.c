@@ -0,0 +1,286 @@
+/*****************************************************************************
+*
+* fat_metrics.c
+*
+* This keeps transfer analytics across resets: connections, completed and
+* abandoned transfers, bytes served, transfer time and a histogram of chunks
+* per transfer.  They are written to flash as a log of small records, at
+* most every FAT_METRICS_SAVE_INTERVAL_MS, so a page is erased only after
+* some eighty saves.
+*
+* Copyright (c) 2016 Matt Roche
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+********************************************************************************/
+
+
+
+
+#include "fat_metrics.h"
+#include <string.h>
+#include "nordic_common.h"
+#include "app_util.h"
+#include "app_timer.h"
+#include "fstorage.h"
+#include "crc16.h"
+#include "ble_fat.h"
+#include "fat_store.h"
+#include "SEGGER_RTT.h"
+
+#define TIMER_PRESCALER     0                                     /**< Same as APP_TIMER_PRESCALER in main.c. */
+#define RECORDS_PER_PAGE    (FS_PAGE_SIZE / sizeof(fat_metrics_record_t))
+#define NO_TRANSFER         UINT32_MAX                            /**< m_transfer_start of a link that isn't transferring. */
+#define TICKS_PER_SAVE      (FAT_METRICS_SAVE_INTERVAL_MS / FAT_METRICS_TIMER_MS)
+
+STATIC_ASSERT(sizeof(fat_metrics_record_t) % sizeof(uint32_t) == 0);
+
+static void fs_evt_handler(uint8_t op_code, uint32_t result, uint32_t const * p_data, fs_length_t length_words);
+
+/**< Flash pages for the record log.  page_order 1 puts them below the page slots of fat_store,
+ *   which stay at the address tools/fatpack.py flashes to. */
+FS_SECTION_VARS_ADD(fs_config_t m_metrics_fs_config) =
+{
+    .cb         = fs_evt_handler,
+    .num_pages  = FAT_METRICS_PAGES,
+    .page_order = 1,
+};
+
+APP_TIMER_DEF(m_save_timer);
+
+static fat_metrics_t        m_metrics;
+static uint8_t              m_save_ticks;                         /**< Save timer expiries since the last save attempt. */
+static bool                 m_dirty;                              /**< m_metrics changed since the last record was written. */
+static bool                 m_saving;                             /**< m_record is with fstorage. */
+static uint8_t              m_page;                               /**< Page records are appended to. */
+static uint16_t             m_next;                               /**< Slot of the next record in m_page, RECORDS_PER_PAGE when it is full. */
+static fat_metrics_record_t m_record;                             /**< Record being written, fstorage reads it when the write runs. */
+static uint32_t             m_transfer_start[BLE_FAT_MAX_LINKS];  /**< app_timer ticks when each link's transfer began. */
+
+
+static fat_metrics_record_t const * record_get(uint8_t page, uint16_t slot)
+{
+    return (fat_metrics_record_t const *) (m_metrics_fs_config.p_start_addr + page * FS_PAGE_SIZE_WORDS) + slot;
+}
+
+static uint16_t record_crc(fat_metrics_record_t const * p_record)
+{
+    return crc16_compute((uint8_t const *) &p_record->seq, sizeof(p_record->seq) + sizeof(p_record->metrics), NULL);
+}
+
+static void record_store(void)
+{
+    fs_ret_t ret = fs_store(&m_metrics_fs_config, (uint32_t const *) record_get(m_page, m_next),
+                            (uint32_t const *) &m_record, sizeof(m_record) / sizeof(uint32_t));
+
+    if (ret != FS_SUCCESS) {
+        SEGGER_RTT_printf(0, "Metrics store Error %d\n", ret);
+        m_saving = false;
+        m_dirty  = true;
+    }
+}
+
+/**@brief fstorage callback, finishes a save.
+ */
+static void fs_evt_handler(uint8_t op_code, uint32_t result, uint32_t const * p_data, fs_length_t length_words)
+{
+    if (result != NRF_SUCCESS) {
+        SEGGER_RTT_printf(0, "Metrics flash Error %d\n", result);
+        m_saving = false;
+        m_dirty  = true;                // Tried again at the next interval.
+        if (op_code == FS_OP_ERASE) {
+            m_page ^= 1;                // The latest record is still on the page we came from.
+            m_next  = RECORDS_PER_PAGE;
+        }
+        return;
+    }
+
+    if (op_code == FS_OP_ERASE) {
+        record_store();
+        return;
+    }
+    m_next++;
+    m_saving = false;
+}
+
+static void save_timeout_handler(void * p_context)
+{
+    UNUSED_PARAMETER(p_context);
+    if (++m_save_ticks >= TICKS_PER_SAVE) {
+        m_save_ticks = 0;
+        fat_metrics_save();
+    }
+}
+
+/**@brief Function for loading the latest record and finding where the next one goes.
+ *
+ * @details Call after fat_store_init(), which starts fstorage.
+ */
+uint32_t fat_metrics_init(void)
+{
+    uint32_t                     err_code;
+    fat_metrics_record_t const * p_latest = NULL;
+    uint16_t                     used[FAT_METRICS_PAGES];
+
+    for (uint8_t page = 0; page < FAT_METRICS_PAGES; page++)
+    {
+        used[page] = 0;
+        for (uint16_t slot = 0; slot < RECORDS_PER_PAGE; slot++)
+        {
+            fat_metrics_record_t const * p_record = record_get(page, slot);
+
+            if (p_record->magic == 0xFFFFFFFF) {
+                continue;
+            }
+            used[page] = slot + 1;          // Past anything written, even a torn record.
+            if ((p_record->magic == FAT_METRICS_MAGIC) && (record_crc(p_record) == p_record->crc) &&
+                ((p_latest == NULL) || (p_record->seq > p_latest->seq))) {
+                p_latest = p_record;
+                m_page   = page;
+            }
+        }
+    }
+    m_next = used[m_page];
+
+    if (p_latest != NULL) {
+        m_metrics    = p_latest->metrics;
+        m_record.seq = p_latest->seq;
+    }
+    memset(m_transfer_start, 0xFF, sizeof(m_transfer_start));
+    SEGGER_RTT_printf(0, "Metrics: %d connections, %d pages served\n", m_metrics.connections, m_metrics.completed);
+
+    err_code = app_timer_create(&m_save_timer, APP_TIMER_MODE_REPEATED, save_timeout_handler);
+    if (err_code != NRF_SUCCESS) {
+        return err_code;
+    }
+    return app_timer_start(m_save_timer, APP_TIMER_TICKS(FAT_METRICS_TIMER_MS, TIMER_PRESCALER), NULL);
+}
+
+void fat_metrics_connected(void)
+{
+    m_metrics.connections++;
+    m_dirty = true;
+}
+
+/**@brief Function for noting when a link's transfer started, for its duration. */
+void fat_metrics_transfer_begin(uint8_t link)
+{
+    (void) app_timer_cnt_get(&m_transfer_start[link]);
+}
+
+/**@brief Function for counting a transfer that has ended.
+ *
+ * @param[in] link      Link index in ble_fat_t.
+ * @param[in] completed true if the whole page was delivered, false if the client left part way.
+ * @param[in] bytes     Page bytes delivered, counted for completed transfers only.
+ * @param[in] chunks    Reads or notifications the transfer took.
+ */
+void fat_metrics_transfer_end(uint8_t link, bool completed, uint32_t bytes, uint16_t chunks)
+{
+    uint32_t now;
+    uint32_t ticks = 0;
+    uint8_t  bin   = 0;
+
+    if (!completed) {
+        m_metrics.abandoned++;
+    } else {
+        if (m_transfer_start[link] != NO_TRANSFER) {
+            (void) app_timer_cnt_get(&now);
+            (void) app_timer_cnt_diff_compute(now, m_transfer_start[link], &ticks);
+        }
+        while ((chunks > 1) && (bin < FAT_METRICS_HIST_BINS - 1))
+        {
+            chunks >>= 1;
+            bin++;
+        }
+        m_metrics.completed++;
+        m_metrics.bytes_served += bytes;
+        m_metrics.transfer_ms  += (uint32_t) (((uint64_t) ticks * 1000) / APP_TIMER_CLOCK_FREQ);
+        if (m_metrics.chunk_hist[bin] < UINT16_MAX) {
+            m_metrics.chunk_hist[bin]++;
+        }
+    }
+    m_transfer_start[link] = NO_TRANSFER;
+    m_dirty = true;
+}
+
+/**@brief Function for encoding the metrics characteristic value.
+ *
+ * @param[out] p_data   FAT_METRICS_VALUE_LEN bytes.
+ *
+ * @return Length of the value.
+ */
+uint16_t fat_metrics_encode(uint8_t * p_data)
+{
+    uint16_t len = 0;
+
+    p_data[len++] = FAT_METRICS_VERSION;
+    len += uint32_encode(m_metrics.connections, &p_data[len]);
+    len += uint32_encode(m_metrics.completed, &p_data[len]);
+    len += uint32_encode(m_metrics.abandoned, &p_data[len]);
+    len += uint32_encode(m_metrics.bytes_served, &p_data[len]);
+    len += uint32_encode((m_metrics.completed > 0) ? (m_metrics.transfer_ms / m_metrics.completed) : 0, &p_data[len]);
+    for (uint8_t i = 0; i < FAT_METRICS_HIST_BINS; i++)
+    {
+        len += uint16_encode(m_metrics.chunk_hist[i], &p_data[len]);
+    }
+    return len;
+}
+
+/**@brief Function for writing the counters to flash if they changed.
+ *
+ * @details Called every FAT_METRICS_SAVE_INTERVAL_MS.  It leaves the flash to an upload in
+ *          progress, whose staging blocks may fill the fstorage queue, and tries again next time.
+ *          When the page is full the other one is erased and the log carries on there.
+ */
+void fat_metrics_save(void)
+{
+    fs_ret_t ret;
+
+    if (!m_dirty || m_saving || fat_store_busy()) {
+        return;
+    }
+
+    m_record.magic    = FAT_METRICS_MAGIC;
+    m_record.seq++;
+    m_record.metrics  = m_metrics;
+    m_record.crc      = record_crc(&m_record);
+    m_record.reserved = 0xFFFF;
+    m_dirty  = false;
+    m_saving = true;
+
+    if (m_next < RECORDS_PER_PAGE) {
+        record_store();
+        return;
+    }
+
+    m_page ^= 1;
+    m_next  = 0;
+    ret = fs_erase(&m_metrics_fs_config, (uint32_t *) record_get(m_page, 0), 1);
+    if (ret != FS_SUCCESS) {
+        SEGGER_RTT_printf(0, "Metrics erase Error %d\n", ret);
+        m_page  ^= 1;
+        m_next   = RECORDS_PER_PAGE;
+        m_saving = false;
+        m_dirty  = true;
+    }
+}
@@ -0,0 +1,119 @@
+/*****************************************************************************
+*
+* fat_sensor.c
+*
+* This keeps the last reading of the tag's sensors.  They are only sampled
+* when something needs a value and the cached one is older than the caller
+* allows: a client connecting to a template page, or the TLM frame going
+* out.  Nothing polls them in between, so they draw nothing while idle.
+*
+* Copyright (c) 2016 Matt Roche
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+********************************************************************************/
+
+
+
+
+
+#include "fat_sensor.h"
+#include <stdbool.h>
+#include "app_util_platform.h"
+#include "fat_tlm.h"
+#include "SEGGER_RTT.h"
+
+static fat_sensor_data_t    m_data;                               /**< Last reading. */
+static bool                 m_valid;                              /**< m_data holds a reading. */
+static uint32_t             m_taken_s;                            /**< Uptime when it was taken. */
+static bool                 m_ready;                              /**< The hardware came up. */
+
+uint32_t fat_sensor_init(void)
+{
+    uint32_t err_code = fat_sensor_hw_init();
+
+    m_ready = (err_code == NRF_SUCCESS);
+    return err_code;
+}
+
+/**@brief Function for getting a reading no older than the caller allows, from the main loop.
+ *
+ * @details Samples the hardware only when the cached reading is too old.  A sample blocks for
+ *          the whole bus transfer, so interrupts use fat_sensor_last_get() instead.
+ *
+ * @param[in]  max_age_s Oldest reading the caller accepts, in seconds.
+ * @param[out] p_data    The reading.
+ *
+ * @return NRF_SUCCESS if p_data was filled in, NRF_ERROR_INVALID_STATE if there has never been
+ *         a reading or the hardware didn't come up, or the error of the sample that failed.
+ */
+uint32_t fat_sensor_get(uint32_t max_age_s, fat_sensor_data_t * p_data)
+{
+    uint32_t          err_code = NRF_SUCCESS;
+    uint32_t          now      = fat_tlm_uptime_get();
+    fat_sensor_data_t data;
+
+    if (!m_ready) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+
+    if (!m_valid || (now - m_taken_s > max_age_s)) {
+        err_code = fat_sensor_hw_sample(&data);
+        if (err_code == NRF_SUCCESS) {
+            // Copied in one go, an interrupt may be in fat_sensor_last_get().
+            CRITICAL_REGION_ENTER();
+            m_data    = data;
+            m_taken_s = now;
+            m_valid   = true;
+            CRITICAL_REGION_EXIT();
+        } else {
+            SEGGER_RTT_printf(0, "Sensor Error %d\n", err_code);
+        }
+    }
+
+    if (!m_valid) {
+        return (err_code != NRF_SUCCESS) ? err_code : NRF_ERROR_INVALID_STATE;
+    }
+    return fat_sensor_last_get(p_data);
+}
+
+/**@brief Function for getting the last reading, however old, without sampling.
+ *
+ * @details Safe from interrupts, it never touches the hardware.
+ *
+ * @param[out] p_data    The reading.
+ *
+ * @return NRF_SUCCESS if p_data was filled in, NRF_ERROR_INVALID_STATE if there has never been
+ *         a reading.
+ */
+uint32_t fat_sensor_last_get(fat_sensor_data_t * p_data)
+{
+    uint32_t err_code = NRF_ERROR_INVALID_STATE;
+
+    CRITICAL_REGION_ENTER();
+    if (m_valid) {
+        *p_data  = m_data;
+        err_code = NRF_SUCCESS;
+    }
+    CRITICAL_REGION_EXIT();
+    return err_code;
+}
@@ -0,0 +1,308 @@
+/*****************************************************************************
+*
+* fat_sensor_ruuvi.c
+*
+* This drives the RuuviTag's sensors for fat_sensor: the Bosch BME280
+* (temperature, humidity, pressure) and the ST LIS2DH12 accelerometer, both
+* on SPI0.  Both sit powered down between samples.  A sample wakes the
+* accelerometer and starts one BME280 forced measurement, waits for both
+* and puts the accelerometer back to sleep.
+*
+* Copyright (c) 2016 Matt Roche
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+********************************************************************************/
+
+
+
+
+
+#include "fat_sensor.h"
+#include <string.h>
+#include "nordic_common.h"
+#include "app_util.h"
+#include "boards.h"
+#include "nrf_drv_spi.h"
+#include "nrf_gpio.h"
+#include "nrf_delay.h"
+
+#define SPI_READ                0x80                              /**< Register address flag of a read, both parts. */
+#define ACC_AUTO_INC            0x40                              /**< LIS2DH12 register address flag, step through registers. */
+
+#define BME280_REG_CALIB_00     0x88                              /**< T1 to P9 and H1, 26 bytes. */
+#define BME280_REG_ID           0xD0
+#define BME280_REG_CALIB_26     0xE1                              /**< H2 to H6, 7 bytes. */
+#define BME280_REG_CTRL_HUM     0xF2
+#define BME280_REG_STATUS       0xF3
+#define BME280_REG_CTRL_MEAS    0xF4
+#define BME280_REG_CONFIG       0xF5
+#define BME280_REG_DATA         0xF7                              /**< Pressure, temperature, humidity, 8 bytes. */
+#define BME280_ID               0x60
+#define BME280_STATUS_MEASURING 0x08
+#define BME280_OSRS_X1          0x01                              /**< One reading per value, about 9 ms for all three. */
+#define BME280_MODE_FORCED      0x01                              /**< One measurement, then back to sleep by itself. */
+
+#define ACC_REG_WHO_AM_I        0x0F
+#define ACC_REG_CTRL_REG1       0x20
+#define ACC_REG_CTRL_REG4       0x23
+#define ACC_REG_STATUS          0x27
+#define ACC_REG_OUT_X_L         0x28                              /**< X, Y, Z, low byte first, 6 bytes. */
+#define ACC_WHO_AM_I            0x33
+#define ACC_CTRL_REG1_200HZ     0x67                              /**< 200 Hz, normal mode, X, Y and Z on.  First reading after 5 ms. */
+#define ACC_CTRL_REG1_OFF       0x00                              /**< Power down. */
+#define ACC_CTRL_REG4_BDU       0x80                              /**< Don't update a reading half way through its read. */
+#define ACC_STATUS_ZYXDA        0x08
+#define ACC_MG_PER_DIGIT        4                                 /**< +-2 g, 10 bit normal mode. */
+
+#define SAMPLE_TIMEOUT_MS       20                                /**< Longer than either part takes, in case one has gone. */
+
+/**@brief BME280 trimming parameters, as named in the data sheet. */
+typedef struct
+{
+    uint16_t dig_T1;
+    int16_t  dig_T2, dig_T3;
+    uint16_t dig_P1;
+    int16_t  dig_P2, dig_P3, dig_P4, dig_P5, dig_P6, dig_P7, dig_P8, dig_P9;
+    uint8_t  dig_H1, dig_H3;
+    int16_t  dig_H2, dig_H4, dig_H5;
+    int8_t   dig_H6;
+} bme280_calib_t;
+
+static const nrf_drv_spi_t  m_spi = NRF_DRV_SPI_INSTANCE(0);
+static bme280_calib_t       m_calib;
+
+/**@brief Function for reading registers of one part, CS held low across the transfer.
+ *
+ * @param[in]  cs_pin   Chip select of the part.
+ * @param[in]  reg      First register, with the part's read flags.
+ * @param[out] p_data   Register contents.
+ * @param[in]  len      Number of registers, at most 32.
+ */
+static uint32_t reg_read(uint8_t cs_pin, uint8_t reg, uint8_t * p_data, uint8_t len)
+{
+    uint32_t err_code;
+    uint8_t  rx[33];
+
+    nrf_gpio_pin_clear(cs_pin);
+    err_code = nrf_drv_spi_transfer(&m_spi, &reg, 1, rx, len + 1);   // rx[0] was clocked in with the address.
+    nrf_gpio_pin_set(cs_pin);
+
+    memcpy(p_data, &rx[1], len);
+    return err_code;
+}
+
+static uint32_t reg_write(uint8_t cs_pin, uint8_t reg, uint8_t value)
+{
+    uint32_t err_code;
+    uint8_t  tx[2] = { reg & ~SPI_READ, value };
+
+    nrf_gpio_pin_clear(cs_pin);
+    err_code = nrf_drv_spi_transfer(&m_spi, tx, sizeof(tx), NULL, 0);
+    nrf_gpio_pin_set(cs_pin);
+    return err_code;
+}
+
+/**@brief Function for reading the BME280's trimming parameters, once at start up. */
+static uint32_t bme280_calib_read(void)
+{
+    uint32_t err_code;
+    uint8_t  c[26];
+    uint8_t  h[7];
+
+    err_code = reg_read(SPIM0_SS_BME280_PIN, BME280_REG_CALIB_00 | SPI_READ, c, sizeof(c));
+    if (err_code == NRF_SUCCESS) {
+        err_code = reg_read(SPIM0_SS_BME280_PIN, BME280_REG_CALIB_26 | SPI_READ, h, sizeof(h));
+    }
+    if (err_code != NRF_SUCCESS) {
+        return err_code;
+    }
+
+    m_calib.dig_T1 = uint16_decode(&c[0]);
+    m_calib.dig_T2 = (int16_t) uint16_decode(&c[2]);
+    m_calib.dig_T3 = (int16_t) uint16_decode(&c[4]);
+    m_calib.dig_P1 = uint16_decode(&c[6]);
+    m_calib.dig_P2 = (int16_t) uint16_decode(&c[8]);
+    m_calib.dig_P3 = (int16_t) uint16_decode(&c[10]);
+    m_calib.dig_P4 = (int16_t) uint16_decode(&c[12]);
+    m_calib.dig_P5 = (int16_t) uint16_decode(&c[14]);
+    m_calib.dig_P6 = (int16_t) uint16_decode(&c[16]);
+    m_calib.dig_P7 = (int16_t) uint16_decode(&c[18]);
+    m_calib.dig_P8 = (int16_t) uint16_decode(&c[20]);
+    m_calib.dig_P9 = (int16_t) uint16_decode(&c[22]);
+    m_calib.dig_H1 = c[25];
+    m_calib.dig_H2 = (int16_t) uint16_decode(&h[0]);
+    m_calib.dig_H3 = h[2];
+    m_calib.dig_H4 = (int16_t) (((int8_t) h[3] << 4) | (h[4] & 0x0F));
+    m_calib.dig_H5 = (int16_t) (((int8_t) h[5] << 4) | (h[4] >> 4));
+    m_calib.dig_H6 = (int8_t) h[6];
+    return NRF_SUCCESS;
+}
+
+/**@brief Function for turning raw BME280 readings into units, with the data sheet's integer
+ *        compensation formulas.
+ */
+static void bme280_compensate(int32_t adc_T, int32_t adc_P, int32_t adc_H, fat_sensor_data_t * p_data)
+{
+    int32_t t_fine;
+    int32_t v1;
+    int32_t v2;
+    int64_t p1;
+    int64_t p2;
+    int64_t p;
+    int32_t h;
+
+    v1 = ((((adc_T >> 3) - ((int32_t) m_calib.dig_T1 << 1))) * ((int32_t) m_calib.dig_T2)) >> 11;
+    v2 = (((((adc_T >> 4) - ((int32_t) m_calib.dig_T1)) * ((adc_T >> 4) - ((int32_t) m_calib.dig_T1))) >> 12) *
+          ((int32_t) m_calib.dig_T3)) >> 14;
+    t_fine = v1 + v2;
+    p_data->temp = (t_fine * 5 + 128) >> 8;
+
+    p1 = ((int64_t) t_fine) - 128000;
+    p2 = p1 * p1 * (int64_t) m_calib.dig_P6;
+    p2 = p2 + ((p1 * (int64_t) m_calib.dig_P5) << 17);
+    p2 = p2 + (((int64_t) m_calib.dig_P4) << 35);
+    p1 = ((p1 * p1 * (int64_t) m_calib.dig_P3) >> 8) + ((p1 * (int64_t) m_calib.dig_P2) << 12);
+    p1 = (((((int64_t) 1) << 47) + p1)) * ((int64_t) m_calib.dig_P1) >> 33;
+    if (p1 == 0) {
+        p_data->pressure = 0;                                     // Avoids a division by zero, as the data sheet does.
+    } else {
+        p = 1048576 - adc_P;
+        p = (((p << 31) - p2) * 3125) / p1;
+        p1 = (((int64_t) m_calib.dig_P9) * (p >> 13) * (p >> 13)) >> 25;
+        p2 = (((int64_t) m_calib.dig_P8) * p) >> 19;
+        p  = ((p + p1 + p2) >> 8) + (((int64_t) m_calib.dig_P7) << 4);
+        p_data->pressure = (uint32_t) (p >> 8);                   // Q24.8 Pa.
+    }
+
+    h = t_fine - ((int32_t) 76800);
+    h = (((((adc_H << 14) - (((int32_t) m_calib.dig_H4) << 20) - (((int32_t) m_calib.dig_H5) * h)) +
+           ((int32_t) 16384)) >> 15) *
+         (((((((h * ((int32_t) m_calib.dig_H6)) >> 10) * (((h * ((int32_t) m_calib.dig_H3)) >> 11) +
+             ((int32_t) 32768))) >> 10) + ((int32_t) 2097152)) * ((int32_t) m_calib.dig_H2) + 8192) >> 14));
+    h = (h - (((((h >> 15) * (h >> 15)) >> 7) * ((int32_t) m_calib.dig_H1)) >> 4));
+    h = (h < 0) ? 0 : h;
+    h = (h > 419430400) ? 419430400 : h;
+    p_data->humidity = (((uint32_t) h >> 12) * 100) >> 10;        // Q22.10 %, to 0.01 %.
+}
+
+uint32_t fat_sensor_hw_init(void)
+{
+    uint32_t             err_code;
+    uint8_t              id;
+    nrf_drv_spi_config_t config = NRF_DRV_SPI_DEFAULT_CONFIG(0);
+
+    // Chip selects are driven here, one bus serves both parts.
+    nrf_gpio_cfg_output(SPIM0_SS_BME280_PIN);
+    nrf_gpio_pin_set(SPIM0_SS_BME280_PIN);
+    nrf_gpio_cfg_output(SPIM0_SS_ACC_PIN);
+    nrf_gpio_pin_set(SPIM0_SS_ACC_PIN);
+
+    config.ss_pin   = NRF_DRV_SPI_PIN_NOT_USED;
+    config.sck_pin  = SPIM0_SCK_PIN;
+    config.mosi_pin = SPIM0_MOSI_PIN;
+    config.miso_pin = SPIM0_MISO_PIN;
+    err_code = nrf_drv_spi_init(&m_spi, &config, NULL);           // No handler, transfers block.
+    if (err_code != NRF_SUCCESS) {
+        return err_code;
+    }
+
+    err_code = reg_read(SPIM0_SS_BME280_PIN, BME280_REG_ID | SPI_READ, &id, 1);
+    if ((err_code == NRF_SUCCESS) && (id != BME280_ID)) {
+        return NRF_ERROR_NOT_FOUND;
+    }
+    if (err_code == NRF_SUCCESS) {
+        err_code = bme280_calib_read();
+    }
+    if (err_code == NRF_SUCCESS) {
+        err_code = reg_write(SPIM0_SS_BME280_PIN, BME280_REG_CONFIG, 0);           // No filter.
+    }
+    if (err_code == NRF_SUCCESS) {
+        err_code = reg_read(SPIM0_SS_ACC_PIN, ACC_REG_WHO_AM_I | SPI_READ, &id, 1);
+    }
+    if ((err_code == NRF_SUCCESS) && (id != ACC_WHO_AM_I)) {
+        return NRF_ERROR_NOT_FOUND;
+    }
+    if (err_code == NRF_SUCCESS) {
+        err_code = reg_write(SPIM0_SS_ACC_PIN, ACC_REG_CTRL_REG4, ACC_CTRL_REG4_BDU);
+    }
+    if (err_code == NRF_SUCCESS) {
+        err_code = reg_write(SPIM0_SS_ACC_PIN, ACC_REG_CTRL_REG1, ACC_CTRL_REG1_OFF);
+    }
+    return err_code;
+}
+
+uint32_t fat_sensor_hw_sample(fat_sensor_data_t * p_data)
+{
+    uint32_t err_code;
+    uint8_t  status = BME280_STATUS_MEASURING;
+    uint8_t  acc_status = 0;
+    uint8_t  raw[8];
+    uint8_t  acc[6];
+
+    // Both parts start together, the accelerometer is ready well before the BME280.
+    err_code = reg_write(SPIM0_SS_ACC_PIN, ACC_REG_CTRL_REG1, ACC_CTRL_REG1_200HZ);
+    if (err_code == NRF_SUCCESS) {
+        err_code = reg_write(SPIM0_SS_BME280_PIN, BME280_REG_CTRL_HUM, BME280_OSRS_X1);
+    }
+    if (err_code == NRF_SUCCESS) {
+        err_code = reg_write(SPIM0_SS_BME280_PIN, BME280_REG_CTRL_MEAS,
+                             (BME280_OSRS_X1 << 5) | (BME280_OSRS_X1 << 2) | BME280_MODE_FORCED);
+    }
+
+    for (uint8_t ms = 0; (err_code == NRF_SUCCESS) && (ms < SAMPLE_TIMEOUT_MS); ms++)
+    {
+        nrf_delay_ms(1);
+        err_code = reg_read(SPIM0_SS_BME280_PIN, BME280_REG_STATUS | SPI_READ, &status, 1);
+        if (err_code == NRF_SUCCESS) {
+            err_code = reg_read(SPIM0_SS_ACC_PIN, ACC_REG_STATUS | SPI_READ, &acc_status, 1);
+        }
+        if (!(status & BME280_STATUS_MEASURING) && (acc_status & ACC_STATUS_ZYXDA)) {
+            break;
+        }
+    }
+    if ((err_code == NRF_SUCCESS) && ((status & BME280_STATUS_MEASURING) || !(acc_status & ACC_STATUS_ZYXDA))) {
+        err_code = NRF_ERROR_TIMEOUT;
+    }
+
+    if (err_code == NRF_SUCCESS) {
+        err_code = reg_read(SPIM0_SS_BME280_PIN, BME280_REG_DATA | SPI_READ, raw, sizeof(raw));
+    }
+    if (err_code == NRF_SUCCESS) {
+        err_code = reg_read(SPIM0_SS_ACC_PIN, ACC_REG_OUT_X_L | SPI_READ | ACC_AUTO_INC, acc, sizeof(acc));
+    }
+    (void) reg_write(SPIM0_SS_ACC_PIN, ACC_REG_CTRL_REG1, ACC_CTRL_REG1_OFF);   // Asleep again whatever happened.
+    if (err_code != NRF_SUCCESS) {
+        return err_code;
+    }
+
+    bme280_compensate(((int32_t) raw[3] << 12) | ((int32_t) raw[4] << 4) | (raw[5] >> 4),
+                      ((int32_t) raw[0] << 12) | ((int32_t) raw[1] << 4) | (raw[2] >> 4),
+                      ((int32_t) raw[6] << 8) | raw[7],
+                      p_data);
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        // Left justified 10 bit readings.
+        p_data->accel[i] = (int16_t) ((((int16_t) uint16_decode(&acc[2 * i])) >> 6) * ACC_MG_PER_DIGIT);
+    }
+    return NRF_SUCCESS;
+}
@@ -0,0 +1,400 @@
+/*****************************************************************************
+*
+* fat_store.c
+*
+* This holds the flash partition the fatbeacon page is served from.
+* The partition is split into two slots.  The valid slot with the highest
+* sequence number is served, the other one receives uploads, so an upload
+* never touches the page that is live.  A valid image replaces the
+* compiled-in STATIC_PAGE.
+*
+* Copyright (c) 2016 Matt Roche
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+********************************************************************************/
+
+
+#include "fat_store.h"
+#include <string.h>
+#include "nordic_common.h"
+#include "fstorage.h"
+#include "crc16.h"
+#include "SEGGER_RTT.h"
+
+#define SLOT_WORDS          (FAT_STORE_SLOT_PAGES * FAT_STORE_PAGE_SIZE / sizeof(uint32_t))
+#define NO_SLOT             (-1)
+
+typedef enum
+{
+    UPLOAD_IDLE,                                                  /**< No upload running. */
+    UPLOAD_ERASING,                                               /**< Waiting for the inactive slot to be erased. */
+    UPLOAD_RECEIVING,                                             /**< Accepting page data. */
+    UPLOAD_FLUSHING,                                              /**< Commit requested, waiting for staged data to reach flash. */
+    UPLOAD_SEALING,                                               /**< Data verified, waiting for the header write. */
+} upload_state_t;
+
+static void fs_evt_handler(uint8_t op_code, uint32_t result, uint32_t const * p_data, fs_length_t length_words);
+
+/**< Flash pages reserved for both slots.  fs_init() fills in the addresses. */
+FS_SECTION_VARS_ADD(fs_config_t m_fs_config) =
+{
+    .cb        = fs_evt_handler,
+    .num_pages = FAT_STORE_NUM_PAGES,
+};
+
+static fat_store_evt_handler_t m_evt_handler;
+static int8_t                  m_active_slot = NO_SLOT;           /**< Slot currently served, NO_SLOT if neither is valid. */
+static uint32_t                m_active_seq;                      /**< Sequence number of the active slot. */
+
+static upload_state_t          m_state = UPLOAD_IDLE;
+static int8_t                  m_upload_slot;                     /**< Slot being written. */
+static fat_store_header_t      m_upload_header;                   /**< Header sealed onto the slot once the data checks out. */
+static uint32_t                m_upload_pos;                      /**< Bytes accepted so far, the next offset expected from the client. */
+
+// Staging blocks.  Data is copied here and written in the background, fstorage keeps a pointer
+// to each block until its write completes.
+static uint32_t                m_buf[FAT_STORE_BUF_COUNT][FAT_STORE_BUF_SIZE / sizeof(uint32_t)];
+static uint8_t                 m_buf_tail;                        /**< Oldest block still being written. */
+static uint8_t                 m_buf_busy;                        /**< Blocks handed to fstorage and not yet written. */
+static uint16_t                m_buf_fill;                        /**< Bytes in the block being filled. */
+static uint8_t                 m_ops_pending;                     /**< Flash operations queued in fstorage, including those of an aborted upload. */
+
+
+static fat_store_header_t const * slot_header(int8_t slot)
+{
+    return (fat_store_header_t const *) (m_fs_config.p_start_addr + slot * SLOT_WORDS);
+}
+
+/**@brief Checks that an image header describes a complete, intact page.
+ *
+ * @param[in] p_header  Header at the start of a slot.
+ *
+ * @return true if the page behind the header can be served.
+ */
+static bool image_is_valid(fat_store_header_t const * p_header)
+{
+    uint16_t crc;
+
+    if (p_header->magic != FAT_STORE_MAGIC) {
+        return false;               // Erased or never sealed.
+    }
+
+    if ((p_header->length == 0) || (p_header->length > FAT_STORE_MAX_PAGE_LEN)) {
+        return false;
+    }
+
+    if (p_header->encoding > FAT_ENCODING_TEMPLATE) {
+        return false;               // Nothing here can decode it.
+    }
+
+    crc = crc16_compute((uint8_t const *) (p_header + 1), p_header->length, NULL);
+
+    return (crc == p_header->crc);
+}
+
+static void upload_fail(uint32_t err_code)
+{
+    SEGGER_RTT_printf(0, "Fat store upload Error %d\n", err_code);
+    m_state = UPLOAD_IDLE;
+    m_evt_handler(FAT_STORE_EVT_ERROR, m_upload_pos);
+}
+
+/**@brief Hands the block being filled to fstorage and moves on to the next one.
+ */
+static uint32_t block_flush(void)
+{
+    uint8_t    idx   = (m_buf_tail + m_buf_busy) % FAT_STORE_BUF_COUNT;
+    uint32_t   words = (m_buf_fill + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+    uint32_t   block_start = m_upload_pos - m_buf_fill;
+    fs_ret_t   ret;
+
+    // Pad the tail of a short final block with the erased value.
+    memset((uint8_t *) m_buf[idx] + m_buf_fill, 0xFF, words * sizeof(uint32_t) - m_buf_fill);
+
+    ret = fs_store(&m_fs_config,
+                   (uint32_t const *) (slot_header(m_upload_slot) + 1) + block_start / sizeof(uint32_t),
+                   m_buf[idx],
+                   words);
+    if (ret != FS_SUCCESS) {
+        return NRF_ERROR_INTERNAL;
+    }
+    m_ops_pending++;
+
+    m_buf_busy++;
+    m_buf_fill = 0;
+    return NRF_SUCCESS;
+}
+
+/**@brief Verifies the uploaded data in flash and writes the header that makes the slot live.
+ */
+static void upload_seal(void)
+{
+    fat_store_header_t const * p_slot = slot_header(m_upload_slot);
+    uint16_t                   crc    = crc16_compute((uint8_t const *) (p_slot + 1), m_upload_header.length, NULL);
+    fs_ret_t                   ret;
+
+    if (crc != m_upload_header.crc) {
+        upload_fail(NRF_ERROR_INVALID_DATA);
+        return;
+    }
+
+    m_state = UPLOAD_SEALING;
+    ret = fs_store(&m_fs_config, (uint32_t const *) p_slot, (uint32_t const *) &m_upload_header,
+                   sizeof(m_upload_header) / sizeof(uint32_t));
+    if (ret != FS_SUCCESS) {
+        upload_fail(NRF_ERROR_INTERNAL);
+        return;
+    }
+    m_ops_pending++;
+}
+
+/**@brief fstorage callback, drives the upload state machine.
+ */
+static void fs_evt_handler(uint8_t op_code, uint32_t result, uint32_t const * p_data, fs_length_t length_words)
+{
+    m_ops_pending--;
+
+    if (m_state == UPLOAD_IDLE) {
+        return;                     // Aborted, ignore what was still in flight.
+    }
+
+    if (result != NRF_SUCCESS) {
+        upload_fail(result);
+        return;
+    }
+
+    if (op_code == FS_OP_ERASE) {
+        m_state = UPLOAD_RECEIVING;
+        m_evt_handler(FAT_STORE_EVT_READY, 0);
+        return;
+    }
+
+    if (p_data == (uint32_t const *) &m_upload_header) {
+        // The header is the last write, the new page is live from here on.
+        m_active_slot = m_upload_slot;
+        m_active_seq  = m_upload_header.seq;
+        m_state       = UPLOAD_IDLE;
+        m_evt_handler(FAT_STORE_EVT_COMMITTED, m_upload_header.length);
+        return;
+    }
+
+    m_buf_tail = (m_buf_tail + 1) % FAT_STORE_BUF_COUNT;
+    m_buf_busy--;
+
+    if ((m_state == UPLOAD_FLUSHING) && (m_buf_busy == 0)) {
+        upload_seal();
+    }
+}
+
+uint32_t fat_store_init(fat_store_evt_handler_t evt_handler)
+{
+    fs_ret_t ret = fs_init();
+
+    if (ret != FS_SUCCESS) {
+        SEGGER_RTT_printf(0, "Fat store init Error %d\n", ret);
+        return NRF_ERROR_INTERNAL;
+    }
+
+    m_evt_handler = evt_handler;
+    m_active_slot = NO_SLOT;
+
+    for (int8_t slot = 0; slot < FAT_STORE_SLOT_COUNT; slot++)
+    {
+        fat_store_header_t const * p_header = slot_header(slot);
+
+        if (image_is_valid(p_header) && ((m_active_slot == NO_SLOT) || (p_header->seq > m_active_seq)))
+        {
+            m_active_slot = slot;
+            m_active_seq  = p_header->seq;
+        }
+    }
+
+    SEGGER_RTT_printf(0, "Fat store at 0x%x, active slot %d\n", m_fs_config.p_start_addr, m_active_slot);
+    return NRF_SUCCESS;
+}
+
+uint32_t fat_store_page_get(uint8_t const ** pp_data, uint16_t * p_len, uint16_t * p_version, uint8_t * p_encoding)
+{
+    fat_store_header_t const * p_header;
+
+    if (m_active_slot == NO_SLOT) {
+        return NRF_ERROR_NOT_FOUND;
+    }
+    p_header = slot_header(m_active_slot);
+
+    // Serve straight out of flash, nothing is copied to RAM.
+    *pp_data   = (uint8_t const *) (p_header + 1);
+    *p_len     = (uint16_t) p_header->length;
+    *p_version = p_header->version;
+    *p_encoding = p_header->encoding;
+
+    return NRF_SUCCESS;
+}
+
+uint32_t fat_store_upload_begin(uint32_t length, uint16_t crc, uint16_t version, uint8_t encoding)
+{
+    fs_ret_t ret;
+
+    if ((length == 0) || (length > FAT_STORE_MAX_PAGE_LEN)) {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+    if (encoding > FAT_ENCODING_TEMPLATE) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    if (m_ops_pending > 0) {
+        return NRF_ERROR_BUSY;      // Flash operations of the last attempt are still queued.
+    }
+
+    m_upload_slot = (m_active_slot == 0) ? 1 : 0;
+
+    memset(&m_upload_header, 0xFF, sizeof(m_upload_header));
+    m_upload_header.magic   = FAT_STORE_MAGIC;
+    m_upload_header.version = version;
+    m_upload_header.crc     = crc;
+    m_upload_header.length  = length;
+    m_upload_header.seq     = (m_active_slot == NO_SLOT) ? 0 : m_active_seq + 1;
+    m_upload_header.encoding = encoding;
+
+    m_upload_pos = 0;
+    m_buf_tail   = 0;
+    m_buf_busy   = 0;
+    m_buf_fill   = 0;
+
+    ret = fs_erase(&m_fs_config, (uint32_t *) slot_header(m_upload_slot), FAT_STORE_SLOT_PAGES);
+    if (ret != FS_SUCCESS) {
+        return NRF_ERROR_INTERNAL;
+    }
+    m_ops_pending++;
+
+    m_state = UPLOAD_ERASING;
+    return NRF_SUCCESS;
+}
+
+uint32_t fat_store_upload_write(uint32_t offset, uint8_t const * p_data, uint16_t len)
+{
+    uint32_t err_code;
+
+    if (m_state != UPLOAD_RECEIVING) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    if (offset != m_upload_pos) {
+        return NRF_ERROR_INVALID_PARAM;     // Lost or repeated packet, client resends from m_upload_pos.
+    }
+    if (len > m_upload_header.length - m_upload_pos) {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+
+    if (len > (FAT_STORE_BUF_COUNT - m_buf_busy) * FAT_STORE_BUF_SIZE - m_buf_fill) {
+        return NRF_ERROR_BUSY;              // Flash is behind, client resends from m_upload_pos.
+    }
+
+    while (len > 0)
+    {
+        uint8_t  idx;
+        uint16_t copy;
+
+        idx  = (m_buf_tail + m_buf_busy) % FAT_STORE_BUF_COUNT;
+        copy = MIN(len, FAT_STORE_BUF_SIZE - m_buf_fill);
+
+        memcpy((uint8_t *) m_buf[idx] + m_buf_fill, p_data, copy);
+        m_buf_fill   += copy;
+        m_upload_pos += copy;
+        p_data       += copy;
+        len          -= copy;
+
+        if (m_buf_fill == FAT_STORE_BUF_SIZE) {
+            err_code = block_flush();
+            if (err_code != NRF_SUCCESS) {
+                m_state = UPLOAD_IDLE;
+                return err_code;
+            }
+        }
+    }
+
+    return NRF_SUCCESS;
+}
+
+uint32_t fat_store_upload_commit(void)
+{
+    uint32_t err_code;
+
+    if (m_state != UPLOAD_RECEIVING) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    if (m_upload_pos != m_upload_header.length) {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+
+    m_state = UPLOAD_FLUSHING;
+
+    if (m_buf_fill > 0) {
+        if (m_buf_busy == FAT_STORE_BUF_COUNT) {
+            m_state = UPLOAD_RECEIVING;
+            return NRF_ERROR_BUSY;
+        }
+        err_code = block_flush();
+        if (err_code != NRF_SUCCESS) {
+            m_state = UPLOAD_IDLE;
+            return err_code;
+        }
+    }
+
+    if (m_buf_busy == 0) {
+        upload_seal();
+    }
+    return NRF_SUCCESS;
+}
+
+/**@brief Drops the running upload, the live page stays as it is.
+ *
+ * @details Too late once the upload is sealing: the header write is already with fstorage and
+ *          will make the slot live on the next boot whatever happens here, so it is left to
+ *          finish and end in FAT_STORE_EVT_COMMITTED, serving the new page now as well.
+ */
+void fat_store_upload_abort(void)
+{
+    if (m_state != UPLOAD_SEALING) {
+        m_state = UPLOAD_IDLE;
+    }
+}
+
+uint32_t fat_store_upload_pos(void)
+{
+    return m_upload_pos;
+}
+
+/**@brief Returns the slot the next upload will erase and write, FAT_STORE_SLOT_PAGES long. */
+uint8_t const * fat_store_upload_slot_get(void)
+{
+    return (uint8_t const *) slot_header((m_active_slot == 0) ? 1 : 0);
+}
+
+/**@brief Tells whether an upload is using the flash, or still has operations queued.
+ *
+ * @details Other fstorage users wait while this is true, so the upload's staging blocks always
+ *          find room in the fstorage queue.
+ */
+bool fat_store_busy(void)
+{
+    return (m_state != UPLOAD_IDLE) || (m_ops_pending > 0);
+}
@@ -0,0 +1,210 @@
+/*****************************************************************************
+*
+* fat_tlm.c
+*
+* This keeps the telemetry sent in the Eddystone-TLM frame: battery voltage
+* from the SAADC, die temperature, uptime and advertising PDUs, plus the
+* fatbeacon's own counters, connections served and bytes delivered.
+* The sensors are only read when a TLM frame is about to go out.
+*
+* Copyright (c) 2016 Matt Roche
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+********************************************************************************/
+
+
+
+
+#include "fat_tlm.h"
+#include <stdbool.h>
+#include <string.h>
+#include "nordic_common.h"
+#include "app_util.h"
+#include "app_util_platform.h"
+#include "app_timer.h"
+#include "nrf_soc.h"
+#include "nrf_drv_saadc.h"
+#include "SEGGER_RTT.h"
+
+#define TIMER_CLOCK_HZ      APP_TIMER_CLOCK_FREQ                  /**< app_timer ticks per second, prescaler 0 as in main.c. */
+#define SAADC_FULL_SCALE_MV 3600                                  /**< VDD through the default 1/6 gain and 0.6 V reference. */
+#define SAADC_MAX_VALUE     1024                                  /**< 10 bit resolution, see nrf_drv_config.h. */
+
+static uint32_t             m_adv_pdus;                           /**< Advertising PDUs sent since power up. */
+static uint32_t             m_conns_served;                       /**< Connections the whole page was delivered on. */
+static uint32_t             m_bytes_delivered;                    /**< Page bytes those connections were sent. */
+static uint64_t             m_uptime_ticks;                       /**< app_timer ticks since power up. */
+static uint32_t             m_last_ticks;                         /**< RTC counter when m_uptime_ticks was last brought up to date. */
+static uint16_t             m_battery_mv;                         /**< Supply voltage measured for the last TLM frame. */
+
+/**@brief Function for adding the time since the last call to the uptime.
+ *
+ * @details The RTC counter is 24 bits and wraps after 512 s, so this has to run more often than
+ *          that.  fat_adv calls in at the end of every advertising slot, which is a few seconds.
+ *          fat_tlm_uptime_get() may read the two from an interrupt, so they change together.
+ */
+static void uptime_update(void)
+{
+    uint32_t ticks;
+    uint32_t diff;
+
+    CRITICAL_REGION_ENTER();
+    (void) app_timer_cnt_get(&ticks);
+    (void) app_timer_cnt_diff_compute(ticks, m_last_ticks, &diff);
+    m_uptime_ticks += diff;
+    m_last_ticks    = ticks;
+    CRITICAL_REGION_EXIT();
+}
+
+static void saadc_event_handler(nrf_drv_saadc_evt_t const * p_event)
+{
+    UNUSED_PARAMETER(p_event);                                    // Only blocking conversions are used.
+}
+
+/**@brief Function for measuring the supply voltage.
+ *
+ * @details The SAADC is only enabled for the one conversion, so it draws nothing in between.
+ *
+ * @return Supply voltage in mV, 0 if it could not be measured.
+ */
+static uint16_t battery_mv_get(void)
+{
+    uint32_t                   err_code;
+    nrf_saadc_value_t          value = 0;
+    nrf_saadc_channel_config_t channel = NRF_DRV_SAADC_DEFAULT_CHANNEL_CONFIG_SE(NRF_SAADC_INPUT_VDD);
+
+    err_code = nrf_drv_saadc_init(NULL, saadc_event_handler);
+    if (err_code == NRF_SUCCESS) {
+        err_code = nrf_drv_saadc_channel_init(0, &channel);
+    }
+    if (err_code == NRF_SUCCESS) {
+        err_code = nrf_drv_saadc_sample_convert(0, &value);
+    }
+    nrf_drv_saadc_uninit();
+
+    if ((err_code != NRF_SUCCESS) || (value < 0)) {
+        SEGGER_RTT_printf(0, "Battery Error %d\n", err_code);
+        return 0;
+    }
+    return (uint16_t) (((uint32_t) value * SAADC_FULL_SCALE_MV) / SAADC_MAX_VALUE);
+}
+
+/**@brief Function for counting advertising PDUs, called by fat_adv as each slot ends. */
+void fat_tlm_adv_pdus_add(uint32_t pdus)
+{
+    m_adv_pdus += pdus;
+    uptime_update();
+}
+
+/**@brief Function for counting a connection the whole page was delivered on.
+ *
+ * @param[in] bytes     Bytes of page data the connection was sent.
+ */
+void fat_tlm_page_served(uint32_t bytes)
+{
+    m_conns_served++;
+    m_bytes_delivered += bytes;
+}
+
+/**@brief Function for getting the time since power up, from any context.
+ *
+ * @return Uptime in seconds.
+ */
+uint32_t fat_tlm_uptime_get(void)
+{
+    uint32_t ticks;
+    uint32_t diff;
+
+    (void) app_timer_cnt_get(&ticks);
+    (void) app_timer_cnt_diff_compute(ticks, m_last_ticks, &diff);
+    return (uint32_t) ((m_uptime_ticks + diff) / TIMER_CLOCK_HZ);
+}
+
+/**@brief Function for getting the connections the whole page was delivered on since power up. */
+uint32_t fat_tlm_served_get(void)
+{
+    return m_conns_served;
+}
+
+/**@brief Function for getting the supply voltage sent in the last TLM frame.
+ *
+ * @details The SAADC is only used from the main loop, this is for callers that can't wait for it.
+ *
+ * @return Supply voltage in mV, 0 before the first TLM frame.
+ */
+uint16_t fat_tlm_battery_mv_get(void)
+{
+    return m_battery_mv;
+}
+
+/**@brief Function for writing the current telemetry.
+ *
+ * @details Called by fat_adv each time the TLM frame comes round, straight into the encoded
+ *          advertising data, so the frame doesn't have to be encoded again.
+ *
+ * @param[out] p_tlm    FAT_TLM_DATA_LEN bytes, the Eddystone service data after the UUID.
+ * @param[out] p_stats  FAT_TLM_STATS_LEN bytes, the manufacturer data after the company ID.
+ */
+void fat_tlm_encode(uint8_t * p_tlm, uint8_t * p_stats)
+{
+    int32_t  temp = 0;
+    uint16_t mv   = battery_mv_get();
+
+#if FAT_SENSOR_ENABLED
+    fat_sensor_data_t sensor;
+    bool              sensed = (fat_sensor_get(FAT_SENSOR_ADV_MAX_AGE_S, &sensor) == NRF_SUCCESS);
+
+    if (sensed) {
+        temp = (sensor.temp * 256) / 100;                         // 8.8 fixed point, from 0.01 degrees.
+    } else
+#endif
+    if (sd_temp_get(&temp) == NRF_SUCCESS) {
+        temp *= 64;                                               // 8.8 fixed point, from 0.25 degree steps.
+    } else {
+        temp = -128 * 256;                                        // 0x8000, not supported.
+    }
+    uptime_update();
+    m_battery_mv = mv;
+
+    p_tlm[0] = FAT_TLM_FRAME_TYPE;
+    p_tlm[1] = FAT_TLM_VERSION;
+    (void) uint16_big_encode(mv, &p_tlm[2]);
+    (void) uint16_big_encode((uint16_t) temp, &p_tlm[4]);
+    (void) uint32_big_encode(m_adv_pdus, &p_tlm[6]);
+    (void) uint32_big_encode((uint32_t) ((m_uptime_ticks * 10) / TIMER_CLOCK_HZ), &p_tlm[10]);   // 0.1 s steps.
+
+    (void) uint32_big_encode(m_conns_served, &p_stats[0]);
+    (void) uint32_big_encode(m_bytes_delivered, &p_stats[4]);
+#if FAT_SENSOR_ENABLED
+    if (sensed) {
+        (void) uint16_big_encode((uint16_t) sensor.humidity, &p_stats[8]);
+        (void) uint16_big_encode((uint16_t) (sensor.pressure - 50000), &p_stats[10]);
+        for (uint8_t i = 0; i < 3; i++)
+        {
+            (void) uint16_big_encode((uint16_t) sensor.accel[i], &p_stats[12 + 2 * i]);
+        }
+    } else {
+        memset(&p_stats[8], 0xFF, FAT_TLM_STATS_LEN - 8);         // No reading.
+    }
+#endif
+}
@@ -0,0 +1,187 @@
+/*****************************************************************************
+*
+* fat_tmpl.c
+*
+* This renders page templates for the fatbeacon characteristic.  A template
+* is literal text with fixed width placeholders for live values, compiled by
+* tools/fatpack.py with a map from each output offset to the text or value
+* that produces it.  Chunks are rendered as they are read, straight from the
+* template in flash, with values frozen when the client connected.
+*
+* Copyright (c) 2016 Matt Roche
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+********************************************************************************/
+
+
+
+
+
+#include "fat_tmpl.h"
+#include <string.h>
+#include "nordic_common.h"
+#include "app_util.h"
+
+#define SEG_OFFSET(p_tmpl, i)   uint16_decode(&(p_tmpl)[FAT_TMPL_HEADER_LEN + (i) * FAT_TMPL_SEG_LEN])
+#define SEG_SRC(p_tmpl, i)      uint16_decode(&(p_tmpl)[FAT_TMPL_HEADER_LEN + (i) * FAT_TMPL_SEG_LEN + 2])
+#define SEG_COUNT(p_tmpl)       uint16_decode(&(p_tmpl)[4])
+#define OUT_LEN(p_tmpl)         uint16_decode(&(p_tmpl)[6])
+
+
+/**@brief Function for finding where segment i of a template ends in the output. */
+static uint16_t seg_end(uint8_t const * p_tmpl, uint16_t i)
+{
+    return (i + 1 < SEG_COUNT(p_tmpl)) ? SEG_OFFSET(p_tmpl, i + 1) : OUT_LEN(p_tmpl);
+}
+
+/**@brief Function for checking a template before it is served.
+ *
+ * @details Every later read trusts the offset map, so it is walked once here: offsets rise from
+ *          0, every literal lies within the text and every placeholder names a known value.
+ *
+ * @param[in]  p_tmpl    Compiled template.
+ * @param[in]  len       Its length in bytes.
+ * @param[out] p_out_len Length of the page once rendered.
+ *
+ * @return NRF_SUCCESS, or NRF_ERROR_INVALID_DATA if the template is malformed.
+ */
+uint32_t fat_tmpl_check(uint8_t const * p_tmpl, uint32_t len, uint16_t * p_out_len)
+{
+    uint16_t count;
+    uint32_t text_len;
+
+    if ((len < FAT_TMPL_HEADER_LEN) || (uint32_decode(p_tmpl) != FAT_TMPL_MAGIC)) {
+        return NRF_ERROR_INVALID_DATA;
+    }
+    count = SEG_COUNT(p_tmpl);
+    if ((count == 0) || (OUT_LEN(p_tmpl) == 0) || (FAT_TMPL_HEADER_LEN + (uint32_t) count * FAT_TMPL_SEG_LEN > len)) {
+        return NRF_ERROR_INVALID_DATA;
+    }
+    text_len = len - FAT_TMPL_HEADER_LEN - (uint32_t) count * FAT_TMPL_SEG_LEN;
+
+    for (uint16_t i = 0; i < count; i++)
+    {
+        uint16_t start = SEG_OFFSET(p_tmpl, i);
+        uint16_t end   = seg_end(p_tmpl, i);
+        uint16_t src   = SEG_SRC(p_tmpl, i);
+
+        if (((i == 0) && (start != 0)) || (end <= start)) {
+            return NRF_ERROR_INVALID_DATA;
+        }
+        if (src & FAT_TMPL_SRC_VAR) {
+            if ((src & ~FAT_TMPL_SRC_VAR) >= FAT_TMPL_VAR_COUNT) {
+                return NRF_ERROR_INVALID_DATA;
+            }
+        } else if ((uint32_t) src + (end - start) > text_len) {
+            return NRF_ERROR_INVALID_DATA;
+        }
+    }
+
+    *p_out_len = OUT_LEN(p_tmpl);
+    return NRF_SUCCESS;
+}
+
+/**@brief Function for listing the values a checked template shows.
+ *
+ * @return Bit n set if fat_tmpl_var_t n has a placeholder, so only those need reading.
+ */
+uint32_t fat_tmpl_vars_get(uint8_t const * p_tmpl)
+{
+    uint32_t vars = 0;
+
+    for (uint16_t i = 0; i < SEG_COUNT(p_tmpl); i++)
+    {
+        uint16_t src = SEG_SRC(p_tmpl, i);
+
+        if (src & FAT_TMPL_SRC_VAR) {
+            vars |= 1UL << (src & ~FAT_TMPL_SRC_VAR);
+        }
+    }
+    return vars;
+}
+
+/**@brief Function for rendering part of a checked template.
+ *
+ * @details The segment holding offset is found by a binary search of the offset map, then
+ *          segments are copied out until len bytes are done.  Values are right aligned in their
+ *          placeholder, and one too long for it shows as '#' all the way across rather than as
+ *          a wrong number.
+ *
+ * @param[in]  p_tmpl    Compiled template.
+ * @param[in]  p_values  Values to show.
+ * @param[in]  offset    First byte of the rendered page wanted.
+ * @param[out] p_dest    Where the bytes go.
+ * @param[in]  len       Bytes wanted.
+ *
+ * @return Bytes rendered, less than len only at the end of the page.
+ */
+uint16_t fat_tmpl_read(uint8_t const * p_tmpl, fat_tmpl_values_t const * p_values, uint16_t offset,
+                       uint8_t * p_dest, uint16_t len)
+{
+    uint8_t const * p_text = p_tmpl + FAT_TMPL_HEADER_LEN + SEG_COUNT(p_tmpl) * FAT_TMPL_SEG_LEN;
+    uint16_t        lo     = 0;
+    uint16_t        hi     = SEG_COUNT(p_tmpl) - 1;
+    uint16_t        done   = 0;
+
+    if (offset >= OUT_LEN(p_tmpl)) {
+        return 0;
+    }
+    len = MIN(len, OUT_LEN(p_tmpl) - offset);
+
+    // Last segment starting at or before offset.
+    while (lo < hi)
+    {
+        uint16_t mid = (lo + hi + 1) / 2;
+
+        if (SEG_OFFSET(p_tmpl, mid) <= offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    for (uint16_t i = lo; done < len; i++)
+    {
+        uint16_t start = SEG_OFFSET(p_tmpl, i);
+        uint16_t pos   = offset + done - start;
+        uint16_t width = seg_end(p_tmpl, i) - start;
+        uint16_t n     = MIN(width - pos, len - done);
+        uint16_t src   = SEG_SRC(p_tmpl, i);
+
+        if (!(src & FAT_TMPL_SRC_VAR)) {
+            memcpy(&p_dest[done], &p_text[src + pos], n);
+        } else {
+            uint8_t  var   = src & ~FAT_TMPL_SRC_VAR;
+            uint8_t  v_len = p_values->len[var];
+            uint16_t pad   = (v_len <= width) ? width - v_len : 0;
+
+            for (uint16_t k = pos; k < pos + n; k++)
+            {
+                p_dest[done + k - pos] = (v_len > width) ? '#' :
+                                         (k < pad)       ? ' ' : p_values->text[var][k - pad];
+            }
+        }
+        done += n;
+    }
+    return len;
+}
@@ -0,0 +1,142 @@
+/*****************************************************************************
+*
+* fat_trace.c
+*
+* Binary event trace of the page path.
+* Fixed size records are written to a RAM ring from any interrupt level without
+* locking and drained to an RTT channel from the idle loop, see tools/fattrace.py.
+*
+* Copyright (c) 2016 Matt Roche
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+********************************************************************************/
+
+
+
+
+
+#include "fat_trace.h"
+
+#if FAT_TRACE_ENABLED
+
+#include <stdbool.h>
+#include "nordic_common.h"
+#include "app_timer.h"
+#include "SEGGER_RTT.h"
+
+#define RING_MASK           (FAT_TRACE_RECORDS - 1)
+
+STATIC_ASSERT(sizeof(fat_trace_rec_t) == 8);
+STATIC_ASSERT((FAT_TRACE_RECORDS & RING_MASK) == 0);
+
+static fat_trace_rec_t      m_ring[FAT_TRACE_RECORDS];
+static volatile uint32_t    m_head;                               /**< Records ever reserved, only moved by fat_trace_put(). */
+static uint32_t             m_tail;                               /**< Records ever drained, only moved by fat_trace_flush(). */
+static uint32_t             m_lost;                               /**< Overwritten records not yet reported. */
+static fat_trace_rec_t      m_held;                               /**< Record RTT had no room for, written first next time. */
+static bool                 m_holding;
+static uint8_t              m_rtt_buf[FAT_TRACE_RTT_BUF_SIZE];
+
+
+/**@brief Function for setting up the RTT channel and marking the start of the stream.
+ *
+ * @details Call after APP_TIMER_INIT(), the records are stamped with its RTC.
+ */
+void fat_trace_init(void)
+{
+    (void) SEGGER_RTT_ConfigUpBuffer(FAT_TRACE_RTT_CHANNEL, "FatTrace", m_rtt_buf, sizeof(m_rtt_buf),
+                                     SEGGER_RTT_MODE_NO_BLOCK_SKIP);
+    fat_trace_put(FAT_TRACE_EVT_START, FAT_TRACE_NO_CONN, FAT_TRACE_VERSION);
+}
+
+/**@brief Function for adding a record, from any context.
+ *
+ * @details Costs an atomic increment, a counter read and three stores, nothing is formatted.
+ *          A put that interrupts another gets the next slot, so their stamps can be out of order
+ *          by the length of the interrupt.
+ */
+void fat_trace_put(fat_trace_evt_t evt, uint16_t conn_handle, uint16_t arg)
+{
+    uint32_t          ticks;
+    fat_trace_rec_t * p_rec = &m_ring[__atomic_fetch_add(&m_head, 1, __ATOMIC_RELAXED) & RING_MASK];
+
+    (void) app_timer_cnt_get(&ticks);
+    p_rec->stamp       = (ticks & 0x00FFFFFF) | ((uint32_t) evt << 24);
+    p_rec->conn_handle = conn_handle;
+    p_rec->arg         = arg;
+}
+
+/**@brief Function for taking the oldest record off the ring.
+ *
+ * @details Runs in thread mode, below every put, so a reserved slot is always fully written by
+ *          the time it gets here.  A put can still overwrite the slot while it is being copied
+ *          if the ring has wrapped, that is checked for afterwards.
+ */
+static bool ring_get(fat_trace_rec_t * p_rec)
+{
+    for (;;)
+    {
+        uint32_t head = m_head;
+
+        if (head - m_tail > FAT_TRACE_RECORDS) {
+            m_lost += head - m_tail - FAT_TRACE_RECORDS;
+            m_tail  = head - FAT_TRACE_RECORDS;
+        }
+        if (m_lost > 0) {
+            p_rec->stamp       = ((uint32_t) FAT_TRACE_EVT_LOST << 24) | (m_ring[m_tail & RING_MASK].stamp & 0x00FFFFFF);
+            p_rec->conn_handle = FAT_TRACE_NO_CONN;
+            p_rec->arg         = (uint16_t) MIN(m_lost, UINT16_MAX);
+            m_lost            -= p_rec->arg;
+            return true;
+        }
+        if (head == m_tail) {
+            return false;
+        }
+
+        *p_rec = m_ring[m_tail & RING_MASK];
+        if (m_head - m_tail <= FAT_TRACE_RECORDS) {
+            m_tail++;
+            return true;
+        }
+        // Overwritten while copying, counted as lost on the next pass.
+    }
+}
+
+/**@brief Function for writing the records out to RTT.  Call from the idle loop.
+ *
+ * @details Stops when the RTT buffer is full, records wait in the ring until the debugger has
+ *          read some out.
+ */
+void fat_trace_flush(void)
+{
+    while (m_holding || ring_get(&m_held))
+    {
+        m_holding = true;
+        if (SEGGER_RTT_Write(FAT_TRACE_RTT_CHANNEL, &m_held, sizeof(m_held)) == 0) {
+            return;
+        }
+        m_holding = false;
+    }
+}
+
+#endif
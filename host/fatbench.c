@@ -0,0 +1,465 @@
+/*****************************************************************************
+*
+* fatbench.c
+*
+* Page delivery benchmark.  Runs the firmware on the host against a
+* modelled BLE link and reports, for every page and link configuration,
+* how long a client takes to get the page.  Results are JSON lines, one
+* per run, so they can be diffed and tracked over time.
+*
+* The link model works in connection events.  Each event carries up to
+* packets_per_event link layer packets from the peripheral, each one is
+* lost with probability loss and then resent in the next slot.  ATT
+* packets are split into 27 byte link layer payloads, as on S132 v2
+* without data length extension.  A request answered by the application
+* (authorized reads, MTU exchange, writes) is answered at the earliest in
+* the event after the one that carried it, and the client sends its next
+* request in the event after the answer arrives.
+*
+* Usage: fatbench [-i ms,..] [-m mtu,..] [-p n,..] [-l loss,..] [-s seed]
+*                 <identity image> <deflate image>
+*
+* Copyright (c) 2016 Matt Roche
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+********************************************************************************/
+
+
+#include "fatclient.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "nordic_common.h"
+#include "ble_fat.h"
+#include "fatbeacon.h"
+
+#define CONN                        0x10
+#define LL_PAYLOAD                  27                            /**< Link layer payload without data length extension. */
+#define L2CAP_HDR_LEN               4
+#define LIST_MAX                    8
+#define EVENT_LIMIT                 1000000                       /**< Gives up on a run that makes no progress. */
+
+/**@brief Link configuration of one run. */
+typedef struct
+{
+    uint32_t                        interval_us;                  /**< Connection interval. */
+    uint16_t                        att_mtu;                      /**< MTU the client asks for, 23 skips the exchange. */
+    uint8_t                         packets_per_event;            /**< Peripheral link layer packets per connection event. */
+    double                          loss;                         /**< Probability of a link layer packet being lost. */
+} link_model_t;
+
+/**@brief Page served in a run and how the client asks for it. */
+typedef enum
+{
+    PAGE_STATIC,                                                  /**< Built in STATIC_PAGE. */
+    PAGE_PACKED,                                                  /**< Identity image in the content partition. */
+    PAGE_DEFLATE,                                                 /**< Deflate image, inflated by the device. */
+    PAGE_DEFLATE_STORED,                                          /**< Deflate image, client sets FAT_CTRL_OPT_DEFLATE. */
+    PAGE_COUNT
+} page_t;
+
+typedef enum
+{
+    TRANSFER_READ,                                                /**< Authorized reads in APP_FAT_READ_MODE. */
+    TRANSFER_NOTIFY,                                              /**< Notifications, see stream_fill(). */
+    TRANSFER_COUNT
+} transfer_t;
+
+typedef struct
+{
+    uint32_t                        bytes;                        /**< Page bytes received. */
+    uint32_t                        ttfb_events;                  /**< Events until the first page byte arrived. */
+    uint32_t                        total_events;                 /**< Events until the client knew the page was complete. */
+    uint32_t                        round_trips;                  /**< Requests the client had to wait for. */
+    uint32_t                        ll_packets;                   /**< Link layer packets sent, retransmissions included. */
+} result_t;
+
+static char const * const           m_page_names[PAGE_COUNT]         = { "static", "packed", "deflate", "deflate_stored" };
+static char const * const           m_transfer_names[TRANSFER_COUNT] = { "read", "notify" };
+
+static fat_image_t                  m_identity;
+static fat_image_t                  m_deflate;
+static fat_client_handles_t         m_handles;
+static uint8_t                      m_page[FAT_CLIENT_PAGE_MAX];
+
+static link_model_t                 m_link;
+static uint32_t                     m_rand_state;
+static uint32_t                     m_event;                      /**< Next event the client can send in. */
+static uint8_t                      m_slots;                      /**< Packets left in event m_event. */
+static result_t                     m_result;
+
+
+/*
+ * Link model
+ */
+
+static bool packet_lost(void)
+{
+    // xorshift32, so runs are repeatable for a given seed.
+    m_rand_state ^= m_rand_state << 13;
+    m_rand_state ^= m_rand_state >> 17;
+    m_rand_state ^= m_rand_state << 5;
+    return m_rand_state < (uint32_t) (m_link.loss * 4294967295.0);
+}
+
+static uint32_t ll_packets(uint16_t att_len)
+{
+    return (att_len + L2CAP_HDR_LEN + LL_PAYLOAD - 1) / LL_PAYLOAD;
+}
+
+static void event_next(void)
+{
+    m_event++;
+    m_slots = m_link.packets_per_event;
+}
+
+/**@brief Sends one ATT packet, starting in the current event.
+ *
+ * @return Event in which its last link layer packet got through.
+ */
+static uint32_t att_send(uint16_t att_len)
+{
+    uint32_t left = ll_packets(att_len);
+
+    while (left > 0)
+    {
+        if (m_slots == 0) {
+            event_next();
+        }
+        m_slots--;
+        m_result.ll_packets++;
+        if (!packet_lost()) {
+            left--;
+        }
+    }
+    return m_event;
+}
+
+/**@brief Carries a request to the device and the answer back.
+ *
+ * @details The answer goes out in the event after the request at the earliest, the client's
+ *          next request in the event after the answer.
+ */
+static void round_trip(uint16_t req_len, uint16_t rsp_len)
+{
+    (void) att_send(req_len);
+    event_next();
+    (void) att_send(rsp_len);
+    event_next();
+    m_result.round_trips++;
+}
+
+static void first_byte(uint32_t event)
+{
+    if ((m_result.bytes == 0) && (m_result.ttfb_events == 0)) {
+        m_result.ttfb_events = event;
+    }
+}
+
+
+/*
+ * Transfers
+ */
+
+static bool transfer_read(void)
+{
+    for (;;)
+    {
+        sim_rec_t reply;
+        uint32_t  event;
+
+        if (!sim_read(CONN, m_handles.fat.value_handle, (uint16_t) m_result.bytes, &reply) ||
+            (reply.gatt_status != BLE_GATT_STATUS_SUCCESS) ||
+            (m_result.bytes + reply.len > FAT_CLIENT_PAGE_MAX)) {
+            return false;
+        }
+
+        (void) att_send(3);                         // Read Request: opcode, handle.
+        event_next();
+        event = att_send(1 + reply.len);            // Read Response: opcode, value.
+        event_next();
+        m_result.round_trips++;
+
+        if (reply.len > 0) {
+            first_byte(event);
+        }
+        memcpy(m_page + m_result.bytes, reply.data, reply.len);
+        m_result.bytes += reply.len;
+
+        if (fat_client_read_done(CONN, reply.len)) {
+            m_result.total_events = event;
+            return true;
+        }
+        if (m_event > EVENT_LIMIT) {
+            return false;
+        }
+    }
+}
+
+/**@brief Streams the page, letting the firmware refill the TX queue after each event. */
+static bool transfer_notify(void)
+{
+    size_t   next    = sim_rec_count();
+    uint32_t pending = 0;                           // Link layer packets left of the notification at the head.
+
+    fat_client_cccd_write(CONN, m_handles.fat.cccd_handle, BLE_GATT_HVX_NOTIFICATION);
+    (void) att_send(5);                             // Write Request: opcode, handle, value.
+    event_next();
+    (void) att_send(1);                             // Write Response, notifications follow in the same event.
+    m_result.round_trips++;
+
+    while (m_event <= EVENT_LIMIT)
+    {
+        uint8_t done = 0;
+
+        // Send what the SoftDevice has queued, in order, until the event is full.
+        for (; next < sim_rec_count(); next++)
+        {
+            sim_rec_t const * p_rec = sim_rec_get(next);
+
+            if ((p_rec->type != SIM_REC_HVX) || (p_rec->handle != m_handles.fat.value_handle)) {
+                continue;
+            }
+            if (pending == 0) {
+                pending = ll_packets(3 + p_rec->len);
+            }
+            while ((pending > 0) && (m_slots > 0))
+            {
+                m_slots--;
+                m_result.ll_packets++;
+                if (!packet_lost()) {
+                    pending--;
+                }
+            }
+            if (pending > 0) {
+                break;                              // Event is full, carry on in the next one.
+            }
+
+            done++;
+            if (p_rec->len == 0) {
+                m_result.total_events = m_event;
+                return true;
+            }
+            first_byte(m_event);
+            if (m_result.bytes + p_rec->len > FAT_CLIENT_PAGE_MAX) {
+                return false;
+            }
+            memcpy(m_page + m_result.bytes, p_rec->data, p_rec->len);
+            m_result.bytes += p_rec->len;
+        }
+
+        if ((done == 0) && (pending == 0)) {
+            return false;                           // Nothing queued and nothing in flight, stalled.
+        }
+        sim_tx_complete(CONN, done);
+        event_next();
+    }
+    return false;
+}
+
+/**@brief Connects, sets the link up and fetches the page once.
+ *
+ * @return True if the page arrived intact.
+ */
+static bool run(page_t page, transfer_t transfer)
+{
+    uint8_t option[] = { FAT_CTRL_OP_OPTIONS, FAT_CTRL_OPT_DEFLATE };
+    uint8_t const * p_expected     = (uint8_t const *) STATIC_PAGE;
+    uint32_t        expected_len   = STATIC_PAGE_LEN;
+    bool            ok;
+
+    if (page == PAGE_PACKED) {
+        fat_slot_load(0, &m_identity);
+    } else if (page != PAGE_STATIC) {
+        fat_slot_load(0, &m_deflate);
+    }
+    if (page == PAGE_PACKED || page == PAGE_DEFLATE) {
+        p_expected   = fat_image_page(&m_identity);
+        expected_len = fat_image_page_len(&m_identity);
+    } else if (page == PAGE_DEFLATE_STORED) {
+        p_expected   = fat_image_page(&m_deflate);
+        expected_len = fat_image_page_len(&m_deflate);
+    }
+
+    fat_client_boot(&m_handles);
+    if (!sim_connect(CONN)) {
+        return false;
+    }
+
+    // Event 0 is the first one after the connection is made.
+    m_event = 0;
+    m_slots = m_link.packets_per_event;
+
+    if (m_link.att_mtu > GATT_MTU_SIZE_DEFAULT) {
+        sim_mtu_exchange(CONN, m_link.att_mtu);
+        round_trip(3, 3);
+    }
+    if (page == PAGE_DEFLATE_STORED) {
+        sim_write(CONN, m_handles.control.value_handle, option, sizeof(option));
+        round_trip(3 + sizeof(option), 1);
+    }
+
+    ok = (transfer == TRANSFER_READ) ? transfer_read() : transfer_notify();
+
+    return ok && (m_result.bytes == expected_len) && (memcmp(m_page, p_expected, expected_len) == 0) &&
+           (sim_stats()->errors == 0);
+}
+
+static void result_print(page_t page, transfer_t transfer, bool ok)
+{
+    double interval_ms = m_link.interval_us / 1000.0;
+
+    printf("{\"page\": \"%s\", \"read_mode\": \"%s\", \"transfer\": \"%s\", "
+           "\"interval_ms\": %.2f, \"att_mtu\": %u, \"packets_per_event\": %u, \"loss\": %.3f, "
+           "\"ok\": %s, \"bytes\": %u, \"ttfb_ms\": %.2f, \"total_ms\": %.2f, "
+           "\"round_trips\": %u, \"ll_packets\": %u}\n",
+           m_page_names[page], (APP_FAT_READ_MODE == BLE_FAT_READ_MODE_CURSOR) ? "cursor" : "offset",
+           m_transfer_names[transfer],
+           interval_ms, sim_att_mtu(CONN), m_link.packets_per_event, m_link.loss,
+           ok ? "true" : "false", m_result.bytes,
+           m_result.ttfb_events * interval_ms, m_result.total_events * interval_ms,
+           m_result.round_trips, m_result.ll_packets);
+}
+
+
+/*
+ * Driver
+ */
+
+/**@brief Parses a comma separated list of numbers.
+ *
+ * @return Number of values, 0 if the list is malformed.
+ */
+static uint32_t list_parse(char * p_arg, double * p_values)
+{
+    uint32_t count = 0;
+
+    for (char * p_tok = strtok(p_arg, ","); p_tok != NULL; p_tok = strtok(NULL, ","))
+    {
+        char * p_end;
+
+        if (count == LIST_MAX) {
+            return 0;
+        }
+        p_values[count] = strtod(p_tok, &p_end);
+        if ((*p_end != '\0') || (p_values[count] < 0)) {
+            return 0;
+        }
+        count++;
+    }
+    return count;
+}
+
+int main(int argc, char ** argv)
+{
+    double   intervals[LIST_MAX] = { 7.5, 30, 60 };
+    double   mtus[LIST_MAX]      = { GATT_MTU_SIZE_DEFAULT, FAT_ATT_MTU_MAX };
+    double   ppes[LIST_MAX]      = { 1, 4 };
+    double   losses[LIST_MAX]    = { 0, 0.05 };
+    uint32_t n_intervals         = 3;
+    uint32_t n_mtus              = 2;
+    uint32_t n_ppes              = 2;
+    uint32_t n_losses            = 2;
+    uint32_t seed                = 1;
+    uint32_t failed              = 0;
+    int      opt;
+
+    while ((opt = getopt(argc, argv, "i:m:p:l:s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'i': n_intervals = list_parse(optarg, intervals); break;
+            case 'm': n_mtus      = list_parse(optarg, mtus);      break;
+            case 'p': n_ppes      = list_parse(optarg, ppes);      break;
+            case 'l': n_losses    = list_parse(optarg, losses);    break;
+            case 's': seed        = strtoul(optarg, NULL, 0);      break;
+            default:  n_intervals = 0;                             break;
+        }
+    }
+
+    for (uint32_t i = 0; i < n_mtus; i++)
+    {
+        if ((mtus[i] < GATT_MTU_SIZE_DEFAULT) || (mtus[i] > FAT_ATT_MTU_MAX)) {
+            n_mtus = 0;
+        }
+    }
+    for (uint32_t i = 0; i < n_ppes; i++)
+    {
+        if ((ppes[i] < 1) || (ppes[i] > 255)) {
+            n_ppes = 0;
+        }
+    }
+    for (uint32_t i = 0; i < n_losses; i++)
+    {
+        if (losses[i] >= 1) {
+            n_losses = 0;
+        }
+    }
+
+    if ((n_intervals == 0) || (n_mtus == 0) || (n_ppes == 0) || (n_losses == 0) || (argc - optind != 2) ||
+        !fat_image_load(argv[optind], &m_identity) || !fat_image_load(argv[optind + 1], &m_deflate)) {
+        fprintf(stderr, "usage: %s [-i ms,..] [-m mtu,..] [-p n,..] [-l loss,..] [-s seed] "
+                        "<identity image> <deflate image>\n", argv[0]);
+        return 2;
+    }
+
+    for (uint32_t page = 0; page < PAGE_COUNT; page++)
+    for (uint32_t transfer = 0; transfer < TRANSFER_COUNT; transfer++)
+    for (uint32_t i = 0; i < n_intervals; i++)
+    for (uint32_t m = 0; m < n_mtus; m++)
+    for (uint32_t p = 0; p < n_ppes; p++)
+    for (uint32_t l = 0; l < n_losses; l++)
+    {
+        int   status;
+        pid_t pid;
+
+        m_link.interval_us       = (uint32_t) (intervals[i] * 1000);
+        m_link.att_mtu           = (uint16_t) mtus[m];
+        m_link.packets_per_event = (uint8_t) ppes[p];
+        m_link.loss              = losses[l];
+
+        // Each run gets a freshly booted firmware in its own process.
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0) {
+            bool ok;
+
+            m_rand_state = (seed == 0) ? 1 : seed;
+            ok = run((page_t) page, (transfer_t) transfer);
+            result_print((page_t) page, (transfer_t) transfer, ok);
+            fflush(stdout);
+            _exit(ok ? 0 : 1);
+        }
+        (void) waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+            failed++;
+        }
+    }
+
+    if (failed > 0) {
+        fprintf(stderr, "fatbench: %u runs did not deliver the page\n", failed);
+    }
+    return (failed == 0) ? 0 : 1;
+}
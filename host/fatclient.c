@@ -0,0 +1,119 @@
+/*****************************************************************************
+*
+* fatclient.c
+*
+* Client side helpers shared by the host programs: loading content
+* images, placing them in the simulated content partition and the bits
+* of the fatbeacon read protocol every client needs.
+*
+* Copyright (c) 2016 Matt Roche
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+********************************************************************************/
+
+
+#include "fatclient.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ble_srv_common.h"
+#include "ble_fat.h"
+#include "fatbeacon.h"
+
+
+bool fat_image_load(char const * p_path, fat_image_t * p_image)
+{
+    FILE * p_file = fopen(p_path, "rb");
+
+    if (p_file == NULL) {
+        perror(p_path);
+        return false;
+    }
+    p_image->p_data = malloc(sizeof(fat_store_header_t) + FAT_CLIENT_PAGE_MAX);
+    p_image->len    = fread(p_image->p_data, 1, sizeof(fat_store_header_t) + FAT_CLIENT_PAGE_MAX, p_file);
+    fclose(p_file);
+
+    if (p_image->len <= sizeof(fat_store_header_t)) {
+        fprintf(stderr, "%s: not a content image\n", p_path);
+        return false;
+    }
+    return true;
+}
+
+uint8_t const * fat_image_page(fat_image_t const * p_image)
+{
+    return p_image->p_data + sizeof(fat_store_header_t);
+}
+
+uint32_t fat_image_page_len(fat_image_t const * p_image)
+{
+    return p_image->len - sizeof(fat_store_header_t);
+}
+
+/**@brief Finds a slot of the content partition in the simulated flash.
+ *
+ * @details fat_store is the only fstorage user, so fs_init() places its pages at the top of
+ *          the flash.
+ */
+uint8_t * fat_slot_get(uint8_t slot)
+{
+    uint8_t * p_store = (uint8_t *) sim_flash_base() + sim_flash_size() - FAT_STORE_NUM_PAGES * FAT_STORE_PAGE_SIZE;
+
+    return p_store + slot * FAT_STORE_SLOT_PAGES * FAT_STORE_PAGE_SIZE;
+}
+
+/**@brief Puts an image in a slot, as "make flash_page" would on the target.  Call before booting. */
+void fat_slot_load(uint8_t slot, fat_image_t const * p_image)
+{
+    memcpy(fat_slot_get(slot), p_image->p_data, p_image->len);
+}
+
+/**@brief Boots the firmware and looks up the fatbeacon service, as discovery would. */
+void fat_client_boot(fat_client_handles_t * p_handles)
+{
+    sim_boot();
+    (void) sim_char_find(BLE_UUID_FAT_URL_CHAR, &p_handles->fat);
+    (void) sim_char_find(BLE_UUID_FAT_UPLOAD_CHAR, &p_handles->upload);
+    (void) sim_char_find(BLE_UUID_FAT_CONTROL_CHAR, &p_handles->control);
+}
+
+void fat_client_cccd_write(uint16_t conn_handle, uint16_t cccd_handle, uint16_t value)
+{
+    uint8_t data[BLE_CCCD_VALUE_LEN];
+
+    (void) uint16_encode(value, data);
+    sim_write(conn_handle, cccd_handle, data, sizeof(data));
+}
+
+/**@brief Tells whether a read reply was the last one of the page.
+ *
+ * @details Cursor clients read until they get an empty reply, offset clients until a reply is
+ *          shorter than ATT_MTU - 1.
+ */
+bool fat_client_read_done(uint16_t conn_handle, uint16_t reply_len)
+{
+    if (APP_FAT_READ_MODE == BLE_FAT_READ_MODE_CURSOR) {
+        return reply_len == 0;
+    }
+    return reply_len < sim_att_mtu(conn_handle) - 1;
+}
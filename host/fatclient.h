@@ -0,0 +1,41 @@
+#ifndef FATCLIENT_H__
+#define FATCLIENT_H__
+
+/* Client side helpers shared by the host programs, see fatsim.h.
+ *
+ * They act as a central talking to the fatbeacon service over the simulated stack.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fatsim.h"
+#include "fat_store.h"
+
+#define FAT_CLIENT_PAGE_MAX         FAT_STORE_MAX_PAGE_LEN
+
+/**@brief Content image as written by tools/fatpack.py --image. */
+typedef struct
+{
+    uint8_t *                       p_data;
+    uint32_t                        len;                          /**< Whole image, header included. */
+} fat_image_t;
+
+/**@brief Attribute handles of the fatbeacon service. */
+typedef struct
+{
+    ble_gatts_char_handles_t        fat;
+    ble_gatts_char_handles_t        upload;
+    ble_gatts_char_handles_t        control;
+} fat_client_handles_t;
+
+bool            fat_image_load(char const * p_path, fat_image_t * p_image);
+uint8_t const * fat_image_page(fat_image_t const * p_image);
+uint32_t        fat_image_page_len(fat_image_t const * p_image);
+void            fat_slot_load(uint8_t slot, fat_image_t const * p_image);
+uint8_t *       fat_slot_get(uint8_t slot);
+
+void            fat_client_boot(fat_client_handles_t * p_handles);
+void            fat_client_cccd_write(uint16_t conn_handle, uint16_t cccd_handle, uint16_t value);
+bool            fat_client_read_done(uint16_t conn_handle, uint16_t reply_len);
+
+#endif
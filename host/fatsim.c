@@ -0,0 +1,1908 @@
+/*****************************************************************************
+*
+* fatsim.c
+*
+* Runs the fatbeacon firmware on the host against the SoftDevice stand-in
+* and checks what clients get back.  Each scenario boots a fresh copy
+* of the firmware in a child process, plays one or more centrals
+* against it and compares the reassembled page with the packed source.
+*
+* Usage: fatsim [-v] <identity image> <deflate image> <template image>
+* The first two are tools/fatpack.py --image output of the same page, the
+* third a --template page with version 12.
+*
+* Copyright (c) 2016 Matt Roche
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+********************************************************************************/
+
+
+#include "fatclient.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "nordic_common.h"
+#include "ble_srv_common.h"
+#include "ble_fat.h"
+#include "crc16.h"
+#include "fatbeacon.h"
+#include "fat_adv.h"
+#include "fat_tlm.h"
+#include "fat_metrics.h"
+#include "fat_trace.h"
+#include "fat_store.h"
+#include "fat_tmpl.h"
+
+#define CONN_A                      0x10
+#define CONN_B                      0x11
+#define CONN_C                      0x12
+#define CONN_D                      0x13
+
+#define TEMPLATE_VERSION            12                            /**< Version host/Makefile packs the template page with. */
+
+typedef struct
+{
+    char const *                    name;
+    bool                            (*run)(void);
+} scenario_t;
+
+static fat_image_t                  m_identity;
+static fat_image_t                  m_deflate;
+static fat_image_t                  m_template;
+static fat_client_handles_t         m_handles;
+static uint8_t                      m_page[FAT_CLIENT_PAGE_MAX];
+static uint32_t                     m_flash_ops;
+static char                         m_note[128];                  /**< Printed after the scenario result. */
+static char const *                 m_trace_path;                 /**< -t: the trace scenario writes what it captured here. */
+
+
+/*
+ * Helpers
+ */
+
+static bool fail(char const * p_what)
+{
+    snprintf(m_note, sizeof(m_note), "%s", p_what);
+    return false;
+}
+
+/**@brief Reads one chunk the way a client of APP_FAT_READ_MODE does.
+ *
+ * @return Bytes received, or -1 if the read failed.
+ */
+static int32_t chunk_read(uint16_t conn_handle, uint32_t offset, uint8_t * p_dest)
+{
+    sim_rec_t reply;
+
+    if (!sim_read(conn_handle, m_handles.fat.value_handle, (uint16_t) offset, &reply) ||
+        (reply.gatt_status != BLE_GATT_STATUS_SUCCESS)) {
+        return -1;
+    }
+    memcpy(p_dest, reply.data, reply.len);
+    return reply.len;
+}
+
+/**@brief Reads the whole page with authorized reads.
+ *
+ * @details Cursor clients read until they get an empty reply, offset clients until a reply is
+ *          shorter than ATT_MTU - 1.
+ *
+ * @return Page length, or -1 if a read failed or the page overflowed p_dest.
+ */
+static int32_t page_read(uint16_t conn_handle, uint8_t * p_dest, uint32_t * p_reads)
+{
+    uint32_t len   = 0;
+    uint32_t reads = 0;
+
+    for (;;)
+    {
+        uint8_t chunk[SIM_MAX_DATA];
+        int32_t got = chunk_read(conn_handle, len, chunk);
+
+        reads++;
+        if ((got < 0) || (len + got > FAT_CLIENT_PAGE_MAX)) {
+            return -1;
+        }
+        memcpy(p_dest + len, chunk, got);
+        len += got;
+
+        if (fat_client_read_done(conn_handle, got)) {
+            break;
+        }
+    }
+    if (p_reads != NULL) {
+        *p_reads = reads;
+    }
+    return len;
+}
+
+/**@brief Collects a streamed page, releasing TX buffers as the link would.
+ *
+ * @return Page length, or -1 if the stream stalled before the empty terminator.
+ */
+static int32_t page_stream(uint16_t conn_handle, uint8_t * p_dest, uint32_t * p_notifications)
+{
+    size_t   next  = sim_rec_count();
+    uint32_t len   = 0;
+    uint32_t count = 0;
+
+    fat_client_cccd_write(conn_handle, m_handles.fat.cccd_handle, BLE_GATT_HVX_NOTIFICATION);
+
+    for (;;)
+    {
+        for (; next < sim_rec_count(); next++)
+        {
+            sim_rec_t const * p_rec = sim_rec_get(next);
+
+            if ((p_rec->type != SIM_REC_HVX) || (p_rec->conn_handle != conn_handle) ||
+                (p_rec->handle != m_handles.fat.value_handle)) {
+                continue;
+            }
+            count++;
+            if (p_rec->len == 0) {
+                if (p_notifications != NULL) {
+                    *p_notifications = count;
+                }
+                return len;
+            }
+            if (len + p_rec->len > FAT_CLIENT_PAGE_MAX) {
+                return -1;
+            }
+            memcpy(p_dest + len, p_rec->data, p_rec->len);
+            len += p_rec->len;
+        }
+        if (sim_tx_queued(conn_handle) == 0) {
+            return -1;
+        }
+        sim_tx_complete(conn_handle, sim_tx_queued(conn_handle));
+    }
+}
+
+static bool page_check(int32_t len, uint8_t const * p_expected, uint32_t expected_len)
+{
+    if (len < 0) {
+        return fail("transfer failed");
+    }
+    if (((uint32_t) len != expected_len) || (memcmp(m_page, p_expected, expected_len) != 0)) {
+        snprintf(m_note, sizeof(m_note), "page mismatch, got %d bytes, expected %u", len, expected_len);
+        return false;
+    }
+    return true;
+}
+
+/**@brief Finds the latest upload status notification sent to a connection since a record index.
+ *
+ * @return True if there was one.
+ */
+static bool upload_status_get(uint16_t conn_handle, size_t since, uint8_t * p_op, uint8_t * p_status, uint32_t * p_offset)
+{
+    bool found = false;
+
+    for (size_t i = since; i < sim_rec_count(); i++)
+    {
+        sim_rec_t const * p_rec = sim_rec_get(i);
+
+        if ((p_rec->type == SIM_REC_HVX) && (p_rec->conn_handle == conn_handle) &&
+            (p_rec->handle == m_handles.upload.value_handle) && (p_rec->len == FAT_UPLOAD_STATUS_LEN)) {
+            *p_op     = p_rec->data[0];
+            *p_status = p_rec->data[1];
+            *p_offset = uint32_decode(&p_rec->data[2]);
+            found     = true;
+        }
+    }
+    return found;
+}
+
+/**@brief Lets a connection interval go by: queued flash work finishes and notifications go out. */
+static void events_run(uint16_t conn_handle)
+{
+    m_flash_ops += sim_flash_run();
+    sim_tx_complete(conn_handle, sim_tx_queued(conn_handle));
+}
+
+/**@brief Starts an upload and sends all of its data the way a client following FAT_UPLOAD_OP_*
+ *        would, up to the commit.
+ *
+ * @details Data goes out as fast as the writes are accepted, the flash only catches up every
+ *          few packets, so the BUSY path is exercised as well.
+ */
+static bool upload_send(uint16_t conn_handle, uint8_t const * p_data, uint32_t len, uint16_t version, uint8_t encoding)
+{
+    uint8_t  packet[SIM_MAX_DATA];
+    uint16_t chunk  = sim_att_mtu(conn_handle) - 3 - 5;
+    uint32_t offset = 0;
+    uint32_t sent   = 0;
+    size_t   mark;
+    uint8_t  op;
+    uint8_t  status;
+    uint32_t pos;
+
+    fat_client_cccd_write(conn_handle, m_handles.upload.cccd_handle, BLE_GATT_HVX_NOTIFICATION);
+
+    mark      = sim_rec_count();
+    packet[0] = FAT_UPLOAD_OP_START;
+    (void) uint32_encode(len, &packet[1]);
+    (void) uint16_encode(crc16_compute(p_data, len, NULL), &packet[5]);
+    (void) uint16_encode(version, &packet[7]);
+    packet[9] = encoding;
+    sim_write(conn_handle, m_handles.upload.value_handle, packet, 10);
+    events_run(conn_handle);
+    if (!upload_status_get(conn_handle, mark, &op, &status, &pos) ||
+        (op != FAT_UPLOAD_OP_START) || (status != FAT_UPLOAD_STATUS_OK)) {
+        return fail("START not acknowledged");
+    }
+
+    while (offset < len)
+    {
+        uint16_t n = MIN(chunk, len - offset);
+
+        mark      = sim_rec_count();
+        packet[0] = FAT_UPLOAD_OP_DATA;
+        (void) uint32_encode(offset, &packet[1]);
+        memcpy(&packet[5], p_data + offset, n);
+        sim_write(conn_handle, m_handles.upload.value_handle, packet, 5 + n);
+
+        if (upload_status_get(conn_handle, mark, &op, &status, &pos)) {
+            if ((status != FAT_UPLOAD_STATUS_BUSY) && (status != FAT_UPLOAD_STATUS_OFFSET)) {
+                return fail("DATA rejected");
+            }
+            events_run(conn_handle);
+            offset = pos;
+        } else {
+            offset += n;
+        }
+        if ((++sent % 8) == 0) {
+            events_run(conn_handle);
+        }
+    }
+    return true;
+}
+
+/**@brief Commits an upload sent by upload_send(), the status is left to the caller. */
+static void upload_commit(uint16_t conn_handle)
+{
+    uint8_t op = FAT_UPLOAD_OP_COMMIT;
+
+    sim_write(conn_handle, m_handles.upload.value_handle, &op, 1);
+    events_run(conn_handle);
+}
+
+/**@brief Uploads a page and checks it was committed. */
+static bool upload(uint16_t conn_handle, uint8_t const * p_data, uint32_t len, uint16_t version, uint8_t encoding)
+{
+    size_t   mark;
+    uint8_t  op;
+    uint8_t  status;
+    uint32_t pos;
+
+    if (!upload_send(conn_handle, p_data, len, version, encoding)) {
+        return false;
+    }
+    mark = sim_rec_count();
+    upload_commit(conn_handle);
+    if (!upload_status_get(conn_handle, mark, &op, &status, &pos) ||
+        (op != FAT_UPLOAD_OP_COMMIT) || (status != FAT_UPLOAD_STATUS_OK) || (pos != len)) {
+        return fail("COMMIT not acknowledged");
+    }
+    return true;
+}
+
+
+/*
+ * Scenarios
+ */
+
+/**@brief Built in page, read at the default ATT MTU. */
+static bool scenario_read(void)
+{
+    int32_t  len;
+    uint32_t reads = 0;
+
+    fat_client_boot(&m_handles);
+    if (!sim_advertising() || !sim_connect(CONN_A)) {
+        return fail("not connectable after boot");
+    }
+    len = page_read(CONN_A, m_page, &reads);
+    snprintf(m_note, sizeof(m_note), "%d bytes in %u reads", len, reads);
+    return page_check(len, (uint8_t const *) STATIC_PAGE, STATIC_PAGE_LEN);
+}
+
+/**@brief Built in page, read at the largest ATT MTU. */
+static bool scenario_read_mtu(void)
+{
+    int32_t  len;
+    uint32_t reads = 0;
+
+    fat_client_boot(&m_handles);
+    (void) sim_connect(CONN_A);
+    sim_mtu_exchange(CONN_A, FAT_ATT_MTU_MAX);
+    if (sim_att_mtu(CONN_A) != FAT_ATT_MTU_MAX) {
+        return fail("MTU not raised");
+    }
+    len = page_read(CONN_A, m_page, &reads);
+    snprintf(m_note, sizeof(m_note), "%d bytes in %u reads", len, reads);
+    return page_check(len, (uint8_t const *) STATIC_PAGE, STATIC_PAGE_LEN);
+}
+
+/**@brief Built in page, pushed as notifications. */
+static bool scenario_stream(void)
+{
+    int32_t  len;
+    uint32_t notifications = 0;
+
+    fat_client_boot(&m_handles);
+    (void) sim_connect(CONN_A);
+    sim_mtu_exchange(CONN_A, FAT_ATT_MTU_MAX);
+    len = page_stream(CONN_A, m_page, &notifications);
+    snprintf(m_note, sizeof(m_note), "%d bytes in %u notifications, %u refused for TX buffers",
+             len, notifications, sim_stats()->hvx_no_tx);
+    return page_check(len, (uint8_t const *) STATIC_PAGE, STATIC_PAGE_LEN);
+}
+
+/**@brief Three clients read at once, a fourth has to wait for a free link. */
+static bool scenario_links(void)
+{
+    uint16_t const conns[BLE_FAT_MAX_LINKS] = { CONN_A, CONN_B, CONN_C };
+    static uint8_t pages[BLE_FAT_MAX_LINKS][FAT_CLIENT_PAGE_MAX];
+    uint32_t       lens[BLE_FAT_MAX_LINKS] = { 0 };
+    bool           done[BLE_FAT_MAX_LINKS] = { false };
+    uint32_t       left = BLE_FAT_MAX_LINKS;
+
+    fat_client_boot(&m_handles);
+    for (uint32_t i = 0; i < BLE_FAT_MAX_LINKS; i++)
+    {
+        if (!sim_connect(conns[i])) {
+            return fail("link refused below the limit");
+        }
+    }
+    if (sim_connect(CONN_D)) {
+        return fail("link accepted above the limit");
+    }
+
+    // Interleave the reads chunk by chunk, so each link has to keep its own place.
+    while (left > 0)
+    {
+        for (uint32_t i = 0; i < BLE_FAT_MAX_LINKS; i++)
+        {
+            int32_t got;
+
+            if (done[i]) {
+                continue;
+            }
+            got = chunk_read(conns[i], lens[i], pages[i] + lens[i]);
+            if (got < 0) {
+                return fail("read failed");
+            }
+            lens[i] += got;
+            if (fat_client_read_done(conns[i], got)) {
+                done[i] = true;
+                left--;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < BLE_FAT_MAX_LINKS; i++)
+    {
+        memcpy(m_page, pages[i], lens[i]);
+        if (!page_check(lens[i], (uint8_t const *) STATIC_PAGE, STATIC_PAGE_LEN)) {
+            return false;
+        }
+    }
+
+    sim_disconnect(CONN_B);
+    if (!sim_advertising() || !sim_connect(CONN_D)) {
+        return fail("advertising not restarted after a disconnect");
+    }
+    snprintf(m_note, sizeof(m_note), "%d links, %u advertising starts", BLE_FAT_MAX_LINKS, sim_stats()->adv_starts);
+    return true;
+}
+
+/**@brief Page flashed to the content partition is served instead of the built in one. */
+static bool scenario_flashed(void)
+{
+    int32_t len;
+
+    fat_slot_load(0, &m_identity);
+    fat_client_boot(&m_handles);
+    (void) sim_connect(CONN_A);
+    len = page_read(CONN_A, m_page, NULL);
+    snprintf(m_note, sizeof(m_note), "%d bytes", len);
+    return page_check(len, fat_image_page(&m_identity), fat_image_page_len(&m_identity));
+}
+
+/**@brief Compressed page: inflated for plain clients, sent as stored to clients that ask. */
+static bool scenario_deflate(void)
+{
+    uint8_t   option[] = { FAT_CTRL_OP_OPTIONS, FAT_CTRL_OPT_DEFLATE };
+    sim_rec_t info;
+    int32_t   len;
+    uint32_t  plain_reads   = 0;
+    uint32_t  deflate_reads = 0;
+
+    fat_slot_load(0, &m_deflate);
+    fat_client_boot(&m_handles);
+    (void) sim_connect(CONN_A);
+    (void) sim_connect(CONN_B);
+
+    len = page_read(CONN_A, m_page, &plain_reads);
+    if (!page_check(len, fat_image_page(&m_identity), fat_image_page_len(&m_identity))) {
+        return false;
+    }
+
+    sim_write(CONN_B, m_handles.control.value_handle, option, sizeof(option));
+    if (!sim_read(CONN_B, m_handles.control.value_handle, 0, &info) ||
+        (info.len != FAT_CTRL_INFO_LEN) || (info.data[0] != FAT_ENCODING_DEFLATE) ||
+        (uint16_decode(&info.data[1]) != fat_image_page_len(&m_deflate))) {
+        return fail("control characteristic does not report the stored stream");
+    }
+    len = page_read(CONN_B, m_page, &deflate_reads);
+    snprintf(m_note, sizeof(m_note), "%u reads inflated, %u reads stored", plain_reads, deflate_reads);
+    return page_check(len, fat_image_page(&m_deflate), fat_image_page_len(&m_deflate));
+}
+
+/**@brief Checks a rendered template page against the compiled template.
+ *
+ * @details Literal text must come through as compiled, and each placeholder must hold its
+ *          expected value right aligned, or '#' across if it doesn't fit.  A NULL value only
+ *          has to be a number.
+ */
+static bool template_check(int32_t len, char const * const * pp_values)
+{
+    uint8_t const * p_tmpl = fat_image_page(&m_template);
+    uint16_t        count  = uint16_decode(&p_tmpl[4]);
+    uint16_t        out    = uint16_decode(&p_tmpl[6]);
+    uint8_t const * p_text = p_tmpl + FAT_TMPL_HEADER_LEN + count * FAT_TMPL_SEG_LEN;
+
+    if (len != out) {
+        return fail("rendered page has the wrong length");
+    }
+    for (uint16_t i = 0; i < count; i++)
+    {
+        uint8_t const * p_seg   = p_tmpl + FAT_TMPL_HEADER_LEN + i * FAT_TMPL_SEG_LEN;
+        uint16_t        start   = uint16_decode(&p_seg[0]);
+        uint16_t        src     = uint16_decode(&p_seg[2]);
+        uint16_t        width   = ((i + 1 < count) ? uint16_decode(&p_seg[FAT_TMPL_SEG_LEN]) : out) - start;
+        char const *    p_value = pp_values[src & ~FAT_TMPL_SRC_VAR];
+        char            field[64];
+
+        if (!(src & FAT_TMPL_SRC_VAR)) {
+            if (memcmp(&m_page[start], &p_text[src], width) != 0) {
+                return fail("literal text garbled");
+            }
+            continue;
+        }
+        if (p_value == NULL) {
+            uint16_t k = 0;
+
+            while ((k < width) && (m_page[start + k] == ' '))
+            {
+                k++;
+            }
+            if ((k == width) || (strspn((char const *) &m_page[start + k], "0123456789") < (size_t) (width - k))) {
+                return fail("placeholder without a number");
+            }
+            continue;
+        }
+        if (strlen(p_value) > width) {
+            memset(field, '#', width);
+        } else {
+            snprintf(field, sizeof(field), "%*s", width, p_value);
+        }
+        if (memcmp(&m_page[start], field, width) != 0) {
+            snprintf(m_note, sizeof(m_note), "placeholder at %u is \"%.*s\", not \"%.*s\"",
+                     start, width, &m_page[start], width, field);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**@brief Fills in the text the sensor placeholders of a template should show for a reading. */
+static void sensor_values_set(fat_sensor_data_t const * p_data, char const ** pp_values)
+{
+    static char text[FAT_TMPL_VAR_COUNT][16];
+    int32_t     hundredths[] = { p_data->temp, (int32_t) p_data->humidity, (int32_t) p_data->pressure };
+    uint8_t     vars[]       = { FAT_TMPL_VAR_TEMP, FAT_TMPL_VAR_HUMIDITY, FAT_TMPL_VAR_PRESSURE };
+
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        snprintf(text[vars[i]], sizeof(text[0]), "%s%d.%02d", (hundredths[i] < 0) ? "-" : "",
+                 abs(hundredths[i]) / 100, abs(hundredths[i]) % 100);
+        pp_values[vars[i]] = text[vars[i]];
+    }
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        snprintf(text[FAT_TMPL_VAR_ACCEL_X + i], sizeof(text[0]), "%d", p_data->accel[i]);
+        pp_values[FAT_TMPL_VAR_ACCEL_X + i] = text[FAT_TMPL_VAR_ACCEL_X + i];
+    }
+}
+
+/**@brief Template page: rendered as it is read, with the values of the moment the client connected. */
+static bool scenario_template(void)
+{
+    char const *      values[FAT_TMPL_VAR_COUNT] = { NULL };
+    char              uptime[16];
+    char              version[16];
+    sim_rec_t         info;
+    int32_t           len = 0;
+    int32_t           got;
+    uint32_t          reads = 0;
+    fat_sensor_data_t sensor = { -512, 8130, 98765, { -12, 20, 1003 } };
+
+    sim_sensor_set(&sensor);
+    fat_slot_load(0, &m_template);
+    fat_client_boot(&m_handles);
+    sim_time_advance(10000);                                      // A TLM frame has measured the battery.
+
+    sim_button_press();                                           // Only the fatbeacon frame can be connected to.
+    snprintf(uptime, sizeof(uptime), "%u", sim_time_ms() / 1000);
+    (void) sim_connect(CONN_A);
+    if (!sim_read(CONN_A, m_handles.control.value_handle, 0, &info) || (info.data[0] != FAT_ENCODING_IDENTITY)) {
+        return fail("control characteristic does not report a rendered page");
+    }
+
+    // Half the page, a few seconds pass, then the rest: uptime has to read the same throughout.
+    do
+    {
+        got = chunk_read(CONN_A, len, &m_page[len]);
+        if (got < 0) {
+            return fail("read refused");
+        }
+        len += got;
+        if (++reads == 5) {
+            sim_time_advance(5000);
+        }
+    } while (!fat_client_read_done(CONN_A, got));
+
+    snprintf(version, sizeof(version), "%u", TEMPLATE_VERSION);
+    values[FAT_TMPL_VAR_UPTIME]  = uptime;
+    values[FAT_TMPL_VAR_SERVED]  = "0";
+    values[FAT_TMPL_VAR_VERSION] = version;
+    sensor_values_set(&sensor, values);
+    if ((uint16_decode(&info.data[1]) != len) || !template_check(len, values)) {
+        return false;
+    }
+    sim_disconnect(CONN_A);
+
+    // The next client sees time move on, and the first client counted.
+    sim_button_press();
+    snprintf(uptime, sizeof(uptime), "%u", sim_time_ms() / 1000);
+    (void) sim_connect(CONN_B);
+    len = page_read(CONN_B, m_page, &reads);
+    values[FAT_TMPL_VAR_SERVED] = "1";
+    if (!template_check(len, values)) {
+        return false;
+    }
+
+    snprintf(m_note, sizeof(m_note), "%d bytes rendered from %u, uptime %s s frozen per link",
+             len, fat_image_page_len(&m_template), uptime);
+    return true;
+}
+
+/**@brief Two pages uploaded over the air in turn, each served to the next connection. */
+static bool scenario_upload(void)
+{
+    fat_store_header_t const * p_header;
+    int32_t                    len;
+
+    fat_client_boot(&m_handles);
+    (void) sim_connect(CONN_A);
+    sim_mtu_exchange(CONN_A, FAT_ATT_MTU_MAX);
+
+    // Slot 0 is blank, so the first upload goes there and the second one to slot 1.
+    if (!upload(CONN_A, fat_image_page(&m_identity), fat_image_page_len(&m_identity), 7, FAT_ENCODING_IDENTITY)) {
+        return false;
+    }
+    (void) sim_connect(CONN_B);
+    len = page_read(CONN_B, m_page, NULL);
+    if (!page_check(len, fat_image_page(&m_identity), fat_image_page_len(&m_identity))) {
+        return false;
+    }
+
+    if (!upload(CONN_A, fat_image_page(&m_deflate), fat_image_page_len(&m_deflate), 8, FAT_ENCODING_DEFLATE)) {
+        return false;
+    }
+    p_header = (fat_store_header_t const *) fat_slot_get(1);
+    if ((p_header->magic != FAT_STORE_MAGIC) || (p_header->version != 8) || (p_header->seq != 1)) {
+        return fail("slot 1 header not written");
+    }
+
+    (void) sim_connect(CONN_C);
+    len = page_read(CONN_C, m_page, NULL);
+    snprintf(m_note, sizeof(m_note), "%u + %u bytes uploaded, %u flash operations", fat_image_page_len(&m_identity),
+             fat_image_page_len(&m_deflate), m_flash_ops);
+    return page_check(len, fat_image_page(&m_identity), fat_image_page_len(&m_identity));
+}
+
+/**@brief An upload is turned away while a link that connected before the last commit still
+ *        reads the page in the slot it would erase.
+ */
+static bool scenario_upload_busy(void)
+{
+    uint8_t  packet[10];
+    size_t   mark;
+    uint8_t  op;
+    uint8_t  status;
+    uint32_t pos;
+    int32_t  len;
+
+    fat_client_boot(&m_handles);
+    (void) sim_connect(CONN_A);
+    sim_mtu_exchange(CONN_A, FAT_ATT_MTU_MAX);
+    if (!upload(CONN_A, fat_image_page(&m_identity), fat_image_page_len(&m_identity), 7, FAT_ENCODING_IDENTITY)) {
+        return false;
+    }
+
+    // B connects on the page in slot 0, then the next upload goes live from slot 1.
+    (void) sim_connect(CONN_B);
+    if (!upload(CONN_A, fat_image_page(&m_deflate), fat_image_page_len(&m_deflate), 8, FAT_ENCODING_DEFLATE)) {
+        return false;
+    }
+
+    // The one after that would erase slot 0 under B.
+    mark      = sim_rec_count();
+    packet[0] = FAT_UPLOAD_OP_START;
+    (void) uint32_encode(fat_image_page_len(&m_identity), &packet[1]);
+    (void) uint16_encode(crc16_compute(fat_image_page(&m_identity), fat_image_page_len(&m_identity), NULL), &packet[5]);
+    (void) uint16_encode(9, &packet[7]);
+    packet[9] = FAT_ENCODING_IDENTITY;
+    sim_write(CONN_A, m_handles.upload.value_handle, packet, sizeof(packet));
+    events_run(CONN_A);
+    if (!upload_status_get(CONN_A, mark, &op, &status, &pos) || (status != FAT_UPLOAD_STATUS_BUSY)) {
+        return fail("upload erased a page still being read");
+    }
+    len = page_read(CONN_B, m_page, NULL);
+    if (!page_check(len, fat_image_page(&m_identity), fat_image_page_len(&m_identity))) {
+        return false;
+    }
+
+    // Once B is gone slot 0 is free again.
+    sim_disconnect(CONN_B);
+    if (!upload(CONN_A, fat_image_page(&m_identity), fat_image_page_len(&m_identity), 9, FAT_ENCODING_IDENTITY)) {
+        return false;
+    }
+    snprintf(m_note, sizeof(m_note), "START busy while slot 0 was read, %u flash operations", m_flash_ops);
+    return true;
+}
+
+/**@brief An uploader that disconnects between its COMMIT and the header write still gets its
+ *        page served, now rather than only after the next reset.
+ */
+static bool scenario_upload_seal(void)
+{
+    uint8_t  op       = FAT_UPLOAD_OP_COMMIT;
+    uint32_t page_len = fat_image_page_len(&m_identity);
+    int32_t  len;
+
+    fat_client_boot(&m_handles);
+    (void) sim_connect(CONN_A);
+    sim_mtu_exchange(CONN_A, FAT_ATT_MTU_MAX);
+    if (!upload_send(CONN_A, fat_image_page(&m_identity), page_len, 7, FAT_ENCODING_IDENTITY)) {
+        return false;
+    }
+    sim_write(CONN_A, m_handles.upload.value_handle, &op, 1);
+
+    // Data verified and the header write queued, but not done yet.
+    while (sim_flash_next() != (uint32_t const *) fat_store_upload_slot_get())
+    {
+        if (!sim_flash_step()) {
+            return fail("header write never queued");
+        }
+    }
+    sim_disconnect(CONN_A);
+    m_flash_ops += sim_flash_run();
+
+    (void) sim_connect(CONN_B);
+    sim_mtu_exchange(CONN_B, FAT_ATT_MTU_MAX);
+    len = page_read(CONN_B, m_page, NULL);
+    if (!page_check(len, fat_image_page(&m_identity), page_len)) {
+        return fail("sealed page not served, it would only go live after a reset");
+    }
+
+    // The upload is over, the next one goes ahead.
+    if (!upload(CONN_B, fat_image_page(&m_deflate), fat_image_page_len(&m_deflate), 8, FAT_ENCODING_DEFLATE)) {
+        return false;
+    }
+
+    snprintf(m_note, sizeof(m_note), "%u bytes live after the uploader left, %u flash operations", page_len, m_flash_ops);
+    return true;
+}
+
+/**@brief Links speed up for a transfer and slow down once the page is delivered. */
+static bool scenario_conn_params(void)
+{
+    ble_gap_conn_params_t fast_a;
+    ble_gap_conn_params_t fast_b;
+    ble_gap_conn_params_t idle;
+    uint8_t               chunk[SIM_MAX_DATA];
+
+    fat_client_boot(&m_handles);
+    (void) sim_connect(CONN_A);
+    (void) sim_connect(CONN_B);
+    sim_central_min_interval_set(CONN_B, 16);          // Turns down anything under 20 ms.
+
+    // The first read starts the transfer on each link.
+    (void) chunk_read(CONN_A, 0, chunk);
+    (void) chunk_read(CONN_B, 0, chunk);
+    (void) sim_conn_params_get(CONN_A, &fast_a);
+    (void) sim_conn_params_get(CONN_B, &fast_b);
+    if ((fast_a.max_conn_interval != 6) || (fast_b.max_conn_interval != 16)) {
+        snprintf(m_note, sizeof(m_note), "transfer runs at %u and %u units",
+                 fast_a.max_conn_interval, fast_b.max_conn_interval);
+        return false;
+    }
+
+    if (page_read(CONN_A, m_page, NULL) < 0) {
+        return fail("read failed");
+    }
+    (void) sim_conn_params_get(CONN_A, &idle);
+    if ((idle.max_conn_interval < 320) || (idle.slave_latency == 0)) {
+        return fail("link not slowed down after the transfer");
+    }
+
+    // Streaming goes through the same steps.
+    (void) sim_connect(CONN_C);
+    if (page_stream(CONN_C, m_page, NULL) < 0) {
+        return fail("stream failed");
+    }
+    (void) sim_conn_params_get(CONN_C, &idle);
+    if (idle.slave_latency == 0) {
+        return fail("link not slowed down after the stream");
+    }
+
+    snprintf(m_note, sizeof(m_note), "%u and %u units transferring, %u units latency %u idle, %u updates",
+             fast_a.max_conn_interval, fast_b.max_conn_interval, idle.max_conn_interval, idle.slave_latency,
+             sim_stats()->conn_param_updates);
+    return true;
+}
+
+/**@brief An update the central never answers is asked again, up to LINK_PARAMS_MAX_UNANSWERED
+ *        times in a row (3 in main.c), each after LINK_PARAMS_TIMEOUT_MS (5 s).
+ */
+static bool scenario_params_retry(void)
+{
+    ble_gap_conn_params_t params;
+    uint8_t               chunk[SIM_MAX_DATA];
+    uint32_t              updates;
+
+    fat_client_boot(&m_handles);
+    (void) sim_connect(CONN_A);
+    sim_central_updates_ignore(CONN_A, 1);
+
+    (void) chunk_read(CONN_A, 0, chunk);                // Asks for the fast range, no answer comes.
+    (void) sim_conn_params_get(CONN_A, &params);
+    if (params.max_conn_interval == 6) {
+        return fail("ignored update applied");
+    }
+    sim_time_advance(5000);
+    (void) sim_conn_params_get(CONN_A, &params);
+    if (params.max_conn_interval != 6) {
+        return fail("update not asked again");
+    }
+
+    // A central that never answers is left alone after three.
+    (void) sim_connect(CONN_B);
+    sim_central_updates_ignore(CONN_B, 255);
+    updates = sim_stats()->conn_param_updates;
+    (void) chunk_read(CONN_B, 0, chunk);
+    sim_time_advance(60000);
+    if (sim_stats()->conn_param_updates - updates != 3) {
+        snprintf(m_note, sizeof(m_note), "%u updates asked of a silent central",
+                 sim_stats()->conn_param_updates - updates);
+        return false;
+    }
+
+    snprintf(m_note, sizeof(m_note), "retried after 5 s, given up after %u", sim_stats()->conn_param_updates - updates);
+    return true;
+}
+
+/**@brief Finds an AD structure of the given type in advertising or scan response data.
+ *
+ * @return Length of its data, 0 if there is none, with *pp_field pointing at the data.
+ */
+static uint8_t ad_field_find(uint8_t const * p_data, uint8_t len, uint8_t ad_type, uint8_t const ** pp_field)
+{
+    for (uint8_t pos = 0; (pos + 1 < len) && (p_data[pos] > 0); pos += p_data[pos] + 1)
+    {
+        if ((p_data[pos + 1] == ad_type) && (pos + 1 + p_data[pos] <= len)) {
+            *pp_field = &p_data[pos + 2];
+            return p_data[pos] - 1;
+        }
+    }
+    return 0;
+}
+
+/**@brief Checks that the data on air is the frame the advertising type says it is.
+ *
+ * @details The connectable frame must carry Eddystone-URL and a scan response naming the
+ *          fatbeacon service, the non-connectable one Eddystone-UID and no scan response, and the
+ *          scannable one Eddystone-TLM with the fatbeacon counters in its scan response.
+ */
+static bool adv_data_check(uint8_t adv_type)
+{
+    uint8_t const * p_adv;
+    uint8_t const * p_sr;
+    uint8_t const * p_field;
+    uint8_t         sr_len;
+    uint8_t         adv_len = sim_adv_data_get(&p_adv, &p_sr, &sr_len);
+    uint8_t         len     = ad_field_find(p_adv, adv_len, BLE_GAP_AD_TYPE_SERVICE_DATA, &p_field);
+
+    if ((len < 3) || (uint16_decode(p_field) != APP_EDDYSTONE_UUID)) {
+        return false;
+    }
+    if (adv_type == BLE_GAP_ADV_TYPE_ADV_NONCONN_IND) {
+        return (p_field[2] == APP_EDDYSTONE_UID_FRAME_TYPE) && (sr_len == 0);
+    }
+    if (adv_type == BLE_GAP_ADV_TYPE_ADV_SCAN_IND) {
+        if ((len != 2 + FAT_TLM_DATA_LEN) || (p_field[2] != FAT_TLM_FRAME_TYPE)) {
+            return false;
+        }
+        len = ad_field_find(p_sr, sr_len, BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA, &p_field);
+        return (len == 2 + FAT_TLM_STATS_LEN) && (uint16_decode(p_field) == FAT_TLM_STATS_COMPANY_ID);
+    }
+    if (p_field[2] != APP_EDDYSTONE_URL_FRAME_TYPE) {
+        return false;
+    }
+    len = ad_field_find(p_sr, sr_len, BLE_GAP_AD_TYPE_COMPLETE_LOCAL_NAME, &p_field);
+    if ((len != strlen(DEVICE_NAME)) || (memcmp(p_field, DEVICE_NAME, len) != 0)) {
+        return false;
+    }
+    len = ad_field_find(p_sr, sr_len, BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA, &p_field);
+    return (len == 2 + FAT_HASH_LEN) && (uint16_decode(p_field) == FAT_HASH_COMPANY_ID);
+}
+
+/**@brief Advertising interleaves both frames, backs off when idle and only offers what is free. */
+static bool scenario_adv(void)
+{
+    uint16_t const       fast = MSEC_TO_UNITS(FAT_ADV_FAST_INTERVAL_MS, UNIT_0_625_MS);
+    uint16_t const       slow = MSEC_TO_UNITS(FAT_ADV_SLOW_INTERVAL_MS, UNIT_0_625_MS);
+    ble_gap_adv_params_t params;
+    uint32_t             fat_ms = 0;
+    uint32_t             uid_ms = 0;
+    uint32_t             tlm_ms = 0;
+
+    fat_client_boot(&m_handles);
+    if (!sim_adv_params_get(&params) || (params.type != BLE_GAP_ADV_TYPE_ADV_IND) || (params.interval != fast)) {
+        return fail("fatbeacon frame not advertised fast after boot");
+    }
+
+    // Sample which frame is on air through the fast period.
+    for (uint32_t t = 0; t < FAT_ADV_FAST_TIMEOUT_MS; t += 10)
+    {
+        sim_time_advance(10);
+        if (!sim_adv_params_get(&params)) {
+            return fail("advertising stopped");
+        }
+        if (!adv_data_check(params.type)) {
+            return fail("advertising data doesn't match the frame on air");
+        }
+        if (params.type == BLE_GAP_ADV_TYPE_ADV_IND) {
+            fat_ms += 10;
+        } else if (params.type == BLE_GAP_ADV_TYPE_ADV_NONCONN_IND) {
+            uid_ms += 10;
+        } else {
+            tlm_ms += 10;
+        }
+    }
+    // Timer ticks round the slots a little, so allow a few percent either way.
+    if ((uid_ms == 0) || (tlm_ms == 0) ||
+        (abs((int32_t) (fat_ms * FAT_ADV_UID_EVENTS) - (int32_t) (uid_ms * FAT_ADV_FAT_EVENTS)) > (int32_t) (fat_ms + uid_ms) / 20) ||
+        (abs((int32_t) (fat_ms * FAT_ADV_TLM_EVENTS) - (int32_t) (tlm_ms * FAT_ADV_FAT_EVENTS)) > (int32_t) (fat_ms + tlm_ms) / 20)) {
+        return fail("frames not interleaved as configured");
+    }
+
+    sim_time_advance(4 * FAT_ADV_SLOW_INTERVAL_MS);
+    if (!sim_adv_params_get(&params) || (params.interval != slow)) {
+        return fail("still advertising fast when idle");
+    }
+    sim_button_press();
+    if (!sim_adv_params_get(&params) || (params.type != BLE_GAP_ADV_TYPE_ADV_IND) || (params.interval != fast)) {
+        return fail("button press didn't bring the fatbeacon frame back fast");
+    }
+
+    // With every link taken only the non-connectable frame may go out.
+    if (!sim_connect(CONN_A) || !sim_connect(CONN_B) || !sim_connect(CONN_C)) {
+        return fail("link refused below the limit");
+    }
+    for (uint32_t t = 0; t < 4 * FAT_ADV_SLOW_INTERVAL_MS; t += 10)
+    {
+        sim_time_advance(10);
+        if (!sim_adv_params_get(&params) || (params.type == BLE_GAP_ADV_TYPE_ADV_IND) || !adv_data_check(params.type)) {
+            return fail("Eddystone frame not alone with every link taken");
+        }
+    }
+
+    sim_time_advance(FAT_ADV_FAST_TIMEOUT_MS);
+    sim_disconnect(CONN_B);
+    if (!sim_adv_params_get(&params) || (params.type != BLE_GAP_ADV_TYPE_ADV_IND) || (params.interval != fast) ||
+        !adv_data_check(params.type)) {
+        return fail("fatbeacon frame not back fast after a disconnect");
+    }
+
+    snprintf(m_note, sizeof(m_note), "%u ms fatbeacon, %u ms UID, %u ms TLM while fast, %u advertising starts",
+             fat_ms, uid_ms, tlm_ms, sim_stats()->adv_starts);
+    return true;
+}
+
+/**@brief Waits for the TLM frame to come round and returns its data and counters. */
+static bool tlm_wait(uint8_t const ** pp_tlm, uint8_t const ** pp_stats)
+{
+    ble_gap_adv_params_t params;
+    uint8_t const *      p_adv;
+    uint8_t const *      p_sr;
+    uint8_t              adv_len;
+    uint8_t              sr_len;
+
+    for (uint32_t t = 0; t < 10 * FAT_ADV_SLOW_INTERVAL_MS; t += 10)
+    {
+        if (sim_adv_params_get(&params) && (params.type == BLE_GAP_ADV_TYPE_ADV_SCAN_IND) && adv_data_check(params.type)) {
+            adv_len = sim_adv_data_get(&p_adv, &p_sr, &sr_len);
+            (void) ad_field_find(p_adv, adv_len, BLE_GAP_AD_TYPE_SERVICE_DATA, pp_tlm);
+            (void) ad_field_find(p_sr, sr_len, BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA, pp_stats);
+            *pp_tlm   += 2;                                       // Past the Eddystone UUID
+            *pp_stats += 2;                                       // and the company ID.
+            return true;
+        }
+        sim_time_advance(10);
+    }
+    return false;
+}
+
+/**@brief The TLM frame reports the supply, temperature, uptime, PDUs and pages served. */
+static bool scenario_tlm(void)
+{
+    uint8_t const * p_tlm;
+    uint8_t const * p_stats;
+    uint32_t        adv_cnt;
+    uint32_t        sec_cnt;
+    int32_t         len;
+
+    fat_client_boot(&m_handles);
+    sim_time_advance(5000);
+    if (!tlm_wait(&p_tlm, &p_stats)) {
+        return fail("no TLM frame");
+    }
+    adv_cnt = uint32_big_decode(&p_tlm[6]);
+    sec_cnt = uint32_big_decode(&p_tlm[10]);
+    if ((p_tlm[1] != FAT_TLM_VERSION) || (uint16_big_decode(&p_tlm[2]) < 2900) || (uint16_big_decode(&p_tlm[2]) > 3100) ||
+        (uint16_big_decode(&p_tlm[4]) != 2150 * 256 / 100)) {
+        return fail("battery or temperature wrong");
+    }
+    // The sensors as sdk_sim.c starts them: 45.25 %, 1013.25 hPa, lying flat.
+    if ((uint16_big_decode(&p_stats[8]) != 4525) || (uint16_big_decode(&p_stats[10]) != 101325 - 50000) ||
+        (uint16_big_decode(&p_stats[12]) != 0) || (uint16_big_decode(&p_stats[14]) != 0) ||
+        (uint16_big_decode(&p_stats[16]) != 1000)) {
+        return fail("sensor readings wrong");
+    }
+    // At the fast interval every 100 ms is one event of three PDUs.  PDUs are counted per slot
+    // and timer ticks round the slots a little, so allow a slot either way.
+    if ((sec_cnt * 100 + 100 < sim_time_ms()) || (sec_cnt * 100 > sim_time_ms()) ||
+        (abs((int32_t) (adv_cnt * 100 / 3) - (int32_t) sim_time_ms()) > 500)) {
+        return fail("uptime or advertising count wrong");
+    }
+    if ((uint32_big_decode(&p_stats[0]) != 0) || (uint32_big_decode(&p_stats[4]) != 0)) {
+        return fail("counters not zero before a client");
+    }
+
+    sim_button_press();                                           // Only the fatbeacon frame can be connected to.
+    (void) sim_connect(CONN_A);
+    len = page_read(CONN_A, m_page, NULL);
+    sim_disconnect(CONN_A);
+    (void) sim_connect(CONN_B);
+    (void) page_read(CONN_B, m_page, NULL);
+    sim_disconnect(CONN_B);
+    if (!tlm_wait(&p_tlm, &p_stats)) {
+        return fail("no TLM frame after the clients");
+    }
+    if ((uint32_big_decode(&p_stats[0]) != 2) || (uint32_big_decode(&p_stats[4]) != 2 * (uint32_t) len) ||
+        (uint32_big_decode(&p_tlm[6]) <= adv_cnt) || (uint32_big_decode(&p_tlm[10]) <= sec_cnt)) {
+        return fail("counters not updated");
+    }
+
+    snprintf(m_note, sizeof(m_note), "%u mV, %u pages, %u bytes, %u PDUs in %u.%u s",
+             uint16_big_decode(&p_tlm[2]), uint32_big_decode(&p_stats[0]), uint32_big_decode(&p_stats[4]),
+             uint32_big_decode(&p_tlm[6]), uint32_big_decode(&p_tlm[10]) / 10, uint32_big_decode(&p_tlm[10]) % 10);
+    return true;
+}
+
+/**@brief Sensors sampled only when a reading is out of date: for a connecting client after
+ *        FAT_SENSOR_CONN_MAX_AGE_S, for the TLM frame after FAT_SENSOR_ADV_MAX_AGE_S.
+ */
+static bool scenario_sensor(void)
+{
+    char const *      values[FAT_TMPL_VAR_COUNT] = { NULL };
+    char              version[16];
+    fat_sensor_data_t before = { 2150, 4525, 101325, { 0, 0, 1000 } };
+    fat_sensor_data_t after  = { 1875, 6010, 100980, { 3, -998, 41 } };
+    uint32_t          hour;
+    uint32_t          samples;
+    int32_t           len;
+
+    sim_sensor_set(&before);
+    fat_slot_load(0, &m_template);
+    fat_client_boot(&m_handles);
+    snprintf(version, sizeof(version), "%u", TEMPLATE_VERSION);
+    values[FAT_TMPL_VAR_VERSION] = version;
+
+    // An hour of advertising alone.
+    sim_time_advance(3600 * 1000);
+    hour = sim_sensor_samples();
+    if ((hour == 0) || (hour > 3600 / FAT_SENSOR_ADV_MAX_AGE_S + 1)) {
+        snprintf(m_note, sizeof(m_note), "%u samples in an hour of advertising", hour);
+        return false;
+    }
+
+    // A client connecting a few seconds after the TLM frame sampled is shown that reading.
+    samples = sim_sensor_samples();
+    for (uint32_t t = 0; (sim_sensor_samples() == samples) && (t < 2 * FAT_SENSOR_ADV_MAX_AGE_S * 1000); t += 10)
+    {
+        sim_time_advance(10);
+    }
+    samples = sim_sensor_samples();
+    sim_sensor_set(&after);
+    sim_time_advance(FAT_SENSOR_CONN_MAX_AGE_S / 2 * 1000);
+    sim_button_press();                                           // Only the fatbeacon frame can be connected to.
+    (void) sim_connect(CONN_A);
+    len = page_read(CONN_A, m_page, NULL);
+    sim_disconnect(CONN_A);
+    sensor_values_set(&before, values);
+    if (!template_check(len, values)) {
+        return false;
+    }
+    if (sim_sensor_samples() != samples) {
+        return fail("sampled again for a recent reading");
+    }
+
+    // Once it is out of date the next client gets a fresh one, which the one after shares.  It is
+    // taken from the main loop, never in the SoftDevice interrupt the connect arrives in.
+    sim_time_advance((FAT_SENSOR_CONN_MAX_AGE_S + 1) * 1000);
+    sim_button_press();
+    sim_idle_hold(true);
+    (void) sim_connect(CONN_B);
+    if (sim_sensor_samples() != samples) {
+        return fail("sampled in the SoftDevice interrupt");
+    }
+    sim_idle_hold(false);
+    len = page_read(CONN_B, m_page, NULL);
+    sim_disconnect(CONN_B);
+    sensor_values_set(&after, values);
+    if (!template_check(len, values)) {
+        return false;
+    }
+    sim_time_advance(FAT_SENSOR_CONN_MAX_AGE_S / 2 * 1000);
+    sim_button_press();
+    (void) sim_connect(CONN_C);
+    len = page_read(CONN_C, m_page, NULL);
+    sim_disconnect(CONN_C);
+    if (!template_check(len, values)) {
+        return false;
+    }
+    if (sim_sensor_samples() != samples + 1) {
+        return fail("not sampled exactly once for two clients");
+    }
+
+    snprintf(m_note, sizeof(m_note), "%u samples in an hour of advertising, 1 for 3 clients", hour);
+    return true;
+}
+
+/**@brief Hashes a page the way ble_fat.c does, 32-bit FNV-1a. */
+static uint32_t page_hash(uint8_t const * p_data, uint32_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (uint32_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ p_data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**@brief Waits up to a rotation for the fatbeacon frame to advertise a content hash. */
+static bool adv_hash_wait(uint32_t hash)
+{
+    ble_gap_adv_params_t params;
+    uint8_t const *      p_adv;
+    uint8_t const *      p_sr;
+    uint8_t const *      p_field;
+    uint8_t              sr_len;
+
+    for (uint32_t t = 0; t < 2 * FAT_ADV_SLOW_INTERVAL_MS * (FAT_ADV_FAT_EVENTS + FAT_ADV_UID_EVENTS + FAT_ADV_TLM_EVENTS); t += 10)
+    {
+        if (sim_adv_params_get(&params) && (params.type == BLE_GAP_ADV_TYPE_ADV_IND) && adv_data_check(params.type)) {
+            (void) sim_adv_data_get(&p_adv, &p_sr, &sr_len);
+            (void) ad_field_find(p_sr, sr_len, BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA, &p_field);
+            if (uint32_decode(&p_field[2]) == hash) {
+                return true;
+            }
+        }
+        sim_time_advance(10);
+    }
+    return false;
+}
+
+/**@brief Returns the content hash the control characteristic reports to a connection. */
+static uint32_t ctrl_hash_get(uint16_t conn_handle)
+{
+    sim_rec_t info;
+
+    if (!sim_read(conn_handle, m_handles.control.value_handle, 0, &info) || (info.len != FAT_CTRL_INFO_LEN)) {
+        return FAT_HASH_NONE;
+    }
+    return uint32_decode(&info.data[5]);
+}
+
+/**@brief Content hash advertised and on the control characteristic, following each upload. */
+static bool scenario_hash(void)
+{
+    uint32_t hash = page_hash((uint8_t const *) STATIC_PAGE, STATIC_PAGE_LEN);
+
+    fat_client_boot(&m_handles);
+    if (!adv_hash_wait(hash)) {
+        return fail("built in page's hash not advertised");
+    }
+    (void) sim_connect(CONN_A);
+    sim_mtu_exchange(CONN_A, FAT_ATT_MTU_MAX);
+    if (ctrl_hash_get(CONN_A) != hash) {
+        return fail("built in page's hash not on the control characteristic");
+    }
+
+    // The upload is hashed as it goes live, and the next fatbeacon frame carries it.
+    if (!upload(CONN_A, fat_image_page(&m_deflate), fat_image_page_len(&m_deflate), 7, FAT_ENCODING_DEFLATE)) {
+        return false;
+    }
+    hash = page_hash(fat_image_page(&m_deflate), fat_image_page_len(&m_deflate));
+    if (!adv_hash_wait(hash)) {
+        return fail("uploaded page's hash not advertised");
+    }
+    (void) sim_connect(CONN_B);
+    if ((ctrl_hash_get(CONN_B) != hash) || (ctrl_hash_get(CONN_A) == hash)) {
+        return fail("control characteristic doesn't follow the page each link is served");
+    }
+
+    // A template changes with every visit, so it has no hash to cache by.
+    if (!upload(CONN_A, fat_image_page(&m_template), fat_image_page_len(&m_template), 8, FAT_ENCODING_TEMPLATE)) {
+        return false;
+    }
+    if (!adv_hash_wait(FAT_HASH_NONE)) {
+        return fail("template page advertised with a hash");
+    }
+    (void) sim_connect(CONN_C);
+    if (ctrl_hash_get(CONN_C) != FAT_HASH_NONE) {
+        return fail("template page reported with a hash");
+    }
+
+    snprintf(m_note, sizeof(m_note), "%08x built in, %08x uploaded, %u advertising starts",
+             page_hash((uint8_t const *) STATIC_PAGE, STATIC_PAGE_LEN), hash, sim_stats()->adv_starts);
+    return true;
+}
+
+/**@brief Asks to resume the transfer with the first offset bytes of m_page as the client's copy.
+ *
+ * @return Offset the transfer resumed at, as the control characteristic reports it.
+ */
+static uint16_t resume(uint16_t conn_handle, uint32_t hash, uint16_t offset)
+{
+    uint8_t   packet[FAT_CTRL_RESUME_LEN];
+    sim_rec_t info;
+
+    packet[0] = FAT_CTRL_OP_RESUME;
+    (void) uint32_encode(hash, &packet[1]);
+    (void) uint16_encode(offset, &packet[5]);
+    (void) uint16_encode(crc16_compute(m_page, offset, NULL), &packet[7]);
+    sim_write(conn_handle, m_handles.control.value_handle, packet, sizeof(packet));
+
+    if (!sim_read(conn_handle, m_handles.control.value_handle, 0, &info) || (info.len != FAT_CTRL_INFO_LEN)) {
+        return 0;
+    }
+    return uint16_decode(&info.data[9]);
+}
+
+/**@brief A transfer cut off by a disconnect carries on where it stopped, on the next connection,
+ *        once the client's copy checks out.
+ */
+static bool scenario_resume(void)
+{
+    uint8_t const * p_expected = fat_image_page(&m_identity);     // What the deflated page inflates to.
+    uint32_t        total      = fat_image_page_len(&m_identity);
+    uint32_t        hash       = page_hash(fat_image_page(&m_deflate), fat_image_page_len(&m_deflate));
+    uint16_t        half;
+    int32_t         len   = 0;
+    int32_t         got;
+    uint32_t        reads = 0;
+
+    fat_slot_load(0, &m_deflate);
+    fat_client_boot(&m_handles);
+
+    // Half the page, then the client walks out of range.
+    (void) sim_connect(CONN_A);
+    do
+    {
+        got = chunk_read(CONN_A, len, &m_page[len]);
+        if (got <= 0) {
+            return fail("read refused");
+        }
+        len += got;
+        reads++;
+    } while (len < (int32_t) total / 2);
+    sim_disconnect(CONN_A);
+    half = (uint16_t) len;
+
+    (void) sim_connect(CONN_B);
+    if (resume(CONN_B, hash, half) != half) {
+        return fail("resume refused");
+    }
+    do
+    {
+        got = chunk_read(CONN_B, len, &m_page[len]);
+        if (got < 0) {
+            return fail("read refused after resuming");
+        }
+        len += got;
+        reads++;
+    } while (!fat_client_read_done(CONN_B, got));
+    if (!page_check(len, p_expected, total)) {
+        return false;
+    }
+
+    // A copy that doesn't match, or was served under other content, starts over.
+    m_page[10] ^= 0xFF;
+    if (resume(CONN_B, hash, half) != 0) {
+        return fail("resumed over a copy that doesn't match");
+    }
+    m_page[10] ^= 0xFF;
+    if ((resume(CONN_B, hash ^ 1, half) != 0) || (resume(CONN_B, FAT_HASH_NONE, half) != 0)) {
+        return fail("resumed a copy of other content");
+    }
+
+    // Streamed, notifications carry on from the offset as well.
+    (void) sim_connect(CONN_C);
+    if (resume(CONN_C, hash, half) != half) {
+        return fail("resume refused before streaming");
+    }
+    got = page_stream(CONN_C, &m_page[half], NULL);
+    if (!page_check((got < 0) ? got : half + got, p_expected, total)) {
+        return false;
+    }
+
+    snprintf(m_note, sizeof(m_note), "resumed at %u of %u bytes, %u reads in all", half, total, reads);
+    return true;
+}
+
+/**@brief Returns a record slot of the metrics log, which sits just below the fat_store slots. */
+static fat_metrics_record_t * metrics_record_get(uint8_t page, uint16_t slot)
+{
+    uint8_t * p_log = (uint8_t *) sim_flash_base() + sim_flash_size() -
+                      (FAT_STORE_NUM_PAGES + FAT_METRICS_PAGES) * FAT_STORE_PAGE_SIZE;
+
+    return (fat_metrics_record_t *) (p_log + page * FAT_STORE_PAGE_SIZE) + slot;
+}
+
+static void metrics_record_put(uint8_t page, uint16_t slot, uint32_t seq, fat_metrics_t const * p_metrics)
+{
+    fat_metrics_record_t * p_record = metrics_record_get(page, slot);
+
+    p_record->magic    = FAT_METRICS_MAGIC;
+    p_record->seq      = seq;
+    p_record->metrics  = *p_metrics;
+    p_record->crc      = crc16_compute((uint8_t const *) &p_record->seq, sizeof(p_record->seq) + sizeof(p_record->metrics), NULL);
+    p_record->reserved = 0xFFFF;
+}
+
+/**@brief Reads the metrics characteristic the way a client does, with a long read if need be. */
+static bool metrics_read(uint16_t conn_handle, uint16_t value_handle, uint8_t * p_value)
+{
+    sim_rec_t reply;
+    uint16_t  len = 0;
+
+    do
+    {
+        if (!sim_read(conn_handle, value_handle, len, &reply) || (reply.gatt_status != BLE_GATT_STATUS_SUCCESS)) {
+            return fail("metrics characteristic read refused");
+        }
+        memcpy(&p_value[len], reply.data, reply.len);
+        len += reply.len;
+    } while (reply.len == sim_att_mtu(conn_handle) - 1);
+
+    if ((len != FAT_METRICS_VALUE_LEN) || (p_value[0] != FAT_METRICS_VERSION)) {
+        return fail("metrics characteristic has the wrong layout");
+    }
+    return true;
+}
+
+/**@brief Collects every notification on a link until the stream stops, terminator or not.
+ *
+ * @return Bytes received, or -1 if they overflowed p_dest.
+ */
+static int32_t notify_collect(uint16_t conn_handle, uint8_t * p_dest, uint32_t * p_notifications)
+{
+    size_t   next  = sim_rec_count();
+    uint32_t len   = 0;
+    uint32_t count = 0;
+
+    fat_client_cccd_write(conn_handle, m_handles.fat.cccd_handle, BLE_GATT_HVX_NOTIFICATION);
+
+    for (;;)
+    {
+        for (; next < sim_rec_count(); next++)
+        {
+            sim_rec_t const * p_rec = sim_rec_get(next);
+
+            if ((p_rec->type != SIM_REC_HVX) || (p_rec->conn_handle != conn_handle) ||
+                (p_rec->handle != m_handles.fat.value_handle)) {
+                continue;
+            }
+            count++;
+            if (len + p_rec->len > FAT_CLIENT_PAGE_MAX) {
+                return -1;
+            }
+            memcpy(p_dest + len, p_rec->data, p_rec->len);
+            len += p_rec->len;
+        }
+        if (sim_tx_queued(conn_handle) == 0) {
+            *p_notifications = count;
+            return len;
+        }
+        sim_tx_complete(conn_handle, sim_tx_queued(conn_handle));
+    }
+}
+
+/**@brief Checks a stream header against what the control characteristic reports. */
+static bool header_check(uint16_t conn_handle, uint8_t const * p_header)
+{
+    sim_rec_t info;
+
+    if (!sim_read(conn_handle, m_handles.control.value_handle, 0, &info) || (info.len != FAT_CTRL_INFO_LEN)) {
+        return fail("control read refused");
+    }
+    if ((uint32_decode(&p_header[0]) != uint16_decode(&info.data[1])) || (p_header[4] != FAT_CONTENT_TYPE_HTML) ||
+        (p_header[5] != info.data[0]) || (uint16_decode(&p_header[6]) != uint16_decode(&info.data[3]))) {
+        return fail("stream header doesn't match the control characteristic");
+    }
+    return true;
+}
+
+/**@brief Clients that ask for the stream header learn the page's length from the first chunk,
+ *        and the page ends on its last byte rather than an empty read or notification.
+ */
+static bool scenario_header(void)
+{
+    uint8_t                  option[]   = { FAT_CTRL_OP_OPTIONS, FAT_CTRL_OPT_HEADER };
+    uint8_t const *          p_expected = fat_image_page(&m_identity);     // What the deflated page inflates to.
+    uint32_t                 total      = fat_image_page_len(&m_identity);
+    uint8_t                  chunk[SIM_MAX_DATA];
+    ble_gatts_char_handles_t metrics;
+    uint8_t                  value[FAT_METRICS_VALUE_LEN];
+    uint32_t                 completed;
+    uint32_t                 plain_reads;
+    uint32_t                 plain_notifications;
+    uint32_t                 reads = 0;
+    uint32_t                 notifications;
+    int32_t                  len;
+    int32_t                  got;
+
+    fat_slot_load(0, &m_deflate);
+    fat_client_boot(&m_handles);
+    (void) sim_connect(CONN_A);
+    (void) sim_connect(CONN_B);
+
+    if (!page_check(page_read(CONN_A, m_page, &plain_reads), p_expected, total) ||
+        !page_check(page_stream(CONN_A, m_page, &plain_notifications), p_expected, total)) {
+        return false;
+    }
+    (void) sim_char_find(BLE_UUID_FAT_METRICS_CHAR, &metrics);
+    if (!metrics_read(CONN_B, metrics.value_handle, value)) {
+        return false;
+    }
+    completed = uint32_decode(&value[5]);
+
+    sim_write(CONN_B, m_handles.control.value_handle, option, sizeof(option));
+    if (APP_FAT_READ_MODE == BLE_FAT_READ_MODE_CURSOR) {
+        got = chunk_read(CONN_B, 0, chunk);
+        if ((got < FAT_HEADER_LEN) || !header_check(CONN_B, chunk)) {
+            return fail("first read carries no stream header");
+        }
+        len = got - FAT_HEADER_LEN;
+        memcpy(m_page, &chunk[FAT_HEADER_LEN], len);
+        for (reads = 1; len < (int32_t) uint32_decode(&chunk[0]); reads++)
+        {
+            got = chunk_read(CONN_B, len, &m_page[len]);
+            if (got <= 0) {
+                return fail("page ended before the length in the header");
+            }
+            len += got;
+        }
+        if (!page_check(len, p_expected, total)) {
+            return false;
+        }
+        // Done already, without an empty read: it counts as completed and the next read starts over.
+        if (!metrics_read(CONN_B, metrics.value_handle, value) || (uint32_decode(&value[5]) != completed + 1)) {
+            return fail("transfer not done on its last byte");
+        }
+        got = chunk_read(CONN_B, 0, chunk);
+        if ((got < FAT_HEADER_LEN) || !header_check(CONN_B, chunk)) {
+            return fail("page still ends on an empty read");
+        }
+    } else {
+        // Offset reads are left as they are, they already end on a short reply.
+        if (!page_check(page_read(CONN_B, m_page, &reads), p_expected, total)) {
+            return false;
+        }
+    }
+
+    sim_disconnect(CONN_B);
+    (void) sim_connect(CONN_B);
+    sim_write(CONN_B, m_handles.control.value_handle, option, sizeof(option));
+    len = notify_collect(CONN_B, m_page, &notifications);
+    if ((len < FAT_HEADER_LEN) || !header_check(CONN_B, m_page)) {
+        return fail("first notification carries no stream header");
+    }
+    if (notifications >= plain_notifications) {
+        return fail("stream still ends on an empty notification");
+    }
+    memmove(m_page, &m_page[FAT_HEADER_LEN], len - FAT_HEADER_LEN);
+    if (!page_check(len - FAT_HEADER_LEN, p_expected, total)) {
+        return false;
+    }
+
+    snprintf(m_note, sizeof(m_note), "%u reads and %u notifications plain, %u and %u with the header",
+             plain_reads, plain_notifications, reads, notifications);
+    return true;
+}
+
+/**@brief Counters survive a reset, count completed and abandoned transfers and go back to flash. */
+static bool scenario_metrics(void)
+{
+    ble_gatts_char_handles_t     handles;
+    fat_metrics_t                saved;
+    fat_metrics_record_t const * p_record;
+    uint8_t                      value[FAT_METRICS_VALUE_LEN];
+    uint32_t                     hist_total = 0;
+    int32_t                      len;
+
+    // An older record on page 0, the latest on page 1, then a record torn by a reset.
+    memset(&saved, 0, sizeof(saved));
+    saved.connections   = 9;
+    metrics_record_put(0, 0, 4, &saved);
+    saved.connections   = 10;
+    saved.completed     = 6;
+    saved.abandoned     = 2;
+    saved.bytes_served  = 6000;
+    saved.transfer_ms   = 6 * 400;
+    saved.chunk_hist[6] = 6;
+    metrics_record_put(1, 0, 5, &saved);
+    metrics_record_put(1, 1, 9, &saved);
+    metrics_record_get(1, 1)->crc ^= 0x5555;
+
+    fat_client_boot(&m_handles);
+    if (sim_char_find(BLE_UUID_FAT_METRICS_CHAR, &handles) == 0) {
+        return fail("no metrics characteristic");
+    }
+    (void) sim_connect(CONN_A);
+    if (!metrics_read(CONN_A, handles.value_handle, value)) {
+        return false;
+    }
+    if ((uint32_decode(&value[1]) != 11) || (uint32_decode(&value[5]) != 6) || (uint32_decode(&value[9]) != 2) ||
+        (uint32_decode(&value[13]) != 6000) || (uint32_decode(&value[17]) != 400)) {
+        return fail("saved counters not restored");
+    }
+
+    len = page_read(CONN_A, m_page, NULL);
+    sim_disconnect(CONN_A);
+    (void) sim_connect(CONN_B);
+    if (chunk_read(CONN_B, 0, m_page) <= 0) {
+        return fail("first chunk not served");
+    }
+    sim_disconnect(CONN_B);
+
+    (void) sim_connect(CONN_A);
+    if (!metrics_read(CONN_A, handles.value_handle, value)) {
+        return false;
+    }
+    for (uint8_t i = 0; i < FAT_METRICS_HIST_BINS; i++)
+    {
+        hist_total += uint16_decode(&value[21 + 2 * i]);
+    }
+    if ((uint32_decode(&value[1]) != 13) || (uint32_decode(&value[5]) != 7) || (uint32_decode(&value[9]) != 3) ||
+        (uint32_decode(&value[13]) != 6000 + (uint32_t) len) || (hist_total != 7)) {
+        return fail("transfers not counted");
+    }
+
+    // Nothing is written before the save interval, then one record follows the torn one.
+    sim_time_advance(FAT_METRICS_SAVE_INTERVAL_MS - FAT_METRICS_TIMER_MS);
+    if ((sim_flash_run() != 0) || (metrics_record_get(1, 2)->magic != 0xFFFFFFFF)) {
+        return fail("metrics written early");
+    }
+    sim_time_advance(FAT_METRICS_TIMER_MS);
+    (void) sim_flash_run();
+    p_record = metrics_record_get(1, 2);
+    if ((p_record->magic != FAT_METRICS_MAGIC) || (p_record->seq != 6) || (p_record->metrics.connections != 13) ||
+        (p_record->metrics.abandoned != 3) || (p_record->metrics.completed != 7)) {
+        return fail("metrics record not written");
+    }
+
+    snprintf(m_note, sizeof(m_note), "%u connections, %u completed, %u abandoned, record %u saved",
+             p_record->metrics.connections, p_record->metrics.completed, p_record->metrics.abandoned, p_record->seq);
+    return true;
+}
+
+/**@brief Pages are served from the SoftDevice interrupt while the main loop is held up, the rest
+ *        catches up once it runs.
+ */
+static bool scenario_sched(void)
+{
+    ble_gatts_char_handles_t handles;
+    uint8_t                  value[FAT_METRICS_VALUE_LEN];
+    int32_t                  len;
+    uint16_t                 queued;
+
+    fat_client_boot(&m_handles);
+    if (sim_char_find(BLE_UUID_FAT_METRICS_CHAR, &handles) == 0) {
+        return fail("no metrics characteristic");
+    }
+
+    sim_idle_hold(true);
+    (void) sim_connect(CONN_A);
+    len = page_read(CONN_A, m_page, NULL);
+    if (!page_check(len, (uint8_t const *) STATIC_PAGE, STATIC_PAGE_LEN)) {
+        return false;
+    }
+    if (!metrics_read(CONN_A, handles.value_handle, value)) {
+        return false;
+    }
+    if ((uint32_decode(&value[1]) != 0) || (uint32_decode(&value[5]) != 0)) {
+        return fail("connection counted before the main loop ran");
+    }
+    queued = sim_sched_queued();
+
+    sim_idle_hold(false);
+    if (sim_sched_queued() != 0) {
+        return fail("scheduler queue not drained");
+    }
+    if (!metrics_read(CONN_A, handles.value_handle, value)) {
+        return false;
+    }
+    if ((uint32_decode(&value[1]) != 1) || (uint32_decode(&value[5]) != 1) ||
+        (uint32_decode(&value[13]) != (uint32_t) len)) {
+        return fail("deferred events lost");
+    }
+
+    snprintf(m_note, sizeof(m_note), "%d bytes served with %u events waiting for the main loop", len, queued);
+    return true;
+}
+
+/**@brief A full scheduler queue drops what doesn't fit instead of resetting the beacon, an
+ *        upload committed meanwhile still goes live.
+ */
+static bool scenario_sched_full(void)
+{
+    size_t   mark;
+    uint8_t  op;
+    uint8_t  status;
+    uint32_t pos;
+    uint16_t queued;
+    int32_t  len;
+    uint32_t page_len = fat_image_page_len(&m_identity);
+
+    fat_client_boot(&m_handles);
+    (void) sim_connect(CONN_A);
+    sim_mtu_exchange(CONN_A, FAT_ATT_MTU_MAX);
+    if (!upload_send(CONN_A, fat_image_page(&m_identity), page_len, 7, FAT_ENCODING_IDENTITY)) {
+        return false;
+    }
+
+    // Every read queues its transfer changes until one finds no room left.
+    sim_idle_hold(true);
+    do {
+        queued = sim_sched_queued();
+        len    = page_read(CONN_A, m_page, NULL);
+        if (!page_check(len, (uint8_t const *) STATIC_PAGE, STATIC_PAGE_LEN)) {
+            return false;
+        }
+    } while (sim_sched_queued() > queued);
+
+    mark = sim_rec_count();
+    upload_commit(CONN_A);
+    if (upload_status_get(CONN_A, mark, &op, &status, &pos)) {
+        return fail("commit ran with the main loop held up");
+    }
+
+    // The queue drains, the next BLE event finds room for the commit.
+    sim_idle_hold(false);
+    len = page_read(CONN_A, m_page, NULL);
+    if (!upload_status_get(CONN_A, mark, &op, &status, &pos) ||
+        (op != FAT_UPLOAD_OP_COMMIT) || (status != FAT_UPLOAD_STATUS_OK) || (pos != page_len)) {
+        return fail("commit lost to a full queue");
+    }
+    (void) sim_connect(CONN_B);
+    len = page_read(CONN_B, m_page, NULL);
+    if (!page_check(len, fat_image_page(&m_identity), page_len)) {
+        return false;
+    }
+
+    snprintf(m_note, sizeof(m_note), "queue full at %u events, commit went live after", queued);
+    return true;
+}
+
+/**@brief A disconnect that finds the scheduler queue full is held back, not lost, so the
+ *        fatbeacon frame still comes back once the main loop catches up.
+ */
+static bool scenario_sched_conn(void)
+{
+    uint16_t queued;
+    int32_t  len;
+
+    fat_client_boot(&m_handles);
+    (void) sim_connect(CONN_A);
+    (void) sim_connect(CONN_B);
+    (void) sim_connect(CONN_C);
+    if (sim_connect(CONN_D)) {
+        return fail("link accepted above the limit");
+    }
+
+    sim_idle_hold(true);
+    do {
+        queued = sim_sched_queued();
+        len    = page_read(CONN_A, m_page, NULL);
+        if (!page_check(len, (uint8_t const *) STATIC_PAGE, STATIC_PAGE_LEN)) {
+            return false;
+        }
+    } while (sim_sched_queued() > queued);
+    sim_disconnect(CONN_C);
+
+    // The queue drains, the next BLE event finds room for the disconnect.
+    sim_idle_hold(false);
+    len = page_read(CONN_A, m_page, NULL);
+    if (!sim_advertising() || !sim_connect(CONN_D)) {
+        return fail("disconnect lost to a full queue");
+    }
+    len = page_read(CONN_D, m_page, NULL);
+    if (!page_check(len, (uint8_t const *) STATIC_PAGE, STATIC_PAGE_LEN)) {
+        return false;
+    }
+
+    snprintf(m_note, sizeof(m_note), "queue full at %u events, advertising again after", queued);
+    return true;
+}
+
+#if FAT_TRACE_ENABLED
+
+/**@brief Returns record n of the trace channel, unpacked. */
+static void trace_rec_get(size_t n, fat_trace_evt_t * p_evt, uint32_t * p_ticks, uint16_t * p_conn, uint16_t * p_arg)
+{
+    uint8_t const * p_data;
+    fat_trace_rec_t rec;
+
+    (void) sim_rtt_trace_get(&p_data);
+    memcpy(&rec, p_data + n * sizeof(rec), sizeof(rec));
+    *p_evt   = (fat_trace_evt_t) (rec.stamp >> 24);
+    *p_ticks = rec.stamp & 0x00FFFFFF;
+    *p_conn  = rec.conn_handle;
+    *p_arg   = rec.arg;
+}
+
+/**@brief The trace holds a READ and a REPLY for every chunk, stamped with the client's timing,
+ *        and owns up to the records it dropped when the idle loop didn't drain it.
+ */
+static bool scenario_trace(void)
+{
+    uint8_t const * p_data;
+    uint8_t         chunk[SIM_MAX_DATA];
+    size_t          count;
+    size_t          n;
+    int32_t         got;
+    fat_trace_evt_t evt;
+    uint32_t        ticks;
+    uint16_t        conn;
+    uint16_t        arg;
+    uint32_t        len        = 0;
+    uint32_t        reads      = 0;
+    uint32_t        replied    = 0;
+    uint32_t        read_ticks = 0;
+    uint32_t        b_reads;
+    uint32_t        b_records  = 0;
+    uint32_t        lost       = 0;
+
+    fat_client_boot(&m_handles);
+    (void) sim_connect(CONN_A);
+    fat_trace_flush();
+    do {                                                          // A chunk every 7 ms, drained as
+        sim_time_advance(7);                                      // the idle loop would after each.
+        got = chunk_read(CONN_A, len, chunk);
+        if (got < 0) {
+            return fail("read refused");
+        }
+        len += got;
+        reads++;
+        fat_trace_flush();
+    } while (!fat_client_read_done(CONN_A, got));
+    sim_disconnect(CONN_A);
+    fat_trace_flush();
+
+    (void) sim_connect(CONN_B);                                   // No draining, the ring overruns.
+    (void) page_read(CONN_B, m_page, &b_reads);
+    sim_disconnect(CONN_B);
+    fat_trace_flush();
+
+    count = sim_rtt_trace_get(&p_data) / sizeof(fat_trace_rec_t);
+    if (m_trace_path != NULL) {
+        FILE * p_file = fopen(m_trace_path, "wb");
+
+        if ((p_file == NULL) || (fwrite(p_data, sizeof(fat_trace_rec_t), count, p_file) != count)) {
+            return fail("cannot write the trace file");
+        }
+        fclose(p_file);
+    }
+
+    trace_rec_get(0, &evt, &ticks, &conn, &arg);
+    if ((count < 3) || (evt != FAT_TRACE_EVT_START) || (arg != FAT_TRACE_VERSION)) {
+        return fail("trace doesn't start with a START record");
+    }
+    trace_rec_get(1, &evt, &ticks, &conn, &arg);
+    if ((evt != FAT_TRACE_EVT_CONNECT) || (conn != CONN_A)) {
+        return fail("no CONNECT record");
+    }
+    for (n = 2; n < count; n++)
+    {
+        trace_rec_get(n, &evt, &ticks, &conn, &arg);
+        if (evt == FAT_TRACE_EVT_DISCONNECT) {
+            break;
+        }
+        if ((evt != FAT_TRACE_EVT_READ) || (conn != CONN_A) || (n + 1 >= count)) {
+            return fail("expected a READ record");
+        }
+        // 7 ms is 229.4 RTC ticks.
+        if ((read_ticks != 0) && (((ticks - read_ticks) & 0x00FFFFFF) < 229 || ((ticks - read_ticks) & 0x00FFFFFF) > 230)) {
+            return fail("READ records not 7 ms apart");
+        }
+        read_ticks = ticks;
+        trace_rec_get(++n, &evt, &ticks, &conn, &arg);
+        if ((evt != FAT_TRACE_EVT_REPLY) || (conn != CONN_A) || (ticks != read_ticks)) {
+            return fail("READ not followed by its REPLY");
+        }
+        replied += arg;
+    }
+    if ((n - 2) / 2 != reads || replied != len) {
+        return fail("chunks missing from the trace");
+    }
+
+    for (n++; n < count; n++)
+    {
+        trace_rec_get(n, &evt, &ticks, &conn, &arg);
+        if (evt == FAT_TRACE_EVT_LOST) {
+            lost += arg;
+        } else {
+            b_records++;
+        }
+    }
+    if ((lost == 0) || (lost + b_records != 2 * b_reads + 2)) {
+        return fail("dropped records not accounted for");
+    }
+
+    snprintf(m_note, sizeof(m_note), "%u records, %u chunks traced, %u records lost unflushed",
+             (unsigned) count, reads, lost);
+    return true;
+}
+
+#endif
+
+static scenario_t const m_scenarios[] =
+{
+    { "read",       scenario_read },
+    { "read_mtu",   scenario_read_mtu },
+    { "stream",     scenario_stream },
+    { "links",      scenario_links },
+    { "flashed",    scenario_flashed },
+    { "deflate",    scenario_deflate },
+    { "template",   scenario_template },
+    { "sensor",     scenario_sensor },
+    { "upload",     scenario_upload },
+    { "upload_busy", scenario_upload_busy },
+    { "upload_seal", scenario_upload_seal },
+    { "conn_params", scenario_conn_params },
+    { "params_retry", scenario_params_retry },
+    { "adv",        scenario_adv },
+    { "tlm",        scenario_tlm },
+    { "hash",       scenario_hash },
+    { "resume",     scenario_resume },
+    { "header",     scenario_header },
+    { "metrics",    scenario_metrics },
+    { "sched",      scenario_sched },
+    { "sched_full", scenario_sched_full },
+    { "sched_conn", scenario_sched_conn },
+#if FAT_TRACE_ENABLED
+    { "trace",      scenario_trace },
+#endif
+};
+
+#define SCENARIO_COUNT              (sizeof(m_scenarios) / sizeof(m_scenarios[0]))
+
+
+/*
+ * Driver
+ */
+
+int main(int argc, char ** argv)
+{
+    int      arg    = 1;
+    uint32_t failed = 0;
+
+    if ((argc > arg) && (strcmp(argv[arg], "-v") == 0)) {
+        sim_verbose_set(true);
+        arg++;
+    }
+    if ((argc > arg + 1) && (strcmp(argv[arg], "-t") == 0)) {
+        m_trace_path = argv[arg + 1];
+        arg += 2;
+    }
+    if ((argc - arg != 3) || !fat_image_load(argv[arg], &m_identity) || !fat_image_load(argv[arg + 1], &m_deflate) ||
+        !fat_image_load(argv[arg + 2], &m_template)) {
+        fprintf(stderr, "usage: %s [-v] [-t <trace file>] <identity image> <deflate image> <template image>\n", argv[0]);
+        return 2;
+    }
+
+    printf("fatsim: %s read mode\n", (APP_FAT_READ_MODE == BLE_FAT_READ_MODE_CURSOR) ? "cursor" : "offset");
+
+    for (uint32_t i = 0; i < SCENARIO_COUNT; i++)
+    {
+        int   status;
+        int   fds[2];
+        char  note[sizeof(m_note)] = "";
+        pid_t pid;
+
+        // Each scenario gets a freshly booted firmware in its own process.
+        fflush(stdout);
+        if (pipe(fds) != 0) {
+            perror("pipe");
+            return 2;
+        }
+        pid = fork();
+        if (pid == 0) {
+            bool pass = m_scenarios[i].run();
+
+            // A call the stack would have refused fails the scenario even if the page arrived.
+            if (pass && (sim_stats()->errors > 0)) {
+                snprintf(m_note, sizeof(m_note), "%u calls rejected by the stack", sim_stats()->errors);
+                pass = false;
+            }
+            (void) write(fds[1], m_note, strlen(m_note) + 1);
+            _exit(pass ? 0 : 1);
+        }
+        close(fds[1]);
+        (void) read(fds[0], note, sizeof(note) - 1);
+        close(fds[0]);
+        (void) waitpid(pid, &status, 0);
+
+        if (WIFEXITED(status) && (WEXITSTATUS(status) == 0)) {
+            printf("  pass  %-12s %s\n", m_scenarios[i].name, note);
+        } else {
+            printf("  FAIL  %-12s %s\n", m_scenarios[i].name,
+                   WIFSIGNALED(status) ? "firmware crashed" : note);
+            failed++;
+        }
+    }
+
+    printf("fatsim: %u of %u scenarios passed\n", (unsigned) (SCENARIO_COUNT - failed),
+           (unsigned) SCENARIO_COUNT);
+    return (failed == 0) ? 0 : 1;
+}
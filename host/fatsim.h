@@ -0,0 +1,104 @@
+#ifndef FATSIM_H__
+#define FATSIM_H__
+
+/* Host build of the fatbeacon firmware.
+ *
+ * main.c, ble_fat.c, fat_store.c and fat_inflate.c are compiled unchanged against the headers in
+ * host/sdk, which stand in for the nRF5 SDK and the S132 SoftDevice.  sd_sim.c plays the
+ * SoftDevice: it hands out attribute handles, checks calls the way the stack would (pending
+ * authorizations, CCCD state, ATT MTU, TX buffers) and records every authorize reply and
+ * notification.  sdk_sim.c covers the SDK libraries, with fstorage backed by a RAM flash, and the
+ * RuuviTag's sensors, which read whatever sim_sensor_set() last gave them.
+ *
+ * A test boots the firmware with sim_boot(), which runs main() until it first waits for an event,
+ * then drives it by injecting events.  After each one sim_idle() drains the app_scheduler queue,
+ * as the main loop would on waking up.  Everything runs on the calling thread and nothing depends
+ * on wall clock time, so a run is fully repeatable.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "ble.h"
+#include "fat_sensor.h"
+
+#define SIM_MAX_CONNS       8
+#define SIM_MAX_DATA        256
+
+typedef enum
+{
+    SIM_REC_READ_REPLY,                                           /**< sd_ble_gatts_rw_authorize_reply() for a read. */
+    SIM_REC_WRITE_REPLY,                                          /**< sd_ble_gatts_rw_authorize_reply() for a write. */
+    SIM_REC_HVX,                                                  /**< Notification or indication queued with sd_ble_gatts_hvx(). */
+} sim_rec_type_t;
+
+/**@brief One call from the firmware into the SoftDevice, as recorded by the simulator. */
+typedef struct
+{
+    sim_rec_type_t                  type;
+    uint16_t                        conn_handle;
+    uint16_t                        handle;                       /**< Attribute the reply or notification is for. */
+    uint16_t                        gatt_status;                  /**< Replies only. */
+    uint16_t                        len;
+    uint8_t                         data[SIM_MAX_DATA];
+} sim_rec_t;
+
+/**@brief SoftDevice calls counted by the simulator. */
+typedef struct
+{
+    uint32_t                        adv_starts;
+    uint32_t                        conn_param_updates;
+    uint32_t                        replies;
+    uint32_t                        hvx;
+    uint32_t                        hvx_no_tx;                    /**< hvx calls refused for lack of TX buffers. */
+    uint32_t                        errors;                       /**< Calls the real stack would have rejected. */
+} sim_stats_t;
+
+// Firmware
+void     sim_boot(void);
+void     sim_verbose_set(bool verbose);
+
+// Events
+bool     sim_connect(uint16_t conn_handle);
+void     sim_disconnect(uint16_t conn_handle);
+void     sim_adv_timeout(void);
+void     sim_button_press(void);
+void     sim_mtu_exchange(uint16_t conn_handle, uint16_t client_rx_mtu);
+void     sim_write(uint16_t conn_handle, uint16_t handle, uint8_t const * p_data, uint16_t len);
+bool     sim_read(uint16_t conn_handle, uint16_t handle, uint16_t offset, sim_rec_t * p_reply);
+void     sim_tx_buffers_set(uint16_t conn_handle, uint8_t count);
+void     sim_central_min_interval_set(uint16_t conn_handle, uint16_t interval);
+void     sim_central_updates_ignore(uint16_t conn_handle, uint8_t count);
+void     sim_tx_complete(uint16_t conn_handle, uint8_t count);
+uint8_t  sim_tx_queued(uint16_t conn_handle);
+void     sim_sys_evt_send(uint32_t sys_evt);
+void     sim_idle(void);
+void     sim_procedures_run(void);
+void     sim_idle_hold(bool hold);
+uint16_t sim_sched_queued(void);
+uint32_t sim_flash_run(void);
+bool     sim_flash_step(void);
+uint32_t const * sim_flash_next(void);
+void     sim_time_advance(uint32_t ms);
+uint32_t sim_time_ms(void);
+void     sim_sensor_set(fat_sensor_data_t const * p_data);
+
+// Inspection
+uint16_t sim_char_find(uint16_t uuid, ble_gatts_char_handles_t * p_handles);
+uint16_t sim_att_mtu(uint16_t conn_handle);
+bool     sim_conn_params_get(uint16_t conn_handle, ble_gap_conn_params_t * p_params);
+bool     sim_advertising(void);
+bool     sim_adv_params_get(ble_gap_adv_params_t * p_params);
+uint8_t  sim_adv_data_get(uint8_t const ** pp_adv, uint8_t const ** pp_sr, uint8_t * p_sr_len);
+size_t   sim_rec_count(void);
+sim_rec_t const * sim_rec_get(size_t index);
+void     sim_rec_clear(void);
+sim_stats_t const * sim_stats(void);
+size_t   sim_rtt_trace_get(uint8_t const ** pp_data);
+uint32_t sim_sensor_samples(void);
+
+// Flash
+uint32_t * sim_flash_base(void);
+size_t   sim_flash_size(void);
+
+#endif
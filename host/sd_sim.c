@@ -0,0 +1,981 @@
+/*****************************************************************************
+*
+* sd_sim.c
+*
+* This stands in for the S132 SoftDevice so the firmware can run on a
+* host.  It allocates attribute handles, delivers injected GAP and GATTS
+* events to the handler main.c registers, checks each call the way the
+* stack would and records every authorize reply and notification.
+*
+* Copyright (c) 2016 Matt Roche
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+********************************************************************************/
+
+
+#include "fatsim.h"
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nordic_common.h"
+#include "ble_srv_common.h"
+#include "softdevice_handler.h"
+
+#define SIM_MAX_CHARS           16
+#define SIM_VS_UUID_MAX         4                                 /**< Vendor specific UUID bases kept for sd_ble_uuid_encode(). */
+#define SIM_TX_BUFFERS_LOW      1                                 /**< Notifications the stack takes before BLE_ERROR_NO_TX_PACKETS, */
+#define SIM_TX_BUFFERS_MID      3                                 /**< by connection bandwidth. */
+#define SIM_TX_BUFFERS_HIGH     6
+#define SIM_CONN_INTERVAL       24                                /**< Interval a central connects with, 30 ms. */
+#define SIM_ADV_INTERVAL_MIN    0x0020                            /**< Advertising interval limits, 0.625 ms units. */
+#define SIM_ADV_INTERVAL_MAX    0x4000
+#define SIM_ADV_NONCONN_INTERVAL_MIN 0x00A0
+#define SIM_CENTRAL_MIN_INTERVAL 6                                /**< Shortest interval a central grants unless told otherwise, 7.5 ms. */
+
+int fatbeacon_main(void);                                         /**< main() of main.c, renamed by the host build. */
+
+typedef struct
+{
+    uint16_t                        uuid;
+    uint8_t                         uuid_type;
+    bool                            rd_auth;
+    ble_gatts_char_handles_t        handles;
+    uint16_t                        max_len;
+    uint16_t                        value_len;
+    uint8_t                         value[SIM_MAX_DATA];          /**< Value kept by the stack, served to reads that need no authorization. */
+} sim_char_t;
+
+typedef struct
+{
+    bool                            connected;
+    uint16_t                        conn_handle;
+    uint16_t                        att_mtu;
+    uint8_t                         tx_max;
+    uint8_t                         tx_free;
+    bool                            read_pending;                 /**< An authorize request is waiting for its reply. */
+    uint16_t                        read_handle;
+    bool                            mtu_pending;
+    uint16_t                        client_rx_mtu;
+    bool                            disconnect_pending;           /**< sd_ble_gap_disconnect() called, event not delivered yet. */
+    ble_gap_conn_params_t           conn_params;                  /**< Parameters the connection runs on. */
+    uint16_t                        central_min_interval;         /**< Shortest interval the central grants. */
+    bool                            update_pending;               /**< sd_ble_gap_conn_param_update() called, event not delivered yet. */
+    uint8_t                         updates_ignored;              /**< Requests the central drops without an answer, see sim_central_updates_ignore(). */
+    ble_gap_conn_params_t           update_request;
+    uint16_t                        cccd[SIM_MAX_CHARS];          /**< CCCD value of each characteristic on this connection. */
+} sim_conn_t;
+
+static jmp_buf                      m_boot_jmp;
+static ble_evt_handler_t            m_ble_evt_handler;
+static sys_evt_handler_t            m_sys_evt_handler;
+static ble_enable_params_t          m_enable_params;
+static ble_conn_bw_counts_t         m_conn_bw_counts;             /**< Links of each bandwidth reserved by softdevice_enable(). */
+static uint8_t                      m_conn_bw = BLE_CONN_BW_MID;  /**< Bandwidth of new connections, BLE_COMMON_OPT_CONN_BW. */
+
+static sim_char_t                   m_chars[SIM_MAX_CHARS];
+static uint8_t                      m_char_count;
+static uint16_t                     m_next_handle = 1;
+static uint8_t                      m_vs_uuid_count;
+static ble_uuid128_t                m_vs_uuids[SIM_VS_UUID_MAX];  /**< Bases added with sd_ble_uuid_vs_add(). */
+static uint8_t                      m_dev_name[BLE_GAP_DEVNAME_MAX_LEN];
+static uint16_t                     m_dev_name_len;
+
+static sim_conn_t                   m_conns[SIM_MAX_CONNS];
+static bool                         m_advertising;
+static ble_gap_adv_params_t         m_adv_params;                 /**< Parameters of the running or last advertising. */
+static uint8_t                      m_adv_data[BLE_GAP_ADV_MAX_SIZE];     /**< Last sd_ble_gap_adv_data_set(). */
+static uint8_t                      m_adv_data_len;
+static uint8_t                      m_sr_data[BLE_GAP_ADV_MAX_SIZE];
+static uint8_t                      m_sr_data_len;
+static ble_gap_conn_params_t        m_ppcp;                       /**< Used by sd_ble_gap_conn_param_update() without parameters. */
+
+static sim_rec_t *                  m_recs;
+static size_t                       m_rec_count;
+static size_t                       m_rec_cap;
+static sim_stats_t                  m_stats;
+
+// Room for a write event carrying a full ATT payload behind the fixed part of ble_evt_t.
+static union
+{
+    ble_evt_t                       evt;
+    uint8_t                         raw[sizeof(ble_evt_t) + SIM_MAX_DATA];
+} m_evt_buf;
+
+
+static sim_conn_t * conn_get(uint16_t conn_handle)
+{
+    for (uint32_t i = 0; i < SIM_MAX_CONNS; i++)
+    {
+        if (m_conns[i].connected && (m_conns[i].conn_handle == conn_handle)) {
+            return &m_conns[i];
+        }
+    }
+    return NULL;
+}
+
+static sim_char_t * char_by_value_handle(uint16_t handle, uint32_t * p_index)
+{
+    for (uint32_t i = 0; i < m_char_count; i++)
+    {
+        if (m_chars[i].handles.value_handle == handle) {
+            if (p_index != NULL) {
+                *p_index = i;
+            }
+            return &m_chars[i];
+        }
+    }
+    return NULL;
+}
+
+/**@brief Counts a call the real stack would have refused and hands back its error code. */
+static uint32_t sim_error(char const * p_call, uint32_t err_code)
+{
+    m_stats.errors++;
+    fprintf(stderr, "fatsim: %s rejected, error 0x%x\n", p_call, (unsigned) err_code);
+    return err_code;
+}
+
+static void rec_add(sim_rec_type_t type, uint16_t conn_handle, uint16_t handle, uint16_t gatt_status,
+                    uint8_t const * p_data, uint16_t len)
+{
+    sim_rec_t * p_rec;
+
+    if (m_rec_count == m_rec_cap) {
+        m_rec_cap = (m_rec_cap == 0) ? 256 : 2 * m_rec_cap;
+        m_recs    = realloc(m_recs, m_rec_cap * sizeof(sim_rec_t));
+        if (m_recs == NULL) {
+            abort();
+        }
+    }
+
+    p_rec = &m_recs[m_rec_count++];
+    memset(p_rec, 0, sizeof(*p_rec));
+    p_rec->type        = type;
+    p_rec->conn_handle = conn_handle;
+    p_rec->handle      = handle;
+    p_rec->gatt_status = gatt_status;
+    p_rec->len         = MIN(len, SIM_MAX_DATA);
+    if (p_data != NULL) {
+        memcpy(p_rec->data, p_data, p_rec->len);
+    }
+}
+
+static ble_evt_t * evt_new(uint16_t evt_id, uint16_t conn_handle)
+{
+    memset(&m_evt_buf, 0, sizeof(m_evt_buf));
+    m_evt_buf.evt.header.evt_id   = evt_id;
+    m_evt_buf.evt.header.evt_len  = sizeof(ble_evt_t);
+    // conn_handle sits first in every event group, set them all so any view of the event works.
+    m_evt_buf.evt.evt.common_evt.conn_handle = conn_handle;
+    m_evt_buf.evt.evt.gap_evt.conn_handle    = conn_handle;
+    m_evt_buf.evt.evt.gatts_evt.conn_handle  = conn_handle;
+    return &m_evt_buf.evt;
+}
+
+static void conn_param_update_finish(sim_conn_t * p_conn);
+
+/**@brief Delivers an event and lets the main loop run, then delivers the outcome of any
+ *        procedures the firmware started on the way.
+ */
+static void evt_send(ble_evt_t * p_evt)
+{
+    if (m_ble_evt_handler == NULL) {
+        fprintf(stderr, "fatsim: event 0x%x before softdevice_ble_evt_handler_set()\n", p_evt->header.evt_id);
+        return;
+    }
+    m_ble_evt_handler(p_evt);
+    sim_idle();
+    sim_procedures_run();
+}
+
+/**@brief Plays the central's side of a connection parameter update.
+ *
+ * @details The central grants the request if it can run an interval in the requested range,
+ *          otherwise it turns it down and the event reports the parameters unchanged.
+ */
+static void conn_param_update_finish(sim_conn_t * p_conn)
+{
+    ble_gap_conn_params_t const * p_req = &p_conn->update_request;
+    ble_evt_t *                   p_evt;
+
+    p_conn->update_pending = false;
+    if (p_conn->updates_ignored > 0) {
+        p_conn->updates_ignored--;                                // No answer, so no event either.
+        return;
+    }
+    if (p_req->max_conn_interval >= p_conn->central_min_interval) {
+        p_conn->conn_params.min_conn_interval = MAX(p_req->min_conn_interval, p_conn->central_min_interval);
+        p_conn->conn_params.max_conn_interval = p_conn->conn_params.min_conn_interval;
+        p_conn->conn_params.slave_latency     = p_req->slave_latency;
+        p_conn->conn_params.conn_sup_timeout  = p_req->conn_sup_timeout;
+    }
+
+    p_evt = evt_new(BLE_GAP_EVT_CONN_PARAM_UPDATE, p_conn->conn_handle);
+    p_evt->evt.gap_evt.params.conn_param_update.conn_params = p_conn->conn_params;
+    evt_send(p_evt);
+}
+
+
+/*
+ * Simulator API
+ */
+
+/**@brief Delivers the outcome of the disconnects and parameter updates the firmware started.
+ *
+ * @details Run after every event, and by sim_time_advance() for procedures a timeout started.
+ */
+void sim_procedures_run(void)
+{
+    for (uint32_t i = 0; i < SIM_MAX_CONNS; i++)
+    {
+        if (m_conns[i].connected && m_conns[i].disconnect_pending) {
+            sim_disconnect(m_conns[i].conn_handle);
+        }
+    }
+    for (uint32_t i = 0; i < SIM_MAX_CONNS; i++)
+    {
+        if (m_conns[i].connected && m_conns[i].update_pending) {
+            conn_param_update_finish(&m_conns[i]);
+        }
+    }
+}
+
+void sim_boot(void)
+{
+    if (setjmp(m_boot_jmp) == 0) {
+        (void) fatbeacon_main();
+        fprintf(stderr, "fatsim: main() returned\n");
+    }
+}
+
+bool sim_connect(uint16_t conn_handle)
+{
+    sim_conn_t * p_conn = NULL;
+    ble_evt_t *  p_evt;
+    uint32_t     count  = 0;
+
+    for (uint32_t i = 0; i < SIM_MAX_CONNS; i++)
+    {
+        if (m_conns[i].connected) {
+            count++;
+        } else if (p_conn == NULL) {
+            p_conn = &m_conns[i];
+        }
+    }
+
+    // A central can only connect to a device that is advertising connectable.
+    if (!m_advertising || (m_adv_params.type != BLE_GAP_ADV_TYPE_ADV_IND) || (p_conn == NULL) ||
+        (count >= m_enable_params.gap_enable_params.periph_conn_count)) {
+        return false;
+    }
+    m_advertising = false;
+
+    memset(p_conn, 0, sizeof(*p_conn));
+    p_conn->connected   = true;
+    p_conn->conn_handle = conn_handle;
+    p_conn->att_mtu     = GATT_MTU_SIZE_DEFAULT;
+    p_conn->tx_max      = (m_conn_bw == BLE_CONN_BW_HIGH) ? SIM_TX_BUFFERS_HIGH
+                        : (m_conn_bw == BLE_CONN_BW_LOW)  ? SIM_TX_BUFFERS_LOW
+                        :                                   SIM_TX_BUFFERS_MID;
+    p_conn->tx_free     = p_conn->tx_max;
+    p_conn->conn_params.min_conn_interval = SIM_CONN_INTERVAL;
+    p_conn->conn_params.max_conn_interval = SIM_CONN_INTERVAL;
+    p_conn->conn_params.conn_sup_timeout  = 400;
+    p_conn->central_min_interval          = SIM_CENTRAL_MIN_INTERVAL;
+
+    p_evt = evt_new(BLE_GAP_EVT_CONNECTED, conn_handle);
+    p_evt->evt.gap_evt.params.connected.role = BLE_GAP_ROLE_PERIPH;
+    p_evt->evt.gap_evt.params.connected.conn_params = p_conn->conn_params;
+    evt_send(p_evt);
+    return true;
+}
+
+void sim_disconnect(uint16_t conn_handle)
+{
+    sim_conn_t * p_conn = conn_get(conn_handle);
+    ble_evt_t *  p_evt;
+
+    if (p_conn == NULL) {
+        return;
+    }
+    memset(p_conn, 0, sizeof(*p_conn));
+
+    p_evt = evt_new(BLE_GAP_EVT_DISCONNECTED, conn_handle);
+    p_evt->evt.gap_evt.params.disconnected.reason = BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION;
+    evt_send(p_evt);
+}
+
+void sim_adv_timeout(void)
+{
+    ble_evt_t * p_evt;
+
+    if (!m_advertising) {
+        return;
+    }
+    m_advertising = false;
+
+    p_evt = evt_new(BLE_GAP_EVT_TIMEOUT, BLE_CONN_HANDLE_INVALID);
+    p_evt->evt.gap_evt.params.timeout.src = BLE_GAP_TIMEOUT_SRC_ADVERTISING;
+    evt_send(p_evt);
+}
+
+void sim_mtu_exchange(uint16_t conn_handle, uint16_t client_rx_mtu)
+{
+    sim_conn_t * p_conn = conn_get(conn_handle);
+    ble_evt_t *  p_evt;
+
+    if (p_conn == NULL) {
+        return;
+    }
+    p_conn->mtu_pending   = true;
+    p_conn->client_rx_mtu = client_rx_mtu;
+
+    p_evt = evt_new(BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST, conn_handle);
+    p_evt->evt.gatts_evt.params.exchange_mtu_request.client_rx_mtu = client_rx_mtu;
+    evt_send(p_evt);
+
+    if (p_conn->mtu_pending) {
+        p_conn->mtu_pending = false;
+        (void) sim_error("exchange MTU request", NRF_ERROR_INVALID_STATE);    // Left unanswered.
+    }
+}
+
+void sim_write(uint16_t conn_handle, uint16_t handle, uint8_t const * p_data, uint16_t len)
+{
+    sim_conn_t * p_conn = conn_get(conn_handle);
+    ble_evt_t *  p_evt;
+
+    if ((p_conn == NULL) || (len > SIM_MAX_DATA)) {
+        return;
+    }
+
+    // The stack keeps CCCD values itself and then reports the write like any other.
+    for (uint32_t i = 0; i < m_char_count; i++)
+    {
+        if ((m_chars[i].handles.cccd_handle == handle) && (len == BLE_CCCD_VALUE_LEN)) {
+            p_conn->cccd[i] = uint16_decode(p_data);
+        }
+    }
+
+    p_evt = evt_new(BLE_GATTS_EVT_WRITE, conn_handle);
+    p_evt->evt.gatts_evt.params.write.handle = handle;
+    p_evt->evt.gatts_evt.params.write.op     = BLE_GATTS_OP_WRITE_REQ;
+    p_evt->evt.gatts_evt.params.write.len    = len;
+    memcpy(p_evt->evt.gatts_evt.params.write.data, p_data, len);
+    evt_send(p_evt);
+}
+
+bool sim_read(uint16_t conn_handle, uint16_t handle, uint16_t offset, sim_rec_t * p_reply)
+{
+    sim_conn_t * p_conn = conn_get(conn_handle);
+    sim_char_t * p_char = char_by_value_handle(handle, NULL);
+    size_t       first  = m_rec_count;
+    ble_evt_t *  p_evt;
+
+    if ((p_conn == NULL) || (p_char == NULL)) {
+        return false;
+    }
+    if (!p_char->rd_auth) {
+        // The stack answers from the stored value, a Read Blob from any offset within it.
+        if (offset > p_char->value_len) {
+            rec_add(SIM_REC_READ_REPLY, conn_handle, handle, BLE_GATT_STATUS_ATTERR_INVALID_OFFSET, NULL, 0);
+        } else {
+            rec_add(SIM_REC_READ_REPLY, conn_handle, handle, BLE_GATT_STATUS_SUCCESS, &p_char->value[offset],
+                    MIN(p_char->value_len - offset, p_conn->att_mtu - 1));
+        }
+        if (p_reply != NULL) {
+            *p_reply = m_recs[m_rec_count - 1];
+        }
+        return true;
+    }
+    p_conn->read_pending = true;
+    p_conn->read_handle  = handle;
+
+    p_evt = evt_new(BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST, conn_handle);
+    p_evt->evt.gatts_evt.params.authorize_request.type                = BLE_GATTS_AUTHORIZE_TYPE_READ;
+    p_evt->evt.gatts_evt.params.authorize_request.request.read.handle = handle;
+    p_evt->evt.gatts_evt.params.authorize_request.request.read.offset = offset;
+    evt_send(p_evt);
+
+    if (p_conn->connected && p_conn->read_pending) {
+        p_conn->read_pending = false;
+        (void) sim_error("read authorization", NRF_ERROR_INVALID_STATE);     // Left unanswered.
+        return false;
+    }
+
+    for (size_t i = first; i < m_rec_count; i++)
+    {
+        if ((m_recs[i].type == SIM_REC_READ_REPLY) && (m_recs[i].conn_handle == conn_handle)) {
+            if (p_reply != NULL) {
+                *p_reply = m_recs[i];
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void sim_tx_buffers_set(uint16_t conn_handle, uint8_t count)
+{
+    sim_conn_t * p_conn = conn_get(conn_handle);
+
+    if (p_conn != NULL) {
+        p_conn->tx_max  = count;
+        p_conn->tx_free = count;
+    }
+}
+
+void sim_tx_complete(uint16_t conn_handle, uint8_t count)
+{
+    sim_conn_t * p_conn = conn_get(conn_handle);
+    ble_evt_t *  p_evt;
+
+    if (p_conn == NULL) {
+        return;
+    }
+    count = MIN(count, p_conn->tx_max - p_conn->tx_free);
+    if (count == 0) {
+        return;
+    }
+    p_conn->tx_free += count;
+
+    p_evt = evt_new(BLE_EVT_TX_COMPLETE, conn_handle);
+    p_evt->evt.common_evt.params.tx_complete.count = count;
+    evt_send(p_evt);
+}
+
+uint8_t sim_tx_queued(uint16_t conn_handle)
+{
+    sim_conn_t * p_conn = conn_get(conn_handle);
+
+    return (p_conn != NULL) ? (p_conn->tx_max - p_conn->tx_free) : 0;
+}
+
+void sim_sys_evt_send(uint32_t sys_evt)
+{
+    if (m_sys_evt_handler != NULL) {
+        m_sys_evt_handler(sys_evt);
+        sim_idle();
+    }
+}
+
+uint16_t sim_char_find(uint16_t uuid, ble_gatts_char_handles_t * p_handles)
+{
+    for (uint32_t i = 0; i < m_char_count; i++)
+    {
+        if (m_chars[i].uuid == uuid) {
+            if (p_handles != NULL) {
+                *p_handles = m_chars[i].handles;
+            }
+            return m_chars[i].handles.value_handle;
+        }
+    }
+    return BLE_GATT_HANDLE_INVALID;
+}
+
+void sim_central_min_interval_set(uint16_t conn_handle, uint16_t interval)
+{
+    sim_conn_t * p_conn = conn_get(conn_handle);
+
+    if (p_conn != NULL) {
+        p_conn->central_min_interval = interval;
+    }
+}
+
+void sim_central_updates_ignore(uint16_t conn_handle, uint8_t count)
+{
+    sim_conn_t * p_conn = conn_get(conn_handle);
+
+    if (p_conn != NULL) {
+        p_conn->updates_ignored = count;
+    }
+}
+
+bool sim_conn_params_get(uint16_t conn_handle, ble_gap_conn_params_t * p_params)
+{
+    sim_conn_t * p_conn = conn_get(conn_handle);
+
+    if (p_conn == NULL) {
+        return false;
+    }
+    *p_params = p_conn->conn_params;
+    return true;
+}
+
+uint16_t sim_att_mtu(uint16_t conn_handle)
+{
+    sim_conn_t * p_conn = conn_get(conn_handle);
+
+    return (p_conn != NULL) ? p_conn->att_mtu : 0;
+}
+
+bool sim_advertising(void)
+{
+    return m_advertising;
+}
+
+bool sim_adv_params_get(ble_gap_adv_params_t * p_params)
+{
+    *p_params = m_adv_params;
+    return m_advertising;
+}
+
+uint8_t sim_adv_data_get(uint8_t const ** pp_adv, uint8_t const ** pp_sr, uint8_t * p_sr_len)
+{
+    *pp_adv   = m_adv_data;
+    *pp_sr    = m_sr_data;
+    *p_sr_len = m_sr_data_len;
+    return m_adv_data_len;
+}
+
+size_t sim_rec_count(void)
+{
+    return m_rec_count;
+}
+
+sim_rec_t const * sim_rec_get(size_t index)
+{
+    return (index < m_rec_count) ? &m_recs[index] : NULL;
+}
+
+void sim_rec_clear(void)
+{
+    m_rec_count = 0;
+}
+
+sim_stats_t const * sim_stats(void)
+{
+    return &m_stats;
+}
+
+
+/*
+ * SoftDevice handler library
+ */
+
+uint32_t softdevice_handler_init(nrf_clock_lf_cfg_t * p_clock, void * p_ble_evt_buffer, uint16_t size, void * evt_schedule_func)
+{
+    return NRF_SUCCESS;
+}
+
+uint32_t softdevice_enable_get_default_config(uint8_t central_links_count, uint8_t periph_links_count, ble_enable_params_t * p_ble_enable_params)
+{
+    memset(p_ble_enable_params, 0, sizeof(*p_ble_enable_params));
+    p_ble_enable_params->common_enable_params.vs_uuid_count = 1;
+    p_ble_enable_params->gap_enable_params.periph_conn_count  = periph_links_count;
+    p_ble_enable_params->gap_enable_params.central_conn_count = central_links_count;
+    p_ble_enable_params->gatt_enable_params.att_mtu           = GATT_MTU_SIZE_DEFAULT;
+    return NRF_SUCCESS;
+}
+
+uint32_t softdevice_enable(ble_enable_params_t * p_ble_enable_params)
+{
+    m_enable_params = *p_ble_enable_params;
+    if (m_enable_params.gatt_enable_params.att_mtu == 0) {
+        m_enable_params.gatt_enable_params.att_mtu = GATT_MTU_SIZE_DEFAULT;
+    }
+    if (m_enable_params.gap_enable_params.periph_conn_count > SIM_MAX_CONNS) {
+        return sim_error("softdevice_enable", NRF_ERROR_INVALID_PARAM);
+    }
+    // Without counts the stack reserves BLE_CONN_BW_MID for every link.
+    memset(&m_conn_bw_counts, 0, sizeof(m_conn_bw_counts));
+    if (p_ble_enable_params->common_enable_params.p_conn_bw_counts != NULL) {
+        m_conn_bw_counts = *p_ble_enable_params->common_enable_params.p_conn_bw_counts;
+        m_enable_params.common_enable_params.p_conn_bw_counts = NULL;
+    } else {
+        m_conn_bw_counts.tx_counts.mid_count = m_enable_params.gap_enable_params.periph_conn_count;
+        m_conn_bw_counts.rx_counts.mid_count = m_enable_params.gap_enable_params.periph_conn_count;
+    }
+    if (m_conn_bw_counts.tx_counts.high_count + m_conn_bw_counts.tx_counts.mid_count +
+        m_conn_bw_counts.tx_counts.low_count < m_enable_params.gap_enable_params.periph_conn_count) {
+        return sim_error("softdevice_enable", NRF_ERROR_INVALID_PARAM);
+    }
+    return NRF_SUCCESS;
+}
+
+uint32_t softdevice_ble_evt_handler_set(ble_evt_handler_t ble_evt_handler)
+{
+    m_ble_evt_handler = ble_evt_handler;
+    return NRF_SUCCESS;
+}
+
+uint32_t softdevice_sys_evt_handler_set(sys_evt_handler_t sys_evt_handler)
+{
+    m_sys_evt_handler = sys_evt_handler;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_check_ram_start(uint32_t sd_req_ram_start)
+{
+    return NRF_SUCCESS;
+}
+
+
+/*
+ * SoftDevice calls
+ */
+
+uint32_t sd_app_evt_wait(void)
+{
+    // main() has finished setting up and gone to sleep, hand control back to sim_boot().
+    longjmp(m_boot_jmp, 1);
+}
+
+uint32_t sd_ble_uuid_vs_add(ble_uuid128_t const * p_vs_uuid, uint8_t * p_uuid_type)
+{
+    if ((m_vs_uuid_count >= m_enable_params.common_enable_params.vs_uuid_count) ||
+        (m_vs_uuid_count >= SIM_VS_UUID_MAX)) {
+        return sim_error("sd_ble_uuid_vs_add", NRF_ERROR_NO_MEM);
+    }
+    m_vs_uuids[m_vs_uuid_count] = *p_vs_uuid;
+    *p_uuid_type = BLE_UUID_TYPE_BLE + 1 + m_vs_uuid_count++;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_uuid_encode(ble_uuid_t const * p_uuid, uint8_t * p_uuid_le_len, uint8_t * p_uuid_le)
+{
+    if (p_uuid->type == BLE_UUID_TYPE_BLE) {
+        *p_uuid_le_len = 2;
+        if (p_uuid_le != NULL) {
+            p_uuid_le[0] = (uint8_t) p_uuid->uuid;
+            p_uuid_le[1] = (uint8_t) (p_uuid->uuid >> 8);
+        }
+        return NRF_SUCCESS;
+    }
+    if ((p_uuid->type <= BLE_UUID_TYPE_BLE) || (p_uuid->type > BLE_UUID_TYPE_BLE + m_vs_uuid_count)) {
+        return sim_error("sd_ble_uuid_encode", NRF_ERROR_INVALID_PARAM);
+    }
+    // The 16-bit UUID goes in bytes 12 and 13 of the base, little endian like the rest.
+    *p_uuid_le_len = sizeof(ble_uuid128_t);
+    if (p_uuid_le != NULL) {
+        memcpy(p_uuid_le, m_vs_uuids[p_uuid->type - BLE_UUID_TYPE_BLE - 1].uuid128, sizeof(ble_uuid128_t));
+        p_uuid_le[12] = (uint8_t) p_uuid->uuid;
+        p_uuid_le[13] = (uint8_t) (p_uuid->uuid >> 8);
+    }
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_service_add(uint8_t type, ble_uuid_t const * p_uuid, uint16_t * p_handle)
+{
+    *p_handle = m_next_handle++;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_characteristic_add(uint16_t service_handle, ble_gatts_char_md_t const * p_char_md,
+                                         ble_gatts_attr_t const * p_attr_char_value, ble_gatts_char_handles_t * p_handles)
+{
+    sim_char_t * p_char;
+
+    if (m_char_count >= SIM_MAX_CHARS) {
+        return sim_error("sd_ble_gatts_characteristic_add", NRF_ERROR_NO_MEM);
+    }
+    if (p_attr_char_value->max_len > m_enable_params.gatt_enable_params.att_mtu) {
+        return sim_error("sd_ble_gatts_characteristic_add", NRF_ERROR_INVALID_PARAM);
+    }
+
+    p_char = &m_chars[m_char_count++];
+    memset(p_char, 0, sizeof(*p_char));
+    p_char->uuid      = p_attr_char_value->p_uuid->uuid;
+    p_char->uuid_type = p_attr_char_value->p_uuid->type;
+    p_char->rd_auth   = p_attr_char_value->p_attr_md->rd_auth;
+    p_char->max_len   = p_attr_char_value->max_len;
+    if ((p_attr_char_value->init_len > 0) && (p_attr_char_value->p_value != NULL)) {
+        p_char->value_len = MIN(p_attr_char_value->init_len, SIM_MAX_DATA);
+        memcpy(p_char->value, p_attr_char_value->p_value, p_char->value_len);
+    }
+
+    m_next_handle++;                                              // Declaration
+    p_char->handles.value_handle = m_next_handle++;
+    if (p_char_md->char_props.notify || p_char_md->char_props.indicate) {
+        p_char->handles.cccd_handle = m_next_handle++;
+    }
+
+    *p_handles = p_char->handles;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_rw_authorize_reply(uint16_t conn_handle, ble_gatts_rw_authorize_reply_params_t const * p_rw_authorize_reply_params)
+{
+    sim_conn_t *                         p_conn  = conn_get(conn_handle);
+    ble_gatts_authorize_params_t const * p_param = &p_rw_authorize_reply_params->params.read;
+
+    if (p_conn == NULL) {
+        return sim_error("sd_ble_gatts_rw_authorize_reply", BLE_ERROR_INVALID_CONN_HANDLE);
+    }
+    if (!p_conn->read_pending) {
+        return sim_error("sd_ble_gatts_rw_authorize_reply", NRF_ERROR_INVALID_STATE);
+    }
+    if (p_rw_authorize_reply_params->type != BLE_GATTS_AUTHORIZE_TYPE_READ) {
+        rec_add(SIM_REC_WRITE_REPLY, conn_handle, p_conn->read_handle, p_param->gatt_status, NULL, 0);
+        return NRF_SUCCESS;
+    }
+    if (p_param->update && (p_param->len > p_conn->att_mtu - 1)) {
+        return sim_error("sd_ble_gatts_rw_authorize_reply", NRF_ERROR_INVALID_PARAM);
+    }
+
+    p_conn->read_pending = false;
+    m_stats.replies++;
+    rec_add(SIM_REC_READ_REPLY, conn_handle, p_conn->read_handle, p_param->gatt_status,
+            p_param->update ? p_param->p_data : NULL, p_param->update ? p_param->len : 0);
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_hvx(uint16_t conn_handle, ble_gatts_hvx_params_t const * p_hvx_params)
+{
+    sim_conn_t * p_conn = conn_get(conn_handle);
+    uint32_t     index;
+    sim_char_t * p_char = char_by_value_handle(p_hvx_params->handle, &index);
+    uint16_t     len    = (p_hvx_params->p_len != NULL) ? *p_hvx_params->p_len : 0;
+
+    if (p_conn == NULL) {
+        return sim_error("sd_ble_gatts_hvx", BLE_ERROR_INVALID_CONN_HANDLE);
+    }
+    if ((p_char == NULL) || (p_char->handles.cccd_handle == BLE_GATT_HANDLE_INVALID)) {
+        return sim_error("sd_ble_gatts_hvx", BLE_ERROR_INVALID_ATTR_HANDLE);
+    }
+    if (!(p_conn->cccd[index] & BLE_GATT_HVX_NOTIFICATION)) {
+        return sim_error("sd_ble_gatts_hvx", NRF_ERROR_INVALID_STATE);
+    }
+    if (len > p_conn->att_mtu - 3) {
+        return sim_error("sd_ble_gatts_hvx", NRF_ERROR_DATA_SIZE);
+    }
+    if (p_conn->tx_free == 0) {
+        m_stats.hvx_no_tx++;
+        return BLE_ERROR_NO_TX_PACKETS;
+    }
+
+    p_conn->tx_free--;
+    m_stats.hvx++;
+    rec_add(SIM_REC_HVX, conn_handle, p_hvx_params->handle, 0, p_hvx_params->p_data, len);
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_exchange_mtu_reply(uint16_t conn_handle, uint16_t server_rx_mtu)
+{
+    sim_conn_t * p_conn = conn_get(conn_handle);
+
+    if (p_conn == NULL) {
+        return sim_error("sd_ble_gatts_exchange_mtu_reply", BLE_ERROR_INVALID_CONN_HANDLE);
+    }
+    if (!p_conn->mtu_pending) {
+        return sim_error("sd_ble_gatts_exchange_mtu_reply", NRF_ERROR_INVALID_STATE);
+    }
+    if ((server_rx_mtu < GATT_MTU_SIZE_DEFAULT) || (server_rx_mtu > m_enable_params.gatt_enable_params.att_mtu)) {
+        return sim_error("sd_ble_gatts_exchange_mtu_reply", NRF_ERROR_INVALID_PARAM);
+    }
+
+    p_conn->mtu_pending = false;
+    p_conn->att_mtu     = MAX(GATT_MTU_SIZE_DEFAULT, MIN(server_rx_mtu, p_conn->client_rx_mtu));
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_sys_attr_set(uint16_t conn_handle, uint8_t const * p_sys_attr_data, uint16_t len, uint32_t flags)
+{
+    return (conn_get(conn_handle) != NULL) ? NRF_SUCCESS
+                                           : sim_error("sd_ble_gatts_sys_attr_set", BLE_ERROR_INVALID_CONN_HANDLE);
+}
+
+uint32_t sd_ble_gatts_value_get(uint16_t conn_handle, uint16_t handle, ble_gatts_value_t * p_value)
+{
+    sim_char_t * p_char = char_by_value_handle(handle, NULL);
+
+    if ((p_char == NULL) || (p_value->offset >= p_char->value_len)) {
+        p_value->len = 0;
+        return NRF_SUCCESS;
+    }
+    p_value->len = MIN(p_value->len, p_char->value_len - p_value->offset);
+    if (p_value->p_value != NULL) {
+        memcpy(p_value->p_value, &p_char->value[p_value->offset], p_value->len);
+    }
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_value_set(uint16_t conn_handle, uint16_t handle, ble_gatts_value_t * p_value)
+{
+    sim_char_t * p_char = char_by_value_handle(handle, NULL);
+
+    if (p_char == NULL) {
+        return sim_error("sd_ble_gatts_value_set", BLE_ERROR_INVALID_ATTR_HANDLE);
+    }
+    if ((p_value->offset + p_value->len > p_char->max_len) || (p_value->offset > p_char->value_len)) {
+        return sim_error("sd_ble_gatts_value_set", NRF_ERROR_INVALID_PARAM);
+    }
+    memcpy(&p_char->value[p_value->offset], p_value->p_value, p_value->len);
+    p_char->value_len = p_value->offset + p_value->len;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_device_name_set(ble_gap_conn_sec_mode_t const * p_write_perm, uint8_t const * p_dev_name, uint16_t len)
+{
+    if (len > BLE_GAP_DEVNAME_MAX_LEN) {
+        return sim_error("sd_ble_gap_device_name_set", NRF_ERROR_DATA_SIZE);
+    }
+    memcpy(m_dev_name, p_dev_name, len);
+    m_dev_name_len = len;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_device_name_get(uint8_t * p_dev_name, uint16_t * p_len)
+{
+    if (p_dev_name != NULL) {
+        if (*p_len < m_dev_name_len) {
+            return NRF_ERROR_DATA_SIZE;
+        }
+        memcpy(p_dev_name, m_dev_name, m_dev_name_len);
+    }
+    *p_len = m_dev_name_len;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_ppcp_set(ble_gap_conn_params_t const * p_conn_params)
+{
+    m_ppcp = *p_conn_params;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_adv_data_set(uint8_t const * p_data, uint8_t dlen, uint8_t const * p_sr_data, uint8_t srdlen)
+{
+    if ((dlen > BLE_GAP_ADV_MAX_SIZE) || (srdlen > BLE_GAP_ADV_MAX_SIZE)) {
+        return sim_error("sd_ble_gap_adv_data_set", NRF_ERROR_INVALID_LENGTH);
+    }
+    if ((p_data != NULL) && (dlen > 0)) {
+        memcpy(m_adv_data, p_data, dlen);
+        m_adv_data_len = dlen;
+    }
+    if (p_sr_data != NULL) {
+        memcpy(m_sr_data, p_sr_data, srdlen);
+    }
+    m_sr_data_len = (p_sr_data != NULL) ? srdlen : 0;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_adv_start(ble_gap_adv_params_t const * p_adv_params)
+{
+    if (m_advertising) {
+        return sim_error("sd_ble_gap_adv_start", NRF_ERROR_INVALID_STATE);
+    }
+    // Non-connectable advertising may not go faster than 100 ms.
+    if ((p_adv_params->interval < SIM_ADV_INTERVAL_MIN) || (p_adv_params->interval > SIM_ADV_INTERVAL_MAX) ||
+        ((p_adv_params->type != BLE_GAP_ADV_TYPE_ADV_IND) && (p_adv_params->interval < SIM_ADV_NONCONN_INTERVAL_MIN))) {
+        return sim_error("sd_ble_gap_adv_start", NRF_ERROR_INVALID_PARAM);
+    }
+    m_adv_params  = *p_adv_params;
+    m_advertising = true;
+    m_stats.adv_starts++;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_adv_stop(void)
+{
+    if (!m_advertising) {
+        return sim_error("sd_ble_gap_adv_stop", NRF_ERROR_INVALID_STATE);
+    }
+    m_advertising = false;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_address_get(ble_gap_addr_t * p_addr)
+{
+    static uint8_t const addr[BLE_GAP_ADDR_LEN] = { 0x01, 0x00, 0xEE, 0xFF, 0xC0, 0xDE };
+
+    memset(p_addr, 0, sizeof(*p_addr));
+    memcpy(p_addr->addr, addr, sizeof(addr));
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_conn_param_update(uint16_t conn_handle, ble_gap_conn_params_t const * p_conn_params)
+{
+    sim_conn_t * p_conn = conn_get(conn_handle);
+    uint16_t     min;
+    uint16_t     max;
+
+    if (p_conn == NULL) {
+        return sim_error("sd_ble_gap_conn_param_update", BLE_ERROR_INVALID_CONN_HANDLE);
+    }
+    if (p_conn->update_pending) {
+        return NRF_ERROR_BUSY;                                    // A procedure is already running, not a misuse.
+    }
+    if (p_conn_params == NULL) {
+        p_conn_params = &m_ppcp;
+    }
+    min = p_conn_params->min_conn_interval;
+    max = p_conn_params->max_conn_interval;
+
+    // Range and supervision timeout rules of the core spec, which the stack enforces.
+    if ((min < BLE_GAP_CP_MIN_CONN_INTVL_MIN) || (max > BLE_GAP_CP_MAX_CONN_INTVL_MAX) || (min > max) ||
+        (p_conn_params->conn_sup_timeout * 4 <= (uint32_t) (1 + p_conn_params->slave_latency) * max)) {
+        return sim_error("sd_ble_gap_conn_param_update", NRF_ERROR_INVALID_PARAM);
+    }
+    p_conn->update_request = *p_conn_params;
+    m_stats.conn_param_updates++;
+    p_conn->update_pending = true;                                // Completed once the current event returns.
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_disconnect(uint16_t conn_handle, uint8_t hci_status_code)
+{
+    sim_conn_t * p_conn = conn_get(conn_handle);
+
+    if (p_conn == NULL) {
+        return sim_error("sd_ble_gap_disconnect", BLE_ERROR_INVALID_CONN_HANDLE);
+    }
+    p_conn->disconnect_pending = true;                            // Delivered once the current event returns.
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_tx_packet_count_get(uint16_t conn_handle, uint8_t * p_count)
+{
+    sim_conn_t * p_conn = conn_get(conn_handle);
+
+    if (p_conn == NULL) {
+        return sim_error("sd_ble_tx_packet_count_get", BLE_ERROR_INVALID_CONN_HANDLE);
+    }
+    *p_count = p_conn->tx_max;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_opt_set(uint32_t opt_id, ble_opt_t const * p_opt)
+{
+    if (opt_id == BLE_COMMON_OPT_CONN_BW) {
+        ble_conn_bw_t const * p_bw = &p_opt->common_opt.conn_bw.conn_bw;
+        uint8_t               reserved;
+
+        // Only a bandwidth softdevice_enable() reserved links for can be used.
+        reserved = (p_bw->conn_bw_tx == BLE_CONN_BW_HIGH) ? m_conn_bw_counts.tx_counts.high_count
+                 : (p_bw->conn_bw_tx == BLE_CONN_BW_MID)  ? m_conn_bw_counts.tx_counts.mid_count
+                 : (p_bw->conn_bw_tx == BLE_CONN_BW_LOW)  ? m_conn_bw_counts.tx_counts.low_count
+                 :                                          0;
+        if ((p_opt->common_opt.conn_bw.role != BLE_GAP_ROLE_PERIPH) || (reserved == 0)) {
+            return sim_error("sd_ble_opt_set", NRF_ERROR_INVALID_PARAM);
+        }
+        m_conn_bw = p_bw->conn_bw_tx;
+    }
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_temp_get(int32_t * p_temp)
+{
+    *p_temp = 25 * 4;                                             // 25 C in 0.25 degree steps.
+    return NRF_SUCCESS;
+}
@@ -0,0 +1,11 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 SEGGER_RTT.h, see host/fatsim.h.
+ * Only what the fatbeacon sources use is declared here. */
+
+#ifndef SEGGER_RTT_H
+#define SEGGER_RTT_H
+int SEGGER_RTT_printf(unsigned BufferIndex, const char * sFormat, ...);
+unsigned SEGGER_RTT_WriteString(unsigned BufferIndex, const char * s);
+unsigned SEGGER_RTT_Write(unsigned BufferIndex, const void * pBuffer, unsigned NumBytes);
+int SEGGER_RTT_ConfigUpBuffer(unsigned BufferIndex, const char * sName, void * pBuffer, unsigned BufferSize, unsigned Flags);
+#define SEGGER_RTT_MODE_NO_BLOCK_SKIP   (0U)
+#endif
@@ -0,0 +1,11 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 app_error.h, see host/fatsim.h.
+ * Only what the fatbeacon sources use is declared here. */
+
+#ifndef APP_ERROR_H__
+#define APP_ERROR_H__
+#include <stdint.h>
+#include "nrf_error.h"
+typedef uint32_t ret_code_t;
+void app_error_handler(uint32_t error_code, uint32_t line_num, const uint8_t * p_file_name);
+#define APP_ERROR_CHECK(ERR) do { const uint32_t e_ = (ERR); if (e_ != NRF_SUCCESS) app_error_handler(e_, __LINE__, (const uint8_t *)__FILE__); } while (0)
+#endif
@@ -0,0 +1,13 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 app_scheduler.h, see host/fatsim.h.
+ * Only what the fatbeacon sources use is declared here. */
+
+#ifndef APP_SCHEDULER_H__
+#define APP_SCHEDULER_H__
+#include <stdint.h>
+#include "app_error.h"
+typedef void (*app_sched_event_handler_t)(void * p_event_data, uint16_t event_size);
+uint32_t app_sched_init(uint16_t max_event_size, uint16_t queue_size, void * p_evt_buffer);
+uint32_t app_sched_event_put(void * p_event_data, uint16_t event_size, app_sched_event_handler_t handler);
+void app_sched_execute(void);
+#define APP_SCHED_INIT(EVENT_SIZE, QUEUE_SIZE) do { uint32_t ERR_CODE = app_sched_init((EVENT_SIZE), (QUEUE_SIZE), NULL); APP_ERROR_CHECK(ERR_CODE); } while (0)
+#endif
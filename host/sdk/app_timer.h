@@ -0,0 +1,22 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 app_timer.h, see host/fatsim.h.
+ * Only what the fatbeacon sources use is declared here. */
+
+#ifndef APP_TIMER_H__
+#define APP_TIMER_H__
+#include <stdint.h>
+#include <stdbool.h>
+#define APP_TIMER_CLOCK_FREQ 32768
+#define APP_TIMER_TICKS(MS, PRESCALER) ((uint32_t)(((uint64_t)(MS) * (APP_TIMER_CLOCK_FREQ / ((PRESCALER) + 1))) / 1000))
+typedef uint32_t * app_timer_id_t;
+#define APP_TIMER_DEF(id) static uint32_t id##_data[8]; static app_timer_id_t id = id##_data
+typedef enum { APP_TIMER_MODE_SINGLE_SHOT, APP_TIMER_MODE_REPEATED } app_timer_mode_t;
+typedef void (*app_timer_timeout_handler_t)(void * p_context);
+typedef uint32_t (*app_timer_evt_schedule_func_t)(app_timer_timeout_handler_t timeout_handler, void * p_context);
+uint32_t app_timer_init(uint32_t prescaler, uint8_t op_queues_size, void * p_buffer, app_timer_evt_schedule_func_t evt_schedule_func);
+#define APP_TIMER_INIT(PRESCALER, OP_QUEUES_SIZE, SCHEDULER_FUNC) do { (void) app_timer_init((PRESCALER), (OP_QUEUES_SIZE) + 1, NULL, (SCHEDULER_FUNC)); } while (0)
+uint32_t app_timer_create(app_timer_id_t const * p_timer_id, app_timer_mode_t mode, app_timer_timeout_handler_t timeout_handler);
+uint32_t app_timer_start(app_timer_id_t timer_id, uint32_t timeout_ticks, void * p_context);
+uint32_t app_timer_stop(app_timer_id_t timer_id);
+uint32_t app_timer_cnt_get(uint32_t * p_ticks);
+uint32_t app_timer_cnt_diff_compute(uint32_t ticks_to, uint32_t ticks_from, uint32_t * p_ticks_diff);
+#endif
@@ -0,0 +1,14 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 app_timer_appsh.h, see host/fatsim.h.
+ * Only what the fatbeacon sources use is declared here. */
+
+#ifndef APP_TIMER_APPSH_H
+#define APP_TIMER_APPSH_H
+#include <stddef.h>
+#include "app_timer.h"
+#include "app_scheduler.h"
+typedef struct { app_timer_timeout_handler_t timeout_handler; void * p_context; } app_timer_event_t;
+#define APP_TIMER_SCHED_EVT_SIZE sizeof(app_timer_event_t)
+uint32_t app_timer_evt_schedule(app_timer_timeout_handler_t timeout_handler, void * p_context);
+#define APP_TIMER_APPSH_INIT(PRESCALER, OP_QUEUES_SIZE, USE_SCHEDULER) \
+    APP_TIMER_INIT(PRESCALER, OP_QUEUES_SIZE, (USE_SCHEDULER) ? app_timer_evt_schedule : NULL)
+#endif
@@ -0,0 +1,16 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 app_util.h, see host/fatsim.h.
+ * MSEC_TO_UNITS and friends live in nordic_common.h here. */
+
+#ifndef APP_UTIL_H__
+#define APP_UTIL_H__
+#include <stdint.h>
+#include "nordic_common.h"
+static inline uint16_t uint16_decode(const uint8_t * p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+static inline uint32_t uint32_decode(const uint8_t * p) { return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24); }
+static inline uint8_t uint16_encode(uint16_t v, uint8_t * p) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); return 2; }
+static inline uint8_t uint32_encode(uint32_t v, uint8_t * p) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24); return 4; }
+static inline uint8_t uint16_big_encode(uint16_t v, uint8_t * p) { p[0] = (uint8_t)(v >> 8); p[1] = (uint8_t)v; return 2; }
+static inline uint8_t uint32_big_encode(uint32_t v, uint8_t * p) { p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v; return 4; }
+static inline uint16_t uint16_big_decode(const uint8_t * p) { return (uint16_t)((p[0] << 8) | p[1]); }
+static inline uint32_t uint32_big_decode(const uint8_t * p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+#endif
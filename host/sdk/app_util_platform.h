@@ -0,0 +1,8 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 app_util_platform.h, see host/fatsim.h.
+ * Only what the fatbeacon sources use is declared here.  Nothing preempts the simulator. */
+
+#ifndef APP_UTIL_PLATFORM_H__
+#define APP_UTIL_PLATFORM_H__
+#define CRITICAL_REGION_ENTER() {
+#define CRITICAL_REGION_EXIT()  }
+#endif
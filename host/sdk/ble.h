@@ -0,0 +1,184 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 ble.h, see host/fatsim.h.
+ * Only what the fatbeacon sources use is declared here. */
+
+#ifndef BLE_H__
+#define BLE_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "nrf_error.h"
+
+#define BLE_CONN_HANDLE_INVALID 0xFFFF
+#define BLE_GATT_HANDLE_INVALID 0x0000
+#define BLE_UUID_TYPE_BLE 1
+#define BLE_GATT_STATUS_SUCCESS 0x0000
+#define BLE_GATT_STATUS_ATTERR_INVALID_OFFSET 0x0107
+#define BLE_GATT_STATUS_ATTERR_INVALID_ATT_VAL_LENGTH 0x010D
+#define BLE_GATT_STATUS_ATTERR_WRITE_NOT_PERMITTED 0x0103
+#define BLE_GATT_STATUS_ATTERR_REQUEST_NOT_SUPPORTED 0x0106
+#define BLE_GATT_HVX_NOTIFICATION 1
+#define BLE_GATT_HVX_INDICATION 2
+#define GATT_MTU_SIZE_DEFAULT 23
+#define BLE_GATTS_VLOC_STACK 1
+#define BLE_GATTS_VLOC_USER 2
+#define BLE_GATTS_SRVC_TYPE_PRIMARY 1
+#define BLE_GATTS_OP_WRITE_REQ 1
+#define BLE_GATTS_OP_WRITE_CMD 2
+#define BLE_GAP_ADV_TYPE_ADV_IND 0
+#define BLE_GAP_ADV_TYPE_ADV_SCAN_IND 2
+#define BLE_GAP_ADV_TYPE_ADV_NONCONN_IND 3
+#define BLE_GAP_ADV_FP_ANY 0
+#define BLE_GAP_TIMEOUT_SRC_ADVERTISING 0
+#define BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE 0x06
+#define BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED 0x04
+#define BLE_GAP_AD_TYPE_FLAGS 0x01
+#define BLE_GAP_AD_TYPE_16BIT_SERVICE_UUID_COMPLETE 0x03
+#define BLE_GAP_AD_TYPE_128BIT_SERVICE_UUID_COMPLETE 0x07
+#define BLE_GAP_AD_TYPE_COMPLETE_LOCAL_NAME 0x09
+#define BLE_GAP_AD_TYPE_SERVICE_DATA 0x16
+#define BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA 0xFF
+#define BLE_GAP_ADV_MAX_SIZE 31
+#define BLE_GAP_DEVNAME_MAX_LEN 31
+#define BLE_GAP_ADDR_LEN 6
+#define BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION 0x13
+#define BLE_GAP_ROLE_PERIPH 1
+#define BLE_CONN_BW_LOW 1
+#define BLE_CONN_BW_MID 2
+#define BLE_CONN_BW_HIGH 3
+#define BLE_ERROR_NO_TX_PACKETS (NRF_ERROR_STK_BASE_NUM+0x200+0x01)
+#define BLE_ERROR_GATTS_SYS_ATTR_MISSING (NRF_ERROR_STK_BASE_NUM+0x400+0x01)
+#define BLE_ERROR_INVALID_CONN_HANDLE (NRF_ERROR_STK_BASE_NUM+0x002)
+#define BLE_ERROR_INVALID_ATTR_HANDLE (NRF_ERROR_STK_BASE_NUM+0x003)
+
+#define BLE_GAP_CONN_SEC_MODE_SET_OPEN(ptr) do {(ptr)->sm = 1; (ptr)->lv = 1;} while(0)
+#define BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(ptr) do {(ptr)->sm = 0; (ptr)->lv = 0;} while(0)
+
+enum {
+  BLE_EVT_TX_COMPLETE = 0x01,
+  BLE_EVT_USER_MEM_REQUEST,
+  BLE_GAP_EVT_CONNECTED = 0x10,
+  BLE_GAP_EVT_DISCONNECTED,
+  BLE_GAP_EVT_CONN_PARAM_UPDATE,
+  BLE_GAP_EVT_SEC_PARAMS_REQUEST,
+  BLE_GAP_EVT_TIMEOUT,
+  BLE_GATTS_EVT_WRITE = 0x50,
+  BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST,
+  BLE_GATTS_EVT_SYS_ATTR_MISSING,
+  BLE_GATTS_EVT_HVC,
+  BLE_GATTS_EVT_SC_CONFIRM,
+  BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST,
+  BLE_GATTS_EVT_TIMEOUT,
+};
+#define BLE_GAP_EVT_BASE 0x10
+#define BLE_GAP_EVT_LAST 0x2F
+enum { BLE_GATTS_AUTHORIZE_TYPE_INVALID, BLE_GATTS_AUTHORIZE_TYPE_READ, BLE_GATTS_AUTHORIZE_TYPE_WRITE };
+enum { BLE_COMMON_OPT_CONN_BW = 0x01, BLE_COMMON_OPT_PA_LNA };
+
+typedef struct { uint16_t uuid; uint8_t type; } ble_uuid_t;
+typedef struct { uint8_t uuid128[16]; } ble_uuid128_t;
+typedef struct { uint8_t sm:4; uint8_t lv:4; } ble_gap_conn_sec_mode_t;
+typedef struct { uint8_t addr_type; uint8_t addr[6]; } ble_gap_addr_t;
+
+typedef struct {
+  uint16_t min_conn_interval, max_conn_interval, slave_latency, conn_sup_timeout;
+} ble_gap_conn_params_t;
+#define BLE_GAP_CP_MIN_CONN_INTVL_MIN 0x0006
+#define BLE_GAP_CP_MAX_CONN_INTVL_MAX 0x0C80
+
+typedef struct {
+  uint8_t type; ble_gap_addr_t * p_peer_addr; uint8_t fp; void * p_whitelist;
+  uint16_t interval; uint16_t timeout; struct { uint8_t ch_37_off:1, ch_38_off:1, ch_39_off:1; } channel_mask;
+} ble_gap_adv_params_t;
+
+typedef struct { ble_gap_addr_t peer_addr; ble_gap_addr_t own_addr; uint8_t role; uint8_t irk_match; uint8_t irk_match_idx; ble_gap_conn_params_t conn_params; } ble_gap_evt_connected_t;
+typedef struct { uint8_t reason; } ble_gap_evt_disconnected_t;
+typedef struct { ble_gap_conn_params_t conn_params; } ble_gap_evt_conn_param_update_t;
+typedef struct { uint8_t src; } ble_gap_evt_timeout_t;
+typedef struct {
+  uint16_t conn_handle;
+  union {
+    ble_gap_evt_connected_t connected;
+    ble_gap_evt_disconnected_t disconnected;
+    ble_gap_evt_conn_param_update_t conn_param_update;
+    ble_gap_evt_timeout_t timeout;
+  } params;
+} ble_gap_evt_t;
+
+typedef struct { uint16_t handle; ble_uuid_t uuid; uint8_t op; uint8_t auth_required; uint16_t offset; uint16_t len; uint8_t data[1]; } ble_gatts_evt_write_t;
+typedef struct { uint16_t handle; ble_uuid_t uuid; uint16_t offset; } ble_gatts_evt_read_t;
+typedef struct { uint8_t type; union { ble_gatts_evt_read_t read; ble_gatts_evt_write_t write; } request; } ble_gatts_evt_rw_authorize_request_t;
+typedef struct { uint16_t client_rx_mtu; } ble_gatts_evt_exchange_mtu_request_t;
+typedef struct {
+  uint16_t conn_handle;
+  union {
+    ble_gatts_evt_write_t write;
+    ble_gatts_evt_rw_authorize_request_t authorize_request;
+    ble_gatts_evt_exchange_mtu_request_t exchange_mtu_request;
+  } params;
+} ble_gatts_evt_t;
+
+typedef struct { uint8_t count; } ble_evt_tx_complete_t;
+typedef struct {
+  uint16_t conn_handle;
+  union { ble_evt_tx_complete_t tx_complete; } params;
+} ble_common_evt_t;
+
+typedef struct { uint16_t evt_id; uint16_t evt_len; } ble_evt_hdr_t;
+typedef struct {
+  ble_evt_hdr_t header;
+  union { ble_common_evt_t common_evt; ble_gap_evt_t gap_evt; ble_gatts_evt_t gatts_evt; } evt;
+} ble_evt_t;
+
+typedef struct { uint16_t gatt_status; uint8_t update:1; uint16_t offset; uint16_t len; const uint8_t * p_data; } ble_gatts_authorize_params_t;
+typedef struct { uint8_t type; union { ble_gatts_authorize_params_t read; ble_gatts_authorize_params_t write; } params; } ble_gatts_rw_authorize_reply_params_t;
+
+typedef struct { uint16_t handle; uint8_t type; uint16_t offset; uint16_t * p_len; const uint8_t * p_data; } ble_gatts_hvx_params_t;
+typedef struct { uint16_t len; uint16_t offset; uint8_t * p_value; } ble_gatts_value_t;
+
+typedef struct {
+  ble_gap_conn_sec_mode_t read_perm, write_perm;
+  uint8_t vlen:1, vloc:2, rd_auth:1, wr_auth:1;
+} ble_gatts_attr_md_t;
+typedef struct { const ble_uuid_t * p_uuid; const ble_gatts_attr_md_t * p_attr_md; uint16_t init_len; uint16_t init_offs; uint16_t max_len; uint8_t * p_value; } ble_gatts_attr_t;
+typedef struct { uint8_t broadcast:1, read:1, write_wo_resp:1, write:1, notify:1, indicate:1, auth_signed_wr:1; } ble_gatt_char_props_t;
+typedef struct {
+  ble_gatt_char_props_t char_props; uint8_t char_ext_props; uint8_t * p_char_user_desc; uint16_t char_user_desc_max_size, char_user_desc_size;
+  void * p_char_pf; ble_gatts_attr_md_t * p_user_desc_md; ble_gatts_attr_md_t * p_cccd_md; ble_gatts_attr_md_t * p_sccd_md;
+} ble_gatts_char_md_t;
+typedef struct { uint16_t value_handle, user_desc_handle, cccd_handle, sccd_handle; } ble_gatts_char_handles_t;
+
+typedef struct { uint8_t high_count, mid_count, low_count; } ble_conn_bw_count_t;
+typedef struct { ble_conn_bw_count_t tx_counts, rx_counts; } ble_conn_bw_counts_t;
+typedef struct { uint8_t conn_bw_tx, conn_bw_rx; } ble_conn_bw_t;
+typedef struct { uint8_t role; ble_conn_bw_t conn_bw; } ble_common_opt_conn_bw_t;
+typedef union { struct { ble_common_opt_conn_bw_t conn_bw; } common_opt; } ble_opt_t;
+
+typedef struct { uint8_t vs_uuid_count; ble_conn_bw_counts_t * p_conn_bw_counts; } ble_common_enable_params_t;
+typedef struct { uint8_t periph_conn_count, central_conn_count, central_sec_count; } ble_gap_enable_params_t;
+typedef struct { uint16_t att_mtu; } ble_gatt_enable_params_t;
+typedef struct { uint8_t service_changed:1; uint32_t attr_tab_size; } ble_gatts_enable_params_t;
+typedef struct { ble_common_enable_params_t common_enable_params; ble_gap_enable_params_t gap_enable_params; ble_gatt_enable_params_t gatt_enable_params; ble_gatts_enable_params_t gatts_enable_params; } ble_enable_params_t;
+
+uint32_t sd_ble_uuid_vs_add(ble_uuid128_t const * p_vs_uuid, uint8_t * p_uuid_type);
+uint32_t sd_ble_uuid_encode(ble_uuid_t const * p_uuid, uint8_t * p_uuid_le_len, uint8_t * p_uuid_le);
+uint32_t sd_ble_gatts_service_add(uint8_t type, ble_uuid_t const * p_uuid, uint16_t * p_handle);
+uint32_t sd_ble_gatts_characteristic_add(uint16_t service_handle, ble_gatts_char_md_t const * p_char_md, ble_gatts_attr_t const * p_attr_char_value, ble_gatts_char_handles_t * p_handles);
+uint32_t sd_ble_gatts_rw_authorize_reply(uint16_t conn_handle, ble_gatts_rw_authorize_reply_params_t const * p_rw_authorize_reply_params);
+uint32_t sd_ble_gatts_hvx(uint16_t conn_handle, ble_gatts_hvx_params_t const * p_hvx_params);
+uint32_t sd_ble_gatts_exchange_mtu_reply(uint16_t conn_handle, uint16_t server_rx_mtu);
+uint32_t sd_ble_gatts_sys_attr_set(uint16_t conn_handle, uint8_t const * p_sys_attr_data, uint16_t len, uint32_t flags);
+uint32_t sd_ble_gatts_value_get(uint16_t conn_handle, uint16_t handle, ble_gatts_value_t * p_value);
+uint32_t sd_ble_gatts_value_set(uint16_t conn_handle, uint16_t handle, ble_gatts_value_t * p_value);
+uint32_t sd_ble_gap_device_name_set(ble_gap_conn_sec_mode_t const * p_write_perm, uint8_t const * p_dev_name, uint16_t len);
+uint32_t sd_ble_gap_device_name_get(uint8_t * p_dev_name, uint16_t * p_len);
+uint32_t sd_ble_gap_ppcp_set(ble_gap_conn_params_t const * p_conn_params);
+uint32_t sd_ble_gap_adv_start(ble_gap_adv_params_t const * p_adv_params);
+uint32_t sd_ble_gap_adv_stop(void);
+uint32_t sd_ble_gap_address_get(ble_gap_addr_t * p_addr);
+uint32_t sd_ble_gap_adv_data_set(uint8_t const * p_data, uint8_t dlen, uint8_t const * p_sr_data, uint8_t srdlen);
+uint32_t sd_ble_gap_conn_param_update(uint16_t conn_handle, ble_gap_conn_params_t const * p_conn_params);
+uint32_t sd_ble_gap_disconnect(uint16_t conn_handle, uint8_t hci_status_code);
+uint32_t sd_ble_tx_packet_count_get(uint16_t conn_handle, uint8_t * p_count);
+uint32_t sd_ble_opt_set(uint32_t opt_id, ble_opt_t const * p_opt);
+uint32_t sd_app_evt_wait(void);
+#endif
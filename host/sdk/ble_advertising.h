@@ -0,0 +1,10 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 ble_advertising.h, see host/fatsim.h.
+ * Only what the fatbeacon sources use is declared here. */
+
+#ifndef BLE_ADVERTISING_H__
+#define BLE_ADVERTISING_H__
+
+#include "ble.h"
+void ble_advertising_on_ble_evt(ble_evt_t const * p_ble_evt);
+void ble_advertising_on_sys_evt(uint32_t sys_evt);
+#endif
@@ -0,0 +1,10 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 ble_srv_common.h, see host/fatsim.h.
+ * Only what the fatbeacon sources use is declared here. */
+
+#ifndef BLE_SRV_COMMON_H__
+#define BLE_SRV_COMMON_H__
+#include "ble.h"
+#include "app_util.h"
+#define BLE_CCCD_VALUE_LEN 2
+static inline bool ble_srv_is_notification_enabled(uint8_t const * p_encoded_data) { return (p_encoded_data[0] & 1) != 0; }
+#endif
@@ -0,0 +1,18 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 bsp.h, see host/fatsim.h.
+ * Only what the fatbeacon sources use is declared here. */
+
+#ifndef BSP_H__
+#define BSP_H__
+
+#include <stdint.h>
+#include "nordic_common.h"
+#define BSP_INIT_LED 1
+#define BSP_INIT_BUTTONS 2
+#define LEDS_MASK 0
+#define LEDS_ON(m) do {} while (0)
+typedef enum { BSP_INDICATE_IDLE, BSP_INDICATE_ADVERTISING, BSP_INDICATE_CONNECTED } bsp_indication_t;
+typedef enum { BSP_EVENT_NOTHING = 0, BSP_EVENT_KEY_0 = 24 } bsp_event_t;
+typedef void (*bsp_event_callback_t)(bsp_event_t);
+uint32_t bsp_init(uint32_t type, uint32_t ticks_per_100ms, bsp_event_callback_t callback);
+uint32_t bsp_indication_set(bsp_indication_t indicate);
+#endif
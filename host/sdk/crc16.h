@@ -0,0 +1,8 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 crc16.h, see host/fatsim.h.
+ * Only what the fatbeacon sources use is declared here. */
+
+#ifndef CRC16_H__
+#define CRC16_H__
+#include <stdint.h>
+uint16_t crc16_compute(const uint8_t * p_data, uint32_t size, const uint16_t * p_crc);
+#endif
@@ -0,0 +1,21 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 fstorage.h, see host/fatsim.h.
+ * Only what the fatbeacon sources use is declared here. */
+
+#ifndef FSTORAGE_H__
+#define FSTORAGE_H__
+#include <stdint.h>
+#define FS_PAGE_SIZE_WORDS 1024
+#define FS_PAGE_SIZE (FS_PAGE_SIZE_WORDS * sizeof(uint32_t))
+#define FS_QUEUE_SIZE 4                 // As in fstorage_config.h
+typedef uint16_t fs_length_t;
+typedef enum { FS_OP_NONE = 0, FS_OP_STORE, FS_OP_ERASE } fs_oper_t;
+typedef void (*fs_cb_t)(uint8_t op_code, uint32_t result, uint32_t const * p_data, fs_length_t length_words);
+typedef struct { uint32_t const * p_start_addr; uint32_t const * p_end_addr; fs_cb_t const cb; uint8_t const num_pages; uint8_t const page_order; } fs_config_t;
+// Configs go in their own section as on the target, fs_init() walks it.
+#define FS_SECTION_VARS_ADD(type_def) __attribute__((section("fs_data"), used)) type_def
+typedef enum { FS_SUCCESS, FS_ERR_NOT_INITIALIZED, FS_ERR_INVALID_CFG, FS_ERR_NULL_ARG, FS_ERR_INVALID_ARG, FS_ERR_INVALID_ADDR, FS_ERR_UNALIGNED_ADDR, FS_ERR_QUEUE_FULL, FS_ERR_OPERATION_TIMEOUT, FS_ERR_INTERNAL } fs_ret_t;
+fs_ret_t fs_init(void);
+fs_ret_t fs_store(fs_config_t const * const p_config, uint32_t const * const p_addr, uint32_t const * const p_data, fs_length_t length_words);
+fs_ret_t fs_erase(fs_config_t const * const p_config, uint32_t * const p_addr, fs_length_t const length_pages);
+void fs_sys_event_handler(uint32_t sys_evt);
+#endif
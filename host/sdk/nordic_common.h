@@ -0,0 +1,13 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 nordic_common.h, see host/fatsim.h.
+ * Only what the fatbeacon sources use is declared here. */
+
+#ifndef NORDIC_COMMON_H__
+#define NORDIC_COMMON_H__
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define UNUSED_PARAMETER(x) ((void)(x))
+#define UNUSED_VARIABLE(x) ((void)(x))
+#define MSEC_TO_UNITS(TIME, RESOLUTION) (((TIME) * 1000) / (RESOLUTION))
+enum { UNIT_0_625_MS = 625, UNIT_1_25_MS = 1250, UNIT_10_MS = 10000 };
+#define STATIC_ASSERT(EXPR) typedef char static_assert_[(EXPR) ? 1 : -1] __attribute__((unused))
+#endif
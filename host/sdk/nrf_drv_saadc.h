@@ -0,0 +1,20 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 nrf_drv_saadc.h, see host/fatsim.h.
+ * Only what the fatbeacon sources use is declared here. */
+
+#ifndef NRF_DRV_SAADC_H__
+#define NRF_DRV_SAADC_H__
+#include <stdint.h>
+#include <stddef.h>
+#include "nrf_error.h"
+typedef int16_t nrf_saadc_value_t;
+typedef enum { NRF_SAADC_INPUT_DISABLED, NRF_SAADC_INPUT_VDD = 9 } nrf_saadc_input_t;
+typedef struct { nrf_saadc_input_t pin_p; nrf_saadc_input_t pin_n; } nrf_saadc_channel_config_t;
+#define NRF_DRV_SAADC_DEFAULT_CHANNEL_CONFIG_SE(PIN_P) { .pin_p = (nrf_saadc_input_t)(PIN_P), .pin_n = NRF_SAADC_INPUT_DISABLED }
+typedef struct { uint32_t type; } nrf_drv_saadc_evt_t;
+typedef struct nrf_drv_saadc_config_s nrf_drv_saadc_config_t;
+typedef void (*nrf_drv_saadc_event_handler_t)(nrf_drv_saadc_evt_t const * p_event);
+uint32_t nrf_drv_saadc_init(nrf_drv_saadc_config_t const * p_config, nrf_drv_saadc_event_handler_t event_handler);
+void     nrf_drv_saadc_uninit(void);
+uint32_t nrf_drv_saadc_channel_init(uint8_t channel, nrf_saadc_channel_config_t const * const p_config);
+uint32_t nrf_drv_saadc_sample_convert(uint8_t channel, nrf_saadc_value_t * p_value);
+#endif
@@ -0,0 +1,19 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 nrf_error.h, see host/fatsim.h.
+ * Only what the fatbeacon sources use is declared here. */
+
+#ifndef NRF_ERROR_H__
+#define NRF_ERROR_H__
+#define NRF_ERROR_BASE_NUM 0
+#define NRF_ERROR_STK_BASE_NUM 0x3000
+#define NRF_SUCCESS 0
+#define NRF_ERROR_INTERNAL 3
+#define NRF_ERROR_NO_MEM 4
+#define NRF_ERROR_NOT_FOUND 5
+#define NRF_ERROR_INVALID_PARAM 7
+#define NRF_ERROR_INVALID_STATE 8
+#define NRF_ERROR_INVALID_LENGTH 9
+#define NRF_ERROR_INVALID_DATA 11
+#define NRF_ERROR_DATA_SIZE 12
+#define NRF_ERROR_NULL 14
+#define NRF_ERROR_BUSY 17
+#endif
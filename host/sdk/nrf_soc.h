@@ -0,0 +1,19 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 nrf_soc.h, see host/fatsim.h.
+ * Only what the fatbeacon sources use is declared here. */
+
+#ifndef NRF_SOC_H__
+#define NRF_SOC_H__
+
+#include <stdint.h>
+
+enum NRF_SOC_EVTS
+{
+  NRF_EVT_HFCLKSTARTED,
+  NRF_EVT_POWER_FAILURE_WARNING,
+  NRF_EVT_FLASH_OPERATION_SUCCESS,
+  NRF_EVT_FLASH_OPERATION_ERROR,
+};
+
+uint32_t sd_temp_get(int32_t * p_temp);
+
+#endif
@@ -0,0 +1,29 @@
+/* Host stand-in for the nRF5 SDK 11 / S132 v2.0.0 softdevice_handler.h, see host/fatsim.h.
+ * Only what the fatbeacon sources use is declared here. */
+
+#ifndef SOFTDEVICE_HANDLER_H__
+#define SOFTDEVICE_HANDLER_H__
+
+#include "ble.h"
+#include "nrf_soc.h"
+#include "app_error.h"
+#include "nordic_common.h"
+typedef struct { uint8_t source, rc_ctiv, rc_temp_ctiv, xtal_accuracy; } nrf_clock_lf_cfg_t;
+#define NRF_CLOCK_LF_SRC_XTAL 1
+#define NRF_CLOCK_LF_XTAL_ACCURACY_20_PPM 7
+#define NRF_CLOCK_LFCLKSRC {.source = NRF_CLOCK_LF_SRC_XTAL, .rc_ctiv = 0, .rc_temp_ctiv = 0, .xtal_accuracy = NRF_CLOCK_LF_XTAL_ACCURACY_20_PPM}
+typedef void (*ble_evt_handler_t)(ble_evt_t * p_ble_evt);
+typedef void (*sys_evt_handler_t)(uint32_t evt_id);
+uint32_t softdevice_handler_init(nrf_clock_lf_cfg_t * p_clock, void * p_ble_evt_buffer, uint16_t size, void * evt_schedule_func);
+#define SOFTDEVICE_HANDLER_INIT(CLOCK, EVT_HANDLER) do { uint32_t r_ = softdevice_handler_init((CLOCK), 0, 0, EVT_HANDLER); APP_ERROR_CHECK(r_); } while (0)
+uint32_t softdevice_enable_get_default_config(uint8_t central_links_count, uint8_t periph_links_count, ble_enable_params_t * p_ble_enable_params);
+uint32_t softdevice_enable(ble_enable_params_t * p_ble_enable_params);
+uint32_t softdevice_ble_evt_handler_set(ble_evt_handler_t ble_evt_handler);
+uint32_t softdevice_sys_evt_handler_set(sys_evt_handler_t sys_evt_handler);
+uint32_t sd_check_ram_start(uint32_t sd_req_ram_start);
+#define APP_RAM_BASE_CENTRAL_LINKS_0_PERIPH_LINKS_1_SEC_COUNT_0_MID_BW 0x20001fe8
+#define APP_RAM_BASE_CENTRAL_LINKS_0_PERIPH_LINKS_2_SEC_COUNT_0_MID_BW 0x200022c8
+#define APP_RAM_BASE_CENTRAL_LINKS_0_PERIPH_LINKS_3_SEC_COUNT_0_MID_BW 0x200025a8
+#define CHECK_RAM_START_ADDR_INTERN(C, P) do { uint32_t a_ = APP_RAM_BASE_CENTRAL_LINKS_##C##_PERIPH_LINKS_##P##_SEC_COUNT_0_MID_BW; err_code = sd_check_ram_start(a_); APP_ERROR_CHECK(err_code); } while (0)
+#define CHECK_RAM_START_ADDR(C, P) CHECK_RAM_START_ADDR_INTERN(C, P)
+#endif
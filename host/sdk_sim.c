@@ -0,0 +1,786 @@
+/*****************************************************************************
+*
+* sdk_sim.c
+*
+* This stands in for the nRF5 SDK libraries the firmware links against
+* on the target.  fstorage works on a RAM flash and completes operations
+* only when the simulator runs it, app_timer runs off a simulated clock,
+* and RTT output goes to stderr when the simulator is verbose.
+*
+* Copyright (c) 2016 Matt Roche
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+********************************************************************************/
+
+
+#include "fatsim.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nordic_common.h"
+#include "app_error.h"
+#include "app_timer.h"
+#include "app_timer_appsh.h"
+#include "app_scheduler.h"
+#include "bsp.h"
+#include "ble_advdata.h"
+#include "ble_advertising.h"
+#include "crc16.h"
+#include "fstorage.h"
+#include "fat_sensor.h"
+#include "nrf_drv_saadc.h"
+#include "nrf_soc.h"
+#include "SEGGER_RTT.h"
+
+#define SIM_FLASH_PAGES         32                                /**< Pages of simulated flash handed out to fstorage users. */
+#define SIM_TIMER_COUNT         16
+#define SIM_SCHED_EVENT_MAX     256                               /**< Largest event app_sched_event_put() takes. */
+#define SIM_VDD_MV              3000                              /**< Supply voltage the SAADC measures. */
+#define SIM_RTT_TRACE_SIZE      (64 * 1024)                       /**< Bytes of the binary trace channel kept. */
+
+typedef struct
+{
+    fs_config_t const *             p_config;
+    fs_oper_t                       op;
+    uint32_t *                      p_addr;
+    uint32_t const *                p_data;                       /**< Read when the operation runs, as on the target. */
+    fs_length_t                     length;                       /**< Words to store or pages to erase. */
+} sim_fs_op_t;
+
+typedef struct
+{
+    app_timer_id_t                  id;
+    app_timer_timeout_handler_t     handler;
+    app_timer_mode_t                mode;
+    bool                            running;
+    uint32_t                        expires_ms;
+    uint32_t                        period_ms;
+    void *                          p_context;
+} sim_timer_t;
+
+// Configs placed with FS_SECTION_VARS_ADD(), bounds provided by the linker.
+extern fs_config_t                  __start_fs_data[];
+extern fs_config_t                  __stop_fs_data[];
+
+static bool                         m_verbose;
+static uint32_t                     m_flash[SIM_FLASH_PAGES * FS_PAGE_SIZE_WORDS];
+static bool                         m_flash_ready;
+static sim_fs_op_t                  m_fs_queue[FS_QUEUE_SIZE];
+static uint8_t                      m_fs_head;
+static uint8_t                      m_fs_count;
+
+static sim_timer_t                  m_timers[SIM_TIMER_COUNT];
+static app_timer_evt_schedule_func_t m_timer_schedule;            /**< Set by APP_TIMER_APPSH_INIT(..., true), timeouts go through the scheduler. */
+static uint32_t                     m_time_ms;
+static bsp_event_callback_t         m_bsp_callback;               /**< Set when the firmware asked for buttons. */
+static bool                         m_saadc_enabled;
+static bool                         m_saadc_vdd;                  /**< Channel 0 measures VDD. */
+static fat_sensor_data_t            m_sensor = { 2150, 4525, 101325, { 0, 0, 1000 } };   /**< What the RuuviTag's sensors read, lying flat indoors. */
+static uint32_t                     m_sensor_samples;
+static uint8_t                      m_rtt_trace[SIM_RTT_TRACE_SIZE];   /**< Written to RTT channel FAT_TRACE_RTT_CHANNEL. */
+static size_t                       m_rtt_trace_len;
+
+
+void sim_verbose_set(bool verbose)
+{
+    m_verbose = verbose;
+}
+
+
+/*
+ * Flash and fstorage
+ */
+
+static void flash_ready(void)
+{
+    if (!m_flash_ready) {
+        memset(m_flash, 0xFF, sizeof(m_flash));
+        m_flash_ready = true;
+    }
+}
+
+uint32_t * sim_flash_base(void)
+{
+    flash_ready();
+    return m_flash;
+}
+
+size_t sim_flash_size(void)
+{
+    return sizeof(m_flash);
+}
+
+static bool fs_range_check(fs_config_t const * p_config, uint32_t const * p_addr, uint32_t words)
+{
+    return (p_addr >= p_config->p_start_addr) && (p_addr + words <= p_config->p_end_addr);
+}
+
+static fs_ret_t fs_queue_push(fs_config_t const * p_config, fs_oper_t op, uint32_t * p_addr,
+                              uint32_t const * p_data, fs_length_t length)
+{
+    sim_fs_op_t * p_op;
+
+    if (m_fs_count == FS_QUEUE_SIZE) {
+        return FS_ERR_QUEUE_FULL;
+    }
+    p_op = &m_fs_queue[(m_fs_head + m_fs_count++) % FS_QUEUE_SIZE];
+    p_op->p_config = p_config;
+    p_op->op       = op;
+    p_op->p_addr   = p_addr;
+    p_op->p_data   = p_data;
+    p_op->length   = length;
+    return FS_SUCCESS;
+}
+
+fs_ret_t fs_init(void)
+{
+    uint32_t * p_end = m_flash + sizeof(m_flash) / sizeof(uint32_t);
+
+    flash_ready();
+
+    // Hand out pages from the top of flash down as fstorage does, lowest page_order first and in
+    // section order among equals.
+    for (uint32_t order = 0; order <= UINT8_MAX; order++)
+    {
+        for (fs_config_t * p_config = __start_fs_data; p_config < __stop_fs_data; p_config++)
+        {
+            uint32_t words = p_config->num_pages * FS_PAGE_SIZE_WORDS;
+
+            if (p_config->page_order != order) {
+                continue;
+            }
+            if (p_end - words < m_flash) {
+                return FS_ERR_INVALID_CFG;
+            }
+            p_config->p_end_addr   = p_end;
+            p_config->p_start_addr = p_end - words;
+            p_end                 -= words;
+        }
+    }
+    return FS_SUCCESS;
+}
+
+fs_ret_t fs_store(fs_config_t const * const p_config, uint32_t const * const p_addr, uint32_t const * const p_data, fs_length_t length_words)
+{
+    if ((p_config == NULL) || (p_data == NULL)) {
+        return FS_ERR_NULL_ARG;
+    }
+    if ((length_words == 0) || !fs_range_check(p_config, p_addr, length_words)) {
+        return FS_ERR_INVALID_ADDR;
+    }
+    return fs_queue_push(p_config, FS_OP_STORE, (uint32_t *) p_addr, p_data, length_words);
+}
+
+fs_ret_t fs_erase(fs_config_t const * const p_config, uint32_t * const p_addr, fs_length_t const length_pages)
+{
+    if (p_config == NULL) {
+        return FS_ERR_NULL_ARG;
+    }
+    if (((p_addr - m_flash) % FS_PAGE_SIZE_WORDS) != 0) {
+        return FS_ERR_UNALIGNED_ADDR;
+    }
+    if ((length_pages == 0) || !fs_range_check(p_config, p_addr, length_pages * FS_PAGE_SIZE_WORDS)) {
+        return FS_ERR_INVALID_ADDR;
+    }
+    return fs_queue_push(p_config, FS_OP_ERASE, p_addr, NULL, length_pages);
+}
+
+void fs_sys_event_handler(uint32_t sys_evt)
+{
+    sim_fs_op_t op;
+
+    if ((m_fs_count == 0) ||
+        ((sys_evt != NRF_EVT_FLASH_OPERATION_SUCCESS) && (sys_evt != NRF_EVT_FLASH_OPERATION_ERROR))) {
+        return;
+    }
+
+    op = m_fs_queue[m_fs_head];
+    m_fs_head = (m_fs_head + 1) % FS_QUEUE_SIZE;
+    m_fs_count--;
+
+    op.p_config->cb(op.op, (sys_evt == NRF_EVT_FLASH_OPERATION_SUCCESS) ? NRF_SUCCESS : NRF_ERROR_INTERNAL,
+                    op.p_data, (op.op == FS_OP_STORE) ? op.length : 0);
+}
+
+/**@brief Carries out the oldest queued flash operation, like the flash controller would.
+ *
+ * @details It ends with the system event the SoftDevice would raise, which reaches fstorage
+ *          through the handler main.c registered.
+ *
+ * @return false if there was nothing queued.
+ */
+bool sim_flash_step(void)
+{
+    sim_fs_op_t * p_op = &m_fs_queue[m_fs_head];
+
+    if (m_fs_count == 0) {
+        return false;
+    }
+    if (p_op->op == FS_OP_ERASE) {
+        memset(p_op->p_addr, 0xFF, p_op->length * FS_PAGE_SIZE);
+    } else {
+        for (uint32_t i = 0; i < p_op->length; i++)
+        {
+            p_op->p_addr[i] &= p_op->p_data[i];         // Programming only clears bits.
+        }
+    }
+
+    sim_sys_evt_send(NRF_EVT_FLASH_OPERATION_SUCCESS);
+    return true;
+}
+
+/**@brief Returns where the next queued flash operation writes or erases, NULL if none is. */
+uint32_t const * sim_flash_next(void)
+{
+    return (m_fs_count > 0) ? m_fs_queue[m_fs_head].p_addr : NULL;
+}
+
+/**@brief Carries out queued flash operations until there are none left, including those queued
+ *        from the completion callbacks.
+ *
+ * @return Number of operations completed.
+ */
+uint32_t sim_flash_run(void)
+{
+    uint32_t done = 0;
+
+    while (sim_flash_step())
+    {
+        done++;
+    }
+    return done;
+}
+
+uint16_t crc16_compute(const uint8_t * p_data, uint32_t size, const uint16_t * p_crc)
+{
+    uint16_t crc = (p_crc == NULL) ? 0xFFFF : *p_crc;
+
+    for (uint32_t i = 0; i < size; i++)
+    {
+        crc  = (uint8_t) (crc >> 8) | (crc << 8);
+        crc ^= p_data[i];
+        crc ^= (uint8_t) (crc & 0xFF) >> 4;
+        crc ^= (crc << 8) << 4;
+        crc ^= ((crc & 0xFF) << 4) << 1;
+    }
+    return crc;
+}
+
+
+/*
+ * Scheduler, the queue the main loop drains
+ */
+
+typedef struct
+{
+    app_sched_event_handler_t       handler;
+    uint16_t                        size;
+    uint8_t                         data[SIM_SCHED_EVENT_MAX];
+} sim_sched_evt_t;
+
+static sim_sched_evt_t *            m_sched_queue;
+static uint16_t                     m_sched_max_size;
+static uint16_t                     m_sched_queue_size;
+static uint16_t                     m_sched_head;
+static uint16_t                     m_sched_count;
+static bool                         m_sched_running;
+static bool                         m_sched_held;                 /**< sim_idle_hold(), the main loop is busy elsewhere. */
+
+uint32_t app_sched_init(uint16_t max_event_size, uint16_t queue_size, void * p_evt_buffer)
+{
+    if (max_event_size > SIM_SCHED_EVENT_MAX) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    m_sched_queue      = calloc(queue_size, sizeof(sim_sched_evt_t));
+    m_sched_max_size   = max_event_size;
+    m_sched_queue_size = queue_size;
+    return (m_sched_queue != NULL) ? NRF_SUCCESS : NRF_ERROR_NO_MEM;
+}
+
+uint32_t app_sched_event_put(void * p_event_data, uint16_t event_size, app_sched_event_handler_t handler)
+{
+    sim_sched_evt_t * p_evt;
+
+    if (event_size > m_sched_max_size) {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+    if (m_sched_count >= m_sched_queue_size) {
+        return NRF_ERROR_NO_MEM;
+    }
+    p_evt = &m_sched_queue[(m_sched_head + m_sched_count++) % m_sched_queue_size];
+    p_evt->handler = handler;
+    p_evt->size    = event_size;
+    if (p_event_data != NULL) {
+        memcpy(p_evt->data, p_event_data, event_size);
+    }
+    return NRF_SUCCESS;
+}
+
+void app_sched_execute(void)
+{
+    while (m_sched_count > 0)
+    {
+        sim_sched_evt_t evt = m_sched_queue[m_sched_head];
+
+        m_sched_head = (m_sched_head + 1) % m_sched_queue_size;
+        m_sched_count--;
+        evt.handler((evt.size > 0) ? evt.data : NULL, evt.size);
+    }
+}
+
+/**@brief Runs what the firmware's main loop does when it wakes up, after every interrupt.
+ *
+ * @details The main loop never runs again once main() has gone to sleep, so the simulator
+ *          drains the scheduler queue itself, and not from inside a handler it is draining.
+ */
+void sim_idle(void)
+{
+    if ((m_sched_queue == NULL) || m_sched_running || m_sched_held) {
+        return;
+    }
+    m_sched_running = true;
+    app_sched_execute();
+    m_sched_running = false;
+}
+
+void sim_idle_hold(bool hold)
+{
+    m_sched_held = hold;
+    sim_idle();
+}
+
+uint16_t sim_sched_queued(void)
+{
+    return m_sched_count;
+}
+
+
+/*
+ * Timers
+ */
+
+static sim_timer_t * timer_get(app_timer_id_t id)
+{
+    for (uint32_t i = 0; i < SIM_TIMER_COUNT; i++)
+    {
+        if (m_timers[i].id == id) {
+            return &m_timers[i];
+        }
+    }
+    return NULL;
+}
+
+uint32_t app_timer_init(uint32_t prescaler, uint8_t op_queues_size, void * p_buffer, app_timer_evt_schedule_func_t evt_schedule_func)
+{
+    m_timer_schedule = evt_schedule_func;
+    return NRF_SUCCESS;
+}
+
+static void timer_evt_execute(void * p_event_data, uint16_t event_size)
+{
+    app_timer_event_t * p_evt = p_event_data;
+
+    p_evt->timeout_handler(p_evt->p_context);
+}
+
+uint32_t app_timer_evt_schedule(app_timer_timeout_handler_t timeout_handler, void * p_context)
+{
+    app_timer_event_t evt = { timeout_handler, p_context };
+
+    return app_sched_event_put(&evt, sizeof(evt), timer_evt_execute);
+}
+
+uint32_t app_timer_create(app_timer_id_t const * p_timer_id, app_timer_mode_t mode, app_timer_timeout_handler_t timeout_handler)
+{
+    sim_timer_t * p_timer = timer_get(NULL);
+
+    if (p_timer == NULL) {
+        return NRF_ERROR_NO_MEM;
+    }
+    memset(p_timer, 0, sizeof(*p_timer));
+    p_timer->id      = *p_timer_id;
+    p_timer->handler = timeout_handler;
+    p_timer->mode    = mode;
+    return NRF_SUCCESS;
+}
+
+uint32_t app_timer_start(app_timer_id_t timer_id, uint32_t timeout_ticks, void * p_context)
+{
+    sim_timer_t * p_timer = timer_get(timer_id);
+    uint32_t      ms      = (uint32_t) (((uint64_t) timeout_ticks * 1000) / APP_TIMER_CLOCK_FREQ);
+
+    if ((p_timer == NULL) || (timer_id == NULL)) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    p_timer->running    = true;
+    p_timer->period_ms  = MAX(ms, 1);
+    p_timer->expires_ms = m_time_ms + p_timer->period_ms;
+    p_timer->p_context  = p_context;
+    return NRF_SUCCESS;
+}
+
+uint32_t app_timer_stop(app_timer_id_t timer_id)
+{
+    sim_timer_t * p_timer = timer_get(timer_id);
+
+    if ((p_timer != NULL) && (timer_id != NULL)) {
+        p_timer->running = false;
+    }
+    return NRF_SUCCESS;
+}
+
+uint32_t app_timer_cnt_get(uint32_t * p_ticks)
+{
+    *p_ticks = (uint32_t) (((uint64_t) m_time_ms * APP_TIMER_CLOCK_FREQ / 1000) & 0x00FFFFFF);
+    return NRF_SUCCESS;
+}
+
+uint32_t app_timer_cnt_diff_compute(uint32_t ticks_to, uint32_t ticks_from, uint32_t * p_ticks_diff)
+{
+    *p_ticks_diff = (ticks_to - ticks_from) & 0x00FFFFFF;       // RTC1 is 24 bits wide.
+    return NRF_SUCCESS;
+}
+
+/**@brief Moves the simulated clock on, firing timers in expiry order as it goes. */
+void sim_time_advance(uint32_t ms)
+{
+    uint32_t target = m_time_ms + ms;
+
+    for (;;)
+    {
+        sim_timer_t * p_next = NULL;
+
+        for (uint32_t i = 0; i < SIM_TIMER_COUNT; i++)
+        {
+            if (m_timers[i].running && (m_timers[i].expires_ms <= target) &&
+                ((p_next == NULL) || (m_timers[i].expires_ms < p_next->expires_ms))) {
+                p_next = &m_timers[i];
+            }
+        }
+        if (p_next == NULL) {
+            break;
+        }
+
+        m_time_ms = p_next->expires_ms;
+        if (p_next->mode == APP_TIMER_MODE_REPEATED) {
+            p_next->expires_ms += p_next->period_ms;
+        } else {
+            p_next->running = false;
+        }
+        if (m_timer_schedule != NULL) {
+            APP_ERROR_CHECK(m_timer_schedule(p_next->handler, p_next->p_context));
+        } else {
+            p_next->handler(p_next->p_context);
+        }
+        sim_idle();
+        sim_procedures_run();
+    }
+    m_time_ms = target;
+}
+
+uint32_t sim_time_ms(void)
+{
+    return m_time_ms;
+}
+
+
+/*
+ * SAADC, 10 bits with the default 1/6 gain and 0.6 V reference
+ */
+
+uint32_t nrf_drv_saadc_init(nrf_drv_saadc_config_t const * p_config, nrf_drv_saadc_event_handler_t event_handler)
+{
+    if (m_saadc_enabled || (event_handler == NULL)) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    m_saadc_enabled = true;
+    return NRF_SUCCESS;
+}
+
+void nrf_drv_saadc_uninit(void)
+{
+    m_saadc_enabled = false;
+    m_saadc_vdd     = false;
+}
+
+uint32_t nrf_drv_saadc_channel_init(uint8_t channel, nrf_saadc_channel_config_t const * const p_config)
+{
+    if (!m_saadc_enabled || (channel != 0)) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    m_saadc_vdd = (p_config->pin_p == NRF_SAADC_INPUT_VDD);
+    return NRF_SUCCESS;
+}
+
+uint32_t nrf_drv_saadc_sample_convert(uint8_t channel, nrf_saadc_value_t * p_value)
+{
+    if (!m_saadc_enabled || (channel != 0)) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    *p_value = m_saadc_vdd ? (nrf_saadc_value_t) (SIM_VDD_MV * 1024 / 3600) : 0;
+    return NRF_SUCCESS;
+}
+
+
+/*
+ * RuuviTag sensors, in place of fat_sensor_ruuvi.c
+ */
+
+uint32_t fat_sensor_hw_init(void)
+{
+    return NRF_SUCCESS;
+}
+
+uint32_t fat_sensor_hw_sample(fat_sensor_data_t * p_data)
+{
+    m_sensor_samples++;
+    *p_data = m_sensor;
+    return NRF_SUCCESS;
+}
+
+/**@brief Sets what the sensors read from the next sample on. */
+void sim_sensor_set(fat_sensor_data_t const * p_data)
+{
+    m_sensor = *p_data;
+}
+
+/**@brief Returns the number of times the firmware has sampled the sensors. */
+uint32_t sim_sensor_samples(void)
+{
+    return m_sensor_samples;
+}
+
+
+/*
+ * Board support and advertising modules
+ */
+
+uint32_t bsp_init(uint32_t type, uint32_t ticks_per_100ms, bsp_event_callback_t callback)
+{
+    m_bsp_callback = (type & BSP_INIT_BUTTONS) ? callback : NULL;
+    return NRF_SUCCESS;
+}
+
+/**@brief Presses button 0 of the board. */
+void sim_button_press(void)
+{
+    if (m_bsp_callback != NULL) {
+        m_bsp_callback(BSP_EVENT_KEY_0);
+        sim_idle();
+    }
+}
+
+uint32_t bsp_indication_set(bsp_indication_t indicate)
+{
+    return NRF_SUCCESS;
+}
+
+/**@brief Appends the complete list of the UUIDs of one size, the way ble_advdata.c does. */
+static uint32_t uuid_list_encode(ble_advdata_uuid_list_t const * p_list, uint8_t uuid_len, uint8_t ad_type,
+                                 uint8_t * p_data, uint16_t * p_pos, uint16_t max)
+{
+    uint16_t start = *p_pos;
+    uint8_t  len;
+
+    for (uint16_t i = 0; i < p_list->uuid_cnt; i++) {
+        if (sd_ble_uuid_encode(&p_list->p_uuids[i], &len, NULL) != NRF_SUCCESS) {
+            return NRF_ERROR_INVALID_PARAM;
+        }
+        if (len != uuid_len) {
+            continue;
+        }
+        if (*p_pos == start) {
+            *p_pos += 2;                                          // Length and type, filled in below.
+        }
+        if (*p_pos + len > max) {
+            return NRF_ERROR_DATA_SIZE;
+        }
+        (void) sd_ble_uuid_encode(&p_list->p_uuids[i], &len, &p_data[*p_pos]);
+        *p_pos += len;
+    }
+    if (*p_pos != start) {
+        if (start + 2 > max) {
+            return NRF_ERROR_DATA_SIZE;
+        }
+        p_data[start]     = (uint8_t) (*p_pos - start - 1);
+        p_data[start + 1] = ad_type;
+    }
+    return NRF_SUCCESS;
+}
+
+/**@brief Encodes the parts of ble_advdata_t the fatbeacon uses, in the order SDK 11 does. */
+uint32_t adv_data_encode(ble_advdata_t const * const p_advdata, uint8_t * const p_encoded_data, uint16_t * const p_len)
+{
+    uint16_t max = *p_len;
+    uint16_t pos = 0;
+    uint16_t name_len;
+    uint32_t err_code;
+
+    *p_len = 0;
+    if (p_advdata->name_type == BLE_ADVDATA_FULL_NAME) {
+        (void) sd_ble_gap_device_name_get(NULL, &name_len);
+        if (pos + 2 + name_len > max) {
+            return NRF_ERROR_DATA_SIZE;
+        }
+        p_encoded_data[pos++] = (uint8_t) (name_len + 1);
+        p_encoded_data[pos++] = BLE_GAP_AD_TYPE_COMPLETE_LOCAL_NAME;
+        (void) sd_ble_gap_device_name_get(&p_encoded_data[pos], &name_len);
+        pos += name_len;
+    }
+    if (p_advdata->flags != 0) {
+        if (pos + 3 > max) {
+            return NRF_ERROR_DATA_SIZE;
+        }
+        p_encoded_data[pos++] = 2;
+        p_encoded_data[pos++] = BLE_GAP_AD_TYPE_FLAGS;
+        p_encoded_data[pos++] = p_advdata->flags;
+    }
+    err_code = uuid_list_encode(&p_advdata->uuids_complete, 2, BLE_GAP_AD_TYPE_16BIT_SERVICE_UUID_COMPLETE,
+                                p_encoded_data, &pos, max);
+    if (err_code == NRF_SUCCESS) {
+        err_code = uuid_list_encode(&p_advdata->uuids_complete, 16, BLE_GAP_AD_TYPE_128BIT_SERVICE_UUID_COMPLETE,
+                                    p_encoded_data, &pos, max);
+    }
+    if (err_code != NRF_SUCCESS) {
+        return err_code;
+    }
+    if (p_advdata->p_manuf_specific_data != NULL) {
+        ble_advdata_manuf_data_t const * p_md = p_advdata->p_manuf_specific_data;
+
+        if (pos + 4 + p_md->data.size > max) {
+            return NRF_ERROR_DATA_SIZE;
+        }
+        p_encoded_data[pos++] = (uint8_t) (3 + p_md->data.size);
+        p_encoded_data[pos++] = BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA;
+        p_encoded_data[pos++] = (uint8_t) p_md->company_identifier;
+        p_encoded_data[pos++] = (uint8_t) (p_md->company_identifier >> 8);
+        memcpy(&p_encoded_data[pos], p_md->data.p_data, p_md->data.size);
+        pos += p_md->data.size;
+    }
+    for (uint8_t i = 0; i < p_advdata->service_data_count; i++) {
+        ble_advdata_service_data_t const * p_sd = &p_advdata->p_service_data_array[i];
+
+        if (pos + 4 + p_sd->data.size > max) {
+            return NRF_ERROR_DATA_SIZE;
+        }
+        p_encoded_data[pos++] = (uint8_t) (3 + p_sd->data.size);
+        p_encoded_data[pos++] = BLE_GAP_AD_TYPE_SERVICE_DATA;
+        p_encoded_data[pos++] = (uint8_t) p_sd->service_uuid;
+        p_encoded_data[pos++] = (uint8_t) (p_sd->service_uuid >> 8);
+        memcpy(&p_encoded_data[pos], p_sd->data.p_data, p_sd->data.size);
+        pos += p_sd->data.size;
+    }
+    *p_len = pos;
+    return NRF_SUCCESS;
+}
+
+uint32_t ble_advdata_set(const ble_advdata_t * p_advdata, const ble_advdata_t * p_srdata)
+{
+    uint8_t  adv[BLE_GAP_ADV_MAX_SIZE];
+    uint8_t  sr[BLE_GAP_ADV_MAX_SIZE];
+    uint16_t adv_len = sizeof(adv);
+    uint16_t sr_len  = 0;
+    uint32_t err_code;
+
+    err_code = adv_data_encode(p_advdata, adv, &adv_len);
+    if ((err_code == NRF_SUCCESS) && (p_srdata != NULL)) {
+        sr_len   = sizeof(sr);
+        err_code = adv_data_encode(p_srdata, sr, &sr_len);
+    }
+    if (err_code != NRF_SUCCESS) {
+        return err_code;
+    }
+    return sd_ble_gap_adv_data_set(adv, (uint8_t) adv_len, (p_srdata != NULL) ? sr : NULL, (uint8_t) sr_len);
+}
+
+void ble_advertising_on_ble_evt(ble_evt_t const * p_ble_evt)
+{
+}
+
+void ble_advertising_on_sys_evt(uint32_t sys_evt)
+{
+}
+
+
+/*
+ * Error handling and logging
+ */
+
+void app_error_handler(uint32_t error_code, uint32_t line_num, const uint8_t * p_file_name)
+{
+    // On the target this ends in a reset, here the run is over.
+    fprintf(stderr, "fatsim: APP_ERROR_CHECK failed, error 0x%x at %s:%u\n",
+            (unsigned) error_code, (char const *) p_file_name, (unsigned) line_num);
+    abort();
+}
+
+int SEGGER_RTT_printf(unsigned BufferIndex, const char * sFormat, ...)
+{
+    va_list args;
+    int     len = 0;
+
+    if (m_verbose) {
+        va_start(args, sFormat);
+        len = vfprintf(stderr, sFormat, args);
+        va_end(args);
+    }
+    return len;
+}
+
+unsigned SEGGER_RTT_WriteString(unsigned BufferIndex, const char * s)
+{
+    if (m_verbose) {
+        fputs(s, stderr);
+    }
+    return strlen(s);
+}
+
+int SEGGER_RTT_ConfigUpBuffer(unsigned BufferIndex, const char * sName, void * pBuffer, unsigned BufferSize, unsigned Flags)
+{
+    m_rtt_trace_len = 0;
+    return 0;
+}
+
+/**@brief Keeps what is written to the trace channel, all or nothing like NO_BLOCK_SKIP. */
+unsigned SEGGER_RTT_Write(unsigned BufferIndex, const void * pBuffer, unsigned NumBytes)
+{
+    if (BufferIndex == 0) {
+        if (m_verbose) {
+            fwrite(pBuffer, 1, NumBytes, stderr);
+        }
+        return NumBytes;
+    }
+    if (m_rtt_trace_len + NumBytes > sizeof(m_rtt_trace)) {
+        return 0;
+    }
+    memcpy(&m_rtt_trace[m_rtt_trace_len], pBuffer, NumBytes);
+    m_rtt_trace_len += NumBytes;
+    return NumBytes;
+}
+
+size_t sim_rtt_trace_get(uint8_t const ** pp_data)
+{
+    *pp_data = m_rtt_trace;
+    return m_rtt_trace_len;
+}
@@ -3,6 +3,8 @@
 
 #include "ble.h"
 #include "ble_srv_common.h"
+#include "fat_inflate.h"
+#include "fat_tmpl.h"
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -10,14 +12,138 @@
 #define FAT_CHARACTERISTIC_BASE_UUID {{0xFA, 0x66, 0xC9, 0xC1, 0x9B, 0x80, 0xCC, 0x9C, 0xCA, 0x46, 0x99, 0x24, 0x00, 0x00, 0xA5, 0xD1}}
 #define BLE_UUID_FAT_URL_SERVICE    0x46D4
 #define BLE_UUID_FAT_URL_CHAR       0x17F0
+#define BLE_UUID_FAT_UPLOAD_CHAR    0x17F1
+#define BLE_UUID_FAT_CONTROL_CHAR   0x17F2
+#define BLE_UUID_FAT_METRICS_CHAR   0x17F3                                /**< Read only, the fat_metrics counters, see include/fat_metrics.h for the layout. */
 
-#define FAT_CHAR_MAX_LEN            (20)
+#define FAT_CHAR_MAX_LEN            (20)                                  /**< Chunk size at the default 23 byte ATT MTU. */
+#define FAT_ATT_MTU_MAX             (247)                                 /**< Largest ATT MTU offered to clients. */
+#define FAT_CHAR_MAX_LEN_EXT        (FAT_ATT_MTU_MAX - 3)                 /**< Chunk size at FAT_ATT_MTU_MAX. */
+
+#define BLE_FAT_MAX_LINKS           3                                     /**< Number of clients that can be served at the same time. */
+
+#define BLE_FAT_PHY_1M              0x01                                  /**< LE 1M, the only PHY before SoftDevice API version 5.  Same bit as BLE_GAP_PHY_1MBPS. */
+#define BLE_FAT_PHY_2M              0x02                                  /**< LE 2M, asked for on every connection where the SoftDevice has it.  Same bit as BLE_GAP_PHY_2MBPS. */
+
+// Upload characteristic protocol.  Every write starts with an opcode, all fields are little endian.
+// The device answers START and COMMIT with a status notification, and DATA only when it has to
+// reject a packet.  A status notification is [opcode][FAT_UPLOAD_STATUS_*][next expected offset u32].
+#define FAT_UPLOAD_OP_START         0x01                                  /**< [op][length u32][crc16 u16][version u16]([encoding u8]), erases the inactive slot. */
+#define FAT_UPLOAD_OP_DATA          0x02                                  /**< [op][offset u32][data...], best sent as write without response. */
+#define FAT_UPLOAD_OP_COMMIT        0x03                                  /**< [op], verifies the CRC and makes the new page live. */
+#define FAT_UPLOAD_OP_ABORT         0x04                                  /**< [op], drops the upload, the live page is unchanged.  Too late once a COMMIT has been verified, that page goes live.  Also sent by the device with FAT_UPLOAD_STATUS_FAILED when it gives up. */
+
+#define FAT_UPLOAD_STATUS_OK        0x00
+#define FAT_UPLOAD_STATUS_BUSY      0x01                                  /**< Flash is behind, resend from the reported offset after a short pause.  For START, a client still reads the inactive slot, try again later. */
+#define FAT_UPLOAD_STATUS_OFFSET    0x02                                  /**< Packet was not at the expected offset, resend from the reported offset. */
+#define FAT_UPLOAD_STATUS_INVALID   0x03                                  /**< Malformed request or wrong state. */
+#define FAT_UPLOAD_STATUS_FAILED    0x04                                  /**< CRC mismatch or flash error, start over. */
+#define FAT_UPLOAD_STATUS_LEN       6
+
+// Control characteristic.  Writes set options for the connection, a read returns
+// [encoding u8][length u16][version u16][hash u32][resumed at u16] of the page as it will be
+// served to this connection.
+#define FAT_CTRL_OP_OPTIONS         0x01                                  /**< [op][FAT_CTRL_OPT_* flags u8], restarts any transfer in progress. */
+#define FAT_CTRL_OP_RESUME          0x02                                  /**< [op][hash u32][offset u16][crc16 u16], continues a transfer cut off by a disconnect, see ble_fat.c. */
+#define FAT_CTRL_OPT_DEFLATE        0x01                                  /**< Client inflates raw deflate itself, compressed pages are sent as stored. */
+#define FAT_CTRL_OPT_HEADER         0x02                                  /**< Client wants the stream header first and no empty chunk last, see below. */
+#define FAT_CTRL_RESUME_LEN         9
+#define FAT_CTRL_INFO_LEN           11
+
+// Stream header, sent ahead of the page to clients that set FAT_CTRL_OPT_HEADER, at the start of
+// the first cursor read or notification: [length u32][FAT_CONTENT_TYPE_* u8][encoding u8][version u16]
+// of the page as it will be served, then the page fills the rest of the chunk.  Such a client
+// knows when it has the last byte, so the empty read or notification that otherwise ends the page
+// is left out.  Offset mode reads don't carry it, they already end on a short reply.
+#define FAT_HEADER_LEN              8
+#define FAT_CONTENT_TYPE_HTML       0x01                                  /**< text/html, the only type a page has so far. */
+
+// Content hash of the page, so a client holding a copy can tell whether it is still current
+// without reading it again: 32-bit FNV-1a of the page as stored, never 0.  FAT_HASH_NONE for a
+// template page, whose values change on every visit.  Also advertised in the fatbeacon frame's
+// scan response as manufacturer specific data, little endian like the control characteristic.
+#define FAT_HASH_NONE               0
+#define FAT_HASH_COMPANY_ID         0xFFFF                                /**< ID reserved for unassigned use, as for the TLM counters. */
+#define FAT_HASH_LEN                4
 
 /*Forward Declaration of of ble_fat_t type*/
 typedef struct ble_fat_s ble_fat_t;
 
+/**@brief Fatbeacon page descriptor.
+*
+* @details Built once by @ref ble_fat_init (or @ref ble_fat_page_set) so that the read path can
+* locate any chunk in constant time instead of scanning the page on every request.
+*/
+typedef struct
+{
+    uint8_t const *                 p_data;                       /**< Start of the page data. */
+    uint16_t                        len;                          /**< Length of the page in bytes, as stored. */
+    uint16_t                        version;                      /**< Content version of the page. */
+    uint8_t                         encoding;                     /**< FAT_ENCODING_* of p_data. */
+    uint16_t                        content_len;                  /**< Length of the page once decoded. */
+    uint32_t                        hash;                         /**< Content hash, see FAT_HASH_NONE. */
+} ble_fat_page_t;
+
+/**@brief How authorized reads of the fatbeacon characteristic walk through the page. */
+typedef enum
+{
+    BLE_FAT_READ_MODE_CURSOR,                                     /**< PWA compatible.  Each read returns the next chunk and the requested offset is ignored. */
+    BLE_FAT_READ_MODE_OFFSET,                                     /**< GATT Read Long / Read Blob.  Each read returns the page from the requested offset. */
+} ble_fat_read_mode_t;
+
+/**@brief Where a client is in fetching the page. */
+typedef enum
+{
+    BLE_FAT_TRANSFER_IDLE,                                        /**< Nothing asked for yet. */
+    BLE_FAT_TRANSFER_ACTIVE,                                      /**< Page is being read or streamed. */
+    BLE_FAT_TRANSFER_DONE,                                        /**< Whole page delivered, client only has to disconnect. */
+    BLE_FAT_TRANSFER_ABANDONED,                                   /**< Client disconnected while the transfer was active. */
+} ble_fat_transfer_t;
+
+/**@brief Per-connection transfer state. */
+typedef struct
+{
+    uint16_t                        conn_handle;                  /**< Handle of the connection using this link, BLE_CONN_HANDLE_INVALID if the slot is free. */
+    ble_fat_page_t                  page;                         /**< Page this link is served, fixed at connect so an upload commit cannot change it mid-transfer. */
+    uint16_t                        att_mtu;                      /**< ATT MTU negotiated on this connection. */
+    uint16_t                        chunk_len;                    /**< Bytes sent per read or notification, follows att_mtu. */
+    int32_t                         read_pos;                     /**< Offset of the next chunk in cursor mode, -1 once the final chunk has gone out. */
+    bool                            streaming;                    /**< True while the page is being pushed out as notifications. */
+    uint16_t                        stream_pos;                   /**< Offset of the next byte to notify. */
+    ble_fat_transfer_t              transfer;                     /**< Progress of the transfer, see @ref ble_fat_transfer_set. */
+    uint8_t                         phy;                          /**< BLE_FAT_PHY_* the link transmits on now. */
+    uint8_t                         transfer_phys;                /**< BLE_FAT_PHY_* bits the link has transmitted on since the transfer went active. */
+    uint16_t                        chunks;                       /**< Chunks read from the page since the last transfer ended. */
+    uint8_t                         options;                      /**< FAT_CTRL_OPT_* set by the client. */
+    bool                            inflating;                    /**< Page is compressed and the client can't inflate it, so it is inflated here. */
+    bool                            rendering;                    /**< Page is a template, rendered here as it is read. */
+    uint16_t                        resume_pos;                   /**< Offset the transfer resumed at, 0 unless FAT_CTRL_OP_RESUME was accepted. */
+    bool                            header_due;                   /**< Stream header goes out before the next chunk, see FAT_CTRL_OPT_HEADER. */
+    uint8_t                         buf[FAT_ATT_MTU_MAX];         /**< Inflated or rendered chunk, valid until the next ble_fat_link_read(). */
+    fat_inflate_t                   inflater;                     /**< Decoder state while inflating. */
+    fat_tmpl_values_t               values;                       /**< Template values, frozen at connect so the page can't change length or tear mid-transfer. */
+} ble_fat_link_t;
+
 typedef void (*ble_fat_read_evt_handler_t) ( ble_fat_t *                p_fat,
-                                             uint16_t                   value_handle
+                                             ble_fat_link_t *           p_link,
+                                             uint16_t                   value_handle,
+                                             uint16_t                   offset
+                                             );
+
+typedef void (*ble_fat_upload_evt_handler_t) ( ble_fat_t *              p_fat,
+                                               ble_fat_link_t *         p_link,
+                                               uint8_t const *          p_data,
+                                               uint16_t                 len
+                                               );
+
+typedef void (*ble_fat_transfer_evt_handler_t) ( ble_fat_t *            p_fat,
+                                                 ble_fat_link_t *       p_link
+                                                 );
+
+typedef uint8_t (*ble_fat_value_handler_t) ( ble_fat_t *                p_fat,
+                                             ble_fat_link_t *           p_link,
+                                             fat_tmpl_var_t             var,
+                                             char *                     p_text
                                              );
 
 /**@brief Fatbeacon URL Service initialization structure.
@@ -29,7 +155,14 @@ typedef void (*ble_fat_read_evt_handler_t) ( ble_fat_t *                p_fat,
 typedef struct
 {
     ble_fat_read_evt_handler_t      read_evt_handler;   /**< Event handler to be called for authorizing read requests. */
-    uint8_t*                        val_data;
+    ble_fat_read_mode_t             read_mode;          /**< Read protocol served to clients. */
+    ble_fat_upload_evt_handler_t    upload_evt_handler; /**< Event handler to be called for writes to the upload characteristic. */
+    ble_fat_transfer_evt_handler_t  transfer_evt_handler; /**< Event handler to be called when a link's transfer state changes, may be NULL. */
+    ble_fat_value_handler_t         value_handler;      /**< Writes up to FAT_TMPL_VALUE_MAX characters of a template value and returns how many, from the SoftDevice interrupt at connect or the main loop through ble_fat_link_values_refresh().  May be NULL, values are then left blank. */
+    uint8_t const *                 p_page_data;        /**< Page served by the fatbeacon characteristic. */
+    uint16_t                        page_len;           /**< Length of the page in bytes. */
+    uint16_t                        page_version;       /**< Content version of the page. */
+    uint8_t                         page_encoding;      /**< FAT_ENCODING_* of the page. */
 } ble_fat_init_t;
 
 struct ble_fat_s
@@ -38,12 +171,29 @@ struct ble_fat_s
     uint8_t                         char_uuid_type;               /**< UUID type for Fatbeacon URL Characteristic Base UUID. */
     uint16_t                        service_handle;               /**< Handle of fatbeacon url Service  */
     ble_gatts_char_handles_t        fat_url_handles;              /**< Handles related to the fatbeacon_url characteristic */
-    uint16_t                        conn_handle;                  /**< Handle of the current connection (as provided by the S132 SoftDevice). BLE_CONN_HANDLE_INVALID if not in a connection. */    
     ble_fat_read_evt_handler_t      read_evt_handler;             /**< Event handler to be called for handling read attempts. */
-    uint8_t*                        val_data;
+    ble_fat_read_mode_t             read_mode;                    /**< Read protocol served to clients. */
+    ble_gatts_char_handles_t        upload_handles;               /**< Handles related to the upload characteristic */
+    ble_fat_upload_evt_handler_t    upload_evt_handler;           /**< Event handler to be called for upload writes. */
+    ble_fat_transfer_evt_handler_t  transfer_evt_handler;         /**< Event handler to be called on transfer state changes. */
+    ble_fat_value_handler_t         value_handler;                /**< Reads template values as links connect. */
+    ble_gatts_char_handles_t        control_handles;              /**< Handles related to the control characteristic */
+    ble_gatts_char_handles_t        metrics_handles;              /**< Handles related to the metrics characteristic */
+    ble_fat_page_t                  page;                         /**< Descriptor of the page being served. */
+    ble_fat_link_t                  links[BLE_FAT_MAX_LINKS];     /**< Transfer state of each connected client. */
 };
 
 uint32_t ble_fat_init(ble_fat_t * p_fat, const ble_fat_init_t * p_fat_init);
 void ble_fat_on_ble_evt(ble_fat_t * p_fat, ble_evt_t * p_ble_evt);
+ble_fat_link_t * ble_fat_link_get(ble_fat_t * p_fat, uint16_t conn_handle);
+uint32_t ble_fat_page_set(ble_fat_t * p_fat, uint8_t const * p_data, uint16_t len, uint16_t version, uint8_t encoding);
+bool ble_fat_page_in_use(ble_fat_t const * p_fat, uint8_t const * p_start, uint32_t len);
+void ble_fat_transfer_set(ble_fat_t * p_fat, ble_fat_link_t * p_link, ble_fat_transfer_t transfer);
+uint16_t ble_fat_link_len(ble_fat_link_t const * p_link);
+uint32_t ble_fat_link_values_refresh(ble_fat_t * p_fat, uint16_t conn_handle);
+uint16_t ble_fat_link_header_read(ble_fat_link_t * p_link, uint16_t len, uint8_t const ** pp_data);
+uint16_t ble_fat_link_read(ble_fat_link_t * p_link, uint16_t offset, uint16_t len, uint8_t const ** pp_data);
+uint32_t ble_fat_upload_status_send(ble_fat_t * p_fat, uint16_t conn_handle, uint8_t opcode, uint8_t status, uint32_t offset);
+uint32_t ble_fat_metrics_set(ble_fat_t * p_fat, uint8_t const * p_data, uint16_t len);
 
 #endif
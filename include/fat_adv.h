@@ -0,0 +1,33 @@
+#ifndef FAT_ADV_H__
+#define FAT_ADV_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ble.h"
+#include "ble_advdata.h"
+
+#define FAT_ADV_FAST_INTERVAL_MS    100                                   /**< Interval after boot, a button press or a disconnect.  Lowest allowed for non-connectable frames. */
+#define FAT_ADV_SLOW_INTERVAL_MS    1000                                  /**< Interval once nobody has been around for FAT_ADV_FAST_TIMEOUT_MS. */
+#define FAT_ADV_FAST_TIMEOUT_MS     30000                                 /**< How long to advertise fast before backing off. */
+
+#define FAT_ADV_FAT_EVENTS          3                                     /**< Advertising events of the connectable fatbeacon frame per rotation. */
+#define FAT_ADV_UID_EVENTS          1                                     /**< Advertising events of the non-connectable Eddystone frame per rotation. */
+#define FAT_ADV_TLM_EVENTS          1                                     /**< Advertising events of the Eddystone-TLM frame per rotation. */
+
+/**@brief Frames the scheduler rotates through. */
+typedef enum
+{
+    FAT_ADV_FRAME_FAT,                                            /**< Connectable ADV_IND carrying the fatbeacon URL frame. */
+    FAT_ADV_FRAME_UID,                                            /**< Non-connectable Eddystone-UID, stands in for the fatbeacon frame while every link is taken. */
+    FAT_ADV_FRAME_TLM,                                            /**< Scannable Eddystone-TLM, with the fatbeacon counters in the scan response, see fat_tlm.h. */
+    FAT_ADV_FRAME_COUNT
+} fat_adv_frame_t;
+
+uint32_t fat_adv_init(void);
+uint32_t fat_adv_frame_encode(fat_adv_frame_t frame, ble_advdata_t const * p_advdata, ble_advdata_t const * p_srdata);
+void     fat_adv_start(void);
+void     fat_adv_fast(void);
+void     fat_adv_connectable_set(bool connectable);
+void     fat_adv_on_ble_evt(ble_evt_t * p_ble_evt);
+
+#endif
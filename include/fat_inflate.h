@@ -0,0 +1,44 @@
+#ifndef FAT_INFLATE_H__
+#define FAT_INFLATE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FAT_INFLATE_WINDOW_BITS     10                                    /**< Largest deflate window that can be inflated, tools/fatpack.py packs with this. */
+#define FAT_INFLATE_WINDOW_SIZE     (1 << FAT_INFLATE_WINDOW_BITS)
+
+#define FAT_INFLATE_LIT_SYMBOLS     288
+#define FAT_INFLATE_DIST_SYMBOLS    32
+
+/**@brief Streaming raw deflate decoder.
+*
+* @details The compressed page stays in flash and is read in place, only the last
+*          FAT_INFLATE_WINDOW_SIZE bytes of output are kept.  Decoding stops as soon as the bytes
+*          asked for have been produced and carries on from there on the next call, so a page is
+*          inflated one chunk at a time as it is read.
+*/
+typedef struct
+{
+    uint8_t const *                 p_src;                        /**< Compressed stream. */
+    uint32_t                        src_len;                      /**< Length of the compressed stream in bytes. */
+    uint32_t                        src_pos;                      /**< Next byte of p_src to load into bit_buf. */
+    uint32_t                        bit_buf;                      /**< Input bits not consumed yet, LSB first. */
+    uint8_t                         bit_cnt;                      /**< Number of valid bits in bit_buf. */
+    uint8_t                         state;                        /**< Where the decoder stopped, see fat_inflate.c. */
+    bool                            final;                        /**< Current block is the last one. */
+    uint16_t                        stored_left;                  /**< Bytes left in a stored block. */
+    uint16_t                        match_len;                    /**< Bytes left to copy from an unfinished match. */
+    uint16_t                        match_dist;                   /**< Distance back of that match. */
+    uint32_t                        out_pos;                      /**< Bytes produced so far. */
+    uint16_t                        lit_counts[16];               /**< Literal/length code, number of codes of each length. */
+    uint16_t                        lit_symbols[FAT_INFLATE_LIT_SYMBOLS];    /**< Literal/length code, symbols ordered by code. */
+    uint16_t                        dist_counts[16];              /**< Distance code, number of codes of each length. */
+    uint16_t                        dist_symbols[FAT_INFLATE_DIST_SYMBOLS];  /**< Distance code, symbols ordered by code. */
+    uint8_t                         window[FAT_INFLATE_WINDOW_SIZE];         /**< Last bytes produced, indexed by out_pos. */
+} fat_inflate_t;
+
+void     fat_inflate_init(fat_inflate_t * p_inf, uint8_t const * p_src, uint32_t src_len);
+uint32_t fat_inflate_read(fat_inflate_t * p_inf, uint32_t offset, uint8_t * p_dest, uint32_t len);
+uint32_t fat_inflate_length(fat_inflate_t * p_inf);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef FAT_METRICS_H__
+#define FAT_METRICS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "nrf_error.h"
+
+#define FAT_METRICS_MAGIC           0x4D544146                            /**< "FATM", marks a written record. */
+#define FAT_METRICS_PAGES           2                                     /**< Flash pages for the record log, one is erased only once the other holds the latest record. */
+#define FAT_METRICS_SAVE_INTERVAL_MS (15 * 60 * 1000)                     /**< Counters are written at most this often, and only if they changed. */
+#define FAT_METRICS_TIMER_MS        (5 * 60 * 1000)                       /**< Save timer period, within the 512 s an app_timer can run at prescaler 0. */
+
+#define FAT_METRICS_HIST_BINS       8                                     /**< Bin n counts transfers of 2^n to 2^(n+1) - 1 chunks, the last bin everything longer. */
+
+// Metrics characteristic value, little endian like the rest of the service:
+// [FAT_METRICS_VERSION u8][connections u32][completed u32][abandoned u32][bytes served u32]
+// [average transfer ms u32][histogram u16 x FAT_METRICS_HIST_BINS]
+#define FAT_METRICS_VERSION         1
+#define FAT_METRICS_VALUE_LEN       (1 + 5 * 4 + FAT_METRICS_HIST_BINS * 2)
+
+/**@brief Counters kept across resets. */
+typedef struct
+{
+    uint32_t                        connections;                  /**< Clients connected. */
+    uint32_t                        completed;                    /**< Transfers that delivered the whole page. */
+    uint32_t                        abandoned;                    /**< Transfers the client disconnected from part way. */
+    uint32_t                        bytes_served;                 /**< Bytes of page delivered by completed transfers. */
+    uint32_t                        transfer_ms;                  /**< Time taken by all completed transfers, for the average. */
+    uint16_t                        chunk_hist[FAT_METRICS_HIST_BINS];   /**< Completed transfers by the number of chunks they took. */
+} fat_metrics_t;
+
+/**@brief One entry of the record log.  Records are appended until the page is full, the one with
+*         the highest sequence number and a good CRC is the current one.
+*/
+typedef struct
+{
+    uint32_t                        magic;                        /**< FAT_METRICS_MAGIC, erased in free slots. */
+    uint32_t                        seq;                          /**< Incremented with every record. */
+    fat_metrics_t                   metrics;
+    uint16_t                        crc;                          /**< CRC-16-CCITT of seq and metrics. */
+    uint16_t                        reserved;                     /**< Left erased. */
+} fat_metrics_record_t;
+
+uint32_t fat_metrics_init(void);
+void     fat_metrics_connected(void);
+void     fat_metrics_transfer_begin(uint8_t link);
+void     fat_metrics_transfer_end(uint8_t link, bool completed, uint32_t bytes, uint16_t chunks);
+uint16_t fat_metrics_encode(uint8_t * p_data);
+void     fat_metrics_save(void);
+
+#endif
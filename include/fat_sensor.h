@@ -0,0 +1,32 @@
+#ifndef FAT_SENSOR_H__
+#define FAT_SENSOR_H__
+
+#include <stdint.h>
+#include "nrf_error.h"
+
+#ifndef FAT_SENSOR_ENABLED
+#define FAT_SENSOR_ENABLED          0                                     /**< Set by the RuuviTag Makefile, see README.md. */
+#endif
+
+#define FAT_SENSOR_CONN_MAX_AGE_S   10                                    /**< Oldest sample a connecting client is shown, older ones are taken again. */
+#define FAT_SENSOR_ADV_MAX_AGE_S    60                                    /**< Oldest sample the TLM frame carries, so advertising samples once a minute at most. */
+
+/**@brief One reading of the environmental sensor and the accelerometer. */
+typedef struct
+{
+    int32_t                         temp;                         /**< Temperature in 0.01 degrees C. */
+    uint32_t                        humidity;                     /**< Relative humidity in 0.01 %. */
+    uint32_t                        pressure;                     /**< Air pressure in Pa. */
+    int16_t                         accel[3];                     /**< Acceleration along X, Y and Z in mg. */
+} fat_sensor_data_t;
+
+uint32_t fat_sensor_init(void);
+uint32_t fat_sensor_get(uint32_t max_age_s, fat_sensor_data_t * p_data);
+uint32_t fat_sensor_last_get(fat_sensor_data_t * p_data);
+
+// The hardware behind fat_sensor: fat_sensor_ruuvi.c on the tag, host/sdk_sim.c on the host.
+// fat_sensor_hw_sample() blocks until the reading is done, about 10 ms on the tag.
+uint32_t fat_sensor_hw_init(void);
+uint32_t fat_sensor_hw_sample(fat_sensor_data_t * p_data);
+
+#endif
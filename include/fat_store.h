@@ -0,0 +1,59 @@
+#ifndef FAT_STORE_H__
+#define FAT_STORE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "nrf_error.h"
+
+#define FAT_STORE_MAGIC             0x50544146                            /**< "FATP", marks a sealed image. */
+#define FAT_STORE_PAGE_SIZE         4096                                  /**< Size of one nRF52 flash page. */
+#define FAT_STORE_SLOT_PAGES        8                                     /**< Flash pages per slot (32 kB). */
+#define FAT_STORE_SLOT_COUNT        2                                     /**< A/B slots, one live and one receiving uploads. */
+#define FAT_STORE_NUM_PAGES         (FAT_STORE_SLOT_PAGES * FAT_STORE_SLOT_COUNT)
+#define FAT_STORE_MAX_PAGE_LEN      (FAT_STORE_SLOT_PAGES * FAT_STORE_PAGE_SIZE - sizeof(fat_store_header_t))
+
+#define FAT_ENCODING_IDENTITY       0                                     /**< Page stored as is. */
+#define FAT_ENCODING_DEFLATE        1                                     /**< Page stored as a raw deflate stream. */
+#define FAT_ENCODING_TEMPLATE       2                                     /**< Page stored as a compiled template, see include/fat_tmpl.h. */
+
+#define FAT_STORE_BUF_SIZE          256                                   /**< Bytes per background flash write. */
+#define FAT_STORE_BUF_COUNT         4                                     /**< Staging blocks, how far the radio may run ahead of the flash.  No more than fstorage queues (FS_QUEUE_SIZE). */
+
+/**@brief Header at the start of each slot, immediately followed by the page.
+*
+* @details The same layout is written by the host side page packer, so keep the two in step.
+*          The header is written after the page data has been verified, so a slot with a valid
+*          header always holds a complete page.
+*/
+typedef struct
+{
+    uint32_t                        magic;                        /**< FAT_STORE_MAGIC when the slot holds an image. */
+    uint16_t                        version;                      /**< Content version of the page. */
+    uint16_t                        crc;                          /**< CRC-16-CCITT (init 0xFFFF) of the page bytes. */
+    uint32_t                        length;                       /**< Length of the page in bytes. */
+    uint32_t                        seq;                          /**< Commit sequence number, the highest valid slot is served. */
+    uint8_t                         encoding;                     /**< FAT_ENCODING_* of the stored page. */
+    uint8_t                         reserved[3];                  /**< Left erased. */
+} fat_store_header_t;
+
+typedef enum
+{
+    FAT_STORE_EVT_READY,                                          /**< Upload slot erased, data can be written. */
+    FAT_STORE_EVT_COMMITTED,                                      /**< Upload verified and live, fat_store_page_get() returns the new page. */
+    FAT_STORE_EVT_ERROR,                                          /**< Upload failed, the live page is unchanged. */
+} fat_store_evt_type_t;
+
+typedef void (*fat_store_evt_handler_t) (fat_store_evt_type_t evt_type, uint32_t offset);
+
+uint32_t fat_store_init(fat_store_evt_handler_t evt_handler);
+uint32_t fat_store_page_get(uint8_t const ** pp_data, uint16_t * p_len, uint16_t * p_version, uint8_t * p_encoding);
+
+uint32_t fat_store_upload_begin(uint32_t length, uint16_t crc, uint16_t version, uint8_t encoding);
+uint32_t fat_store_upload_write(uint32_t offset, uint8_t const * p_data, uint16_t len);
+uint32_t fat_store_upload_commit(void);
+void     fat_store_upload_abort(void);
+uint32_t fat_store_upload_pos(void);
+uint8_t const * fat_store_upload_slot_get(void);
+bool     fat_store_busy(void);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef FAT_TLM_H__
+#define FAT_TLM_H__
+
+#include <stdint.h>
+#include "fat_sensor.h"
+
+#define FAT_TLM_FRAME_TYPE          0x20                                  /**< Eddystone-TLM frame type. */
+#define FAT_TLM_VERSION             0x00                                  /**< Unencrypted TLM. */
+#define FAT_TLM_DATA_LEN            14                                    /**< Eddystone service data of the frame: type, version, VBATT, TEMP, ADV_CNT, SEC_CNT. */
+
+#define FAT_TLM_STATS_COMPANY_ID    0xFFFF                                /**< Manufacturer specific data of the TLM scan response, ID reserved for unassigned use. */
+#if FAT_SENSOR_ENABLED
+#define FAT_TLM_STATS_LEN           18                                    /**< As below, then humidity in 0.01 % u16, pressure in Pa - 50000 u16, X, Y, Z in mg i16. */
+#else
+#define FAT_TLM_STATS_LEN           8                                     /**< After the company ID: connections served, bytes delivered, u32 big endian like TLM. */
+#endif
+
+void fat_tlm_adv_pdus_add(uint32_t pdus);
+void fat_tlm_page_served(uint32_t bytes);
+void fat_tlm_encode(uint8_t * p_tlm, uint8_t * p_stats);
+uint32_t fat_tlm_uptime_get(void);
+uint32_t fat_tlm_served_get(void);
+uint16_t fat_tlm_battery_mv_get(void);
+
+#endif
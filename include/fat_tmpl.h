@@ -0,0 +1,50 @@
+#ifndef FAT_TMPL_H__
+#define FAT_TMPL_H__
+
+#include <stdint.h>
+#include "nrf_error.h"
+
+#define FAT_TMPL_MAGIC              0x4C505446                            /**< "FTPL", start of a compiled template. */
+#define FAT_TMPL_HEADER_LEN         8
+#define FAT_TMPL_SEG_LEN            4
+#define FAT_TMPL_SRC_VAR            0x8000                                /**< Segment source flag, the segment is a placeholder. */
+#define FAT_TMPL_VALUE_MAX          12                                    /**< Longest value text, wider placeholders are padded. */
+
+// Compiled template, as tools/fatpack.py --template writes it, little endian:
+// [FAT_TMPL_MAGIC u32][segment count u16][rendered length u16]
+// [output offset u16][source u16] for each segment, by output offset, the first at 0
+// [literal text]
+// A segment runs up to the next one's output offset, the last to the rendered length.  Its source
+// is FAT_TMPL_SRC_VAR | fat_tmpl_var_t for a placeholder, else the offset of its literal text.
+// Placeholders have a fixed width, so the offset map never changes and the rendered length is
+// known before any value is.
+
+/**@brief Values a placeholder can show.  tools/fatpack.py mirrors these. */
+typedef enum
+{
+    FAT_TMPL_VAR_UPTIME,                                          /**< Seconds since power up. */
+    FAT_TMPL_VAR_SERVED,                                          /**< Connections a whole page was delivered on since power up. */
+    FAT_TMPL_VAR_BATTERY,                                         /**< Supply voltage in mV, from the last TLM frame. */
+    FAT_TMPL_VAR_TEMP,                                            /**< Temperature in degrees C, the BME280's to 0.01 on a RuuviTag, else the die's to 0.25. */
+    FAT_TMPL_VAR_VERSION,                                         /**< Content version of the page. */
+    FAT_TMPL_VAR_HUMIDITY,                                        /**< Relative humidity in %, to 0.01.  Blank without FAT_SENSOR_ENABLED. */
+    FAT_TMPL_VAR_PRESSURE,                                        /**< Air pressure in hPa, to 0.01.  Blank without FAT_SENSOR_ENABLED. */
+    FAT_TMPL_VAR_ACCEL_X,                                         /**< Acceleration in mg.  Blank without FAT_SENSOR_ENABLED. */
+    FAT_TMPL_VAR_ACCEL_Y,
+    FAT_TMPL_VAR_ACCEL_Z,
+    FAT_TMPL_VAR_COUNT
+} fat_tmpl_var_t;
+
+/**@brief Placeholder values frozen for one connection. */
+typedef struct
+{
+    uint8_t                         len[FAT_TMPL_VAR_COUNT];      /**< Length of each text. */
+    char                            text[FAT_TMPL_VAR_COUNT][FAT_TMPL_VALUE_MAX];   /**< Not terminated. */
+} fat_tmpl_values_t;
+
+uint32_t fat_tmpl_check(uint8_t const * p_tmpl, uint32_t len, uint16_t * p_out_len);
+uint32_t fat_tmpl_vars_get(uint8_t const * p_tmpl);
+uint16_t fat_tmpl_read(uint8_t const * p_tmpl, fat_tmpl_values_t const * p_values, uint16_t offset,
+                       uint8_t * p_dest, uint16_t len);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef FAT_TRACE_H__
+#define FAT_TRACE_H__
+
+#include <stdint.h>
+
+#ifndef FAT_TRACE_ENABLED
+#define FAT_TRACE_ENABLED           0                                     /**< Set by "make TRACE=1", see README.md. */
+#endif
+
+#define FAT_TRACE_VERSION           1                                     /**< Argument of FAT_TRACE_EVT_START, bumped if the record layout changes. */
+#define FAT_TRACE_RECORDS           64                                    /**< Ring size, a power of two.  Oldest records are overwritten if the idle loop falls behind. */
+#define FAT_TRACE_RTT_CHANNEL       1                                     /**< RTT up channel the records are written to, binary, channel 0 stays text. */
+#define FAT_TRACE_RTT_BUF_SIZE      512                                   /**< RTT buffer, 64 records. */
+#define FAT_TRACE_NO_CONN           0xFFFF                                /**< conn_handle of records that belong to no link. */
+
+/**@brief Trace events, the record's arg is given for each.  tools/fattrace.py mirrors these. */
+typedef enum
+{
+    FAT_TRACE_EVT_START,                                          /**< fat_trace_init(), FAT_TRACE_VERSION.  Marks a reset in the stream. */
+    FAT_TRACE_EVT_CONNECT,                                        /**< Link up, 0. */
+    FAT_TRACE_EVT_DISCONNECT,                                     /**< Link down, HCI reason. */
+    FAT_TRACE_EVT_READ,                                           /**< Authorized read of the page arrived, offset asked for. */
+    FAT_TRACE_EVT_REPLY,                                          /**< Read reply handed to the SoftDevice, length. */
+    FAT_TRACE_EVT_NOTIFY,                                         /**< Page notification queued, length. */
+    FAT_TRACE_EVT_TX_COMPLETE,                                    /**< Packets the SoftDevice has sent, count. */
+    FAT_TRACE_EVT_ERROR,                                          /**< SoftDevice call failed on the page path, error code. */
+    FAT_TRACE_EVT_LOST,                                           /**< Records overwritten before they were drained, count. */
+    FAT_TRACE_EVT_RESUME,                                         /**< FAT_CTRL_OP_RESUME handled, offset resumed at, 0 if refused. */
+} fat_trace_evt_t;
+
+/**@brief One trace record, little endian as the CPU writes it. */
+typedef struct
+{
+    uint32_t                        stamp;                        /**< RTC1 ticks (24 bits, 30.5 us) in the low bits, fat_trace_evt_t in the top byte. */
+    uint16_t                        conn_handle;                  /**< Link, or FAT_TRACE_NO_CONN. */
+    uint16_t                        arg;                          /**< Depends on the event. */
+} fat_trace_rec_t;
+
+#if FAT_TRACE_ENABLED
+
+#define FAT_TRACE(evt, conn_handle, arg)    fat_trace_put((evt), (conn_handle), (uint16_t) (arg))
+
+void fat_trace_init(void);
+void fat_trace_put(fat_trace_evt_t evt, uint16_t conn_handle, uint16_t arg);
+void fat_trace_flush(void);
+
+#else
+
+#define FAT_TRACE(evt, conn_handle, arg)
+#define fat_trace_init()
+#define fat_trace_flush()
+
+#endif
+
+#endif
@@ -13,6 +13,15 @@
 #define APP_EDDYSTONE_RSSI              0xEE                              /**< 0xEE = -18 dB is the approximate signal strength at 0 m. */
 #define APP_FATBEACON_URI               0x0E                              /** 0x0E is the URL scheme for Fatbeacon */
 #define APP_EDDYSTONE_URL_FRAME_TYPE    0x10                              /**< URL Frame type is fixed at 0x10. */
+#define APP_EDDYSTONE_UID_FRAME_TYPE    0x00                              /**< UID Frame type is fixed at 0x00. */
+#define APP_EDDYSTONE_UID_NAMESPACE     0xAE, 0x59, 0x46, 0xD4, 0xA9, \
+                                        0x7C, 0xCA, 0x6A, 0xFF, 0xD3      /**< Elided fatbeacon service UUID (first 4 and last 6 bytes), as the Eddystone spec suggests. */
+
+// Fatbeacon read protocol.  BLE_FAT_READ_MODE_CURSOR works with the current PWA client,
+// BLE_FAT_READ_MODE_OFFSET serves standard GATT Read Long / Read Blob clients.
+#ifndef APP_FAT_READ_MODE
+#define APP_FAT_READ_MODE               BLE_FAT_READ_MODE_CURSOR
+#endif
 
 // Fatbeacon description
 #define APP_FATBEACON_NAME              'H', 'e', 'l', 'l', \
@@ -27,6 +36,10 @@
                                         'g', 'h', 't' 
 */
 
+#ifdef FAT_USE_PACKED_PAGE
+// Built from page/ by "make page", see tools/fatpack.py.
+#include "fatpage.h"
+#else
 // A smaller static webpage (about 2kB, load time is 4-5 seconds)
 #define STATIC_PAGE         "<html><head><meta charset=\"utf-8\"><title>"\
                             "I'm a Fatbeacon</title><style>"\
@@ -63,6 +76,12 @@
                             "</section><footer><hr />Fatbeacon powered!</footer>"\
                             "</body></html>"\
 
+// Page descriptor inputs.  The length is taken at compile time so nothing has to scan the page at runtime.
+#define STATIC_PAGE_LEN                 (sizeof(STATIC_PAGE) - 1)         /**< Length of STATIC_PAGE without the terminating NUL. */
+#define STATIC_PAGE_VERSION             1                                 /**< Content version of STATIC_PAGE.  Bump it whenever the page changes. */
+#define STATIC_PAGE_ENCODING            0                                 /**< FAT_ENCODING_IDENTITY, STATIC_PAGE is plain html. */
+#endif
+
 /* Static web page.  You can put any single-page html/css/js you like here.  By default this
  * returns a short blurb about the eddystone lighthouse (this is from Wikipedia so if you use it
  * make sure to provide attribution).   
@@ -33,6 +33,13 @@
 
 #define BSP_BUTTON_0_MASK (1<<BSP_BUTTON_0)
 
+// Sensors share SPI0, each with its own chip select, see fat_sensor_ruuvi.c.
+#define SPIM0_SCK_PIN       29
+#define SPIM0_MOSI_PIN      25
+#define SPIM0_MISO_PIN      28
+#define SPIM0_SS_BME280_PIN 3
+#define SPIM0_SS_ACC_PIN    8
+
 #define NRF_CLOCK_LFCLKSRC      {.source        = NRF_CLOCK_LF_SRC_XTAL,            \
                                  .rc_ctiv       = 0,                                \
                                  .rc_temp_ctiv  = 0,                                \
@@ -46,44 +46,138 @@
 #include <stdint.h>
 #include "ble_advdata.h"
 #include "ble_advertising.h"
-#include "ble_conn_params.h"
 #include "nordic_common.h"
 #include "softdevice_handler.h"
 #include "bsp.h"
 #include "app_timer.h"
+#include "app_timer_appsh.h"
+#include "app_scheduler.h"
+#include "app_util_platform.h"
 #include "ble_fat.h"
+#include "fat_store.h"
+#include "fat_adv.h"
+#include "fat_tlm.h"
+#include "fat_sensor.h"
+#include "fat_metrics.h"
+#include "fat_trace.h"
+#include "fstorage.h"
 #include "fatbeacon.h"
 #include "SEGGER_RTT.h"
 
 #define IS_SRVC_CHANGED_CHARACT_PRESENT 0                                 /**< Include the service changed characteristic. If not enabled, the server's database cannot be changed for the lifetime of the device. */
 
 #define CENTRAL_LINK_COUNT              0                                 /**< Number of central links used by the application. When changing this number remember to adjust the RAM settings*/
-#define PERIPHERAL_LINK_COUNT           1                                 /**< Number of peripheral links used by the application. When changing this number remember to adjust the RAM settings*/
-
-#define APP_CFG_NON_CONN_ADV_TIMEOUT    0                                 /**< Time for which the device must be advertising in non-connectable mode (in seconds). 0 disables the time-out. */
-#define APP_CFG_CONNECTABLE_ADV_TIMEOUT         60  
-#define NON_CONNECTABLE_ADV_INTERVAL            MSEC_TO_UNITS(100, UNIT_0_625_MS) /**< The advertising interval for non-connectable advertisement (100 ms). This value can vary between 100 ms and 10.24 s). */
-#define APP_CFG_CONNECTABLE_ADV_INTERVAL_MS     100     
+#define PERIPHERAL_LINK_COUNT           3                                 /**< Number of peripheral links used by the application. When changing this number remember to adjust the RAM settings*/
+
+#if PERIPHERAL_LINK_COUNT > BLE_FAT_MAX_LINKS
+#error "PERIPHERAL_LINK_COUNT exceeds the number of links ble_fat can track"
+#endif
+
+// Radio bandwidth profile, set by BW_PROFILE in the board Makefile.  BLE_CONN_BW_HIGH gives every
+// link the most TX buffers and packets per connection event, at the cost of SoftDevice RAM.  The
+// Makefile also moves the RAM start in the linker script to match and passes it as FAT_APP_RAM_BASE.
+#ifndef FAT_BW_PROFILE
+#define FAT_BW_PROFILE                  BLE_CONN_BW_MID                   /**< The SoftDevice default, the RAM start in the .ld files is for this one. */
+#endif
+#ifndef FAT_CONN_EVT_EXT
+#define FAT_CONN_EVT_EXT                1                                 /**< Extend connection events while there is data to send, SoftDevices with API version 4 and later. */
+#endif
 
 #define MIN_CONN_INTERVAL                       MSEC_TO_UNITS(30, UNIT_1_25_MS)             /**< Minimum acceptable connection interval (20 ms), Connection interval uses 1.25 ms units. */
 #define MAX_CONN_INTERVAL                       MSEC_TO_UNITS(60, UNIT_1_25_MS)             /**< Maximum acceptable connection interval (75 ms), Connection interval uses 1.25 ms units. */
 #define SLAVE_LATENCY                           0                                           /**< Slave latency. */
 #define CONN_SUP_TIMEOUT                        MSEC_TO_UNITS(1000, UNIT_10_MS)             /**< Connection supervisory timeout (4 seconds), Supervision Timeout uses 10 ms units. */
 
-#define FIRST_CONN_PARAMS_UPDATE_DELAY          APP_TIMER_TICKS(15000, APP_TIMER_PRESCALER)  /**< Time from initiating event (connect or start of notification) to first time sd_ble_gap_conn_param_update is called (5 seconds). */
-#define NEXT_CONN_PARAMS_UPDATE_DELAY           APP_TIMER_TICKS(30000, APP_TIMER_PRESCALER) /**< Time between each call to sd_ble_gap_conn_param_update after the first call (30 seconds). */
-#define MAX_CONN_PARAMS_UPDATE_COUNT            3                                           /**< Number of attempts before giving up the connection parameter negotiation. */
+// Each link asks for the fastest interval it can get as soon as a transfer starts, and for a long
+// interval with slave latency once the page is delivered, see link_params_request().
+#define FAST_MIN_CONN_INTERVAL                  MSEC_TO_UNITS(7.5, UNIT_1_25_MS)            /**< Fastest interval the spec allows, asked for while a page is sent. */
+#define FAST_MAX_CONN_INTERVAL                  MSEC_TO_UNITS(15, UNIT_1_25_MS)
+#define COMPAT_MIN_CONN_INTERVAL                MSEC_TO_UNITS(15, UNIT_1_25_MS)             /**< Fallback for centrals that turn the fastest range down, fits Apple's accessory guidelines. */
+#define COMPAT_MAX_CONN_INTERVAL                MSEC_TO_UNITS(30, UNIT_1_25_MS)
+#define IDLE_MIN_CONN_INTERVAL                  MSEC_TO_UNITS(400, UNIT_1_25_MS)            /**< Asked for once the page is delivered, until the client disconnects. */
+#define IDLE_MAX_CONN_INTERVAL                  MSEC_TO_UNITS(500, UNIT_1_25_MS)
+#define IDLE_SLAVE_LATENCY                      2                                           /**< Lets the radio sleep through 2 of every 3 idle connection events. */
+#define LINK_CONN_SUP_TIMEOUT                   MSEC_TO_UNITS(4000, UNIT_10_MS)             /**< Supervision timeout for all of them, over 3 x (latency + 1) x interval when idle. */
+#define LINK_PARAMS_TIMER_MS                    1000                                        /**< Running update procedures are checked on this often, only while there are any. */
+#define LINK_PARAMS_TIMEOUT_MS                  5000                                        /**< An update the central hasn't answered in this long is given up on and asked again. */
+#define LINK_PARAMS_MAX_UNANSWERED              3                                           /**< Unanswered updates in a row after which a link keeps what the central chose. */
 
 #define DEAD_BEEF                       0xDEADBEEF                        /**< Value used as error code on stack dump, can be used to identify stack location on stack unwind. */
 
 #define APP_TIMER_PRESCALER             0                                 /**< Value of the RTC1 PRESCALER register. */
 #define APP_TIMER_OP_QUEUE_SIZE         4                                 /**< Size of timer operation queues. */
 
-static ble_gap_adv_params_t m_adv_params;                                 /**< Parameters to be passed to the stack when starting advertising. */
+// Work handed from interrupts to the main loop, see ble_evt_dispatch().  Timer timeouts go the
+// same way, so everything but the page path runs in thread mode, one handler at a time.
+#define SCHED_MAX_EVENT_DATA_SIZE       MAX(APP_TIMER_SCHED_EVT_SIZE, sizeof(ble_evt_t))   /**< A timeout, a copy of a GAP event or one of the events below. */
+// Per link a burst is up to 6 GAP events (connect, parameter, PHY and data length updates,
+// disconnect) and 2 transfer changes; on top of that one timeout per timer and a commit.
+#define SCHED_QUEUE_SIZE                (8 * PERIPHERAL_LINK_COUNT + 6)   /**< Events the main loop can fall behind by, see sched_put(). */
+#define CONN_EVT_PENDING_MAX            (2 * PERIPHERAL_LINK_COUNT)       /**< Connects and disconnects held back by a full queue, see conn_evt_put(). */
+
 static ble_fat_t            m_ble_fat;
-static uint8_t *            m_page_data = (uint8_t *) STATIC_PAGE; //{STATIC_BORING_WEBPAGE};
-static uint16_t             m_conn_handle = BLE_CONN_HANDLE_INVALID;
-static int16_t              m_last_data_pos = 0;
+static uint8_t const *      m_page_data = (uint8_t const *) STATIC_PAGE; /**< Compiled-in page, served when the content partition is empty. */
+static uint8_t              m_conn_count = 0;                         /**< Number of clients currently connected. */
+static uint16_t             m_upload_conn_handle = BLE_CONN_HANDLE_INVALID;   /**< Connection that started the running upload. */
+
+/**@brief Connection parameter sets a link can ask for. */
+typedef enum
+{
+    LINK_PARAMS_CENTRAL,                                                  /**< Whatever the central chose, nothing asked for. */
+    LINK_PARAMS_FAST,
+    LINK_PARAMS_COMPAT,
+    LINK_PARAMS_IDLE,
+} link_params_t;
+
+/**@brief Connection parameter negotiation of one link. */
+typedef struct
+{
+    link_params_t           wanted;                                       /**< Parameters the link should be on for its transfer state. */
+    link_params_t           requested;                                    /**< Parameters last asked of the central. */
+    bool                    busy;                                         /**< Update procedure running, ask again once it ends. */
+    bool                    fast_refused;                                 /**< Central turned LINK_PARAMS_FAST down, use LINK_PARAMS_COMPAT. */
+    uint8_t                 waited;                                       /**< Timer periods the running procedure has gone unanswered. */
+    uint8_t                 unanswered;                                   /**< Procedures in a row the central never answered. */
+} link_params_state_t;
+
+static ble_gap_conn_params_t const m_link_conn_params[] =
+{
+    [LINK_PARAMS_FAST]   = { FAST_MIN_CONN_INTERVAL,   FAST_MAX_CONN_INTERVAL,   0,                  LINK_CONN_SUP_TIMEOUT },
+    [LINK_PARAMS_COMPAT] = { COMPAT_MIN_CONN_INTERVAL, COMPAT_MAX_CONN_INTERVAL, 0,                  LINK_CONN_SUP_TIMEOUT },
+    [LINK_PARAMS_IDLE]   = { IDLE_MIN_CONN_INTERVAL,   IDLE_MAX_CONN_INTERVAL,   IDLE_SLAVE_LATENCY, LINK_CONN_SUP_TIMEOUT },
+};
+
+static link_params_state_t  m_link_params[BLE_FAT_MAX_LINKS];           /**< Indexed like m_ble_fat.links. */
+static bool                 m_link_params_timer_on;                       /**< m_link_params_timer runs while any link is busy. */
+APP_TIMER_DEF(m_link_params_timer);
+
+/**@brief A link's transfer changed state, passed to the main loop by fat_transfer_evt_handler(). */
+typedef struct
+{
+    uint16_t                conn_handle;                                  /**< Link it happened on, it may be gone by the time this runs. */
+    uint8_t                 link;                                         /**< Index in m_ble_fat.links. */
+    ble_fat_transfer_t      transfer;                                     /**< State it changed to. */
+    uint8_t                 phys;                                         /**< transfer_phys at the time. */
+    uint16_t                len;                                          /**< ble_fat_link_len() at the time. */
+    uint16_t                chunks;                                       /**< Chunks the transfer took. */
+} transfer_evt_t;
+
+/**@brief An upload was committed, passed to the main loop by fat_store_evt_handler(). */
+typedef struct
+{
+    uint16_t                conn_handle;                                  /**< Uploader, to be told how it went. */
+    uint32_t                offset;                                       /**< Bytes committed. */
+} commit_evt_t;
+
+STATIC_ASSERT(sizeof(transfer_evt_t) <= SCHED_MAX_EVENT_DATA_SIZE);
+STATIC_ASSERT(sizeof(commit_evt_t) <= SCHED_MAX_EVENT_DATA_SIZE);
+
+static commit_evt_t         m_commit;                                     /**< Commit waiting for room in the scheduler queue, see commit_put(). */
+static volatile bool        m_commit_pending;                             /**< m_commit is still to be queued. */
+static uint32_t             m_sched_full_count;                           /**< Events that found the scheduler queue full. */
+static ble_evt_t            m_conn_evts[CONN_EVT_PENDING_MAX];            /**< Connects and disconnects waiting for room in the scheduler queue, oldest at m_conn_evts_first. */
+static uint8_t              m_conn_evts_first;
+static volatile uint8_t     m_conn_evts_count;
 
 static uint8_t eddystone_url_data[] =   /**< Information advertised by the Eddystone Fatbeacon frame type. */
 {
@@ -93,92 +187,683 @@ static uint8_t eddystone_url_data[] =   /**< Information advertised by the Eddys
     APP_FATBEACON_NAME              // Description displayed by the Fatbeacon, max 18 chars
 };
 
-static void advertising_start(void);
+static uint8_t eddystone_uid_data[] =   /**< Information advertised by the Eddystone-UID frame, between Fatbeacon frames. */
+{
+    APP_EDDYSTONE_UID_FRAME_TYPE,   // Eddystone UID frame type.
+    APP_EDDYSTONE_RSSI,             // RSSI value at 0 m.
+    APP_EDDYSTONE_UID_NAMESPACE,    // 10-byte namespace.
+    0, 0, 0, 0, 0, 0,               // 6-byte instance, the device address, see advertising_init().
+    0x00, 0x00                      // Reserved for future use.
+};
+
+#define EDDYSTONE_UID_INSTANCE_OFFSET   12                                /**< Where the instance starts in eddystone_uid_data. */
 
-/**@brief handler for BLE fatbeacon read event 
+static uint8_t eddystone_tlm_data[FAT_TLM_DATA_LEN];   /**< Eddystone-TLM frame, filled in by fat_tlm_encode() each time it goes out. */
+static uint8_t fat_tlm_stats_data[FAT_TLM_STATS_LEN];  /**< Fatbeacon counters in the TLM scan response, likewise. */
+
+/**@brief Builds the reply for a read in BLE_FAT_READ_MODE_CURSOR.
  * 
- * @details This handler captures the read request for the fatbeacon characteristic value.
- *          It does not care what the initial values are.  Instead, to work with the current 
- *          PWA implementation, it merely returns the static page value 20 bytes at a time,
- *          incrementing its own internal offset with each read.  It continues until the last
- *          bytes are read, setting the offset to -1 which will cause it to send a 0 byte reply
+ * @details It does not care what the requested offset is.  Instead, to work with the current 
+ *          PWA implementation, it merely returns the page one chunk at a time, advancing its
+ *          own offset with each read, kept per connection in p_link.  A chunk is 20 bytes unless the client negotiated
+ *          a larger ATT MTU, in which case it grows to MTU - 3.  It continues until the last
+ *          chunk is read, setting the offset to -1 which will cause it to send a 0 byte reply
  *          (if requested).  Once complete, the PWA app should close the connection.    
  *          The offset is reset by any Disconnect event, or the act of reading past the end of the 
- *          data.  
+ *          data, unless a client resumes with FAT_CTRL_OP_RESUME.  
+ *
+ *          A client that set FAT_CTRL_OPT_HEADER gets the stream header at the start of its first
+ *          read, and knows the length from it, so the offset goes straight back to 0 after the
+ *          last chunk and the empty read is saved.
+ *
+ *          Chunks come from ble_fat_link_read(), straight out of flash, or out of the link's
+ *          inflater when the page is compressed and the client can't inflate it.  Either way a
+ *          read costs only the bytes it returns, no matter how large the page is.
  *
  *          This doesn't follow the normal GATT spec, so this is only for testing / compatability
  *          with the PWA app. 
 */
-static void fat_read_evt_handler(ble_fat_t* p_fat, uint16_t value_handle)
+static void fat_cursor_reply_build(ble_fat_t* p_fat, ble_fat_link_t * p_link, ble_gatts_rw_authorize_reply_params_t * p_reply)
+{
+    uint16_t page_len = ble_fat_link_len(p_link);
+    uint16_t len;
+
+    if (p_link->header_due || (p_link->read_pos >= 0 && p_link->read_pos < page_len)) // Active request
+    {
+        if (p_link->header_due) {
+            len = ble_fat_link_header_read(p_link, p_link->chunk_len, &p_reply->params.read.p_data);
+            p_reply->params.read.len = FAT_HEADER_LEN + len;
+            p_link->header_due       = false;
+        } else {
+            len = ble_fat_link_read(p_link, p_link->read_pos, p_link->chunk_len, &p_reply->params.read.p_data);
+            p_reply->params.read.len = len;
+        }
+        p_reply->params.read.update      = 1;
+        p_reply->params.read.offset      = 0;
+        p_reply->params.read.gatt_status = BLE_GATT_STATUS_SUCCESS;
+
+        ble_fat_transfer_set(p_fat, p_link, BLE_FAT_TRANSFER_ACTIVE);
+        p_link->read_pos += len;
+        if ((p_link->read_pos >= page_len) && (p_link->options & FAT_CTRL_OPT_HEADER)) {
+            p_link->read_pos   = 0;             // The client counted to the end, no empty read to wait for.
+            p_link->header_due = true;
+            ble_fat_transfer_set(p_fat, p_link, BLE_FAT_TRANSFER_DONE);
+        } else if (p_link->read_pos >= page_len) {
+            p_link->read_pos = -1;
+        }
+    } else {    // Send empty response as last packet
+        p_reply->params.read.p_data      = NULL;
+        p_reply->params.read.len         = 0;
+        p_reply->params.read.update      = 1;
+        p_reply->params.read.offset      = 0;
+        p_reply->params.read.gatt_status = BLE_GATT_STATUS_SUCCESS;
+        p_link->read_pos = 0; 
+        p_link->header_due = (p_link->options & FAT_CTRL_OPT_HEADER) != 0;
+        ble_fat_transfer_set(p_fat, p_link, BLE_FAT_TRANSFER_DONE);
+    }
+}
+
+/**@brief Builds the reply for a read in BLE_FAT_READ_MODE_OFFSET.
+ *
+ * @details Serves the page starting at the offset the client asked for, as in a standard GATT
+ *          Read Long.  No state is kept between reads, so a client can retry, pipeline or resume
+ *          at any offset.  Replies are a full ATT_MTU - 1 so the client knows the page has ended
+ *          as soon as it receives a shorter one, and no extra empty read is needed.
+ */
+static void fat_offset_reply_build(ble_fat_t* p_fat, ble_fat_link_t * p_link, uint16_t offset, ble_gatts_rw_authorize_reply_params_t * p_reply)
+{
+    p_reply->params.read.update = 1;
+    p_reply->params.read.offset = 0;
+
+    if (offset > ble_fat_link_len(p_link)) {
+        p_reply->params.read.gatt_status = BLE_GATT_STATUS_ATTERR_INVALID_OFFSET;
+        return;
+    }
+
+    p_reply->params.read.len         = ble_fat_link_read(p_link, offset, p_link->att_mtu - 1,
+                                                         &p_reply->params.read.p_data);
+    p_reply->params.read.gatt_status = BLE_GATT_STATUS_SUCCESS;
+
+    // A short reply is the last one the client needs.
+    ble_fat_transfer_set(p_fat, p_link, (p_reply->params.read.len < p_link->att_mtu - 1) ?
+                                        BLE_FAT_TRANSFER_DONE : BLE_FAT_TRANSFER_ACTIVE);
+}
+
+/**@brief handler for BLE fatbeacon read event 
+ *
+ * @details Captures the read request for the fatbeacon characteristic value and answers it
+ *          according to the read mode the service was initialized with.
+ */
+static void fat_read_evt_handler(ble_fat_t* p_fat, ble_fat_link_t * p_link, uint16_t value_handle, uint16_t offset)
 {   
     ret_code_t                            err_code;
     ble_gatts_rw_authorize_reply_params_t reply;
 
-    uint16_t page_size = strlen((char *)m_page_data);
+    memset(&reply, 0, sizeof(reply));
+    reply.type = BLE_GATTS_AUTHORIZE_TYPE_READ;
+
+    if (p_fat->read_mode == BLE_FAT_READ_MODE_OFFSET) {
+        fat_offset_reply_build(p_fat, p_link, offset, &reply);
+    } else {
+        fat_cursor_reply_build(p_fat, p_link, &reply);
+    }
+
+    // Per-chunk timing goes to the binary trace, formatting it here would skew what it measures.
+    err_code = sd_ble_gatts_rw_authorize_reply(p_link->conn_handle, &reply);
+    if (err_code != NRF_SUCCESS) {
+        FAT_TRACE(FAT_TRACE_EVT_ERROR, p_link->conn_handle, err_code);
+        SEGGER_RTT_printf(0, "GATT Reply Error %d\n", err_code);
+    } else {
+        FAT_TRACE(FAT_TRACE_EVT_REPLY, p_link->conn_handle, reply.params.read.len);
+    }
     
-    if (page_size > 10000) {
-        page_size = 10000;      // Imposing an arbitrary limit on page size.
+}
+
+/**@brief Writes a number in decimal, with decimals digits after the point.
+ *
+ * @return Characters written, at most FAT_TMPL_VALUE_MAX.
+ */
+static uint8_t number_write(char * p_text, int32_t value, uint8_t decimals)
+{
+    char     digits[FAT_TMPL_VALUE_MAX];
+    uint8_t  count     = 0;
+    uint8_t  len       = 0;
+    uint32_t magnitude = (value < 0) ? -(uint32_t) value : (uint32_t) value;
+
+    do
+    {
+        digits[count++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while ((magnitude > 0) || (count <= decimals));
+
+    if (value < 0) {
+        p_text[len++] = '-';
     }
+    while (count > 0)
+    {
+        if (count == decimals) {
+            p_text[len++] = '.';
+        }
+        p_text[len++] = digits[--count];
+    }
+    return len;
+}
 
-    memset(&reply, 0, sizeof(reply));
-    reply.type = BLE_GATTS_AUTHORIZE_TYPE_READ;
+/**@brief handler for template values
+ *
+ * @details Called by ble_fat from the SoftDevice interrupt as a client connects to a template
+ *          page, so only values that can be read there are offered: counters, the battery
+ *          voltage fat_tlm measured last and, on a RuuviTag, the sensors' last reading.  Never
+ *          samples, link_sensor_refresh() does that from the main loop.
+ */
+static uint8_t fat_value_handler(ble_fat_t * p_fat, ble_fat_link_t * p_link, fat_tmpl_var_t var, char * p_text)
+{
+    int32_t temp;
+#if FAT_SENSOR_ENABLED
+    fat_sensor_data_t sensor;
 
-    if (m_last_data_pos >= 0) // Active request
+    if ((var == FAT_TMPL_VAR_TEMP) || (var >= FAT_TMPL_VAR_HUMIDITY)) {
+        if (fat_sensor_last_get(&sensor) != NRF_SUCCESS) {
+            return 0;
+        }
+        switch (var)
+        {
+            case FAT_TMPL_VAR_TEMP:     return number_write(p_text, sensor.temp, 2);
+            case FAT_TMPL_VAR_HUMIDITY: return number_write(p_text, (int32_t) sensor.humidity, 2);
+            case FAT_TMPL_VAR_PRESSURE: return number_write(p_text, (int32_t) sensor.pressure, 2);   // Pa is 0.01 hPa.
+            case FAT_TMPL_VAR_ACCEL_X:  return number_write(p_text, sensor.accel[0], 0);
+            case FAT_TMPL_VAR_ACCEL_Y:  return number_write(p_text, sensor.accel[1], 0);
+            case FAT_TMPL_VAR_ACCEL_Z:  return number_write(p_text, sensor.accel[2], 0);
+            default:                    return 0;
+        }
+    }
+#endif
+
+    switch (var)
     {
-        if (m_last_data_pos + FAT_CHAR_MAX_LEN >= page_size) {
-            reply.params.read.len = page_size - m_last_data_pos;
-        } else {
-            reply.params.read.len = FAT_CHAR_MAX_LEN;
+        case FAT_TMPL_VAR_UPTIME:
+            return number_write(p_text, fat_tlm_uptime_get(), 0);
+
+        case FAT_TMPL_VAR_SERVED:
+            return number_write(p_text, fat_tlm_served_get(), 0);
+
+        case FAT_TMPL_VAR_BATTERY:
+            // Left blank until the first TLM frame has measured it.
+            return (fat_tlm_battery_mv_get() != 0) ? number_write(p_text, fat_tlm_battery_mv_get(), 0) : 0;
+
+        case FAT_TMPL_VAR_TEMP:
+            if (sd_temp_get(&temp) != NRF_SUCCESS) {
+                return 0;
+            }
+            return number_write(p_text, temp * 25, 2);              // 0.25 degree steps.
+
+        case FAT_TMPL_VAR_VERSION:
+            return number_write(p_text, p_link->page.version, 0);
+
+        default:
+            return 0;
+    }
+}
+
+/**@brief Maps a fat_store error to the status reported to the uploading client.
+ */
+static uint8_t upload_status_get(uint32_t err_code)
+{
+    switch (err_code)
+    {
+        case NRF_SUCCESS:               return FAT_UPLOAD_STATUS_OK;
+        case NRF_ERROR_BUSY:            return FAT_UPLOAD_STATUS_BUSY;
+        case NRF_ERROR_INVALID_PARAM:   return FAT_UPLOAD_STATUS_OFFSET;
+        case NRF_ERROR_INTERNAL:        return FAT_UPLOAD_STATUS_FAILED;
+        default:                        return FAT_UPLOAD_STATUS_INVALID;
+    }
+}
+
+/**@brief handler for writes to the upload characteristic
+ *
+ * @details Decodes the FAT_UPLOAD_OP_* packets and feeds them to fat_store, which writes the
+ *          data to the inactive slot in the background.  START and COMMIT are answered from
+ *          fat_store_evt_handler once the flash work is done.  DATA is only answered when a
+ *          packet has to be rejected, so a burst of writes costs nothing on the way back.
+ *          START is turned away as busy while any link still reads the page it would erase.
+ */
+static void fat_upload_evt_handler(ble_fat_t * p_fat, ble_fat_link_t * p_link, uint8_t const * p_data, uint16_t len)
+{
+    uint32_t err_code = NRF_ERROR_INVALID_LENGTH;
+    uint8_t  opcode   = (len > 0) ? p_data[0] : 0;
+
+    switch (opcode)
+    {
+        case FAT_UPLOAD_OP_START:
+            if ((len == 9 || len == 10) &&
+                ble_fat_page_in_use(p_fat, fat_store_upload_slot_get(), FAT_STORE_SLOT_PAGES * FAT_STORE_PAGE_SIZE)) {
+                err_code = NRF_ERROR_BUSY;      // A link still reads the page the upload would erase.
+            } else if (len == 9 || len == 10) {
+                m_upload_conn_handle = p_link->conn_handle;
+                err_code = fat_store_upload_begin(uint32_decode(&p_data[1]),
+                                                  uint16_decode(&p_data[5]),
+                                                  uint16_decode(&p_data[7]),
+                                                  (len == 10) ? p_data[9] : FAT_ENCODING_IDENTITY);
+            }
+            break;
+
+        case FAT_UPLOAD_OP_DATA:
+            if (len > 5 && p_link->conn_handle == m_upload_conn_handle) {
+                err_code = fat_store_upload_write(uint32_decode(&p_data[1]), &p_data[5], len - 5);
+                if (err_code == NRF_SUCCESS) {
+                    return;
+                }
+            }
+            break;
+
+        case FAT_UPLOAD_OP_COMMIT:
+            if (p_link->conn_handle == m_upload_conn_handle) {
+                err_code = fat_store_upload_commit();
+            }
+            break;
+
+        case FAT_UPLOAD_OP_ABORT:
+            fat_store_upload_abort();
+            m_upload_conn_handle = BLE_CONN_HANDLE_INVALID;
+            err_code = NRF_SUCCESS;
+            break;
+
+        default:
+            break;
+    }
+
+    // Successful START and COMMIT are reported when the flash work completes.
+    if (err_code != NRF_SUCCESS || opcode == FAT_UPLOAD_OP_ABORT) {
+        (void) ble_fat_upload_status_send(p_fat, p_link->conn_handle, opcode,
+                                          upload_status_get(err_code), fat_store_upload_pos());
+    }
+}
+
+static uint32_t adv_frame_encode(fat_adv_frame_t frame);
+
+/**@brief Queues an event for the main loop from an interrupt.
+ *
+ * @details A full queue means the main loop is behind, not that anything is broken, so the
+ *          event is counted in m_sched_full_count and traced instead of resetting the beacon.
+ *
+ * @param[in] p_data       Event data, copied into the queue.
+ * @param[in] size         Size of the event data.
+ * @param[in] handler      Main loop handler for the event.
+ * @param[in] conn_handle  Link the event is about, for the trace.
+ *
+ * @return NRF_SUCCESS, or NRF_ERROR_NO_MEM if the queue was full.
+ */
+static uint32_t sched_put(void * p_data, uint16_t size, app_sched_event_handler_t handler, uint16_t conn_handle)
+{
+    uint32_t err_code;
+
+    err_code = app_sched_event_put(p_data, size, handler);
+    if (err_code == NRF_ERROR_NO_MEM) {
+        m_sched_full_count++;
+        FAT_TRACE(FAT_TRACE_EVT_ERROR, conn_handle, err_code);
+    } else {
+        APP_ERROR_CHECK(err_code);
+    }
+    return err_code;
+}
+
+/**@brief Puts a committed page live, from the main loop.
+ *
+ * @details ble_fat_page_set() inflates a compressed page in full to check it, far too long to
+ *          hold up the SoftDevice interrupt for.  New connections get the new page, running
+ *          transfers finish on the old one.
+ */
+static void commit_evt_execute(void * p_event_data, uint16_t event_size)
+{
+    commit_evt_t *  p_evt = p_event_data;
+    uint32_t        err_code;
+    uint8_t const * p_data;
+    uint16_t        len;
+    uint16_t        version;
+    uint8_t         encoding;
+
+    err_code = fat_store_page_get(&p_data, &len, &version, &encoding);
+    if (err_code == NRF_SUCCESS) {
+        err_code = ble_fat_page_set(&m_ble_fat, p_data, len, version, encoding);
+    }
+    if (err_code == NRF_SUCCESS) {
+        SEGGER_RTT_printf(0, "Page version %d live, %d bytes\n", version, len);
+        // New content hash, advertised from the next fatbeacon frame on.
+        if (adv_frame_encode(FAT_ADV_FRAME_FAT) != NRF_SUCCESS) {
+            SEGGER_RTT_WriteString(0, "Fatbeacon frame not encoded again\n");
         }
+    } else {
+        SEGGER_RTT_printf(0, "Committed page not served Error %d\n", err_code);
+    }
+    if (p_evt->conn_handle != BLE_CONN_HANDLE_INVALID) {
+        // Gone if it disconnected while the header was being written, see fat_store_upload_abort().
+        (void) ble_fat_upload_status_send(&m_ble_fat, p_evt->conn_handle, FAT_UPLOAD_OP_COMMIT,
+                                          (err_code == NRF_SUCCESS) ? FAT_UPLOAD_STATUS_OK : FAT_UPLOAD_STATUS_FAILED,
+                                          p_evt->offset);
+    }
+}
 
-        reply.params.read.p_data      = m_page_data + m_last_data_pos;        
-        reply.params.read.update      = 1;
-        reply.params.read.offset      = 0;
-        reply.params.read.gatt_status = BLE_GATT_STATUS_SUCCESS;
+/**@brief Queues the pending commit, if any.
+ *
+ * @details Losing a commit would leave the uploaded page in flash but never live, and the
+ *          uploader waiting for a status that never comes.  One that finds the queue full stays
+ *          pending and is tried again on the next BLE event and each time the main loop wakes.
+ */
+static void commit_put(void)
+{
+    CRITICAL_REGION_ENTER();
+    if (m_commit_pending &&
+        (sched_put(&m_commit, sizeof(m_commit), commit_evt_execute, m_commit.conn_handle) == NRF_SUCCESS)) {
+        m_commit_pending = false;
+    }
+    CRITICAL_REGION_EXIT();
+}
 
-        if (m_last_data_pos + FAT_CHAR_MAX_LEN < page_size) {
-            m_last_data_pos += reply.params.read.len;
-        } else {
-            m_last_data_pos = -1;
+/**@brief handler for fat_store upload events
+ */
+static void fat_store_evt_handler(fat_store_evt_type_t evt_type, uint32_t offset)
+{
+    switch (evt_type)
+    {
+        case FAT_STORE_EVT_READY:
+            (void) ble_fat_upload_status_send(&m_ble_fat, m_upload_conn_handle, FAT_UPLOAD_OP_START,
+                                              FAT_UPLOAD_STATUS_OK, 0);
+            break;
+
+        case FAT_STORE_EVT_COMMITTED:
+            // The upload is over as far as fat_store is concerned, the page goes live from the main loop.
+            m_commit.conn_handle = m_upload_conn_handle;
+            m_commit.offset      = offset;
+            m_commit_pending     = true;
+            m_upload_conn_handle = BLE_CONN_HANDLE_INVALID;
+            commit_put();
+            break;
+
+        case FAT_STORE_EVT_ERROR:
+            // Reported as an abort, the device has dropped the upload.
+            (void) ble_fat_upload_status_send(&m_ble_fat, m_upload_conn_handle, FAT_UPLOAD_OP_ABORT,
+                                              FAT_UPLOAD_STATUS_FAILED, offset);
+            m_upload_conn_handle = BLE_CONN_HANDLE_INVALID;
+            break;
+    }
+}
+
+/**@brief Asks the central for the connection parameters a link wants, unless it already has.
+ *
+ * @details Only one update procedure can run per link, so while one is running the request
+ *          waits for @ref BLE_GAP_EVT_CONN_PARAM_UPDATE.  A central may reject the request or
+ *          ignore it without that event ever coming, so link_params_timeout_handler() gives up
+ *          on a procedure after LINK_PARAMS_TIMEOUT_MS, and on the link after
+ *          LINK_PARAMS_MAX_UNANSWERED of them in a row.
+ */
+static void link_params_request(ble_fat_link_t * p_link)
+{
+    uint32_t              err_code;
+    link_params_state_t * p_state = &m_link_params[p_link - m_ble_fat.links];
+
+    if (p_state->busy || (p_state->wanted == p_state->requested) ||
+        (p_state->unanswered >= LINK_PARAMS_MAX_UNANSWERED)) {
+        return;
+    }
+
+    err_code = sd_ble_gap_conn_param_update(p_link->conn_handle, &m_link_conn_params[p_state->wanted]);
+    if (err_code == NRF_SUCCESS) {
+        p_state->requested = p_state->wanted;
+        p_state->busy      = true;
+    } else if (err_code == NRF_ERROR_BUSY) {
+        p_state->busy      = true;      // The central is changing them itself, retry when it is done.
+    } else {
+        SEGGER_RTT_printf(0, "Conn param update Error %d\n", err_code);
+        return;
+    }
+
+    p_state->waited = 0;
+    if (!m_link_params_timer_on) {
+        err_code = app_timer_start(m_link_params_timer, APP_TIMER_TICKS(LINK_PARAMS_TIMER_MS, APP_TIMER_PRESCALER), NULL);
+        if (err_code != NRF_SUCCESS) {
+            SEGGER_RTT_printf(0, "Link params timer Error %d\n", err_code);
         }
-    } else {    // Send empty response as last packet
-        reply.params.read.p_data      = NULL;
-        reply.params.read.len         = 0;
-        reply.params.read.update      = 1;
-        reply.params.read.offset      = 0;
-        reply.params.read.gatt_status = BLE_GATT_STATUS_SUCCESS;
-        m_last_data_pos = 0; 
+        m_link_params_timer_on = (err_code == NRF_SUCCESS);
+    }
+}
+
+/**@brief Gives up on update procedures the central never answered, and asks again.
+ *
+ * @details Runs from the main loop every LINK_PARAMS_TIMER_MS while any link is busy, and
+ *          stops the timer once none is.
+ */
+static void link_params_timeout_handler(void * p_context)
+{
+    bool busy = false;
+
+    for (uint32_t i = 0; i < BLE_FAT_MAX_LINKS; i++)
+    {
+        link_params_state_t * p_state = &m_link_params[i];
+        ble_fat_link_t *      p_link  = &m_ble_fat.links[i];
+
+        if (!p_state->busy) {
+            continue;
+        }
+        if (p_link->conn_handle == BLE_CONN_HANDLE_INVALID) {
+            p_state->busy = false;      // Disconnected while waiting.
+            continue;
+        }
+        if (++p_state->waited < LINK_PARAMS_TIMEOUT_MS / LINK_PARAMS_TIMER_MS) {
+            busy = true;
+            continue;
+        }
+
+        SEGGER_RTT_printf(0, "Handle: %d conn param update unanswered\n", p_link->conn_handle);
+        p_state->busy      = false;
+        p_state->requested = LINK_PARAMS_CENTRAL;   // Whatever the link runs on now, it may not be what was asked.
+        p_state->unanswered++;
+        link_params_request(p_link);
+        busy = busy || p_state->busy;
     }
 
-    //SEGGER_RTT_printf(0, "Reply Char len: %d of %d at: 0x%x", reply.params.read.len, page_size, m_page_data);
-    err_code = sd_ble_gatts_rw_authorize_reply(m_conn_handle, &reply);
+    if (!busy) {
+        (void) app_timer_stop(m_link_params_timer);
+        m_link_params_timer_on = false;
+    }
+}
+
+/**@brief Function for giving the metrics characteristic the current counters.
+ */
+static void metrics_publish(void)
+{
+    uint8_t  data[FAT_METRICS_VALUE_LEN];
+    uint16_t len = fat_metrics_encode(data);
+    uint32_t err_code = ble_fat_metrics_set(&m_ble_fat, data, len);
+
     if (err_code != NRF_SUCCESS) {
-        SEGGER_RTT_printf(0, "GATT Reply Error %d\n", err_code);
+        SEGGER_RTT_printf(0, "Metrics set Error %d\n", err_code);
+    }
+}
+
+/**@brief Acts on a transfer state change, from the main loop.
+ *
+ * @details Speeds the link up as soon as a client starts fetching the page, and slows it down
+ *          once it has it.  The fixed preferred parameters suit neither: downloads are over long
+ *          before a 15 s delayed update would kick in, and idle links burn current at 30 ms.
+ *          Also logs the PHY each delivered page went out on and counts transfers in fat_metrics.
+ */
+static void transfer_evt_execute(void * p_event_data, uint16_t event_size)
+{
+    transfer_evt_t *      p_evt   = p_event_data;
+    ble_fat_link_t *      p_link  = &m_ble_fat.links[p_evt->link];
+    link_params_state_t * p_state = &m_link_params[p_evt->link];
+
+    switch (p_evt->transfer)
+    {
+        case BLE_FAT_TRANSFER_ACTIVE:
+            fat_metrics_transfer_begin(p_evt->link);
+            p_state->wanted = p_state->fast_refused ? LINK_PARAMS_COMPAT : LINK_PARAMS_FAST;
+            break;
+
+        case BLE_FAT_TRANSFER_DONE:
+            fat_tlm_page_served(p_evt->len);
+            fat_metrics_transfer_end(p_evt->link, true, p_evt->len, p_evt->chunks);
+            metrics_publish();
+            SEGGER_RTT_printf(0, "Link %d page sent on %s\n", p_evt->link,
+                              (p_evt->phys == BLE_FAT_PHY_2M) ? "2M PHY" :
+                              (p_evt->phys == BLE_FAT_PHY_1M) ? "1M PHY" : "1M and 2M PHY");
+            p_state->wanted = LINK_PARAMS_IDLE;
+            break;
+
+        case BLE_FAT_TRANSFER_ABANDONED:
+            fat_metrics_transfer_end(p_evt->link, false, 0, p_evt->chunks);
+            metrics_publish();
+            return;                         // The link is going, nothing to ask of it.
+
+        default:
+            return;
+    }
+    if (p_link->conn_handle == p_evt->conn_handle) {
+        link_params_request(p_link);
     }
-    
 }
 
+/**@brief handler for fatbeacon transfer state changes
+ *
+ * @details Called by ble_fat from the SoftDevice interrupt, in the middle of answering a read.
+ *          Takes down what changed and leaves the rest to transfer_evt_execute().
+ */
+static void fat_transfer_evt_handler(ble_fat_t * p_fat, ble_fat_link_t * p_link)
+{
+    transfer_evt_t evt;
+
+    if (p_link->transfer == BLE_FAT_TRANSFER_IDLE) {
+        return;
+    }
+    evt.conn_handle = p_link->conn_handle;
+    evt.link        = p_link - p_fat->links;
+    evt.transfer    = p_link->transfer;
+    evt.phys        = p_link->transfer_phys;
+    evt.len         = ble_fat_link_len(p_link);
+    evt.chunks      = p_link->chunks;
+    // Dropped only costs the metrics and link parameters of this one change.
+    (void) sched_put(&evt, sizeof(evt), transfer_evt_execute, evt.conn_handle);
+}
+
+/**@brief Handles the end of a connection parameter update procedure on a link.
+ *
+ * @details A central that turns a request down leaves the parameters as they were.  If that
+ *          happens to the fast range, the compatible one is tried instead for the rest of the
+ *          connection.
+ */
+static void link_params_on_update(ble_fat_link_t * p_link, ble_gap_conn_params_t const * p_params)
+{
+    link_params_state_t * p_state = &m_link_params[p_link - m_ble_fat.links];
+
+    p_state->busy       = false;
+    p_state->unanswered = 0;
+
+    if ((p_state->requested == LINK_PARAMS_FAST) && (p_params->max_conn_interval > FAST_MAX_CONN_INTERVAL)) {
+        p_state->fast_refused = true;
+        if (p_state->wanted == LINK_PARAMS_FAST) {
+            p_state->wanted = LINK_PARAMS_COMPAT;
+        }
+    }
+    SEGGER_RTT_printf(0, "Handle: %d interval %d latency %d\n", p_link->conn_handle,
+                      p_params->max_conn_interval, p_params->slave_latency);
+    link_params_request(p_link);
+}
+
+/**@brief Handles the BLE events that can't wait for the main loop.
+ *
+ * @details Called from the SoftDevice interrupt, like ble_fat.  An upload is part of the page path
+ *          and must be dropped before the next event can reach it.
+ */
+static void on_ble_evt_now(ble_evt_t * p_ble_evt)
+{
+    uint32_t err_code;
+
+    switch (p_ble_evt->header.evt_id)
+    {
+        case BLE_GAP_EVT_DISCONNECTED:
+            if (p_ble_evt->evt.gap_evt.conn_handle == m_upload_conn_handle) {
+                fat_store_upload_abort();   // The uploader is gone, the live page stays as it is unless already sealing.
+                m_upload_conn_handle = BLE_CONN_HANDLE_INVALID;
+            }
+            break;
+
+        case BLE_GATTS_EVT_SYS_ATTR_MISSING:
+            // No bonding, so there is no stored CCCD state to restore.
+            err_code = sd_ble_gatts_sys_attr_set(p_ble_evt->evt.gatts_evt.conn_handle, NULL, 0, 0);
+            APP_ERROR_CHECK(err_code);
+            break;
+
+        default:
+            // No implementation needed.
+            break;
+    }
+}
+
+#if FAT_SENSOR_ENABLED
+// Template placeholders fat_value_handler() fills in from the sensors.
+#define SENSOR_TMPL_VARS                ((1UL << FAT_TMPL_VAR_TEMP) | \
+                                         (((1UL << FAT_TMPL_VAR_COUNT) - 1) & ~((1UL << FAT_TMPL_VAR_HUMIDITY) - 1)))
+
+/**@brief Brings the sensor values of a link that connected to a template page up to date.
+ *
+ * @details The link was frozen from the last reading, which an idle tag may have taken up to
+ *          FAT_SENSOR_ADV_MAX_AGE_S ago.  Sampling takes a bus transfer and a wait that can't
+ *          happen in the SoftDevice interrupt, so it happens here in the main loop, only when
+ *          that reading is older than FAT_SENSOR_CONN_MAX_AGE_S.  The client is still
+ *          discovering services and nearly always gets the new values; one that has already
+ *          started reading keeps the old ones.
+ */
+static void link_sensor_refresh(ble_fat_link_t * p_link)
+{
+    fat_sensor_data_t sensor;
+
+    if (!p_link->rendering || ((fat_tmpl_vars_get(p_link->page.p_data) & SENSOR_TMPL_VARS) == 0)) {
+        return;
+    }
+    if (fat_sensor_get(FAT_SENSOR_CONN_MAX_AGE_S, &sensor) == NRF_SUCCESS) {
+        (void) ble_fat_link_values_refresh(&m_ble_fat, p_link->conn_handle);
+    }
+}
+#endif
+
 static void on_ble_evt(ble_evt_t * p_ble_evt)
 {
+    ble_fat_link_t * p_link;
+
     switch (p_ble_evt->header.evt_id)
             {
         case BLE_GAP_EVT_CONNECTED:            
-            m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
-            SEGGER_RTT_printf(0,"Got BLE Connection. Handle: %d\n", m_conn_handle);
+            FAT_TRACE(FAT_TRACE_EVT_CONNECT, p_ble_evt->evt.gap_evt.conn_handle, 0);
+            m_conn_count++;
+            SEGGER_RTT_printf(0,"Got BLE Connection. Handle: %d\n", p_ble_evt->evt.gap_evt.conn_handle);
+            fat_metrics_connected();
+            metrics_publish();
+
+            // NULL if the link is already gone again by the time this runs.
+            p_link = ble_fat_link_get(&m_ble_fat, p_ble_evt->evt.gap_evt.conn_handle);
+            if (p_link != NULL) {
+                memset(&m_link_params[p_link - m_ble_fat.links], 0, sizeof(link_params_state_t));
+#if FAT_SENSOR_ENABLED
+                link_sensor_refresh(p_link);
+#endif
+            }
+
+            // Keep offering the fatbeacon frame while there are free links.
+            fat_adv_connectable_set(m_conn_count < PERIPHERAL_LINK_COUNT);
             break;
 
-        case BLE_GAP_EVT_DISCONNECTED:
-            SEGGER_RTT_printf(0,"BLE Handle: %d Disconnected.\n", m_conn_handle);
-            m_conn_handle = BLE_CONN_HANDLE_INVALID;
-            
-            m_last_data_pos = 0;            // Reset FAT Characteristic read on disconnect.
-             
-            advertising_start();            // Restart the advertising
+        case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+            p_link = ble_fat_link_get(&m_ble_fat, p_ble_evt->evt.gap_evt.conn_handle);
+            if (p_link != NULL) {
+                link_params_on_update(p_link, &p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params);
+            }
             break;
 
-        case BLE_GAP_EVT_TIMEOUT:
-              
-            advertising_start();            // Restart advertising on timeout.
+        case BLE_GAP_EVT_DISCONNECTED:
+            FAT_TRACE(FAT_TRACE_EVT_DISCONNECT, p_ble_evt->evt.gap_evt.conn_handle,
+                      p_ble_evt->evt.gap_evt.params.disconnected.reason);
+            SEGGER_RTT_printf(0,"BLE Handle: %d Disconnected.\n", p_ble_evt->evt.gap_evt.conn_handle);
+            m_conn_count--;                 // fat_adv goes back to fast, connectable advertising.
             break;
 
         default:
@@ -187,14 +872,76 @@ static void on_ble_evt(ble_evt_t * p_ble_evt)
     }
 }
 
+/**@brief Runs a GAP event queued by ble_evt_dispatch(), from the main loop.
+ */
+static void ble_evt_execute(void * p_event_data, uint16_t event_size)
+{
+    ble_evt_t * p_ble_evt = p_event_data;
+
+    fat_adv_on_ble_evt(p_ble_evt);
+    on_ble_evt(p_ble_evt);
+    ble_advertising_on_ble_evt(p_ble_evt);
+}
+
+/**@brief Queues the connects and disconnects held back by conn_evt_put(), oldest first. */
+static void conn_evts_put(void)
+{
+    CRITICAL_REGION_ENTER();
+    while ((m_conn_evts_count > 0) &&
+           (sched_put(&m_conn_evts[m_conn_evts_first], sizeof(ble_evt_t), ble_evt_execute,
+                      m_conn_evts[m_conn_evts_first].evt.gap_evt.conn_handle) == NRF_SUCCESS))
+    {
+        m_conn_evts_first = (m_conn_evts_first + 1) % CONN_EVT_PENDING_MAX;
+        m_conn_evts_count--;
+    }
+    CRITICAL_REGION_EXIT();
+}
+
+/**@brief Queues a connect or disconnect for the main loop, from the SoftDevice interrupt.
+ *
+ * @details Losing one would leave the connection count, fat_adv and the link's parameters out
+ *          of step with the links for good, the fatbeacon frame could stay off until a reset.
+ *          One that finds the queue full is held back like a commit, in order behind any
+ *          already waiting, and tried again on the next BLE event and each time the main loop
+ *          wakes.  Only a main loop stalled through CONN_EVT_PENDING_MAX of them loses one.
+ */
+static void conn_evt_put(ble_evt_t * p_ble_evt)
+{
+    conn_evts_put();
+
+    CRITICAL_REGION_ENTER();
+    if ((m_conn_evts_count > 0) ||
+        (sched_put(p_ble_evt, sizeof(ble_evt_t), ble_evt_execute, p_ble_evt->evt.gap_evt.conn_handle) != NRF_SUCCESS)) {
+        if (m_conn_evts_count < CONN_EVT_PENDING_MAX) {
+            m_conn_evts[(m_conn_evts_first + m_conn_evts_count) % CONN_EVT_PENDING_MAX] = *p_ble_evt;
+            m_conn_evts_count++;
+        } else {
+            SEGGER_RTT_printf(0, "Connection event %d lost Error %d\n", p_ble_evt->header.evt_id, NRF_ERROR_NO_MEM);
+        }
+    }
+    CRITICAL_REGION_EXIT();
+}
+
 /**@brief Primary dispatch function for BLE events
-*/
+ *
+ * @details Runs in the SoftDevice interrupt.  Page reads, notifications and uploads are answered
+ *          here by ble_fat, a read reply can't wait behind the main loop.  GAP events are copied to
+ *          the scheduler queue: advertising, link parameters, metrics and the connection count
+ *          are only ever touched from the main loop, one handler at a time.
+ */
 static void ble_evt_dispatch(ble_evt_t * p_ble_evt)
 {
-    ble_conn_params_on_ble_evt(p_ble_evt);
+    conn_evts_put();
+    commit_put();
     ble_fat_on_ble_evt(&m_ble_fat, p_ble_evt);
-    on_ble_evt(p_ble_evt);
-    ble_advertising_on_ble_evt(p_ble_evt);
+    on_ble_evt_now(p_ble_evt);
+
+    if ((p_ble_evt->header.evt_id == BLE_GAP_EVT_CONNECTED) || (p_ble_evt->header.evt_id == BLE_GAP_EVT_DISCONNECTED)) {
+        conn_evt_put(p_ble_evt);
+    } else if ((p_ble_evt->header.evt_id >= BLE_GAP_EVT_BASE) && (p_ble_evt->header.evt_id <= BLE_GAP_EVT_LAST)) {
+        // The rest only tune a link, the next update or transfer change puts it right.
+        (void) sched_put(p_ble_evt, sizeof(ble_evt_t), ble_evt_execute, p_ble_evt->evt.gap_evt.conn_handle);
+    }
 }
 
 /**@brief Function for dispatching a system event to interested modules.
@@ -206,6 +953,7 @@ static void ble_evt_dispatch(ble_evt_t * p_ble_evt)
  */
 static void sys_evt_dispatch(uint32_t sys_evt)
 {
+    fs_sys_event_handler(sys_evt);
     ble_advertising_on_sys_evt(sys_evt);
 }
 
@@ -234,26 +982,6 @@ static void gap_params_init(void)
    APP_ERROR_CHECK(err_code);
 }
 
-static void conn_params_init(void)
-{
-    uint32_t               err_code;
-    ble_conn_params_init_t cp_init;
-
-    memset(&cp_init, 0, sizeof(cp_init));
-
-    cp_init.p_conn_params                  = NULL;
-    cp_init.first_conn_params_update_delay = FIRST_CONN_PARAMS_UPDATE_DELAY;
-    cp_init.next_conn_params_update_delay  = NEXT_CONN_PARAMS_UPDATE_DELAY;
-    cp_init.max_conn_params_update_count   = MAX_CONN_PARAMS_UPDATE_COUNT;
-    cp_init.start_on_notify_cccd_handle    = BLE_GATT_HANDLE_INVALID;
-    cp_init.disconnect_on_fail             = true;
-
-    err_code = ble_conn_params_init(&cp_init);
-    APP_ERROR_CHECK(err_code);
-
-}
-
-
 /**@brief Callback function for asserts in the SoftDevice.
  *
  * @details This function will be called in case of an assert in the SoftDevice.
@@ -271,31 +999,47 @@ void assert_nrf_callback(uint16_t line_num, const uint8_t * p_file_name)
 }
 
 
-/**@brief Function for initializing the advertising functionality.
+/**@brief Function for encoding the advertising data of a frame and handing it to fat_adv.
  *
- * @details Encodes the required advertising data and passes it to the stack.
- *          Also builds a structure to be passed to the stack when starting advertising.
+ * @details The fatbeacon frame carries the Eddystone-URL data and is connectable, so it also
+ *          gets a scan response with the device name and the page's content hash, for clients
+ *          that cache the page.  With both, the fatbeacon service UUID no longer fits in the
+ *          31 bytes; clients find the service by discovery after connecting, as they always
+ *          have.  Encode the frame again when the page changes.  The TLM frame's scan response
+ *          carries the fatbeacon counters, which don't fit in Eddystone-TLM.
  */
-static void advertising_init(void)
+static uint32_t adv_frame_encode(fat_adv_frame_t frame)
 {
-    uint32_t      err_code;
     ble_advdata_t adv_data;
     ble_advdata_t scrsp_data;
     uint8_t       flags = BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE;
     ble_uuid_t    adv_uuids[] = {{APP_EDDYSTONE_UUID, BLE_UUID_TYPE_BLE}};
-    ble_uuid_t    scrp_uuids[] = {{BLE_UUID_FAT_URL_SERVICE, m_ble_fat.uuid_type}};
+    ble_advdata_manuf_data_t stats_data;
+    ble_advdata_manuf_data_t hash_data;
+    uint8_t       hash[FAT_HASH_LEN];
 
     uint8_array_t eddystone_data_array;                             // Array for Service Data structure.
 /** @snippet [Eddystone data array] */
-    eddystone_data_array.p_data = (uint8_t *) eddystone_url_data;   // Pointer to the data to advertise.
-    eddystone_data_array.size = sizeof(eddystone_url_data);         // Size of the data to advertise.
+    if (frame == FAT_ADV_FRAME_UID) {
+        eddystone_data_array.p_data = (uint8_t *) eddystone_uid_data;
+        eddystone_data_array.size = sizeof(eddystone_uid_data);
+        flags = BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED;               // Non-connectable, nothing to discover.
+    } else if (frame == FAT_ADV_FRAME_TLM) {
+        fat_tlm_encode(eddystone_tlm_data, fat_tlm_stats_data);
+        eddystone_data_array.p_data = eddystone_tlm_data;
+        eddystone_data_array.size = sizeof(eddystone_tlm_data);
+        flags = BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED;
+    } else {
+        eddystone_data_array.p_data = (uint8_t *) eddystone_url_data;   // Pointer to the data to advertise.
+        eddystone_data_array.size = sizeof(eddystone_url_data);         // Size of the data to advertise.
+    }
 /** @snippet [Eddystone data array] */
 
     ble_advdata_service_data_t service_data;                        // Structure to hold Service Data.
     service_data.service_uuid = APP_EDDYSTONE_UUID;                 // Eddystone UUID to allow discoverability on iOS devices.
     service_data.data = eddystone_data_array;                       // Array for service advertisement data.
 
-    // Build and set advertising data.
+    // Build advertising data.
     memset(&adv_data, 0, sizeof(adv_data));
 
     adv_data.name_type               = BLE_ADVDATA_NO_NAME;
@@ -306,39 +1050,116 @@ static void advertising_init(void)
     adv_data.service_data_count      = 1;
 
     memset(&scrsp_data, 0, sizeof(scrsp_data));
-    scrsp_data.name_type            = BLE_ADVDATA_FULL_NAME;
-    scrsp_data.include_appearance   = false;
-    scrsp_data.uuids_complete.uuid_cnt = sizeof(scrp_uuids) / sizeof(scrp_uuids[0]);
-    scrsp_data.uuids_complete.p_uuids = scrp_uuids;
+    switch (frame)
+    {
+        case FAT_ADV_FRAME_UID:
+            return fat_adv_frame_encode(frame, &adv_data, NULL);    // Scanned actively or not, there is nothing more to tell.
+
+        case FAT_ADV_FRAME_TLM:
+            stats_data.company_identifier = FAT_TLM_STATS_COMPANY_ID;
+            stats_data.data.p_data        = fat_tlm_stats_data;
+            stats_data.data.size          = sizeof(fat_tlm_stats_data);
+            scrsp_data.name_type             = BLE_ADVDATA_NO_NAME;
+            scrsp_data.p_manuf_specific_data = &stats_data;
+            break;
+
+        default:
+            (void) uint32_encode(m_ble_fat.page.hash, hash);
+            hash_data.company_identifier = FAT_HASH_COMPANY_ID;
+            hash_data.data.p_data        = hash;
+            hash_data.data.size          = sizeof(hash);
+            scrsp_data.name_type            = BLE_ADVDATA_FULL_NAME;
+            scrsp_data.include_appearance   = false;
+            scrsp_data.p_manuf_specific_data = &hash_data;
+            break;
+    }
+
+    return fat_adv_frame_encode(frame, &adv_data, &scrsp_data);
+}
+
 
-    //err_code = ble_advdata_set(&adv_data, &scrsp_data);
-    err_code = ble_advdata_set(&adv_data, NULL);
+/**@brief Function for initializing the advertising functionality.
+ *
+ * @details Fills in the Eddystone-UID instance, encodes every frame once and sets up the
+ *          advertising scheduler, see fat_adv.c.
+ */
+static void advertising_init(void)
+{
+    uint32_t       err_code;
+    ble_gap_addr_t addr;
+
+    err_code = sd_ble_gap_address_get(&addr);
     APP_ERROR_CHECK(err_code);
+    for (uint32_t i = 0; i < BLE_GAP_ADDR_LEN; i++)
+    {
+        eddystone_uid_data[EDDYSTONE_UID_INSTANCE_OFFSET + i] = addr.addr[BLE_GAP_ADDR_LEN - 1 - i];   // Most significant byte first.
+    }
 
-    // Initialize advertising parameters (used when starting advertising).
-    memset(&m_adv_params, 0, sizeof(m_adv_params));
-    
-    m_adv_params.type        = BLE_GAP_ADV_TYPE_ADV_IND;
-    m_adv_params.interval    = MSEC_TO_UNITS(APP_CFG_CONNECTABLE_ADV_INTERVAL_MS, UNIT_0_625_MS);
-    m_adv_params.timeout     = APP_CFG_CONNECTABLE_ADV_TIMEOUT;
+    for (uint32_t frame = 0; frame < FAT_ADV_FRAME_COUNT; frame++)
+    {
+        err_code = adv_frame_encode((fat_adv_frame_t) frame);
+        APP_ERROR_CHECK(err_code);
+    }
+
+    err_code = fat_adv_init();
+    APP_ERROR_CHECK(err_code);
 }
 
 
-/**@brief Function for starting advertising.
+/**@brief Function for setting the SoftDevice bandwidth of every peripheral link to FAT_BW_PROFILE.
+ *
+ * @details The counts reserve buffers for PERIPHERAL_LINK_COUNT links of the chosen bandwidth when
+ *          the SoftDevice is enabled, the option makes new connections use them.
  */
-static void advertising_start(void)
+static void conn_bw_counts_set(ble_conn_bw_counts_t * p_counts)
 {
-    uint32_t err_code;
+    memset(p_counts, 0, sizeof(*p_counts));
+    switch (FAT_BW_PROFILE)
+    {
+        case BLE_CONN_BW_HIGH:
+            p_counts->tx_counts.high_count = PERIPHERAL_LINK_COUNT;
+            p_counts->rx_counts.high_count = PERIPHERAL_LINK_COUNT;
+            break;
+
+        case BLE_CONN_BW_LOW:
+            p_counts->tx_counts.low_count  = PERIPHERAL_LINK_COUNT;
+            p_counts->rx_counts.low_count  = PERIPHERAL_LINK_COUNT;
+            break;
 
-    err_code = sd_ble_gap_adv_start(&m_adv_params);
-    //err_code = ble_advertising_start(BLE_ADV_MODE_FAST);
+        default:
+            p_counts->tx_counts.mid_count  = PERIPHERAL_LINK_COUNT;
+            p_counts->rx_counts.mid_count  = PERIPHERAL_LINK_COUNT;
+            break;
+    }
+}
+
+
+/**@brief Function for applying FAT_BW_PROFILE and FAT_CONN_EVT_EXT, before advertising starts.
+ */
+static void conn_bw_opt_set(void)
+{
+    uint32_t   err_code;
+    ble_opt_t  opt;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.common_opt.conn_bw.role = BLE_GAP_ROLE_PERIPH;
+    opt.common_opt.conn_bw.conn_bw.conn_bw_tx = FAT_BW_PROFILE;
+    opt.common_opt.conn_bw.conn_bw.conn_bw_rx = FAT_BW_PROFILE;
+    err_code = sd_ble_opt_set(BLE_COMMON_OPT_CONN_BW, &opt);
     if (err_code != NRF_SUCCESS) {
-        SEGGER_RTT_printf(0, "Error %d\n", err_code);
+        SEGGER_RTT_printf(0, "Conn bandwidth Error %d\n", err_code);
     }
-    //APP_ERROR_CHECK(err_code);
 
-    err_code = bsp_indication_set(BSP_INDICATE_ADVERTISING);
-    APP_ERROR_CHECK(err_code);
+#if defined(NRF_SD_BLE_API_VERSION) && (NRF_SD_BLE_API_VERSION >= 4)
+    // Keep the connection event open for as long as either side has packets, rather than one
+    // exchange per event.  S132 v2 has no such option, there the bandwidth alone sets the count.
+    memset(&opt, 0, sizeof(opt));
+    opt.common_opt.conn_evt_ext.enable = FAT_CONN_EVT_EXT;
+    err_code = sd_ble_opt_set(BLE_COMMON_OPT_CONN_EVT_EXT, &opt);
+    if (err_code != NRF_SUCCESS) {
+        SEGGER_RTT_printf(0, "Conn event extension Error %d\n", err_code);
+    }
+#endif
 }
 
 
@@ -356,6 +1177,7 @@ static void ble_stack_init(void)
     SOFTDEVICE_HANDLER_INIT(&clock_lf_cfg, NULL);
 
     ble_enable_params_t ble_enable_params;
+    ble_conn_bw_counts_t conn_bw_counts;
     err_code = softdevice_enable_get_default_config(CENTRAL_LINK_COUNT,
                                                     PERIPHERAL_LINK_COUNT,
                                                     &ble_enable_params);
@@ -365,9 +1187,19 @@ static void ble_stack_init(void)
     //APP_ERROR_CHECK(err_code);
 
     ble_enable_params.common_enable_params.vs_uuid_count = 2;
+    ble_enable_params.gatt_enable_params.att_mtu = FAT_ATT_MTU_MAX;     // Let clients negotiate chunks larger than 20 bytes.
+    conn_bw_counts_set(&conn_bw_counts);
+    ble_enable_params.common_enable_params.p_conn_bw_counts = &conn_bw_counts;
     SEGGER_RTT_printf(0, "UUID Count %d\n", ble_enable_params.common_enable_params.vs_uuid_count);
     //Check the ram settings against the used number of links
+#ifdef FAT_APP_RAM_BASE
+    // The tables behind CHECK_RAM_START_ADDR only cover BLE_CONN_BW_MID, check against the RAM start
+    // the board Makefile put in the linker script for FAT_BW_PROFILE instead.
+    err_code = sd_check_ram_start(FAT_APP_RAM_BASE);
+    APP_ERROR_CHECK(err_code);
+#else
     CHECK_RAM_START_ADDR(CENTRAL_LINK_COUNT,PERIPHERAL_LINK_COUNT);
+#endif
 
     // Enable BLE stack.
     err_code = softdevice_enable(&ble_enable_params);
@@ -375,6 +1207,7 @@ static void ble_stack_init(void)
         SEGGER_RTT_printf(0, "Softlink Enable Error %d\n", err_code);
     }
     //APP_ERROR_CHECK(err_code);
+    conn_bw_opt_set();
 
     err_code = softdevice_ble_evt_handler_set(ble_evt_dispatch);
     if (err_code != NRF_SUCCESS) {
@@ -387,6 +1220,19 @@ static void ble_stack_init(void)
 }
 
 
+/**@brief Function for handling button presses.
+ *
+ * @details Someone at the beacon wants it found quickly, so advertise fast for a while.  Boards
+ *          without buttons never get here.
+ */
+static void bsp_event_handler(bsp_event_t event)
+{
+    if (event == BSP_EVENT_KEY_0) {
+        fat_adv_fast();
+    }
+}
+
+
 /**@brief Function for doing power management.
  */
 static void power_manage(void)
@@ -404,31 +1250,71 @@ int main(void)
     ble_fat_init_t fat_init;
 
     // Initialize.
-    APP_TIMER_INIT(APP_TIMER_PRESCALER, APP_TIMER_OP_QUEUE_SIZE, false);
-    err_code = bsp_init(BSP_INIT_LED, APP_TIMER_TICKS(100, APP_TIMER_PRESCALER), NULL);
+    APP_SCHED_INIT(SCHED_MAX_EVENT_DATA_SIZE, SCHED_QUEUE_SIZE);
+    APP_TIMER_APPSH_INIT(APP_TIMER_PRESCALER, APP_TIMER_OP_QUEUE_SIZE, true);
+    fat_trace_init();
+    err_code = bsp_init(BSP_INIT_LED | BSP_INIT_BUTTONS, APP_TIMER_TICKS(100, APP_TIMER_PRESCALER), bsp_event_handler);
+    APP_ERROR_CHECK(err_code);
+    err_code = app_timer_create(&m_link_params_timer, APP_TIMER_MODE_REPEATED, link_params_timeout_handler);
     APP_ERROR_CHECK(err_code);
 
     SEGGER_RTT_WriteString(0, "Starting up BeaconBuddy\n");
 
     ble_stack_init();
     gap_params_init();
-    conn_params_init();
+
+    err_code = fat_store_init(fat_store_evt_handler);
+    APP_ERROR_CHECK(err_code);
+    err_code = fat_metrics_init();
+    APP_ERROR_CHECK(err_code);
+#if FAT_SENSOR_ENABLED
+    err_code = fat_sensor_init();
+    if (err_code != NRF_SUCCESS) {
+        SEGGER_RTT_printf(0, "Sensor init Error %d\n", err_code);   // The page is still served, without readings.
+    }
+#endif
 
     memset(&fat_init, 0, sizeof(fat_init));
     fat_init.read_evt_handler = fat_read_evt_handler;
-    fat_init.val_data = m_page_data;
+    fat_init.read_mode = APP_FAT_READ_MODE;
+    fat_init.upload_evt_handler = fat_upload_evt_handler;
+    fat_init.transfer_evt_handler = fat_transfer_evt_handler;
+    fat_init.value_handler = fat_value_handler;
+
+    // Serve the flashed page if there is a valid one, the compiled-in page otherwise.
+    err_code = fat_store_page_get(&fat_init.p_page_data, &fat_init.page_len, &fat_init.page_version,
+                                  &fat_init.page_encoding);
+    if (err_code != NRF_SUCCESS) {
+        SEGGER_RTT_WriteString(0, "No stored page, using STATIC_PAGE\n");
+        fat_init.p_page_data = m_page_data;
+        fat_init.page_len = STATIC_PAGE_LEN;
+        fat_init.page_version = STATIC_PAGE_VERSION;
+        fat_init.page_encoding = STATIC_PAGE_ENCODING;
+    }
 
     err_code = ble_fat_init(&m_ble_fat, &fat_init);
+    if (err_code == NRF_ERROR_INVALID_DATA) {
+        SEGGER_RTT_WriteString(0, "Stored page doesn't decode, using STATIC_PAGE\n");
+        err_code = ble_fat_page_set(&m_ble_fat, m_page_data, STATIC_PAGE_LEN, STATIC_PAGE_VERSION,
+                                    STATIC_PAGE_ENCODING);
+    }
     APP_ERROR_CHECK(err_code);
+    metrics_publish();
 
     advertising_init();
     LEDS_ON(LEDS_MASK);
     // Start execution.
-    advertising_start();
+    fat_adv_start();
+    err_code = bsp_indication_set(BSP_INDICATE_ADVERTISING);
+    APP_ERROR_CHECK(err_code);
 
     // Enter main loop.
     for (;; )
     {
+        app_sched_execute();
+        conn_evts_put();
+        commit_put();
+        fat_trace_flush();
         power_manage();
     }
 }
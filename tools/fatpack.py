@@ -0,0 +1,254 @@
+#!/usr/bin/env python3
+"""
+fatpack.py
+
+Packs a page source directory into the form the fatbeacon firmware serves.
+
+The source directory holds index.html plus any local stylesheets and SVG
+files it uses.  Stylesheets linked with <link rel="stylesheet" href="x.css">
+are inlined into a <style> block, and <!--#include "x.svg" --> is replaced by
+the file.  The result is minified and, with --deflate, compressed as a raw
+deflate stream with a small window so the device can inflate it on the fly.
+
+With --template, placeholders like {{uptime}} or {{temp:8}} are compiled
+into a template the device renders as the page is read, with the value
+right aligned in a field of the given width (default per value, see
+TEMPLATE_VARS).  The page can't also be deflated.
+
+Outputs (any combination):
+  --header   C header defining STATIC_PAGE as a byte array, to be compiled in
+  --image    binary content image: fat_store header followed by the page
+  --hex      the same image as Intel HEX at --base, ready for nrfjprog
+
+Copyright (c) 2016 Matt Roche
+All rights reserved.  Licensed under BSD, see LICENSE.
+"""
+
+import argparse
+import binascii
+import os
+import re
+import struct
+import sys
+import zlib
+
+FAT_STORE_MAGIC = 0x50544146            # "FATP", see include/fat_store.h
+FAT_STORE_SLOT_SIZE = 8 * 4096          # FAT_STORE_SLOT_PAGES * FAT_STORE_PAGE_SIZE
+HEADER_FMT = "<IHHIIB3s"                # magic, version, crc, length, seq, encoding, reserved
+
+ENCODING_IDENTITY = 0                   # FAT_ENCODING_IDENTITY
+ENCODING_DEFLATE = 1                    # FAT_ENCODING_DEFLATE
+ENCODING_TEMPLATE = 2                   # FAT_ENCODING_TEMPLATE
+INFLATE_WINDOW_BITS = 10                # FAT_INFLATE_WINDOW_BITS, include/fat_inflate.h
+
+TEMPLATE_MAGIC = 0x4C505446             # FAT_TMPL_MAGIC, see include/fat_tmpl.h
+TEMPLATE_SRC_VAR = 0x8000               # FAT_TMPL_SRC_VAR
+# fat_tmpl_var_t, in order, with the default field width: wide enough for any value it can take.
+TEMPLATE_VARS = [("uptime", 10), ("served", 10), ("battery", 4), ("temp", 6), ("version", 5),
+                 ("humidity", 6), ("pressure", 7), ("accel_x", 5), ("accel_y", 5), ("accel_z", 5)]
+
+
+def minify_css(css):
+    css = re.sub(r"/\*.*?\*/", "", css, flags=re.S)
+    css = re.sub(r"\s+", " ", css)
+    css = re.sub(r"\s*([{}:;,>])\s*", r"\1", css)
+    css = css.replace(";}", "}")
+    return css.strip()
+
+
+def minify_svg(svg):
+    svg = re.sub(r"<\?xml.*?\?>", "", svg, flags=re.S)
+    svg = re.sub(r"<!--.*?-->", "", svg, flags=re.S)
+    svg = re.sub(r">\s+<", "><", svg)
+    svg = re.sub(r"\s+", " ", svg)
+    return svg.strip()
+
+
+def minify_html(html):
+    html = re.sub(r"<!--.*?-->", "", html, flags=re.S)
+    html = re.sub(r">\s+<", "><", html)
+    html = re.sub(r"\s+", " ", html)
+    html = re.sub(r"\s*(<(?:/?(?:html|head|body|header|footer|section|div|p|h\d|hr|br|ul|li|meta|title|style)\b[^>]*)>)\s*",
+                  r"\1", html)
+    return html.strip()
+
+
+def read_text(src_dir, name):
+    path = os.path.join(src_dir, name)
+    if not os.path.isfile(path):
+        sys.exit("fatpack: %s not found" % path)
+    with open(path, encoding="utf-8") as f:
+        return f.read()
+
+
+def assemble(src_dir):
+    """Inlines local stylesheets and includes into index.html."""
+    html = read_text(src_dir, "index.html")
+
+    def include(match):
+        name = match.group(1)
+        text = read_text(src_dir, name)
+        return minify_svg(text) if name.endswith(".svg") else text
+
+    def stylesheet(match):
+        return "<style>" + minify_css(read_text(src_dir, match.group(1))) + "</style>"
+
+    html = re.sub(r'<!--#include\s+"([^"]+)"\s*-->', include, html)
+    html = re.sub(r'<link\s+rel="stylesheet"\s+href="([^":]+)"\s*/?>', stylesheet, html)
+    html = re.sub(r"<style>(.*?)</style>", lambda m: "<style>" + minify_css(m.group(1)) + "</style>", html, flags=re.S)
+    return minify_html(html)
+
+
+def deflate(data, window_bits):
+    comp = zlib.compressobj(9, zlib.DEFLATED, -window_bits, 9)
+    return comp.compress(data) + comp.flush()
+
+
+def template(html):
+    """Compiles {{name}} and {{name:width}} placeholders, see include/fat_tmpl.h for the layout."""
+    names = {name: (i, width) for i, (name, width) in enumerate(TEMPLATE_VARS)}
+    segments = []                       # (output offset, source)
+    text = b""
+    out_len = 0
+    pos = 0
+    for match in re.finditer(r"\{\{\s*(\w+)(?::(\d+))?\s*\}\}", html):
+        literal = html[pos:match.start()].encode("utf-8")
+        if literal:
+            segments.append((out_len, len(text)))
+            text += literal
+            out_len += len(literal)
+        if match.group(1) not in names:
+            sys.exit("fatpack: unknown placeholder {{%s}}, known are %s"
+                     % (match.group(1), ", ".join(name for name, _ in TEMPLATE_VARS)))
+        var, width = names[match.group(1)]
+        width = int(match.group(2)) if match.group(2) else width
+        if width == 0:
+            sys.exit("fatpack: {{%s}} has no width" % match.group(1))
+        segments.append((out_len, TEMPLATE_SRC_VAR | var))
+        out_len += width
+        pos = match.end()
+    literal = html[pos:].encode("utf-8")
+    if literal:
+        segments.append((out_len, len(text)))
+        text += literal
+        out_len += len(literal)
+
+    if len(text) >= TEMPLATE_SRC_VAR or out_len > 0xFFFF:
+        sys.exit("fatpack: template renders %d bytes from %d of text, the device serves at most 65535 from 32767"
+                 % (out_len, len(text)))
+    header = struct.pack("<IHH", TEMPLATE_MAGIC, len(segments), out_len)
+    return header + b"".join(struct.pack("<HH", off, src) for off, src in segments) + text
+
+
+def content_image(page, version, encoding):
+    crc = binascii.crc_hqx(page, 0xFFFF)        # Same as crc16_compute(p, n, NULL)
+    header = struct.pack(HEADER_FMT, FAT_STORE_MAGIC, version, crc, len(page), 0, encoding, b"\xff" * 3)
+    image = header + page
+    if len(image) > FAT_STORE_SLOT_SIZE:
+        sys.exit("fatpack: page is %d bytes, a slot holds %d" % (len(page), FAT_STORE_SLOT_SIZE - len(header)))
+    return image
+
+
+def c_header(page, version, encoding, source):
+    lines = ["/* Generated by tools/fatpack.py from %s, do not edit. */" % source,
+             "",
+             "#ifndef FATPAGE_H__",
+             "#define FATPAGE_H__",
+             "",
+             "#include <stdint.h>",
+             "",
+             "static const uint8_t fat_packed_page[%d] =" % len(page),
+             "{"]
+    for i in range(0, len(page), 16):
+        lines.append("    " + " ".join("0x%02x," % b for b in page[i:i + 16]))
+    lines += ["};",
+              "",
+              "#define STATIC_PAGE                     fat_packed_page",
+              "#define STATIC_PAGE_LEN                 sizeof(fat_packed_page)",
+              "#define STATIC_PAGE_VERSION             %d" % version,
+              "#define STATIC_PAGE_ENCODING            %d" % encoding,
+              "",
+              "#endif",
+              ""]
+    return "\n".join(lines)
+
+
+def content_hash(page, encoding):
+    """The content hash the device advertises, FAT_HASH_NONE (0) for a template.  See include/ble_fat.h."""
+    if encoding == ENCODING_TEMPLATE:
+        return 0
+    h = 2166136261
+    for b in page:
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h or 1
+
+
+def intel_hex(segments):
+    """segments: list of (address, bytes)."""
+    out = []
+
+    def record(rtype, addr, data):
+        body = bytes([len(data), (addr >> 8) & 0xFF, addr & 0xFF, rtype]) + data
+        out.append(":" + body.hex().upper() + "%02X" % ((-sum(body)) & 0xFF))
+
+    for base, data in segments:
+        upper = None
+        for i in range(0, len(data), 16):
+            addr = base + i
+            if addr >> 16 != upper:
+                upper = addr >> 16
+                record(4, 0, struct.pack(">H", upper))
+            record(0, addr & 0xFFFF, data[i:i + 16])
+    record(1, 0, b"")
+    return "\n".join(out) + "\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Pack a page directory for the fatbeacon firmware.")
+    parser.add_argument("src", help="page source directory containing index.html")
+    parser.add_argument("--version", type=int, default=1, help="content version (default 1)")
+    parser.add_argument("--deflate", action="store_true", help="store the page as raw deflate")
+    parser.add_argument("--template", action="store_true", help="compile {{value}} placeholders into a template")
+    parser.add_argument("--window-bits", type=int, default=10,
+                        help="deflate window, 2^N bytes; the device inflater supports 9..10 (default 10)")
+    parser.add_argument("--header", help="write a C header defining STATIC_PAGE")
+    parser.add_argument("--image", help="write a binary content image")
+    parser.add_argument("--hex", help="write the content image as Intel HEX")
+    parser.add_argument("--base", type=lambda v: int(v, 0), default=0x70000,
+                        help="flash address of slot 0 for --hex (default 0x70000)")
+    args = parser.parse_args()
+
+    raw = assemble(args.src).encode("utf-8")
+    page, encoding = raw, ENCODING_IDENTITY
+    if args.template:
+        if args.deflate:
+            sys.exit("fatpack: a template can't be deflated")
+        page, encoding = template(raw.decode("utf-8")), ENCODING_TEMPLATE
+    elif args.deflate:
+        if not 9 <= args.window_bits <= INFLATE_WINDOW_BITS:
+            sys.exit("fatpack: --window-bits must be 9..%d" % INFLATE_WINDOW_BITS)
+        if len(raw) > 0xFFFF:
+            sys.exit("fatpack: page is %d bytes, the device serves at most 65535" % len(raw))
+        page, encoding = deflate(raw, args.window_bits), ENCODING_DEFLATE
+
+    image = content_image(page, args.version, encoding)
+
+    if args.header:
+        with open(args.header, "w") as f:
+            f.write(c_header(page, args.version, encoding, args.src))
+    if args.image:
+        with open(args.image, "wb") as f:
+            f.write(image)
+    if args.hex:
+        # Blank the header of slot 1 too, so a stale upload there cannot outrank the flashed page.
+        blank = b"\xff" * struct.calcsize(HEADER_FMT)
+        with open(args.hex, "w") as f:
+            f.write(intel_hex([(args.base, image), (args.base + FAT_STORE_SLOT_SIZE, blank)]))
+
+    print("fatpack: %d bytes of source -> %d bytes %s, version %d, hash %08x"
+          % (len(raw), len(page), ["identity", "deflate", "template"][encoding], args.version,
+             content_hash(page, encoding)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,217 @@
+#!/usr/bin/env python3
+"""
+fattrace.py
+
+Decodes the binary event trace the firmware writes to RTT channel 1 when it
+is built with TRACE=1 (see include/fat_trace.h) into per-chunk timelines.
+
+Capture the channel with the J-Link RTT logger, for example
+
+  JLinkRTTLogger -Device NRF52832_XXAA -If SWD -Speed 4000 -RTTChannel 1 trace.bin
+
+or with "make -C host trace", which captures it from the host build.  Each
+record is 8 bytes: a 32-bit word holding 24 bits of RTC1 ticks (30.5 us) and
+the event in the top byte, then the connection handle and an argument.
+
+For every transfer the timeline lists one line per chunk: when the read
+arrived, the offset asked for, how long the reply took, the bytes sent and
+the gap since the previous chunk, which is where the connection interval and
+the client's own pace show up.  Streamed pages list their notifications and
+TX complete events instead.  A summary per transfer follows.  --csv writes
+the chunk lines as CSV for plotting.
+
+Copyright (c) 2016 Matt Roche
+All rights reserved.  Licensed under BSD, see LICENSE.
+"""
+
+import argparse
+import csv
+import statistics
+import struct
+import sys
+
+RECORD_FMT = "<IHH"                     # stamp, conn_handle, arg; fat_trace_rec_t
+RECORD_SIZE = struct.calcsize(RECORD_FMT)
+TRACE_VERSION = 1                       # FAT_TRACE_VERSION
+NO_CONN = 0xFFFF                        # FAT_TRACE_NO_CONN
+RTC_HZ = 32768                          # APP_TIMER_CLOCK_FREQ, prescaler 0
+RTC_MASK = 0xFFFFFF
+
+# fat_trace_evt_t, include/fat_trace.h
+EVT_START, EVT_CONNECT, EVT_DISCONNECT, EVT_READ, EVT_REPLY, EVT_NOTIFY, EVT_TX_COMPLETE, EVT_ERROR, EVT_LOST, \
+    EVT_RESUME = range(10)
+EVENT_NAMES = ["START", "CONNECT", "DISCONNECT", "READ", "REPLY", "NOTIFY", "TX_COMPLETE", "ERROR", "LOST", "RESUME"]
+
+
+def records(data):
+    """Yields (event, ticks, conn_handle, arg) from a dump.
+
+    The firmware writes whole records, but a capture can start part way into
+    one.  The dump is aligned on its first START record, or failing that on
+    the offset that gives the most known events.
+    """
+    start_mark = struct.pack("<HH", NO_CONN, TRACE_VERSION)
+    align = None
+    pos = data.find(start_mark, 4)
+    while pos >= 0 and align is None:
+        if data[pos - 1] == EVT_START:
+            align = (pos - 4) % RECORD_SIZE
+        pos = data.find(start_mark, pos + 1)
+    if align is None:
+        align = max(range(RECORD_SIZE), key=lambda a: sum(
+            1 for p in range(a + 3, len(data) - RECORD_SIZE + 4, RECORD_SIZE) if data[p] < len(EVENT_NAMES)))
+    for pos in range(align, len(data) - RECORD_SIZE + 1, RECORD_SIZE):
+        stamp, conn, arg = struct.unpack_from(RECORD_FMT, data, pos)
+        yield stamp >> 24, stamp & RTC_MASK, conn, arg
+
+
+def timeline(data):
+    """Yields (event, time in us, conn_handle, arg), with the 24-bit RTC unwrapped.
+
+    Records put from an interrupt that preempted another put can be a few
+    ticks out of order, so a small step back is not taken as a wrap.
+    """
+    base = 0
+    last = None
+    for evt, ticks, conn, arg in records(data):
+        if evt == EVT_START:
+            base, last = 0, None        # The device reset, the RTC restarted.
+        if last is not None:
+            step = (ticks - last) & RTC_MASK
+            if step > RTC_MASK // 2:
+                step -= RTC_MASK + 1
+            base += step
+        last = ticks
+        yield evt, base * 1000000 // RTC_HZ, conn, arg
+
+
+class Transfer:
+    def __init__(self, conn, t_connect):
+        self.conn = conn
+        self.t_connect = t_connect
+        self.t_disconnect = None
+        self.reason = None
+        self.chunks = []                # (t read or notify, offset or None, latency us or None, len, gap us)
+        self.pending = None             # (t, offset) of a read without its reply yet
+        self.tx_complete = 0
+        self.errors = []
+        self.resumed_at = None          # Offset of the last resume asked for, 0 if it was refused.
+
+    def chunk(self, t, offset, latency, length):
+        gap = t - self.chunks[-1][0] if self.chunks else None
+        self.chunks.append((t, offset, latency, length, gap))
+
+
+def transfers(data):
+    """Groups the timeline by connection, returns (transfers, lost records, resets)."""
+    done = []
+    open_links = {}
+    lost = 0
+    resets = 0
+
+    for evt, t, conn, arg in timeline(data):
+        if evt == EVT_START:
+            resets += 1
+            done.extend(open_links.values())
+            open_links = {}
+            continue
+        if evt == EVT_LOST:
+            lost += arg
+            continue
+        if evt == EVT_CONNECT:
+            if conn in open_links:
+                done.append(open_links[conn])
+            open_links[conn] = Transfer(conn, t)
+            continue
+
+        link = open_links.get(conn)
+        if link is None:
+            link = open_links[conn] = Transfer(conn, None)      # Its CONNECT was lost or before the capture.
+        if evt == EVT_DISCONNECT:
+            link.t_disconnect, link.reason = t, arg
+            done.append(open_links.pop(conn))
+        elif evt == EVT_READ:
+            link.pending = (t, arg)
+        elif evt == EVT_REPLY:
+            if link.pending is not None:
+                link.chunk(link.pending[0], link.pending[1], t - link.pending[0], arg)
+            else:
+                link.chunk(t, None, None, arg)
+            link.pending = None
+        elif evt == EVT_NOTIFY:
+            link.chunk(t, None, None, arg)
+        elif evt == EVT_TX_COMPLETE:
+            link.tx_complete += arg
+        elif evt == EVT_ERROR:
+            link.errors.append((t, arg))
+        elif evt == EVT_RESUME:
+            link.resumed_at = arg
+    done.extend(open_links.values())
+    return done, lost, resets
+
+
+def ms(us):
+    return "%.3f" % (us / 1000.0)
+
+
+def print_transfer(link, out):
+    start = link.t_connect if link.t_connect is not None else (link.chunks[0][0] if link.chunks else 0)
+    print("link %d%s" % (link.conn, "" if link.t_connect is not None else " (connect not captured)"), file=out)
+    print("  %10s %7s %9s %5s %9s" % ("t ms", "offset", "reply us", "len", "gap ms"), file=out)
+    for t, offset, latency, length, gap in link.chunks:
+        print("  %10s %7s %9s %5d %9s" % (ms(t - start), "-" if offset is None else offset,
+                                          "-" if latency is None else latency, length,
+                                          "-" if gap is None else ms(gap)), file=out)
+    for t, err in link.errors:
+        print("  %10s error %d" % (ms(t - start), err), file=out)
+
+    sent = [c for c in link.chunks if c[3] > 0]
+    summary = "  %d chunks, %d bytes" % (len(sent), sum(c[3] for c in sent))
+    if len(link.chunks) > 1:
+        summary += " in %s ms" % ms(link.chunks[-1][0] - link.chunks[0][0])
+        gaps = [c[4] for c in link.chunks[1:]]
+        summary += ", gap median %s max %s ms" % (ms(statistics.median(gaps)), ms(max(gaps)))
+    latencies = [c[2] for c in link.chunks if c[2] is not None]
+    if latencies:
+        summary += ", reply max %d us" % max(latencies)
+    if link.tx_complete:
+        summary += ", %d packets sent" % link.tx_complete
+    if link.resumed_at is not None:
+        summary += ", resumed at %d" % link.resumed_at if link.resumed_at else ", resume refused"
+    if link.t_disconnect is not None:
+        summary += ", disconnected after %s ms, reason 0x%02x" % (ms(link.t_disconnect - start), link.reason)
+    print(summary, file=out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode a fatbeacon binary trace captured from RTT channel 1.")
+    parser.add_argument("trace", help="binary dump of RTT channel 1")
+    parser.add_argument("--csv", help="also write one line per chunk to this CSV file")
+    args = parser.parse_args()
+
+    with open(args.trace, "rb") as f:
+        data = f.read()
+    if len(data) < RECORD_SIZE:
+        sys.exit("fattrace: %s holds no records" % args.trace)
+
+    links, lost, resets = transfers(data)
+    for link in links:
+        print_transfer(link, sys.stdout)
+        print()
+    print("fattrace: %d records, %d transfers, %d resets, %d records lost on the device"
+          % (len(data) // RECORD_SIZE, len(links), resets, lost))
+    if lost:
+        print("fattrace: lost records mean the idle loop fell behind, the timelines around them have holes")
+
+    if args.csv:
+        with open(args.csv, "w", newline="") as f:
+            writer = csv.writer(f)
+            writer.writerow(["link", "t_us", "offset", "reply_us", "len", "gap_us"])
+            for link in links:
+                for t, offset, latency, length, gap in link.chunks:
+                    writer.writerow([link.conn, t, "" if offset is None else offset,
+                                     "" if latency is None else latency, length, "" if gap is None else gap])
+
+
+if __name__ == "__main__":
+    main()